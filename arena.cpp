@@ -0,0 +1,177 @@
+#include "arena.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <vector>
+
+#include <immintrin.h> // _mm_malloc
+
+// Smallest block the arena allocates
+constexpr size_t min_block_size = 64 * 1024;
+
+////////////////////////////////////////////////////////////
+/// Allocation counter
+////////////////////////////////////////////////////////////
+/*
+* Replaces the global operator new to count every heap allocation made through it, which is how the renderer checks that a steady
+* stream of frames does not allocate. Memory from _mm_malloc (frame buffers, arena blocks) is not counted here.
+*/
+
+#ifdef COUNT_ALLOCATIONS
+
+static std::atomic<long long> heap_allocations(0);
+
+void* operator new(std::size_t size)
+{
+	heap_allocations.fetch_add(1, std::memory_order_relaxed);
+	if (void* p = std::malloc(size ? size : 1))
+		return p;
+	throw std::bad_alloc();
+}
+
+void* operator new[](std::size_t size)
+{
+	return operator new(size);
+}
+
+void operator delete(void* p) noexcept
+{
+	std::free(p);
+}
+
+void operator delete[](void* p) noexcept
+{
+	std::free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept
+{
+	std::free(p);
+}
+
+void operator delete[](void* p, std::size_t) noexcept
+{
+	std::free(p);
+}
+
+long long heapAllocations()
+{
+	return heap_allocations.load(std::memory_order_relaxed);
+}
+
+#else
+
+long long heapAllocations()
+{
+	return 0;
+}
+
+#endif
+
+////////////////////////////////////////////////////////////
+/// Arena
+////////////////////////////////////////////////////////////
+
+Arena::Arena()
+{
+	used = 0;
+	high_water = 0;
+	growths = 0;
+	blocks.reserve(16);
+}
+
+Arena::~Arena()
+{
+	release();
+}
+
+void Arena::addBlock(size_t size)
+{
+	size = std::max(size, min_block_size);
+	char* data = static_cast<char*>(_mm_malloc(size, 64));
+	if (!data)
+		throw std::bad_alloc();
+
+	blocks.push_back(Block{ data, size });
+	used = 0;
+	growths += 1;
+}
+
+void Arena::release()
+{
+	for (Block& block : blocks)
+		_mm_free(block.data);
+	blocks.clear();
+	used = 0;
+}
+
+/*
+* Hand out bytes of memory aligned to alignment (a power of 2). The memory stays valid until the next reset.
+* If the current block is full a new one, at least twice as large, is started.
+*/
+void* Arena::allocate(size_t bytes, size_t alignment)
+{
+	if (blocks.empty())
+		addBlock(bytes + alignment);
+
+	Block* block = &blocks.back();
+	uintptr_t base = reinterpret_cast<uintptr_t>(block->data);
+	size_t offset = ((base + used + alignment - 1) & ~(static_cast<uintptr_t>(alignment) - 1)) - base;
+
+	if (offset + bytes > block->size)
+	{
+		addBlock(std::max(bytes + alignment, block->size * 2));
+		block = &blocks.back();
+		base = reinterpret_cast<uintptr_t>(block->data);
+		offset = ((base + alignment - 1) & ~(static_cast<uintptr_t>(alignment) - 1)) - base;
+	}
+
+	used = offset + bytes;
+	return block->data + offset;
+}
+
+/*
+* Make sure the next frame can allocate bytes without growing. Only call this right after a reset.
+*/
+void Arena::reserve(size_t bytes)
+{
+	if (capacity() >= bytes && blocks.size() == 1)
+		return;
+
+	release();
+	addBlock(bytes);
+}
+
+/*
+* Free everything handed out since the last reset. If the frame needed more than one block, they are replaced by a single block
+* as large as all of them together, so the next frame of the same size does not allocate at all.
+*/
+void Arena::reset()
+{
+	size_t total = capacity();
+	high_water = std::max(high_water, total);
+
+	if (blocks.size() > 1)
+	{
+		release();
+		addBlock(total);
+	}
+	used = 0;
+}
+
+size_t Arena::capacity() const
+{
+	size_t total = 0;
+	for (const Block& block : blocks)
+		total += block.size;
+	return total;
+}
+
+// Number of blocks allocated from the heap so far
+long long Arena::blockAllocations() const
+{
+	return growths;
+}
@@ -0,0 +1,51 @@
+/*
+* Declares Arena, a bump allocator for the temporaries of a frame, and a counter of the heap allocations made through operator new.
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <vector>
+
+// Number of calls to the global operator new so far. Only counted in builds with COUNT_ALLOCATIONS defined (e.g. -DCOUNT_ALLOCATIONS),
+// as counting replaces the standard operator new; 0 otherwise
+long long heapAllocations();
+
+class Arena
+{
+	struct Block {
+		char* data;
+		size_t size;
+	};
+
+	// Normally a single block. A frame which needs more than it holds gets extra blocks, which are merged into one on the next reset
+	std::vector<Block> blocks;
+	size_t used;
+	size_t high_water;
+	long long growths;
+
+	void addBlock(size_t size);
+	void release();
+
+public:
+	Arena();
+	~Arena();
+
+	void* allocate(size_t bytes, size_t alignment = 64);
+	void reserve(size_t bytes);
+	void reset();
+
+	size_t capacity() const;
+	long long blockAllocations() const;
+
+	// Uninitialized storage for count values of type T, aligned to a cache line
+	template <typename T>
+	T* allocate(size_t count)
+	{
+		return static_cast<T*>(allocate(count * sizeof(T), std::max<size_t>(alignof(T), 64)));
+	}
+
+	Arena(Arena const&) = delete;
+	void operator=(Arena const&) = delete;
+};
@@ -0,0 +1,952 @@
+#include "batch.h"
+
+#include "color.h"
+#include "fractal.h"
+#include "mapped_file.h"
+#include "render_cluster.h"
+#include "renderer.h"
+#include "thread_pool.h"
+#include "tile_cache.h"
+#include "tile_store.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#endif
+
+////////////////////////////////////////////////////////////
+/// Tile store pre-warming
+////////////////////////////////////////////////////////////
+
+/*
+* Render every location of the file at locations_path (one per line as written by Fractal::location, blank lines and lines starting with #
+* skipped) at width x height, along with the zoom_levels zoom levels above it, and add their tiles to the tile store at store_path.
+* Rendering uses the same settings as the window does by default, so the window then reads these views from the store.
+* Returns the exit code of the program.
+*/
+int prewarmStore(const std::string& store_path, const std::string& locations_path, int width, int height, int zoom_levels)
+{
+	TileStore store;
+	if (!store.open(store_path, true))
+	{
+		std::cerr << "Cannot open tile store " << store_path << std::endl;
+		return 1;
+	}
+	if (!store.isWritable())
+	{
+		std::cerr << "Tile store " << store_path << " is written by another process, close it first" << std::endl;
+		return 1;
+	}
+	std::ifstream locations(locations_path);
+	if (!locations)
+	{
+		std::cerr << "Cannot read locations from " << locations_path << std::endl;
+		return 1;
+	}
+
+	TileCache cache;
+	ColorGenerator cg;
+	Renderer renderer;
+	renderer.tile_cache = &cache;
+	renderer.tile_store = &store;
+	std::vector<int> output(static_cast<size_t>(width) * height);
+
+	auto batch_start = std::chrono::steady_clock::now();
+	long long stored_before = store.size();
+	int rendered = 0;
+	std::string line;
+	while (std::getline(locations, line))
+	{
+		if (line.find_first_not_of(" \t\r") == std::string::npos || line[line.find_first_not_of(" \t\r")] == '#')
+			continue;
+
+		Fractal fractal;
+		if (!fractal.setLocation(line))
+		{
+			std::cerr << "Skipping malformed location: " << line << std::endl;
+			continue;
+		}
+
+		// The location itself first, then the zoom levels a user passes through on the way there
+		for (int level = 0; level <= zoom_levels; ++level)
+		{
+			auto start = std::chrono::steady_clock::now();
+			long long tiles = store.size();
+			Renderer::Frame frame;
+			do
+				frame = renderer.render(fractal, cg, output.data(), width, height, true);
+			while (frame.pending);
+			double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+			std::cout << fractal.location() << ": " << ms << " ms, " << store.size() - tiles << " tiles stored" << std::endl;
+			rendered += 1;
+			fractal.stationaryZoom(-1, width, height);
+		}
+	}
+	store.flush();
+
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - batch_start).count();
+	TileStore::Stats stats = store.statistics();
+	std::cout << "Pre-warmed " << rendered << " views in " << seconds << " s: " << store.size() - stored_before << " tiles stored, " <<
+		stats.hits << " already in the store, " << store.size() << " tiles in " << store_path << std::endl;
+	return 0;
+}
+
+/*
+* The viewport of the tile at pixel x, y of vp. Tiles are computed from their own viewport, locally and on workers alike, so an image
+* comes out the same wherever its tiles were computed.
+*/
+static Fractal::Viewport tileViewport(const Fractal::Viewport& vp, int x, int y)
+{
+	return Fractal::Viewport{ vp.x_origin + x * vp.x_step, vp.y_origin + y * vp.y_step, vp.x_step, vp.y_step };
+}
+
+////////////////////////////////////////////////////////////
+/// Out-of-core export
+////////////////////////////////////////////////////////////
+
+// Rows of pixels finished (and recorded in the progress file) at a time. The output pages of one band are all that stays resident
+constexpr int band_rows = 64;
+
+// Progress file of an export, next to the output: this header, then one byte per band, 1 once the band is in the output file
+struct ExportProgress {
+	char magic[8];
+	uint64_t id;				// Hash of everything which determines the output, so a changed export starts over
+	uint32_t band_count;
+	uint32_t reserved;
+};
+
+static const char progress_magic[8] = { 'F', 'R', 'A', 'C', 'E', 'X', 'P', 'T' };
+
+/*
+* Render the view of location (the default view if empty) at width x height into the file at path, as a binary PPM if path ends in .ppm
+* and as raw RGBA otherwise. The output file is memory mapped and written a band of rows at a time, each band's tiles computed and colored
+* on the thread pool and written straight into the mapping, then written back and dropped from memory. So memory use does not grow with
+* the size of the image, and images far larger than memory can be rendered.
+* Finished bands are recorded in path.progress, so running the same export again after it was killed picks up where it stopped.
+* With a cluster the tiles are iterated by its workers instead, and colored and written here as their results come in; the bands of the
+* image are handed out in order, so only the few bands the workers are on at a time stay resident.
+* The histogram generator needs every pixel of the image before it can color one and is not supported.
+* Returns the exit code of the program.
+*/
+int exportImage(const std::string& path, const std::string& location, int width, int height, ColorGenerator::Generators colors,
+				RenderCluster* cluster)
+{
+	Fractal fractal;
+	if (!location.empty() && !fractal.setLocation(location))
+	{
+		std::cerr << "Not a location: " << location << std::endl;
+		return 1;
+	}
+	if (colors == ColorGenerator::Generators::HISTOGRAM)
+	{
+		std::cerr << "The histogram colors need the whole image at once, export with simple, smooth or distance colors" << std::endl;
+		return 1;
+	}
+
+	bool ppm = path.size() >= 4 && path.compare(path.size() - 4, 4, ".ppm") == 0;
+	std::string header = ppm ? "P6\n" + std::to_string(width) + " " + std::to_string(height) + "\n255\n" : "";
+	size_t pixel_bytes = ppm ? 3 : 4;
+	size_t row_bytes = static_cast<size_t>(width) * pixel_bytes;
+	size_t bytes = header.size() + row_bytes * height;
+
+	MappedFile output;
+	if (!output.open(path, true, bytes) || (output.size() != bytes && !output.resize(bytes)))
+	{
+		std::cerr << "Cannot write " << bytes << " bytes to " << path << std::endl;
+		return 1;
+	}
+	std::memcpy(output.bytes(), header.data(), header.size());
+
+	// Everything the output depends on, hashed with FNV-1a
+	std::string description = fractal.location() + " " + std::to_string(width) + "x" + std::to_string(height) + " " + header +
+							  std::to_string(static_cast<int>(colors)) + " " + std::to_string(band_rows);
+	uint64_t id = 0xCBF29CE484222325ull;
+	for (char c : description)
+		id = (id ^ static_cast<unsigned char>(c)) * 0x100000001B3ull;
+
+	uint32_t band_count = static_cast<uint32_t>((height + band_rows - 1) / band_rows);
+	size_t progress_bytes = sizeof(ExportProgress) + band_count;
+	std::string progress_path = path + ".progress";
+	MappedFile progress;
+	if (!progress.open(progress_path, true, progress_bytes))
+	{
+		std::cerr << "Cannot write " << progress_path << std::endl;
+		return 1;
+	}
+	ExportProgress* state = reinterpret_cast<ExportProgress*>(progress.bytes());
+	bool resuming = progress.size() == progress_bytes && std::memcmp(state->magic, progress_magic, sizeof(progress_magic)) == 0 &&
+					state->id == id && state->band_count == band_count;
+	if (!resuming)
+	{
+		if (progress.size() != progress_bytes && !progress.resize(progress_bytes))
+		{
+			std::cerr << "Cannot write " << progress_path << std::endl;
+			return 1;
+		}
+		state = reinterpret_cast<ExportProgress*>(progress.bytes());
+		std::memset(progress.bytes(), 0, progress_bytes);
+		std::memcpy(state->magic, progress_magic, sizeof(progress_magic));
+		state->id = id;
+		state->band_count = band_count;
+		progress.flush();
+	}
+	unsigned char* band_done = reinterpret_cast<unsigned char*>(progress.bytes()) + sizeof(ExportProgress);
+
+	ColorGenerator cg;
+	cg.color_mode = colors;
+	bool want_distance = colors == ColorGenerator::Generators::DISTANCE;
+	bool want_smooth = colors == ColorGenerator::Generators::SMOOTH;
+	int n = fractal.maxIterations();
+	float marker = 0.0f;	// Only tells beginTiles the distance estimates or smooth values are there
+	cg.beginTiles(width, height, n, want_distance ? &marker : nullptr, want_smooth ? &marker : nullptr);
+
+	constexpr int size = TileCache::tile_size;
+	Fractal::Viewport image = fractal.getViewport(width, height);
+	ThreadPool& pool = ThreadPool::getInstance();
+	int columns = (width + size - 1) / size;
+	char* pixels = output.bytes() + header.size();
+
+	// Colors are packed as r | g << 8 | b << 16
+	auto writePixels = [&](const int* tile_colors, int stride, int x, int y, int tile_width, int tile_height) {
+		for (int row = 0; row < tile_height; ++row)
+		{
+			unsigned char* out = reinterpret_cast<unsigned char*>(pixels + static_cast<size_t>(y + row) * row_bytes + x * pixel_bytes);
+			const int* in = tile_colors + row * stride;
+			for (int column = 0; column < tile_width; ++column, out += pixel_bytes)
+			{
+				uint32_t color = static_cast<uint32_t>(in[column]);
+				out[0] = static_cast<unsigned char>(color);
+				out[1] = static_cast<unsigned char>(color >> 8);
+				out[2] = static_cast<unsigned char>(color >> 16);
+				if (pixel_bytes == 4)
+					out[3] = 0xFF;
+			}
+		}
+	};
+
+	auto start = std::chrono::steady_clock::now();
+	auto last_report = start;
+	long long rendered = 0;
+	int skipped = 0;
+	int finished_rows = 0;
+	std::mutex progress_mutex;
+
+	// The band goes to disk before it is recorded as done
+	auto finishBand = [&](uint32_t band) {
+		int band_y = static_cast<int>(band) * band_rows;
+		int rows = std::min(band_rows, height - band_y);
+		size_t band_offset = header.size() + static_cast<size_t>(band_y) * row_bytes;
+		output.evict(band_offset, static_cast<size_t>(rows) * row_bytes);
+
+		std::lock_guard<std::mutex> lock(progress_mutex);
+		band_done[band] = 1;
+		progress.flush();
+		rendered += static_cast<long long>(rows) * width;
+		finished_rows += rows;
+
+		auto now = std::chrono::steady_clock::now();
+		if (now - last_report > std::chrono::seconds(1) || finished_rows == height)
+		{
+			double seconds = std::chrono::duration<double>(now - start).count();
+			std::cout << "Rows " << finished_rows << " of " << height << ", " << rendered / 1e6 / seconds << " Mpixels/s" << std::endl;
+			last_report = now;
+		}
+	};
+
+	std::vector<RenderCluster::Job> jobs;
+	std::vector<Fractal::Tile> job_tiles;		// Where the pixels of each job go
+	std::vector<int> band_jobs(band_count, 0);
+	for (uint32_t band = 0; band < band_count; ++band)
+	{
+		int band_y = static_cast<int>(band) * band_rows;
+		int rows = std::min(band_rows, height - band_y);
+		if (band_done[band])
+		{
+			skipped += 1;
+			finished_rows += rows;
+			continue;
+		}
+		if (!cluster)
+		{
+			pool.run(columns * ((rows + size - 1) / size), [&](int index) {
+				int x = index % columns * size;
+				int y = band_y + index / columns * size;
+				int tile_width = std::min(size, width - x);
+				int tile_height = std::min(size, band_y + rows - y);
+
+				// Computed and colored in a tile of its own, then written into the output, so nothing but the output grows with the image
+				int values[size * size];
+				float extra[size * size];
+				int tile_colors[size * size];
+				Fractal::Tile tile{ 0, 0, tile_width, tile_height };
+				fractal.computeTile(values, want_distance ? extra : nullptr, size, tile, tileViewport(image, x, y), true, want_smooth ? extra : nullptr);
+				cg.colorTile(values, want_distance ? extra : nullptr, want_smooth ? extra : nullptr, tile_colors, size, 0, 0, tile_width, tile_height, true);
+				writePixels(tile_colors, size, x, y, tile_width, tile_height);
+			});
+			finishBand(band);
+			continue;
+		}
+
+		// The same tiles as above, so the image comes out the same however it was rendered, resumed or not
+		for (int y = band_y; y < band_y + rows; y += size)
+		{
+			for (int x = 0; x < width; x += size)
+			{
+				jobs.push_back(RenderCluster::Job{ tileViewport(image, x, y), std::min(size, width - x), std::min(size, band_y + rows - y) });
+				job_tiles.push_back(Fractal::Tile{ x, y, jobs.back().width, jobs.back().height });
+				band_jobs[band] += 1;
+			}
+		}
+	}
+
+	if (cluster)
+	{
+		bool finished = cluster->render(fractal, want_distance, want_smooth, jobs, [&](int index, const int* values, const float* extra) {
+			const Fractal::Tile& tile = job_tiles[index];
+			uint32_t band = static_cast<uint32_t>(tile.y / band_rows);
+			std::vector<int> job_colors(static_cast<size_t>(tile.width) * tile.height);
+			cg.colorTile(values, want_distance ? extra : nullptr, want_smooth ? extra : nullptr, job_colors.data(), tile.width, 0, 0, tile.width, tile.height, true);
+			writePixels(job_colors.data(), tile.width, tile.x, tile.y, tile.width, tile.height);
+
+			bool band_finished;
+			{
+				std::lock_guard<std::mutex> lock(progress_mutex);
+				band_finished = --band_jobs[band] == 0;
+			}
+			if (band_finished)
+				finishBand(band);
+		});
+		std::cout << cluster->statistics();
+		if (!finished)
+		{
+			std::cerr << "No workers left with " << finished_rows << " of " << height << " rows done, export again to finish" << std::endl;
+			return 1;
+		}
+	}
+	output.flush();
+	output.close();
+	progress.close();
+	std::remove(progress_path.c_str());
+
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	std::cout << "Exported " << width << "x" << height << " to " << path << " in " << seconds << " s";
+	if (skipped > 0)
+		std::cout << ", resumed after " << skipped << " of " << band_count << " bands";
+	std::cout << std::endl;
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+/// Zoom animation
+////////////////////////////////////////////////////////////
+
+// Frames which share an iteration limit, so that all but the first of them can reuse the interior of the frame before
+constexpr int limit_group = 16;
+
+// A frame of an animation, from its iteration values to its encoded bytes. Two of them take turns, so one is computed while the other
+// is colored and written
+struct AnimationFrame {
+	Fractal::Viewport vp;
+	int max_iter;
+	std::vector<int> iterations;
+	std::vector<float> extra;			// Distance estimates or smooth values, for the colors which need them
+	std::vector<unsigned char> tiles;	// Per tile: 1 if it was filled in from the previous frame's interior instead of computed
+	ColorGenerator cg;
+	int palette_iter;					// Iteration limit cg was set up for
+	std::vector<int> colors;
+	std::vector<unsigned char> bytes;
+};
+
+/*
+* Interior reuse: a tile lies within the pixels of the previous frame in the box around it, and if the border of that box is inside the
+* set, the whole box is, as the Mandelbrot set and filled Julia sets have no holes. Then the tile is all interior and is filled in without
+* iterating it. Like solid guessing this trusts the previous frame's pixels to have caught every filament crossing the border.
+*/
+static bool interiorTile(const AnimationFrame& previous, const Fractal::Viewport& vp, int width, int height, const Fractal::Tile& tile)
+{
+	auto column = [&](int x) {
+		return static_cast<double>((vp.x_origin + x * vp.x_step - previous.vp.x_origin) / previous.vp.x_step);
+	};
+	auto row = [&](int y) {
+		return static_cast<double>((vp.y_origin + y * vp.y_step - previous.vp.y_origin) / previous.vp.y_step);
+	};
+	double first_x = column(tile.x), last_x = column(tile.x + tile.width - 1);
+	double first_y = row(tile.y), last_y = row(tile.y + tile.height - 1);
+	long long left = static_cast<long long>(std::floor(std::min(first_x, last_x)));
+	long long right = static_cast<long long>(std::ceil(std::max(first_x, last_x)));
+	long long top = static_cast<long long>(std::floor(std::min(first_y, last_y)));
+	long long bottom = static_cast<long long>(std::ceil(std::max(first_y, last_y)));
+	if (left < 0 || top < 0 || right >= width || bottom >= height)
+		return false;
+
+	const int* values = previous.iterations.data();
+	for (long long x = left; x <= right; ++x)
+	{
+		if (values[top * width + x] != 0 || values[bottom * width + x] != 0)
+			return false;
+	}
+	for (long long y = top; y <= bottom; ++y)
+	{
+		if (values[y * width + left] != 0 || values[y * width + right] != 0)
+			return false;
+	}
+	return true;
+}
+
+// Color a frame and encode it as a frame of a YUV4MPEG2 (4:4:4, BT.601) or a binary PPM stream into frame.bytes
+static void encodeFrame(AnimationFrame& frame, int width, int height, bool y4m)
+{
+	bool distance = frame.cg.color_mode == ColorGenerator::Generators::DISTANCE;
+	bool smooth = frame.cg.color_mode == ColorGenerator::Generators::SMOOTH;
+	frame.cg.colorTile(frame.iterations.data(), distance ? frame.extra.data() : nullptr, smooth ? frame.extra.data() : nullptr, frame.colors.data(),
+					   width, 0, 0, width, height, true);
+
+	size_t pixels = static_cast<size_t>(width) * height;
+	std::string header = y4m ? "FRAME\n" : "P6\n" + std::to_string(width) + " " + std::to_string(height) + "\n255\n";
+	frame.bytes.resize(header.size() + pixels * 3);
+	std::memcpy(frame.bytes.data(), header.data(), header.size());
+	unsigned char* out = frame.bytes.data() + header.size();
+	const int* colors = frame.colors.data();
+	if (!y4m)
+	{
+		for (size_t i = 0; i < pixels; ++i, out += 3)
+		{
+			out[0] = static_cast<unsigned char>(colors[i]);
+			out[1] = static_cast<unsigned char>(colors[i] >> 8);
+			out[2] = static_cast<unsigned char>(colors[i] >> 16);
+		}
+		return;
+	}
+
+	// Planar, the Y, U and V planes one after another
+	unsigned char* y_plane = out;
+	unsigned char* u_plane = out + pixels;
+	unsigned char* v_plane = out + 2 * pixels;
+	for (size_t i = 0; i < pixels; ++i)
+	{
+		int r = colors[i] & 0xFF, g = (colors[i] >> 8) & 0xFF, b = (colors[i] >> 16) & 0xFF;
+		y_plane[i] = static_cast<unsigned char>(((66 * r + 129 * g + 25 * b + 128) >> 8) + 16);
+		u_plane[i] = static_cast<unsigned char>(((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128);
+		v_plane[i] = static_cast<unsigned char>(((112 * r - 94 * g - 18 * b + 128) >> 8) + 128);
+	}
+}
+
+/*
+* Render frame_count frames of an exponential zoom from the location from to the location to (see Fractal::zoomBetween) at width x height
+* and write them to path, or to the standard output if path is "-", as a stream of binary PPM images if path ends in .ppm and as YUV4MPEG2
+* at fps frames per second otherwise. Either can be piped into a video encoder.
+* Frames are pipelined: while the thread pool (or a cluster's workers) iterates a frame, a writer thread colors and encodes the one before.
+* Tiles of the Mandelbrot and Julia sets which lie within the interior of the previous frame are filled in from it instead of iterated,
+* see interiorTile.
+* The histogram generator flickers between frames and is not supported.
+* Returns the exit code of the program.
+*/
+int animateZoom(const std::string& path, const std::string& from, const std::string& to, int frame_count, int width, int height,
+				ColorGenerator::Generators colors, int fps, RenderCluster* cluster)
+{
+	Fractal start, end;
+	for (const std::string& location : { from, to })
+	{
+		if (!location.empty() && !Fractal().setLocation(location))
+		{
+			std::cerr << "Not a location: " << location << std::endl;
+			return 1;
+		}
+	}
+	if (!from.empty())
+		start.setLocation(from);
+	end = start;
+	if (!to.empty())
+		end.setLocation(to);
+	Fractal fractal = start;
+	if (!fractal.zoomBetween(start, end, 0))
+	{
+		std::cerr << "Both ends of a zoom must show the same fractal set" << std::endl;
+		return 1;
+	}
+	if (colors == ColorGenerator::Generators::HISTOGRAM)
+	{
+		std::cerr << "The histogram colors change with every frame, animate with simple, smooth or distance colors" << std::endl;
+		return 1;
+	}
+
+	bool to_stdout = path == "-";
+	bool y4m = !(path.size() >= 4 && path.compare(path.size() - 4, 4, ".ppm") == 0);
+	FILE* file = to_stdout ? stdout : std::fopen(path.c_str(), "wb");
+	if (!file)
+	{
+		std::cerr << "Cannot write " << path << std::endl;
+		return 1;
+	}
+#ifdef _WIN32
+	if (to_stdout)
+		_setmode(_fileno(stdout), _O_BINARY);
+#endif
+	// The frames own the standard output, so everything printed goes to the standard error instead
+	std::streambuf* cout_buffer = std::cout.rdbuf();
+	if (to_stdout)
+		std::cout.rdbuf(std::cerr.rdbuf());
+
+	bool failed = false;
+	if (y4m)
+	{
+		std::string header = "YUV4MPEG2 W" + std::to_string(width) + " H" + std::to_string(height) + " F" + std::to_string(fps) + ":1 Ip A1:1 C444\n";
+		failed = std::fwrite(header.data(), 1, header.size(), file) != header.size();
+	}
+
+	constexpr int size = TileCache::tile_size;
+	int columns = (width + size - 1) / size;
+	int rows = (height + size - 1) / size;
+	size_t pixels = static_cast<size_t>(width) * height;
+	bool want_distance = colors == ColorGenerator::Generators::DISTANCE;
+	bool want_smooth = colors == ColorGenerator::Generators::SMOOTH;
+	bool connected = fractal.fractal_mode != Fractal::FractalSets::BSHIP;
+
+	AnimationFrame frames[2];
+	for (AnimationFrame& frame : frames)
+	{
+		frame.iterations.resize(pixels);
+		frame.extra.resize(want_distance || want_smooth ? pixels : 0);
+		frame.tiles.resize(static_cast<size_t>(columns) * rows);
+		frame.cg.color_mode = colors;
+		frame.colors.resize(pixels);
+		frame.max_iter = 0;
+		frame.palette_iter = 0;
+	}
+
+	// Frames handed to the writer, and frames it has written
+	std::mutex mutex;
+	std::condition_variable condition;
+	int handed = 0, written = 0;
+	bool closing = false;
+	std::thread writer([&]() {
+		for (int next = 0;; ++next)
+		{
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				condition.wait(lock, [&]() {return handed > next || closing; });
+				if (handed <= next)
+					return;
+			}
+			AnimationFrame& frame = frames[next % 2];
+			encodeFrame(frame, width, height, y4m);
+			bool ok = std::fwrite(frame.bytes.data(), 1, frame.bytes.size(), file) == frame.bytes.size();
+
+			std::lock_guard<std::mutex> lock(mutex);
+			failed = failed || !ok;
+			written = next + 1;
+			condition.notify_all();
+		}
+	});
+
+	ThreadPool& pool = ThreadPool::getInstance();
+	std::vector<RenderCluster::Job> jobs;
+	std::vector<int> job_tiles;			// Index of the tile each job is
+	bool stranded = false;				// Set if the cluster ran out of workers
+	auto begin = std::chrono::steady_clock::now();
+	auto last_report = begin;
+	long long reused = 0;
+	for (int k = 0; k < frame_count; ++k)
+	{
+		// The frame two back has to be written before its buffers are used again
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			condition.wait(lock, [&]() {return written >= k - 1; });
+			if (failed)
+				break;
+		}
+
+		AnimationFrame& frame = frames[k % 2];
+		const AnimationFrame& previous = frames[(k + 1) % 2];
+		auto at = [frame_count](int k) {
+			return frame_count > 1 ? static_cast<long double>(std::min(k, frame_count - 1)) / (frame_count - 1) : 0.0L;
+		};
+		// The iteration limit is the one of the last frame of every group, so it changes only between groups. Interior reuse needs a limit
+		// no higher than the previous frame's, as pixels which did not escape before might escape with more iterations
+		Fractal limit;
+		limit.zoomBetween(start, end, at(k / limit_group * limit_group + limit_group - 1));
+		fractal.zoomBetween(start, end, at(k));
+		fractal.setMaxIterations(std::max(fractal.maxIterations(), limit.maxIterations()));
+		frame.vp = fractal.getViewport(width, height);
+		frame.max_iter = fractal.maxIterations();
+		bool reuse = connected && k > 0 && previous.max_iter >= frame.max_iter;
+
+		pool.run(columns * rows, [&](int index) {
+			Fractal::Tile tile{ index % columns * size, index / columns * size, 0, 0 };
+			tile.width = std::min(size, width - tile.x);
+			tile.height = std::min(size, height - tile.y);
+			frame.tiles[index] = reuse && interiorTile(previous, frame.vp, width, height, tile);
+			if (frame.tiles[index])
+			{
+				for (int y = tile.y; y < tile.y + tile.height; ++y)
+				{
+					std::fill_n(&frame.iterations[static_cast<size_t>(y) * width + tile.x], tile.width, 0);
+					if (!frame.extra.empty())
+						std::fill_n(&frame.extra[static_cast<size_t>(y) * width + tile.x], tile.width, 0.0f);
+				}
+				return;
+			}
+			if (!cluster)
+			{
+				size_t at = static_cast<size_t>(tile.y) * width + tile.x;
+				fractal.computeTile(&frame.iterations[at], want_distance ? &frame.extra[at] : nullptr, width, Fractal::Tile{ 0, 0, tile.width, tile.height },
+									tileViewport(frame.vp, tile.x, tile.y), true, want_smooth ? &frame.extra[at] : nullptr);
+			}
+		});
+		for (unsigned char tile : frame.tiles)
+			reused += tile;
+
+		// On a cluster every tile which was not filled in is a job of its own
+		if (cluster)
+		{
+			jobs.clear();
+			job_tiles.clear();
+			for (int index = 0; index < columns * rows; ++index)
+			{
+				if (frame.tiles[index])
+					continue;
+				int x = index % columns * size, y = index / columns * size;
+				jobs.push_back(RenderCluster::Job{ tileViewport(frame.vp, x, y), std::min(size, width - x), std::min(size, height - y) });
+				job_tiles.push_back(index);
+			}
+			bool finished = cluster->render(fractal, want_distance, want_smooth, jobs, [&](int index, const int* values, const float* extra) {
+				const RenderCluster::Job& job = jobs[index];
+				int x = job_tiles[index] % columns * size, y = job_tiles[index] / columns * size;
+				for (int row = 0; row < job.height; ++row)
+				{
+					size_t at = static_cast<size_t>(y + row) * width + x;
+					std::memcpy(&frame.iterations[at], values + row * job.width, job.width * sizeof(int));
+					if (extra)
+						std::memcpy(&frame.extra[at], extra + row * job.width, job.width * sizeof(float));
+				}
+			});
+			if (!finished)
+			{
+				std::cerr << "No workers left at frame " << k + 1 << std::endl;
+				stranded = true;
+				break;
+			}
+		}
+
+		// The palette only depends on the iteration limit, so it is only built again when that changes
+		if (frame.palette_iter != frame.max_iter)
+		{
+			frame.cg.beginTiles(width, height, frame.max_iter, want_distance ? frame.extra.data() : nullptr, want_smooth ? frame.extra.data() : nullptr);
+			frame.palette_iter = frame.max_iter;
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			handed = k + 1;
+			condition.notify_all();
+		}
+
+		auto now = std::chrono::steady_clock::now();
+		if (now - last_report > std::chrono::seconds(1))
+		{
+			std::cout << "Frame " << k + 1 << " of " << frame_count << ", " << (k + 1) / std::chrono::duration<double>(now - begin).count() <<
+				" frames/s" << std::endl;
+			last_report = now;
+		}
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		closing = true;
+		condition.notify_all();
+	}
+	writer.join();
+	if (cluster)
+		std::cout << cluster->statistics();
+	std::fflush(file);
+	if (!to_stdout)
+		failed = std::fclose(file) != 0 || failed;
+
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+	if (failed)
+		std::cerr << "Cannot write " << path << " after " << written << " frames" << std::endl;
+	else if (!stranded)
+		std::cout << "Rendered " << written << " frames of " << width << "x" << height << " in " << seconds << " s, " << written / seconds <<
+			" frames/s, " << 100.0 * reused / (static_cast<double>(columns) * rows * std::max(written, 1)) << "% of tiles reused from the previous frame" << std::endl;
+	std::cout.rdbuf(cout_buffer);
+	return failed || stranded ? 1 : 0;
+}
+
+////////////////////////////////////////////////////////////
+/// Parameter sweep
+////////////////////////////////////////////////////////////
+
+/*
+* Read an axis written as parameter=first:last:count, where parameter is re or im (of the Julia constant), iter or zoom.
+* Returns false if text is not an axis.
+*/
+bool parseSweepAxis(const std::string& text, SweepAxis& axis)
+{
+	static const char* const names[] = { "re", "im", "iter", "zoom" };
+	size_t equals = text.find('=');
+	if (equals == std::string::npos)
+		return false;
+
+	int parameter = 0;
+	while (parameter < 4 && text.compare(0, equals, names[parameter]) != 0)
+		++parameter;
+	std::istringstream in(text.substr(equals + 1));
+	char colon[2];
+	if (parameter == 4 || !(in >> axis.first >> colon[0] >> axis.last >> colon[1] >> axis.count) || colon[0] != ':' || colon[1] != ':' || axis.count < 1)
+		return false;
+
+	axis.parameter = static_cast<SweepAxis::Parameter>(parameter);
+	bool positive = axis.parameter == SweepAxis::Parameter::MAX_ITER || axis.parameter == SweepAxis::Parameter::ZOOM;
+	return !positive || (axis.first > 0 && axis.last > 0);
+}
+
+// Set the parameter of axis to its index-th value
+static void applySweepAxis(Fractal& fractal, const SweepAxis& axis, int index)
+{
+	long double t = axis.count > 1 ? static_cast<long double>(index) / (axis.count - 1) : 0.0L;
+	long double value = axis.parameter == SweepAxis::Parameter::ZOOM ? axis.first * std::pow(axis.last / axis.first, t) : axis.first + (axis.last - axis.first) * t;
+	if (axis.parameter == SweepAxis::Parameter::JULIA_REAL)
+		fractal.julia_complex_param.real(value);
+	else if (axis.parameter == SweepAxis::Parameter::JULIA_IMAG)
+		fractal.julia_complex_param.imag(value);
+	else if (axis.parameter == SweepAxis::Parameter::MAX_ITER)
+		fractal.setMaxIterations(static_cast<unsigned int>(std::max(1LL, std::llround(value))));
+	else
+		fractal.setZoom(value);
+}
+
+// A location followed by the Julia constant, which sweepParameters reads back from a list
+static std::string sweepLine(const Fractal& fractal)
+{
+	std::ostringstream out;
+	out.precision(std::numeric_limits<long double>::max_digits10);
+	out << fractal.location() << ' ' << fractal.julia_complex_param.real() << ' ' << fractal.julia_complex_param.imag();
+	return out.str();
+}
+
+/*
+* Render a thumbnail of thumbnail_width x thumbnail_height for every parameter set of a sweep, laid out as a contact sheet in the file at
+* path, a binary PPM if path ends in .ppm and raw RGBA otherwise, and list the parameter sets in sheet order in path.txt.
+* The parameter sets are either the lines of the file at list_path (a location as written by Fractal::location, optionally followed by
+* the real and imaginary part of the Julia constant), one row of the sheet after another, or the grid of axes (the first along the rows,
+* the second, if any, down the columns) applied to location, the default view if empty, of the Julia set if a Julia constant is swept.
+*
+* Thumbnails are rendered a band of sheet rows at a time on the thread pool. Small ones are rendered whole, one per job, as splitting them
+* into tiles would only add jobs, while larger ones are split into tiles, so that even a few of them keep every thread busy. Palettes only
+* depend on the iteration limit and are set up once for each limit of the sweep.
+* Returns the exit code of the program.
+*/
+int sweepParameters(const std::string& path, const std::string& location, const std::vector<SweepAxis>& axes, const std::string& list_path,
+					int thumbnail_width, int thumbnail_height, ColorGenerator::Generators colors)
+{
+	if (colors == ColorGenerator::Generators::HISTOGRAM)
+	{
+		std::cerr << "The histogram colors need a histogram of every thumbnail, sweep with simple, smooth or distance colors" << std::endl;
+		return 1;
+	}
+
+	std::vector<Fractal> views;
+	int columns = 1;
+	if (!list_path.empty())
+	{
+		std::ifstream list(list_path);
+		if (!list)
+		{
+			std::cerr << "Cannot read parameter sets from " << list_path << std::endl;
+			return 1;
+		}
+		std::string line;
+		while (std::getline(list, line))
+		{
+			if (line.find_first_not_of(" \t\r") == std::string::npos || line[line.find_first_not_of(" \t\r")] == '#')
+				continue;
+
+			Fractal fractal;
+			if (!fractal.setLocation(line))
+			{
+				std::cerr << "Skipping malformed parameter set: " << line << std::endl;
+				continue;
+			}
+			std::istringstream in(line);
+			std::string skipped;
+			for (int i = 0; i < 5; ++i)
+				in >> skipped;
+			long double real, imag;
+			if (in >> real >> imag)
+				fractal.julia_complex_param = std::complex<long double>(real, imag);
+			views.push_back(fractal);
+		}
+		while (columns * columns < static_cast<int>(views.size()))
+			++columns;
+	}
+	else
+	{
+		Fractal base;
+		bool julia = std::any_of(axes.begin(), axes.end(), [](const SweepAxis& axis) {
+			return axis.parameter == SweepAxis::Parameter::JULIA_REAL || axis.parameter == SweepAxis::Parameter::JULIA_IMAG;
+		});
+		if (!location.empty() && !base.setLocation(location))
+		{
+			std::cerr << "Not a location: " << location << std::endl;
+			return 1;
+		}
+		if (location.empty() && julia)
+			base.selectFractal(static_cast<int>(Fractal::FractalSets::JULIA));
+
+		SweepAxis single{ SweepAxis::Parameter::MAX_ITER, 0, 0, 1 };
+		const SweepAxis& across = axes.size() > 0 ? axes[0] : single;
+		const SweepAxis& down = axes.size() > 1 ? axes[1] : single;
+		for (int row = 0; row < down.count; ++row)
+		{
+			for (int column = 0; column < across.count; ++column)
+			{
+				Fractal fractal = base;
+				if (axes.size() > 0)
+					applySweepAxis(fractal, across, column);
+				if (axes.size() > 1)
+					applySweepAxis(fractal, down, row);
+				views.push_back(fractal);
+			}
+		}
+		columns = across.count;
+	}
+	if (views.empty())
+	{
+		std::cerr << "No parameter sets to render" << std::endl;
+		return 1;
+	}
+
+	bool want_distance = colors == ColorGenerator::Generators::DISTANCE;
+	bool want_smooth = colors == ColorGenerator::Generators::SMOOTH;
+	float marker = 0.0f;	// Only tells beginTiles the distance estimates or smooth values are there
+	std::map<int, ColorGenerator> palettes;
+	for (const Fractal& fractal : views)
+	{
+		if (palettes.count(fractal.maxIterations()))
+			continue;
+		ColorGenerator& cg = palettes[fractal.maxIterations()];
+		cg.color_mode = colors;
+		cg.beginTiles(thumbnail_width, thumbnail_height, fractal.maxIterations(), want_distance ? &marker : nullptr, want_smooth ? &marker : nullptr);
+	}
+
+	std::ofstream output(path, std::ios::binary);
+	std::ofstream list(path + ".txt");
+	if (!output || !list)
+	{
+		std::cerr << "Cannot write " << path << std::endl;
+		return 1;
+	}
+	for (const Fractal& fractal : views)
+		list << sweepLine(fractal) << '\n';
+
+	int count = static_cast<int>(views.size());
+	int rows = (count + columns - 1) / columns;
+	int sheet_width = columns * thumbnail_width;
+	bool ppm = path.size() >= 4 && path.compare(path.size() - 4, 4, ".ppm") == 0;
+	size_t pixel_bytes = ppm ? 3 : 4;
+	if (ppm)
+		output << "P6\n" << sheet_width << " " << rows * thumbnail_height << "\n255\n";
+
+	// Up to 4 tiles worth of pixels a thumbnail is one job, and bands are made tall enough to give every thread several of them
+	constexpr int size = TileCache::tile_size;
+	ThreadPool& pool = ThreadPool::getInstance();
+	bool whole = static_cast<long long>(thumbnail_width) * thumbnail_height <= 4 * size * size;
+	int band_rows = whole ? std::max(1, (4 * (pool.size + 1) + columns - 1) / columns) : 1;
+	size_t band_pixels = static_cast<size_t>(sheet_width) * band_rows * thumbnail_height;
+	std::vector<int> iterations(band_pixels);
+	std::vector<float> extra(want_distance || want_smooth ? band_pixels : 0);
+	std::vector<int> band_colors(band_pixels);
+	std::vector<unsigned char> bytes(band_pixels * pixel_bytes);
+
+	struct SweepJob {
+		int view;
+		Fractal::Tile tile;		// Within the band
+	};
+	std::vector<SweepJob> jobs;
+
+	auto start = std::chrono::steady_clock::now();
+	for (int band = 0; band < rows; band += band_rows)
+	{
+		int first = band * columns;
+		int last = std::min(count, (band + band_rows) * columns);
+		jobs.clear();
+		for (int view = first; view < last; ++view)
+		{
+			int x = (view - first) % columns * thumbnail_width;
+			int y = (view - first) / columns * thumbnail_height;
+			if (whole)
+			{
+				jobs.push_back(SweepJob{ view, Fractal::Tile{ x, y, thumbnail_width, thumbnail_height } });
+				continue;
+			}
+			for (int tile_y = 0; tile_y < thumbnail_height; tile_y += size)
+			{
+				for (int tile_x = 0; tile_x < thumbnail_width; tile_x += size)
+					jobs.push_back(SweepJob{ view, Fractal::Tile{ x + tile_x, y + tile_y, std::min(size, thumbnail_width - tile_x), std::min(size, thumbnail_height - tile_y) } });
+			}
+		}
+
+		std::fill(band_colors.begin(), band_colors.end(), 0);
+		pool.run(static_cast<int>(jobs.size()), [&](int index) {
+			const SweepJob& job = jobs[index];
+			Fractal fractal = views[job.view];
+			int x = (job.view - first) % columns * thumbnail_width;
+			int y = (job.view - first) / columns * thumbnail_height;
+
+			// The thumbnail's viewport, moved to where the thumbnail is in the band
+			Fractal::Viewport vp = fractal.getViewport(thumbnail_width, thumbnail_height);
+			vp.x_origin -= x * vp.x_step;
+			vp.y_origin -= y * vp.y_step;
+			float* distance = want_distance ? extra.data() : nullptr;
+			float* smooth = want_smooth ? extra.data() : nullptr;
+			fractal.computeTile(iterations.data(), distance, sheet_width, job.tile, vp, true, smooth);
+			palettes.find(fractal.maxIterations())->second.colorTile(iterations.data(), distance, smooth, band_colors.data(), sheet_width,
+																	 job.tile.x, job.tile.y, job.tile.width, job.tile.height, true);
+		});
+
+		// Colors are packed as r | g << 8 | b << 16
+		size_t pixels = static_cast<size_t>(sheet_width) * std::min(band_rows, rows - band) * thumbnail_height;
+		for (size_t i = 0; i < pixels; ++i)
+		{
+			uint32_t color = static_cast<uint32_t>(band_colors[i]);
+			unsigned char* out = &bytes[i * pixel_bytes];
+			out[0] = static_cast<unsigned char>(color);
+			out[1] = static_cast<unsigned char>(color >> 8);
+			out[2] = static_cast<unsigned char>(color >> 16);
+			if (pixel_bytes == 4)
+				out[3] = 0xFF;
+		}
+		output.write(reinterpret_cast<const char*>(bytes.data()), static_cast<std::streamsize>(pixels * pixel_bytes));
+	}
+	output.close();
+	if (!output)
+	{
+		std::cerr << "Cannot write " << path << std::endl;
+		return 1;
+	}
+
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	std::cout << "Rendered " << count << " thumbnails of " << thumbnail_width << "x" << thumbnail_height << " (" << (whole ? "one per job" : "tiles per job") <<
+		", " << palettes.size() << " palettes) into a " << columns << "x" << rows << " sheet in " << seconds << " s, " << count / seconds * 60 <<
+		" thumbnails/minute" << std::endl;
+	return 0;
+}
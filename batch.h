@@ -0,0 +1,27 @@
+/*
+* Declares the batch modes, which render without a window from the command line.
+*/
+
+#pragma once
+
+#include "color.h"
+#include "render_cluster.h"
+
+#include <string>
+#include <vector>
+
+// One axis of a parameter sweep: count values of parameter from first to last, evenly spaced (by the same factor for the zoom)
+struct SweepAxis {
+	enum class Parameter { JULIA_REAL, JULIA_IMAG, MAX_ITER, ZOOM } parameter;
+	long double first, last;
+	int count;
+};
+
+int prewarmStore(const std::string& store_path, const std::string& locations_path, int width, int height, int zoom_levels);
+int exportImage(const std::string& path, const std::string& location, int width, int height, ColorGenerator::Generators colors,
+				RenderCluster* cluster = nullptr);
+int animateZoom(const std::string& path, const std::string& from, const std::string& to, int frame_count, int width, int height,
+				ColorGenerator::Generators colors, int fps, RenderCluster* cluster = nullptr);
+bool parseSweepAxis(const std::string& text, SweepAxis& axis);
+int sweepParameters(const std::string& path, const std::string& location, const std::vector<SweepAxis>& axes, const std::string& list_path,
+					int thumbnail_width, int thumbnail_height, ColorGenerator::Generators colors);
@@ -2,9 +2,9 @@
 #include "thread_pool.h"
 
 #include <algorithm>
-#include <atomic>
-#include <memory>
+#include <cmath>
 #include <stdint.h>
+#include <utility>
 #include <vector>
 
 #include <immintrin.h> // AVX intrinsics
@@ -28,14 +28,21 @@ uint8_t sat_sub_u8b(uint8_t l, uint8_t r)
 ColorGenerator::ColorGenerator()
 {
 	color_mode = Generators::SIMPLE;
+	tile_mode = Generators::SIMPLE;
+	tile_n = 0;
 
 	simple_red_modifier = 1.246f;
 	simple_green_modifier = 0.396f;
 	simple_blue_modifier = 3.141f;
+	palette_phase = 0.0f;
+	std::fill(simple_lut_modifiers, simple_lut_modifiers + 4, 0.0f);
 
 	weak = Color{ 50, 100, 25 };
 	strong = Color{ 255, 255, 255 };
 
+	distance_falloff = 4.0f;
+	histogram_sample_stride = 1;
+
 	t_pool = &ThreadPool::getInstance();
 }
 
@@ -49,6 +56,23 @@ void ColorGenerator::selectMode(int mode)
 	color_mode = (Generators)((static_cast<int>(mode)) % static_cast<int>(Generators::LAST));
 }
 
+/*
+* Take over the color mode and palette parameters of other, but keep this generator's own tables and scratch buffers, so that a copy
+* which is updated every frame does not allocate.
+*/
+void ColorGenerator::copyParameters(const ColorGenerator& other)
+{
+	color_mode = other.color_mode;
+	simple_red_modifier = other.simple_red_modifier;
+	simple_green_modifier = other.simple_green_modifier;
+	simple_blue_modifier = other.simple_blue_modifier;
+	palette_phase = other.palette_phase;
+	strong = other.strong;
+	weak = other.weak;
+	distance_falloff = other.distance_falloff;
+	histogram_sample_stride = other.histogram_sample_stride;
+}
+
 // To pack chars into a 32-bit int we use bit shifting.
 // OpenGL expects the last 8-bits to be the alpha value of the color, but since we dont use the
 // alpha channel we just ignore it.
@@ -74,9 +98,57 @@ ColorGenerator::Color ColorGenerator::Color::operator-(const Color& other)
 
 ColorGenerator::Color ColorGenerator::Color::operator*(double multiplier)
 {
-	return Color{	unsigned char(r * multiplier),
-					unsigned char(g * multiplier),
-					unsigned char(b * multiplier) };
+	return Color{	static_cast<unsigned char>(r * multiplier),
+					static_cast<unsigned char>(g * multiplier),
+					static_cast<unsigned char>(b * multiplier) };
+}
+
+////////////////////////////////////////////////////////////
+/// Palette lookup
+////////////////////////////////////////////////////////////
+/*
+* The simple and histogram generators both boil down to a table with the packed color of every iteration value. Applying it is a single
+* lookup per pixel, which costs the same no matter how the table was made.
+*/
+
+void ColorGenerator::paletteThread(int index, int stride, const int* lut, int* matrix, int end_index)
+{
+	for (int i = index; i < end_index; i += stride)
+	{
+		matrix[i] = lut[matrix[i]];
+	}
+}
+
+void ColorGenerator::palette(const int* lut, int* matrix, int end_index)
+{
+	// One job per pool thread and one for the calling thread, which runs jobs as well
+	int jobs = t_pool->size + 1;
+	t_pool->run(jobs, [=](int index) {paletteThread(index, jobs, lut, matrix, end_index); });
+}
+
+/*
+* Same as paletteThread, but the lookups are done 8 pixels at a time with AVX2 gathers.
+*/
+void ColorGenerator::paletteAVXThread(int index, int stride, const int* lut, int* matrix, int end_index)
+{
+	for (int i = index; i < end_index; i += stride)
+	{
+		// The padding past the end of the matrix is not guaranteed to hold valid iteration values, so the last partial group is looked up one at a time
+		if (i + 8 > end_index)
+		{
+			for (int k = i; k < end_index; ++k)
+				matrix[k] = lut[matrix[k]];
+			break;
+		}
+		__m256i _iter = _mm256_load_si256((__m256i*)&matrix[i]);
+		_mm256_store_si256((__m256i*)&matrix[i], _mm256_i32gather_epi32(lut, _iter, 4));
+	}
+}
+
+void ColorGenerator::paletteAVX(const int* lut, int* matrix, int end_index)
+{
+	int jobs = t_pool->size + 1;
+	t_pool->run(jobs, [=](int index) {paletteAVXThread(index * 8, jobs * 8, lut, matrix, end_index); });
 }
 
 ////////////////////////////////////////////////////////////
@@ -85,186 +157,502 @@ ColorGenerator::Color ColorGenerator::Color::operator*(double multiplier)
 /*
 * To produce some nice, simple colors, simply plug the number of iterations into the sine function. Arbitrary modifiers can be applied
 * to change the color palette.
+*
+* The sine is only evaluated once per iteration value, into a table which is kept until n or the modifiers change.
 */
 
-void ColorGenerator::simpleThread(int index, int stride, int* matrix, int matrix_width, int matrix_height)
+void ColorGenerator::simplePaletteThread(int index, int stride, int n)
 {
 	double a;
 	unsigned char r, g, b;
-	for (int i = index; i < (matrix_width * matrix_height); i += stride)
+	for (int i = index; i <= n; i += stride)
 	{
-		a = static_cast<double>(matrix[i]);
+		a = static_cast<double>(i);
 		// 255 -> max value of an unsigned char
 		// The sine function can return negative values, so map its natural codomain of [-1.0, 1.0] to [0.0, 1.0] by
 		// multiplying by 0.5 then adding 0.5.
 		// The float values inside the sine function are arbitrary and can be changed to alter the color palette.
-		r = static_cast<unsigned char>(255 * (0.5f * std::sin(a * 0.1f + simple_red_modifier) + 0.5f));
-		g = static_cast<unsigned char>(255 * (0.5f * std::sin(a * 0.1f + simple_green_modifier) + 0.5f));
-		b = static_cast<unsigned char>(255 * (0.5f * std::sin(a * 0.1f + simple_blue_modifier) + 0.5f));
+		r = static_cast<unsigned char>(255 * (0.5f * std::sin(a * 0.1f + simple_red_modifier + palette_phase) + 0.5f));
+		g = static_cast<unsigned char>(255 * (0.5f * std::sin(a * 0.1f + simple_green_modifier + palette_phase) + 0.5f));
+		b = static_cast<unsigned char>(255 * (0.5f * std::sin(a * 0.1f + simple_blue_modifier + palette_phase) + 0.5f));
 
 		// Pack the unsigned chars into an int for OpenGL
-		matrix[i] = int(b << 16 | g << 8 | r);
+		simple_lut[i] = int(b << 16 | g << 8 | r);
+	}
+}
+
+void ColorGenerator::simplePalette(int n)
+{
+	float modifiers[4] = { simple_red_modifier, simple_green_modifier, simple_blue_modifier, palette_phase };
+	if (simple_lut.size() == static_cast<size_t>(n) + 1 && std::equal(modifiers, modifiers + 4, simple_lut_modifiers))
+		return;
+
+	simple_lut.resize(static_cast<size_t>(n) + 1);
+	std::copy(modifiers, modifiers + 4, simple_lut_modifiers);
+
+	int jobs = t_pool->size + 1;
+	t_pool->run(jobs, [=](int index) {simplePaletteThread(index, jobs, n); });
+}
+
+void ColorGenerator::simple(int* matrix, int matrix_width, int matrix_height, int n)
+{
+	simplePalette(n);
+	palette(simple_lut.data(), matrix, matrix_width * matrix_height);
+}
+
+void ColorGenerator::simpleAVX(int* matrix, int matrix_width, int matrix_height, int n)
+{
+	simplePalette(n);
+	paletteAVX(simple_lut.data(), matrix, matrix_width * matrix_height);
+}
+
+////////////////////////////////////////////////////////////
+/// Histogram color generator
+////////////////////////////////////////////////////////////
+/*
+* Produces a more regular color pattern by spreading the colors evenly over the pixels of the frame.
+*/
+
+/*
+* Color of an iteration value with below of the total counted pixels having fewer iterations.
+*/
+int ColorGenerator::histogramColor(long long below, long long total)
+{
+	double hue = total > 0 ? static_cast<double>(below) / total : 0.0;
+	return int(weak + ((strong - weak) * hue));
+}
+
+/*
+* Count the iteration values of a contiguous range of pixels into the private bins of one job, so that no two jobs ever write to the same counter.
+* Only every histogram_sample_stride-th pixel is counted.
+*/
+void ColorGenerator::histogramCountThread(int index, int* matrix, int begin, int end, int n)
+{
+	int* bins = histogram_bins.data() + static_cast<size_t>(index) * n;
+	std::fill(bins, bins + n, 0);
+	for (int i = begin; i < end; i += histogram_sample_stride)
+	{
+		bins[matrix[i]] += 1;
 	}
 }
 
-void ColorGenerator::simple(int* matrix, int matrix_width, int matrix_height)
+/*
+* With a high iteration limit most bins are empty, so instead each job sorts the iteration values of its range of pixels and
+* keeps them as (value, count) runs.
+*/
+void ColorGenerator::histogramSortThread(int index, int* matrix, int begin, int end)
 {
-	for (int index = 0; index < t_pool->size; ++index)
+	std::vector<int>& values = histogram_values[index];
+	values.clear();
+	for (int i = begin; i < end; i += histogram_sample_stride)
+		values.push_back(matrix[i]);
+	std::sort(values.begin(), values.end());
+
+	std::vector<std::pair<int, int>>& runs = histogram_runs[index];
+	runs.clear();
+	for (int value : values)
 	{
-		t_pool->addJob([=]() {simpleThread(index, t_pool->size, matrix, matrix_width, matrix_height); });
+		if (runs.empty() || runs.back().first != value)
+			runs.emplace_back(value, 0);
+		runs.back().second += 1;
 	}
-	t_pool->synchronize();
 }
 
 /*
-* Perform simple iteration value to color conversion using AVX instructions.
-* All operations can be safely performed with 32-bit ints and floats, so we can perform 8 conversions per pass with
-* 256-bit AVX2 registers.
+* Color of each iteration value, built from the cumulative distribution of the histogram: an iteration value gets the hue
+* hue(iter) = (number of pixels with fewer iterations) / total, so the colors spread evenly over the pixels of the frame.
+* Coloring the pixels is then a single lookup each, so the whole generator costs O(pixels + n) no matter how deep the frame is.
+*
+* Each job counts a contiguous range of pixels into its own bins. The bins are then reduced in parallel, each job summing one chunk
+* of iteration values across all of the private bins and adding up its chunk as it goes. The chunk totals are turned into offsets,
+* and each job scans its chunk again starting from its offset, writing the color of every iteration value.
+*
+* The private bins take (t_pool->size + 1) * n to clear and reduce. Once that outgrows the frame itself the histogram is built from sorted
+* runs of iteration values instead (see histogramSortThread), which only costs as much as the pixels.
 */
-void ColorGenerator::simpleAVXThread(int index, int stride, int* matrix, int end_index)
+void ColorGenerator::histogramLUT(int* matrix, int matrix_width, int matrix_height, int n)
 {
-	__m256 _iter, _r, _g, _b, _uchar_max, _half, _tenth, _r_mod, _g_mod, _b_mod;
-	__m256i _res;
+	int pixels = matrix_width * matrix_height;
+	// The calling thread runs jobs too, so there is always at least one
+	int threads = t_pool->size + 1;
+	int pixel_chunk = (pixels + threads - 1) / threads;
+	// Each job starts at a multiple of the stride, so that subsampling always picks the same pixels
+	pixel_chunk = (pixel_chunk + histogram_sample_stride - 1) / histogram_sample_stride * histogram_sample_stride;
 
-	_uchar_max	= _mm256_set1_ps(255.0f);
-	_half		= _mm256_set1_ps(0.5f);
-	_tenth		= _mm256_set1_ps(0.1f);
-	_r_mod		= _mm256_set1_ps(simple_red_modifier);
-	_g_mod		= _mm256_set1_ps(simple_green_modifier);
-	_b_mod		= _mm256_set1_ps(simple_blue_modifier);
+	histogram_lut.resize(std::max(n, 1));
 
-	for (int i = index; i < end_index; i += stride)
+	if (static_cast<long long>(threads) * n > pixels)
 	{
-		// Load the iteration values, convert them to floats, and store them in _iter
-		_iter = _mm256_cvtepi32_ps(_mm256_load_si256((__m256i*)&matrix[i]));
-
-		// r
-		_r = _mm256_sin_ps(_mm256_fmadd_ps(_iter, _tenth, _r_mod));
-		_r = _mm256_fmadd_ps(_half, _r, _half);
-		_r = _mm256_mul_ps(_uchar_max, _r);
-
-		// g
-		_g = _mm256_sin_ps(_mm256_fmadd_ps(_iter, _tenth, _g_mod));
-		_g = _mm256_fmadd_ps(_half, _g, _half);
-		_g = _mm256_mul_ps(_uchar_max, _g);
-
-		// b
-		_b = _mm256_sin_ps(_mm256_fmadd_ps(_iter, _tenth, _b_mod));
-		_b = _mm256_fmadd_ps(_half, _b, _half);
-		_b = _mm256_mul_ps(_uchar_max, _b);
-
-		/*
-		* We wish to shift and pack the R, G, and B values into an int, as is done in the standard isntruction version of this function:
-		* matrix[i] = int(b << 16 | g << 8 | r);
-		*/
-		_res = _mm256_slli_epi32(_mm256_cvtps_epi32(_b), 16);						// Convert _b from float to 32-bit int and shift left 16
-		_res = _mm256_or_si256(_res, _mm256_slli_epi32(_mm256_cvtps_epi32(_g), 8)); // Convert _g from float to 32-bit int, shift left 8, and or with _res
-		_res = _mm256_or_si256(_res, _mm256_cvtps_epi32(_r));						// Convert _r from float to 32-bit int and or with _res
-
-		// Write _res directly into the matrix, overwriting the iteration values we used
-		_mm256_store_si256((__m256i*) & matrix[i], _res);
+		histogram_values.resize(threads);
+		histogram_runs.resize(threads);
+		t_pool->run(threads, [=](int index) {
+			int begin = std::min(pixels, index * pixel_chunk);
+			int end = std::min(pixels, begin + pixel_chunk);
+			histogramSortThread(index, matrix, begin, end);
+		});
+
+		// Merge the runs of all jobs. There are at most as many runs as counted pixels
+		std::vector<std::pair<int, int>>& merged = histogram_merged;
+		merged.clear();
+		for (const auto& runs : histogram_runs)
+			merged.insert(merged.end(), runs.begin(), runs.end());
+		std::sort(merged.begin(), merged.end());
+
+		long long total = 0;
+		for (const auto& run : merged)
+			total += run.second;
+
+		// Every iteration value after the previous counted one up to this one has the same pixels below it. This also colors the
+		// values which were skipped by subsampling
+		long long below = 0;
+		int next = 0;
+		for (const auto& run : merged)
+		{
+			if (run.first >= next)
+			{
+				std::fill(histogram_lut.begin() + next, histogram_lut.begin() + run.first + 1, histogramColor(below, total));
+				next = run.first + 1;
+			}
+			below += run.second;
+		}
+		std::fill(histogram_lut.begin() + next, histogram_lut.end(), histogramColor(below, total));
+		return;
 	}
+
+	histogram_bins.resize(static_cast<size_t>(threads) * n);
+	t_pool->run(threads, [=](int index) {
+		int begin = std::min(pixels, index * pixel_chunk);
+		int end = std::min(pixels, begin + pixel_chunk);
+		histogramCountThread(index, matrix, begin, end, n);
+	});
+
+	histogramReduce(n, threads);
 }
 
-void ColorGenerator::simpleAVX(int* matrix, int end_index)
+/*
+* Sum the first sets private bins into the histogram and build the color table from its cumulative distribution.
+*/
+void ColorGenerator::histogramReduce(int n, int sets)
 {
-	for (int index = 0; index < t_pool->size; ++index)
+	int threads = t_pool->size + 1;
+	histogram_counts.resize(n);
+	histogram_lut.resize(std::max(n, 1));
+
+	int chunk = (n + threads - 1) / threads;
+	std::vector<long long>& chunk_sums = histogram_chunk_sums;
+	chunk_sums.assign(threads, 0);
+	t_pool->run(threads, [=, &chunk_sums](int index) {
+		for (int k = index * chunk; k < std::min(n, (index + 1) * chunk); ++k)
+		{
+			int count = 0;
+			for (int t = 0; t < sets; ++t)
+				count += histogram_bins[static_cast<size_t>(t) * n + k];
+			histogram_counts[k] = count;
+			chunk_sums[index] += count;
+		}
+	});
+
+	// Exclusive scan of the chunk totals, which leaves the total number of counted pixels in total
+	long long total = 0;
+	for (long long& sum : chunk_sums)
 	{
-		t_pool->addJob([=]() {simpleAVXThread(index * 8, (t_pool->size) * 8, matrix, end_index); });
+		long long chunk_total = sum;
+		sum = total;
+		total += chunk_total;
 	}
-	t_pool->synchronize();
+
+	t_pool->run(threads, [=, &chunk_sums](int index) {
+		long long below = chunk_sums[index];
+		for (int k = index * chunk; k < std::min(n, (index + 1) * chunk); ++k)
+		{
+			histogram_lut[k] = histogramColor(below, total);
+			below += histogram_counts[k];
+		}
+	});
+}
+
+void ColorGenerator::histogram(int* matrix, int matrix_width, int matrix_height, int n)
+{
+	histogramLUT(matrix, matrix_width, matrix_height, n);
+	palette(histogram_lut.data(), matrix, matrix_width * matrix_height);
+}
+
+void ColorGenerator::histogramAVX(int* matrix, int matrix_width, int matrix_height, int n)
+{
+	histogramLUT(matrix, matrix_width, matrix_height, n);
+	paletteAVX(histogram_lut.data(), matrix, matrix_width * matrix_height);
 }
 
 ////////////////////////////////////////////////////////////
-/// Histogram color generator
+/// Distance color generator
 ////////////////////////////////////////////////////////////
 /*
-* Produces a more regular color pattern, but is slower.
+* Shades each pixel by its estimated distance (in pixels) to the fractal, which outlines the filaments of the set no matter how many
+* iterations they took. Pixels right at the set get the strong color and fade towards the weak color over distance_falloff pixels.
+* Points in the set have a distance of 0 and an iteration value of 0, and are left black.
 */
-void histogramCountThread(int index, int stride, std::vector<std::unique_ptr<std::atomic<int>>>& num_iters_per_pixel, int* matrix, int matrix_width, int matrix_height)
+int ColorGenerator::distanceColor(float distance)
 {
-	for (int i = index; i < matrix_width * matrix_height; i += stride)
-	{
-		(*num_iters_per_pixel[matrix[i]]) += 1;
-	}
+	double t = std::min(1.0, static_cast<double>(distance) / distance_falloff);
+	return int(strong - ((strong - weak) * t));
 }
 
-void histogramSumThread(int index, int stride, int* result, std::vector<std::unique_ptr<std::atomic<int>>>& num_iters_per_pixel, int n)
+void ColorGenerator::distanceThread(int index, int stride, int* matrix, const float* distance, int matrix_width, int matrix_height)
 {
-	for (int i = index; i < n; i += stride)
+	for (int i = index; i < (matrix_width * matrix_height); i += stride)
 	{
-		(*result) += num_iters_per_pixel[i]->load();
+		if (matrix[i] == 0)
+			continue;
+
+		matrix[i] = distanceColor(distance[i]);
 	}
 }
 
-void ColorGenerator::histogramHueThead(int index, int stride, unsigned int total, std::vector<std::unique_ptr<std::atomic<int>>>& num_iters_per_pixel, int* matrix, int matrix_width, int matrix_height)
+void ColorGenerator::distanceShading(int* matrix, const float* distance, int matrix_width, int matrix_height)
 {
-	int iter;
-	double hue;
-	for (int i = index; i < matrix_width * matrix_height; i += stride)
+	int jobs = t_pool->size + 1;
+	t_pool->run(jobs, [=](int index) {distanceThread(index, jobs, matrix, distance, matrix_width, matrix_height); });
+}
+
+////////////////////////////////////////////////////////////
+/// Smooth color generator
+////////////////////////////////////////////////////////////
+/*
+* Colors each pixel from its smooth escape value (see Fractal::tileSmoothAVX) by interpolating between the two entries of the simple
+* palette around it. The palette is the same as the simple generator's, but without the bands between iteration counts.
+*/
+
+/*
+* Interpolate each of the 3 channels between lut[floor(mu)] and lut[floor(mu) + 1]. mu is clamped to the n + 1 entries of the table.
+*/
+static int smoothColor(const int* lut, int n, float mu)
+{
+	mu = std::min(std::max(mu, 0.0f), static_cast<float>(std::max(n - 1, 0)));
+	int index = static_cast<int>(mu);
+	float t = mu - index;
+	int low = lut[index];
+	int high = lut[index + 1];
+
+	int color = 0;
+	for (int shift = 0; shift < 24; shift += 8)
 	{
-		iter = matrix[i];
-		hue = 0.0;
-		for (int k = 0; k < iter; ++k)
-		{
-			hue += double(num_iters_per_pixel[k]->load()) / total;
-		}
-		matrix[i] = int(weak + ((strong - weak) * hue));
+		float l = static_cast<float>((low >> shift) & 0xFF);
+		float h = static_cast<float>((high >> shift) & 0xFF);
+		color |= static_cast<int>(l + (h - l) * t + 0.5f) << shift;
 	}
+	return color;
 }
 
-void ColorGenerator::histogram(int* matrix, int matrix_width, int matrix_height, int n)
+/*
+* Same as smoothColor, for 8 pixels at a time. Both palette entries are fetched with gathers and the channels are interpolated as floats.
+*/
+static __m256i smoothColorAVX(const int* lut, int n, const __m256& _smooth)
 {
-	std::vector<std::unique_ptr<std::atomic<int>>> num_iters_per_pixel(n);
-	for (auto& p : num_iters_per_pixel)
-		p = std::make_unique<std::atomic<int>>(0);
-
-	for (int index = 0; index < t_pool->size; ++index)
+	__m256 _mu, _t, _l, _h;
+	__m256i _index, _low, _high, _mask, _res;
+
+	_mu = _mm256_min_ps(_mm256_max_ps(_smooth, _mm256_setzero_ps()), _mm256_set1_ps(static_cast<float>(std::max(n - 1, 0))));
+	_index = _mm256_cvttps_epi32(_mu);
+	_t = _mm256_sub_ps(_mu, _mm256_cvtepi32_ps(_index));
+	_low = _mm256_i32gather_epi32(lut, _index, 4);
+	_high = _mm256_i32gather_epi32(lut + 1, _index, 4);
+	_mask = _mm256_set1_epi32(0xFF);
+
+	// r, g and b, with the rounding of the scalar version
+	_res = _mm256_setzero_si256();
+	for (int shift = 0; shift < 24; shift += 8)
 	{
-		t_pool->addJob([=, &num_iters_per_pixel]() {histogramCountThread(index, t_pool->size, num_iters_per_pixel, matrix, matrix_width, matrix_height); });
+		_l = _mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(_low, shift), _mask));
+		_h = _mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(_high, shift), _mask));
+		_l = _mm256_add_ps(_mm256_fmadd_ps(_mm256_sub_ps(_h, _l), _t, _l), _mm256_set1_ps(0.5f));
+		_res = _mm256_or_si256(_res, _mm256_sll_epi32(_mm256_cvttps_epi32(_l), _mm_cvtsi32_si128(shift)));
 	}
+	return _res;
+}
 
-	std::vector<int> thread_sums(t_pool->size, 0);
-	t_pool->synchronize();
-
-	for (int index = 0; index < t_pool->size; ++index)
+void ColorGenerator::smoothThread(int index, int stride, int* matrix, const float* smooth, int end_index, int n)
+{
+	const int* lut = simple_lut.data();
+	for (int i = index; i < end_index; i += stride)
 	{
-		t_pool->addJob([=, &num_iters_per_pixel, &thread_sums]() {histogramSumThread(index, t_pool->size, &thread_sums[index], num_iters_per_pixel, n); });
+		matrix[i] = smoothColor(lut, n, smooth[i]);
 	}
-	t_pool->synchronize();
-
-	unsigned int total = 0;
-	for (int sum : thread_sums)
-		total += sum;
+}
 
-	for (int index = 0; index < t_pool->size; ++index)
+void ColorGenerator::smoothAVXThread(int index, int stride, int* matrix, const float* smooth, int end_index, int n)
+{
+	const int* lut = simple_lut.data();
+	for (int i = index; i < end_index; i += stride)
 	{
-		t_pool->addJob([=, &num_iters_per_pixel]() {histogramHueThead(index, t_pool->size, total, num_iters_per_pixel, matrix, matrix_width, matrix_height); });
+		if (i + 8 > end_index)
+		{
+			for (int k = i; k < end_index; ++k)
+				matrix[k] = smoothColor(lut, n, smooth[k]);
+			break;
+		}
+		_mm256_storeu_si256((__m256i*)&matrix[i], smoothColorAVX(lut, n, _mm256_loadu_ps(&smooth[i])));
 	}
-	t_pool->synchronize();
+}
 
+void ColorGenerator::smoothShading(int* matrix, const float* smooth, int matrix_width, int matrix_height, int n, bool AVX)
+{
+	simplePalette(n);
+
+	int end_index = matrix_width * matrix_height;
+	int jobs = t_pool->size + 1;
+	t_pool->run(jobs, [=](int index) {
+		if (AVX)
+			smoothAVXThread(index * 8, jobs * 8, matrix, smooth, end_index, n);
+		else
+			smoothThread(index, jobs, matrix, smooth, end_index, n);
+	});
 }
 
-void ColorGenerator::generate(int* matrix, int matrix_width, int matrix_height, int n)
+/*
+* The distance generator needs the distance estimate of each pixel, and the smooth generator the smooth escape value of each pixel.
+* Without them they fall back to the simple generator.
+*/
+void ColorGenerator::generate(int* matrix, int matrix_width, int matrix_height, int n, const float* distance, const float* smooth)
 {
 	if (color_mode == Generators::HISTOGRAM)
 	{
 		histogram(matrix, matrix_width, matrix_height, n);
 	}
+	else if (color_mode == Generators::DISTANCE && distance)
+	{
+		distanceShading(matrix, distance, matrix_width, matrix_height);
+	}
+	else if (color_mode == Generators::SMOOTH && smooth)
+	{
+		smoothShading(matrix, smooth, matrix_width, matrix_height, n, false);
+	}
 	else
 	{
-		simple(matrix, matrix_width, matrix_height);
+		simple(matrix, matrix_width, matrix_height, n);
 	}
 }
 
-void ColorGenerator::generateAVX(int* matrix, int matrix_width, int matrix_height, int n)
+void ColorGenerator::generateAVX(int* matrix, int matrix_width, int matrix_height, int n, const float* distance, const float* smooth)
 {
 	if (color_mode == Generators::HISTOGRAM)
 	{
-		histogram(matrix, matrix_width, matrix_height, n);
+		histogramAVX(matrix, matrix_width, matrix_height, n);
+	}
+	else if (color_mode == Generators::DISTANCE && distance)
+	{
+		distanceShading(matrix, distance, matrix_width, matrix_height);
+	}
+	else if (color_mode == Generators::SMOOTH && smooth)
+	{
+		smoothShading(matrix, smooth, matrix_width, matrix_height, n, true);
 	}
 	else
 	{
-		simpleAVX(matrix, matrix_width * matrix_height);
+		simpleAVX(matrix, matrix_width, matrix_height, n);
+	}
+}
+
+////////////////////////////////////////////////////////////
+/// Tile coloring
+////////////////////////////////////////////////////////////
+/*
+* Lets a renderer color each tile right after it has been computed, while its iteration values are still in cache, instead of making a
+* second pass over the whole frame. beginTiles is called once before the tiles are handed out, colorTile from the tile jobs, and endTiles
+* once they are all done.
+*
+* The simple, distance and smooth generators color each pixel on its own. The histogram generator needs every pixel of the frame, so colorTile only
+* counts the tile into the private bins of the pool thread running it, and endTiles builds the color table and colors the frame.
+* Returns false if the current generator cannot work this way, which is the case for a histogram too sparse for private bins.
+*/
+bool ColorGenerator::beginTiles(int matrix_width, int matrix_height, int n, const float* distance, const float* smooth)
+{
+	tile_mode = color_mode;
+	if ((color_mode == Generators::DISTANCE && !distance) || (color_mode == Generators::SMOOTH && !smooth))
+		tile_mode = Generators::SIMPLE;
+
+	if (tile_mode == Generators::SIMPLE || tile_mode == Generators::SMOOTH)
+	{
+		simplePalette(n);
+	}
+	else if (tile_mode == Generators::HISTOGRAM)
+	{
+		if (static_cast<long long>(t_pool->size + 1) * n > static_cast<long long>(matrix_width) * matrix_height)
+			return false;
+
+		// One set of bins per pool thread, plus one for the calling thread
+		histogram_bins.assign(static_cast<size_t>(t_pool->size + 1) * n, 0);
+	}
+	tile_n = n;
+	return true;
+}
+
+void ColorGenerator::colorTile(const int* matrix, const float* distance, const float* smooth, int* colors, int matrix_width, int x, int y, int width, int height, bool AVX)
+{
+	if (tile_mode == Generators::HISTOGRAM)
+	{
+		int worker = ThreadPool::workerIndex();
+		int* bins = histogram_bins.data() + static_cast<size_t>(worker < 0 ? t_pool->size : worker) * tile_n;
+		for (int row = y; row < y + height; ++row)
+		{
+			// Count the same pixels as histogramCountThread would, every histogram_sample_stride-th one of the whole frame
+			int i = row * matrix_width + x;
+			int end = i + width;
+			i += (histogram_sample_stride - i % histogram_sample_stride) % histogram_sample_stride;
+			for (; i < end; i += histogram_sample_stride)
+				bins[matrix[i]] += 1;
+		}
+		return;
 	}
-}
\ No newline at end of file
+
+	for (int row = y; row < y + height; ++row)
+	{
+		int i = row * matrix_width + x;
+		int end = i + width;
+
+		if (tile_mode == Generators::DISTANCE)
+		{
+			for (; i < end; ++i)
+				colors[i] = matrix[i] == 0 ? 0 : distanceColor(distance[i]);
+			continue;
+		}
+
+		const int* lut = simple_lut.data();
+		if (tile_mode == Generators::SMOOTH)
+		{
+			if (AVX)
+			{
+				for (; i + 8 <= end; i += 8)
+					_mm256_storeu_si256((__m256i*)&colors[i], smoothColorAVX(lut, tile_n, _mm256_loadu_ps(&smooth[i])));
+			}
+			for (; i < end; ++i)
+				colors[i] = smoothColor(lut, tile_n, smooth[i]);
+			continue;
+		}
+
+		if (AVX)
+		{
+			for (; i + 8 <= end; i += 8)
+			{
+				__m256i _iter = _mm256_loadu_si256((const __m256i*)&matrix[i]);
+				_mm256_storeu_si256((__m256i*)&colors[i], _mm256_i32gather_epi32(lut, _iter, 4));
+			}
+		}
+		for (; i < end; ++i)
+			colors[i] = lut[matrix[i]];
+	}
+}
+
+void ColorGenerator::endTiles(const int* matrix, int* colors, int matrix_width, int matrix_height, bool AVX)
+{
+	if (tile_mode != Generators::HISTOGRAM)
+		return;
+
+	histogramReduce(tile_n, t_pool->size + 1);
+
+	int end_index = matrix_width * matrix_height;
+	std::copy(matrix, matrix + end_index, colors);
+	if (AVX)
+		paletteAVX(histogram_lut.data(), colors, end_index);
+	else
+		palette(histogram_lut.data(), colors, end_index);
+}
@@ -7,9 +7,8 @@
 
 #include "thread_pool.h"
 
-#include <atomic>
-#include <memory>
 #include <stdint.h>
+#include <utility>
 #include <vector>
 
 // Some saturated arithmetic functions for 8-bit data types
@@ -28,27 +27,77 @@ class ColorGenerator
 
 	ThreadPool* t_pool;
 
-	void simpleThread(int index, int stride, int* matrix, int matrix_width, int matrix_height);
-	void simple(int* matrix, int matrix_width, int matrix_height);
-	void simpleAVXThread(int index, int stride, int* matrix, int end_index);
-	void simpleAVX(int* matrix, int end_index);
+	void paletteThread(int index, int stride, const int* lut, int* matrix, int end_index);
+	void palette(const int* lut, int* matrix, int end_index);
+	void paletteAVXThread(int index, int stride, const int* lut, int* matrix, int end_index);
+	void paletteAVX(const int* lut, int* matrix, int end_index);
 
-	void histogramHueThead(int index, int stride, unsigned int total, std::vector<std::unique_ptr<std::atomic<int>>>& num_iters_per_pixel, int* matrix, int matrix_width, int matrix_height);
+	// Color of each iteration value for the simple generator, and the modifiers (and phase) it was built with
+	std::vector<int> simple_lut;
+	float simple_lut_modifiers[4];
+
+	void simplePaletteThread(int index, int stride, int n);
+	void simplePalette(int n);
+	void simple(int* matrix, int matrix_width, int matrix_height, int n);
+	void simpleAVX(int* matrix, int matrix_width, int matrix_height, int n);
+
+	// Color of each iteration value for the histogram generator, rebuilt every frame
+	std::vector<int> histogram_lut;
+	// Private bins of each job, one after another, and their sum
+	std::vector<int> histogram_bins;
+	std::vector<int> histogram_counts;
+	// Sorted iteration values and (value, count) runs of each job, when the bins would be mostly empty
+	std::vector<std::vector<int>> histogram_values;
+	std::vector<std::vector<std::pair<int, int>>> histogram_runs;
+	// Kept between frames so that building the table does not allocate once they are large enough
+	std::vector<std::pair<int, int>> histogram_merged;
+	std::vector<long long> histogram_chunk_sums;
+
+	int histogramColor(long long below, long long total);
+	void histogramCountThread(int index, int* matrix, int begin, int end, int n);
+	void histogramSortThread(int index, int* matrix, int begin, int end);
+	void histogramReduce(int n, int sets);
+	void histogramLUT(int* matrix, int matrix_width, int matrix_height, int n);
 	void histogram(int* matrix, int matrix_width, int matrix_height, int n);
+	void histogramAVX(int* matrix, int matrix_width, int matrix_height, int n);
+
+	int distanceColor(float distance);
+	void distanceThread(int index, int stride, int* matrix, const float* distance, int matrix_width, int matrix_height);
+	void distanceShading(int* matrix, const float* distance, int matrix_width, int matrix_height);
+
+	void smoothThread(int index, int stride, int* matrix, const float* smooth, int end_index, int n);
+	void smoothAVXThread(int index, int stride, int* matrix, const float* smooth, int end_index, int n);
+	void smoothShading(int* matrix, const float* smooth, int matrix_width, int matrix_height, int n, bool AVX);
+
+public:
+	enum class Generators { SIMPLE = 0, HISTOGRAM, DISTANCE, SMOOTH, LAST } color_mode;
+
+private:
+	// Generator and iteration limit of the tiles between beginTiles and endTiles
+	Generators tile_mode;
+	int tile_n;
 
 public:
-	enum class Generators { SIMPLE = 0, HISTOGRAM, LAST } color_mode;
 
 	float simple_red_modifier;
 	float simple_green_modifier;
 	float simple_blue_modifier;
+	float palette_phase;	// Added to all three modifiers, advancing it cycles the palette
 
 	Color strong;
 	Color weak;
 
+	float distance_falloff;
+	int histogram_sample_stride;	// Build the histogram from every n-th pixel only, which is close enough for interactive frames. 1 is exact
+
 	ColorGenerator();
 	void switchMode();
 	void selectMode(int mode);
-	void generate(int* matrix, int matrix_width, int matrix_height, int n);
-	void generateAVX(int* matrix, int matrix_width, int matrix_height, int n);
+	void copyParameters(const ColorGenerator& other);
+	void generate(int* matrix, int matrix_width, int matrix_height, int n, const float* distance = nullptr, const float* smooth = nullptr);
+	void generateAVX(int* matrix, int matrix_width, int matrix_height, int n, const float* distance = nullptr, const float* smooth = nullptr);
+
+	bool beginTiles(int matrix_width, int matrix_height, int n, const float* distance, const float* smooth);
+	void colorTile(const int* matrix, const float* distance, const float* smooth, int* colors, int matrix_width, int x, int y, int width, int height, bool AVX);
+	void endTiles(const int* matrix, int* colors, int matrix_width, int matrix_height, bool AVX);
 };
\ No newline at end of file
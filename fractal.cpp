@@ -2,9 +2,13 @@
 
 #include "thread_pool.h"
 
+#include <algorithm>
 #include <cmath>
 #include <complex>
 #include <functional>
+#include <limits>
+#include <sstream>
+#include <string>
 #include <thread>
 #include <vector>
 
@@ -60,10 +64,17 @@ Fractal::Fractal()
 	bship_max_iter_multiplier		= bship_max_iter_multiplier_DEFAULT;
 	bship_radius					= bship_radius_DEFAULT;
 
+
+	tile_size						= tile_size_DEFAULT;
+	de_block_size					= de_block_size_DEFAULT;
+	distance_estimation				= distance_estimation_DEFAULT;
+	smooth_radius					= smooth_radius_DEFAULT;
+
 	t_pool = &ThreadPool::getInstance();
 }
 
 
+
 ////////////////////////////////////////////////////////////
 /// Mandelbrot Set Functions
 ////////////////////////////////////////////////////////////
@@ -102,13 +113,8 @@ bool Fractal::mandelbrotPrune(long double x_0, long double y_0)
 			mandelbrotBulbCheck(x_0, y_0);
 }
 
-int Fractal::mandelbrotSetAtPoint(int x, int y, int max_x, int max_y)
+int Fractal::mandelbrotSetAtPoint(long double x_0, long double y_0)
 {
-	long double x_0;
-	long double y_0;
-	mandelbrotScale(x_0, y_0, x, y, max_x, max_y);
-
-
 	if (mandelbrotPrune(x_0, y_0))
 		return 0;
 
@@ -138,7 +144,7 @@ int Fractal::mandelbrotSetAtPoint(int x, int y, int max_x, int max_y)
 			if (x_2 == check_x && y_2 == check_y)
 				return 0;
 		}
-		
+
 		check_x = x_2;
 		check_y = y_2;
 		period_check += period_check;
@@ -161,26 +167,6 @@ int Fractal::mandelbrotSetAtPoint(int x, int y, int max_x, int max_y)
 	return iter;*/
 }
 
-void Fractal::mandelbrotThread(int index, int* matrix, int matrix_width, int matrix_height, int stride)
-{
-	for (int i = index; i < (matrix_width * matrix_height); i += stride)
-	{
-		matrix[i] = mandelbrotSetAtPoint(i % matrix_width, i / matrix_width, matrix_width, matrix_height);
-	}
-}
-
-/*
-*	Adds jobs to the ThreadPool job queue that will fill the supplied matrix with Mandelbrot set iteration values.
-*/
-void Fractal::mandelbrotMatrix(int* matrix, int matrix_width, int matrix_height)
-{
-	for (int index = 0; index < t_pool->size; ++index)
-	{
-		t_pool->addJob([=]() {mandelbrotThread(index, matrix, matrix_width, matrix_height, t_pool->size); });
-	}
-	t_pool->synchronize();
-}
-
 
 //	Mandelbrot set functions for AVX instruction set
 
@@ -238,166 +224,6 @@ bool Fractal::mandelbrotPruneAVX(const __m256d& _x, const __m256d& _y)
 	return false;
 }
 
-/*
-* Calculate mandelbrot iterations using AVX2 instructions. AVX2 uses 256-bit registers and we do calculations with 64-bit floating point numbers, so we are able
-* to calculate 4 points per pass.
-*/
-void Fractal::mandelbrotAVXThread(int index, int* matrix, int matrix_width, int matrix_height, int stride)
-{
-	__m256d _index, _radius, _max_x, _max_y, _m_x_min, _m_y_min, _m_x_subbed, _m_y_subbed, _m_x_offset, _m_y_offset, _m_zoom, _x_0, _y_0, _x_1, _y_1, _x_2, _y_2, _mask1, _index_add_mask, _check_x, _check_y;
-	__m256i _iter, _max_iter, _active, _one, _mask2;
-	int period, period_check;
-
-
-	_radius		= _mm256_set1_pd(mandelbrot_radius);
-	_max_x		= _mm256_set1_pd(static_cast<long double>(matrix_width));
-	_max_y		= _mm256_set1_pd(static_cast<long double>(matrix_height));
-	_m_x_min	= _mm256_set1_pd(mandelbrot_x_min);
-	_m_y_min	= _mm256_set1_pd(mandelbrot_y_min);
-	_m_x_subbed = _mm256_set1_pd(mandelbrot_x_max - mandelbrot_x_min);
-	_m_y_subbed = _mm256_set1_pd(mandelbrot_y_max - mandelbrot_y_min);
-	_m_x_offset = _mm256_set1_pd(mandelbrot_x_offset);
-	_m_y_offset = _mm256_set1_pd(mandelbrot_y_offset);
-	_m_zoom		= _mm256_set1_pd(mandelbrot_zoom);
-
-	_index_add_mask = _mm256_set_pd(0.0, 1.0, 2.0, 3.0);
-
-	_one = _mm256_set1_epi64x(1);
-	_max_iter = _mm256_set1_epi64x(mandelbrot_max_iter);
-
-	for (int i = index; i < (matrix_width * matrix_height); i += (stride * 4))
-	{
-		_index = _mm256_set1_pd(static_cast<long double>(i));
-		_index = _mm256_add_pd(_index, _index_add_mask);
-
-		// Convert from flat index to 2-D x and y
-		_x_0 = _mm256_div_pd(_index, _max_x);
-		_x_0 = _mm256_floor_pd(_x_0);
-		_x_0 = _mm256_mul_pd(_max_x, _x_0);
-		_x_0 = _mm256_sub_pd(_index, _x_0);
-
-		_y_0 = _mm256_div_pd(_index, _max_x);
-		_y_0 = _mm256_floor_pd(_y_0);
-
-		// Scaling from window pixels to Cartesian X and Y
-		// x_0 = mandelbrot_x_min + ((mandelbrot_x_max - mandelbrot_x_min) * long double(x) / max_x);
-		_x_0 = _mm256_div_pd(_x_0, _max_x);
-		_x_0 = _mm256_mul_pd(_x_0, _m_x_subbed);
-		_x_0 = _mm256_add_pd(_x_0, _m_x_min);
-		// y_0 = mandelbrot_y_min + ((mandelbrot_y_max - mandelbrot_y_min) * long double(y) / max_y);
-		_y_0 = _mm256_div_pd(_y_0, _max_y);
-		_y_0 = _mm256_mul_pd(_y_0, _m_y_subbed);
-		_y_0 = _mm256_add_pd(_y_0, _m_y_min);
-
-		// x_0 = (x_0 + mandelbrot_x_offset) / mandelbrot_zoom;
-		_x_0 = _mm256_add_pd(_x_0, _m_x_offset);
-		_x_0 = _mm256_div_pd(_x_0, _m_zoom);
-		// y_0 = (y_0 + mandelbrot_y_offset) / mandelbrot_zoom;
-		_y_0 = _mm256_add_pd(_y_0, _m_y_offset);
-		_y_0 = _mm256_div_pd(_y_0, _m_zoom);
-
-		// Check to see if each of these 4 points are guaranteed to be in the cardiod or the bulb. If so, set them all to 0 and assign.
-		if (mandelbrotPruneAVX(_x_0, _y_0))
-		{
-			_iter = _mm256_set1_epi64x(0);
-			goto assign;
-		}
-
-		_x_1 = _mm256_set1_pd(0.0);
-		_y_1 = _mm256_set1_pd(0.0);
-		_x_2 = _mm256_set1_pd(0.0);
-		_y_2 = _mm256_set1_pd(0.0);
-		_iter = _mm256_set1_epi64x(0);
-		_active = _mm256_set1_epi64x(-1);
-		period = 10;
-		period_check = 0;
-
-		_check_x = _x_0;
-		_check_y = _y_0;
-
-	loop:
-		for (; period_check < period; ++period_check)
-		{
-			_y_1 = _mm256_fmadd_pd(_mm256_add_pd(_x_1, _x_1), _y_1, _y_0);  // y_1 = (x_1 + x_1) * y_1 + y_0;
-			_x_1 = _mm256_add_pd(_mm256_sub_pd(_x_2, _y_2), _x_0);			// x_1 = x_2 - y_2 + x_0;
-			_x_2 = _mm256_mul_pd(_x_1, _x_1);								// x_2 = x_1 * x_1;
-			_y_2 = _mm256_mul_pd(_y_1, _y_1);								// y_2 = y_1 * y_1;
-
-
-			//if (x_2 + y_2 <= mandelbrot_radius)
-			_mask1 = _mm256_cmp_pd(_mm256_add_pd(_x_2, _y_2), _radius, _CMP_LE_OQ);
-			// Each point that violates the above is marked as inactive so that its iteration count it not incremented anymore
-			_active = _mm256_and_si256(_active, _mm256_castpd_si256(_mask1));
-
-			//if (x_2 != check_x || y_2 != check_y)
-			_mask1 = _mm256_or_pd(_mm256_cmp_pd(_x_2, _check_x, _CMP_NEQ_OQ), _mm256_cmp_pd(_y_2, _check_y, _CMP_NEQ_OQ));
-			// Each point that violates the above should have its iteration count set to 0, but only if that point is still active
-			_iter = _mm256_and_si256(_iter, _mm256_or_si256(_mm256_castpd_si256(_mask1), _mm256_xor_si256(_active, _mm256_set1_epi64x(-1))));
-			// Set the points that violate the above as inactive
-			_active = _mm256_and_si256(_active, _mm256_castpd_si256(_mask1));
-			
-
-			// Check to see if all of the points are inactive. If they are we are done and will jump to assign
-			if (_mm256_movemask_pd(_mm256_castsi256_pd(_active)) == 0)
-				goto assign;
-			// At least one point is still active, so we increment
-			_iter = _mm256_add_epi64(_iter, _mm256_and_si256(_one, _active)); // one AND active
-		}
-
-		// If any points iteration count has reached the max we are done
-		_mask2 = _mm256_cmpeq_epi64(_iter, _max_iter);
-		if (_mm256_movemask_pd(_mm256_castsi256_pd(_mask2)) > 0)
-			goto assign;
-
-		_check_x = _x_2;
-		_check_y = _y_2;
-		period += period;
-		if (period > mandelbrot_max_iter)
-			period = mandelbrot_max_iter;
-		goto loop;
-
-	// Loop without period checking
-	//loop:
-
-	//	_y_1 = _mm256_fmadd_pd(_mm256_add_pd(_x_1, _x_1), _y_1, _y_0);  // y_1 = (x_1 + x_1) * y_1 + y_0;
-	//	_x_1 = _mm256_add_pd(_mm256_sub_pd(_x_2, _y_2), _x_0);			// x_1 = x_2 - y_2 + x_0;
-	//	_x_2 = _mm256_mul_pd(_x_1, _x_1);								// x_2 = x_1 * x_1;
-	//	_y_2 = _mm256_mul_pd(_y_1, _y_1);								// y_2 = y_1 * y_1;
-
-	//	_mask1 = _mm256_cmp_pd(_mm256_add_pd(_x_2, _y_2), _radius, _CMP_LE_OQ);  // is x_2 + x_2 <= mandelbrot_radius?
-	//	_mask2 = _mm256_cmpgt_epi64(_max_iter, _iter);							 // is iter < max_iter?
-	//	_mask2 = _mm256_and_si256(_mask2, _mm256_castpd_si256(_mask1));			 // AND the two masks together, since we dont want to increment if either of the two conditions above are false
-	//	_increment = _mm256_and_si256(_one, _mask2);
-	//	_iter = _mm256_add_epi64(_iter, _increment);
-	//	if (_mm256_movemask_pd(_mm256_castsi256_pd(_mask2)) > 0)		// Loop if any of the 4 values in the vector dont violate either mask condition
-	//		goto loop;
-
-
-
-	assign:
-
-		// If any of the iteration values = max_iter, set them to 0
-		_mask2 = _mm256_cmpeq_epi64(_iter, _max_iter);
-		_iter = _mm256_andnot_si256(_mask2, _iter);
-
-		// Extract vector values
-		// These iter values should never get too high, so casting from 64-bit int to 32-bit int should not be a problem
-		matrix[i]	  = static_cast<int>(_iter.m256i_i64[3]);
-		matrix[i + 1] = static_cast<int>(_iter.m256i_i64[2]);
-		matrix[i + 2] = static_cast<int>(_iter.m256i_i64[1]);
-		matrix[i + 3] = static_cast<int>(_iter.m256i_i64[0]);
-	}
-}
-
-void Fractal::mandelbrotMatrixAVX(int* matrix, int matrix_width, int matrix_height)
-{
-	for (int index = 0; index < t_pool->size; ++index)
-	{
-		t_pool->addJob([=]() {mandelbrotAVXThread(index * 4, matrix, matrix_width, matrix_height, t_pool->size); });
-	}
-	t_pool->synchronize();
-}
-
 ////////////////////////////////////////////////////////////
 /// Julia Set Functions
 ////////////////////////////////////////////////////////////
@@ -409,30 +235,8 @@ void Fractal::juliaScale(long double& scaled_x, long double& scaled_y, int x, in
 	scaled_y = (scaled_y + julia_y_offset) / julia_zoom / (static_cast<long double>(max_x) / max_y); // We want to stretch out the y-axis since the window frame most likely has a larger width (e.g. 1280x720)
 }
 
-void Fractal::juliaMatrix(int* matrix, int matrix_width, int matrix_height)
+int Fractal::juliaSetAtPoint(long double zx, long double zy)
 {
-	for (int index = 0; index < t_pool->size; ++index)
-	{
-		t_pool->addJob([=]() {juliaThread(index, matrix, matrix_width, matrix_height, t_pool->size); });
-	}
-	t_pool->synchronize();
-}
-
-void Fractal::juliaThread(int index, int* matrix, int matrix_width, int matrix_height, int stride)
-{
-	for (int i = index; i < (matrix_width * matrix_height); i += stride)
-	{
-		matrix[i] = juliaSetAtPoint(i % matrix_width, i / matrix_width, matrix_width, matrix_height);
-	}
-}
-
-int Fractal::juliaSetAtPoint(int x, int y, int max_x, int max_y)
-{
-	long double zx;
-	long double zy;
-	juliaScale(zx, zy, x, y, max_x, max_y);
-
-
 	int period_check = 10;
 	long double check_zx = zx;
 	long double check_zy = zy;
@@ -473,142 +277,13 @@ int Fractal::juliaSetAtPoint(int x, int y, int max_x, int max_y)
 
 		iter += 1;
 	}
-	
+
 	if (iter == julia_max_iter)
 		return 0;
 	else
 		return iter;*/
 }
 
-
-void Fractal::juliaAVXThread(int index, int* matrix, int matrix_width, int matrix_height, int stride)
-{
-	__m256d _index, _radius, _radius_sq, _max_x, _max_y, _x_offset, _y_offset, _zoom, _imag, _real, _zx, _zy, _temp, _mask1, _index_add_mask, _check_zx, _check_zy, _two;
-	__m256i _iter, _max_iter, _active, _one, _mask2;
-	int period, period_check;
-
-
-	_radius = _mm256_set1_pd(julia_radius);
-	_radius_sq = _mm256_mul_pd(_radius, _radius);
-	_max_x = _mm256_set1_pd(static_cast<long double>(matrix_width));
-	_max_y = _mm256_set1_pd(static_cast<long double>(matrix_height));
-	_x_offset = _mm256_set1_pd(julia_x_offset);
-	_y_offset = _mm256_set1_pd(julia_y_offset);
-	_zoom = _mm256_set1_pd(julia_zoom);
-	_imag = _mm256_set1_pd(julia_complex_param.imag());
-	_real = _mm256_set1_pd(julia_complex_param.real());
-
-	_index_add_mask = _mm256_set_pd(0.0, 1.0, 2.0, 3.0);
-
-	_one = _mm256_set1_epi64x(1);
-	_two = _mm256_set1_pd(2.0);
-	_max_iter = _mm256_set1_epi64x(julia_max_iter);
-
-	for (int i = index; i < (matrix_width * matrix_height); i += (stride * 4))
-	{
-		_index = _mm256_set1_pd(static_cast<long double>(i));
-		_index = _mm256_add_pd(_index, _index_add_mask);
-
-		// Convert from flat index to 2-D x and y
-		_zx = _mm256_div_pd(_index, _max_x);
-		_zx = _mm256_floor_pd(_zx);
-		_zx = _mm256_mul_pd(_max_x, _zx);
-		_zx = _mm256_sub_pd(_index, _zx);
-
-		_zy = _mm256_div_pd(_index, _max_x);
-		_zy = _mm256_floor_pd(_zy);
-
-		// Scaling from window pixels to Cartesian X and Y
-		// -julia_radius + (2.0 * julia_radius * (static_cast<long double>(x) / max_x));
-		_zx = _mm256_div_pd(_zx, _max_x);
-		_zx = _mm256_mul_pd(_zx, _radius);
-		_zx = _mm256_fmsub_pd(_zx, _two, _radius);
-		// -julia_radius + (2.0 * julia_radius * (static_cast<long double>(y) / max_y));
-		_zy = _mm256_div_pd(_zy, _max_y);
-		_zy = _mm256_mul_pd(_zy, _radius);
-		_zy = _mm256_fmsub_pd(_zy, _two, _radius);
-
-		// (scaled_x + julia_x_offset) / julia_zoom;
-		_zx = _mm256_add_pd(_zx, _x_offset);
-		_zx = _mm256_div_pd(_zx, _zoom);
-		// (scaled_y + julia_y_offset) / julia_zoom / (static_cast<long double>(max_x) / max_y);
-		_zy = _mm256_add_pd(_zy, _y_offset);
-		_zy = _mm256_div_pd(_zy, _zoom);
-		_zy = _mm256_div_pd(_zy, _mm256_div_pd(_max_x, _max_y));
-		
-
-
-		_iter = _mm256_set1_epi64x(0);
-		_active = _mm256_set1_epi64x(-1);
-		period = 10;
-		period_check = 0;
-
-		_check_zx = _zx;
-		_check_zy = _zy;
-
-	loop:
-		for (; period_check < period; ++period_check)
-		{
-			_temp = _mm256_fmsub_pd(_zx, _zx, _mm256_mul_pd(_zy, _zy));		// temp = zx * zx - zy * zy;
-			_zy = _mm256_fmadd_pd(_two, _mm256_mul_pd(_zx, _zy), _imag);	//zy = 2 * zx * zy + julia_complex_param.imag();
-			_zx = _mm256_add_pd(_temp, _real);
-
-			//if (zx * zx + zy * zy < (julia_radius * julia_radius))
-			_mask1 = _mm256_cmp_pd(_mm256_fmadd_pd(_zx, _zx, _mm256_mul_pd(_zy, _zy)), _radius_sq, _CMP_LT_OQ);
-			// Each point that violates the above is marked as inactive so that its iteration count it not incremented anymore
-			_active = _mm256_and_si256(_active, _mm256_castpd_si256(_mask1));
-
-			//if (zx != check_zx || zy != check_zy)
-			_mask1 = _mm256_or_pd(_mm256_cmp_pd(_zx, _check_zx, _CMP_NEQ_OQ), _mm256_cmp_pd(_zy, _check_zy, _CMP_NEQ_OQ));
-			// Each point that violates the above should have its iteration count set to 0, but only if that point is still active
-			_iter = _mm256_and_si256(_iter, _mm256_or_si256(_mm256_castpd_si256(_mask1), _mm256_xor_si256(_active, _mm256_set1_epi64x(-1))));
-			// Set the points that violate the above as inactive
-			_active = _mm256_and_si256(_active, _mm256_castpd_si256(_mask1));
-
-
-			// Check to see if all of the points are inactive. If they are we are done and will jump to assign
-			if (_mm256_movemask_pd(_mm256_castsi256_pd(_active)) == 0)
-				goto assign;
-			// At least one point is still active, so we increment
-			_iter = _mm256_add_epi64(_iter, _mm256_and_si256(_one, _active)); // one AND active
-		}
-
-		// If any points iteration count has reached the max we are done
-		_mask2 = _mm256_cmpeq_epi64(_iter, _max_iter);
-		if (_mm256_movemask_pd(_mm256_castsi256_pd(_mask2)) > 0)
-			goto assign;
-
-		_check_zx = _zx;
-		_check_zy = _zy;
-		period += period;
-		if (period > julia_max_iter)
-			period = julia_max_iter;
-		goto loop;
-
-	assign:
-
-		// If any of the iteration values = max_iter, set them to 0
-		_mask2 = _mm256_cmpeq_epi64(_iter, _max_iter);
-		_iter = _mm256_andnot_si256(_mask2, _iter);
-
-		// Extract vector values
-		// These iter values should never get too high, so casting from 64-bit int to 32-bit int should not be a problem
-		matrix[i] = static_cast<int>(_iter.m256i_i64[3]);
-		matrix[i + 1] = static_cast<int>(_iter.m256i_i64[2]);
-		matrix[i + 2] = static_cast<int>(_iter.m256i_i64[1]);
-		matrix[i + 3] = static_cast<int>(_iter.m256i_i64[0]);
-	}
-}
-
-void Fractal::juliaMatrixAVX(int* matrix, int matrix_width, int matrix_height)
-{
-	for (int index = 0; index < t_pool->size; ++index)
-	{
-		t_pool->addJob([=]() {juliaAVXThread(index * 4, matrix, matrix_width, matrix_height, t_pool->size); });
-	}
-	t_pool->synchronize();
-}
-
 ////////////////////////////////////////////////////////////
 /// Burning Ship Functions
 ////////////////////////////////////////////////////////////
@@ -621,21 +296,8 @@ void Fractal::bshipScale(long double& scaled_x, long double& scaled_y, int x, in
 	scaled_y = (scaled_y + bship_y_offset) / bship_zoom / (static_cast<long double>(max_x) / max_y);
 }
 
-void Fractal::bshipThread(int index, int* matrix, int matrix_width, int matrix_height, int stride)
-{
-	for (int i = index; i < (matrix_width * matrix_height); i += stride)
-	{
-		// Flip the fractal about the x-axis for asthetic purposes
-		matrix[i] = bshipAtPoint(i % matrix_width, matrix_height - (i / matrix_width), matrix_width, matrix_height);
-	}
-}
-
-int Fractal::bshipAtPoint(int x, int y, int max_x, int max_y)
+int Fractal::bshipAtPoint(long double scaled_x, long double scaled_y)
 {
-	long double scaled_x;
-	long double scaled_y;
-	bshipScale(scaled_x, scaled_y, x, y, max_x, max_y);
-
 	long double zx = scaled_x;
 	long double zy = scaled_y;
 
@@ -669,145 +331,1054 @@ int Fractal::bshipAtPoint(int x, int y, int max_x, int max_y)
 	}
 	return 0;
 }
-void Fractal::bshipMatrix(int* matrix, int matrix_width, int matrix_height)
+
+
+////////////////////////////////////////////////////////////
+/// Tile Kernels
+////////////////////////////////////////////////////////////
+/*
+* A frame is split into square tiles which are handed to the thread pool one job each. Every tile maps its pixels to the complex
+* plane through a Viewport, so a tile can be computed on its own regardless of where it sits in the frame.
+*/
+
+Fractal::Viewport Fractal::getViewport(int max_x, int max_y) const
 {
-	for (int index = 0; index < t_pool->size; ++index)
+	Viewport vp;
+	if (fractal_mode == FractalSets::MANDELBROT)
+	{
+		// x_0 = (mandelbrot_x_min + ((mandelbrot_x_max - mandelbrot_x_min) * x / max_x) + mandelbrot_x_offset) / mandelbrot_zoom
+		vp.x_origin = (mandelbrot_x_min + mandelbrot_x_offset) / mandelbrot_zoom;
+		vp.y_origin = (mandelbrot_y_min + mandelbrot_y_offset) / mandelbrot_zoom;
+		vp.x_step = (mandelbrot_x_max - mandelbrot_x_min) / max_x / mandelbrot_zoom;
+		vp.y_step = (mandelbrot_y_max - mandelbrot_y_min) / max_y / mandelbrot_zoom;
+	}
+	else if (fractal_mode == FractalSets::JULIA)
 	{
-		t_pool->addJob([=]() {bshipThread(index, matrix, matrix_width, matrix_height, t_pool->size); });
+		// The y-axis is stretched by max_x / max_y, which leaves the julia set with square pixels
+		long double aspect = static_cast<long double>(max_x) / max_y;
+		vp.x_origin = (julia_x_offset - julia_radius) / julia_zoom;
+		vp.y_origin = (julia_y_offset - julia_radius) / julia_zoom / aspect;
+		vp.x_step = 2.0 * julia_radius / max_x / julia_zoom;
+		vp.y_step = 2.0 * julia_radius / max_y / julia_zoom / aspect;
 	}
-	t_pool->synchronize();
+	else
+	{
+		// Same as the julia set, but flipped about the x-axis for asthetic purposes (row y is evaluated as max_y - y)
+		long double aspect = static_cast<long double>(max_x) / max_y;
+		vp.x_origin = (bship_x_offset - bship_radius) / bship_zoom;
+		vp.x_step = 2.0 * bship_radius / max_x / bship_zoom;
+		vp.y_step = -2.0 * bship_radius / max_y / bship_zoom / aspect;
+		vp.y_origin = (bship_y_offset - bship_radius) / bship_zoom / aspect - max_y * vp.y_step;
+	}
+	return vp;
 }
 
-void Fractal::bshipAVXThread(int index, int* matrix, int matrix_width, int matrix_height, int stride)
+bool Fractal::FormulaParams::operator==(const FormulaParams& other) const
 {
-	__m256d _index, _radius, _radius_sq, _max_x, _max_y, _x_offset, _y_offset, _zoom, _imag, _real, _zx, _zy, _temp, _mask1, _index_add_mask, _check_zx, _check_zy, _two;
-	__m256i _iter, _max_iter, _active, _one, _mask2;
-	int period, period_check;
+	return	mode == other.mode &&
+			max_iter == other.max_iter &&
+			radius == other.radius &&
+			julia_complex_param == other.julia_complex_param &&
+			distance_estimation == other.distance_estimation;
+}
 
+bool Fractal::FormulaParams::operator!=(const FormulaParams& other) const
+{
+	return !(*this == other);
+}
 
-	_radius = _mm256_set1_pd(bship_radius);
-	_radius_sq = _mm256_mul_pd(_radius, _radius);
-	_max_x = _mm256_set1_pd(static_cast<long double>(matrix_width));
-	_max_y = _mm256_set1_pd(static_cast<long double>(matrix_height));
-	_x_offset = _mm256_set1_pd(bship_x_offset);
-	_y_offset = _mm256_set1_pd(bship_y_offset);
-	_zoom = _mm256_set1_pd(bship_zoom);
+Fractal::FormulaParams Fractal::getFormulaParams() const
+{
+	FormulaParams params;
+	params.mode = fractal_mode;
+	params.max_iter = maxIterations();
+	params.distance_estimation = distance_estimation;
+	params.julia_complex_param = std::complex<long double>(0.0, 0.0);
 
-	_index_add_mask = _mm256_set_pd(0.0, 1.0, 2.0, 3.0);
+	if (fractal_mode == FractalSets::MANDELBROT)
+	{
+		params.radius = mandelbrot_radius;
+	}
+	else if (fractal_mode == FractalSets::JULIA)
+	{
+		params.radius = julia_radius;
+		params.julia_complex_param = julia_complex_param;
+	}
+	else
+	{
+		params.radius = bship_radius;
+	}
+	return params;
+}
+
+/*
+* Take on the fractal set, iteration limit, escape radius and Julia constant of params, e.g. ones received from another process, so that
+* computeTile gives the same values as it does there.
+*/
+void Fractal::setFormulaParams(const FormulaParams& params)
+{
+	fractal_mode = params.mode;
+	setMaxIterations(params.max_iter);
+	distance_estimation = params.distance_estimation;
+
+	if (fractal_mode == FractalSets::MANDELBROT)
+	{
+		mandelbrot_radius = params.radius;
+	}
+	else if (fractal_mode == FractalSets::JULIA)
+	{
+		julia_radius = params.radius;
+		julia_complex_param = params.julia_complex_param;
+	}
+	else
+	{
+		bship_radius = params.radius;
+	}
+}
+
+int Fractal::maxIterations() const
+{
+	if (fractal_mode == FractalSets::MANDELBROT)
+		return mandelbrot_max_iter;
+	else if (fractal_mode == FractalSets::JULIA)
+		return julia_max_iter;
+	return bship_max_iter;
+}
+
+void Fractal::setMaxIterations(unsigned int max_iter)
+{
+	if (fractal_mode == FractalSets::MANDELBROT)
+		mandelbrot_max_iter = max_iter;
+	else if (fractal_mode == FractalSets::JULIA)
+		julia_max_iter = max_iter;
+	else
+		bship_max_iter = max_iter;
+}
+
+// Orbits escape once |z|^2 passes this. The mandelbrot radius is already squared
+double Fractal::escapeRadiusSq() const
+{
+	if (fractal_mode == FractalSets::MANDELBROT)
+		return static_cast<double>(mandelbrot_radius);
+	else if (fractal_mode == FractalSets::JULIA)
+		return static_cast<double>(julia_radius * julia_radius);
+	return static_cast<double>(bship_radius * bship_radius);
+}
+
+void Fractal::tileStandard(int* matrix, int matrix_width, const Tile& tile, const Viewport& vp)
+{
+	for (int y = tile.y; y < tile.y + tile.height; ++y)
+	{
+		long double point_y = vp.y_origin + y * vp.y_step;
+		int* row = matrix + static_cast<size_t>(y) * matrix_width;
+
+		for (int x = tile.x; x < tile.x + tile.width; ++x)
+		{
+			long double point_x = vp.x_origin + x * vp.x_step;
+
+			if (fractal_mode == FractalSets::MANDELBROT)
+				row[x] = mandelbrotSetAtPoint(point_x, point_y);
+			else if (fractal_mode == FractalSets::JULIA)
+				row[x] = juliaSetAtPoint(point_x, point_y);
+			else
+				row[x] = bshipAtPoint(point_x, point_y);
+		}
+	}
+}
+
+/*
+* Set up 4 orbits starting at the points _px and _py, which are c for the mandelbrot set and burning ship, and z_0 for the julia set.
+* Returns false if the orbits do not need to be iterated at all, which is the case when the mandelbrot set can prune all 4 points.
+*/
+template <Fractal::FractalSets F>
+bool Fractal::startOrbitAVX(OrbitAVX& o, const __m256d& _px, const __m256d& _py)
+{
+	o.iter = _mm256_setzero_si256();
+	o.mag_sq = _mm256_setzero_pd();
+	o.dmag_sq = _mm256_setzero_pd();
+	o.dzy = _mm256_setzero_pd();
+	o.active = _mm256_set1_epi64x(-1);
+
+	if (F == FractalSets::MANDELBROT)
+	{
+		o.zx = _mm256_setzero_pd();
+		o.zy = _mm256_setzero_pd();
+		o.cx = _px;
+		o.cy = _py;
+		o.dzx = _mm256_setzero_pd();	// z_0 = 0 does not depend on c
+
+		// Check to see if each of these 4 points are guaranteed to be in the cardiod or the bulb. If so, they are all 0.
+		if (mandelbrotPruneAVX(_px, _py))
+		{
+			o.active = _mm256_setzero_si256();
+			return false;
+		}
+	}
+	else if (F == FractalSets::JULIA)
+	{
+		o.zx = _px;
+		o.zy = _py;
+		o.cx = _mm256_set1_pd(julia_complex_param.real());
+		o.cy = _mm256_set1_pd(julia_complex_param.imag());
+		o.dzx = _mm256_set1_pd(1.0);	// dz_0/dz_0 = 1
+	}
+	else
+	{
+		o.zx = _px;
+		o.zy = _py;
+		o.cx = _px;
+		o.cy = _py;
+		o.dzx = _mm256_set1_pd(1.0);	// z_0 = c, so dz_0/dc = 1
+	}
+	return true;
+}
+
+/*
+* Iterate 4 orbits at once using AVX2 instructions. AVX2 uses 256-bit registers and we do calculations with 64-bit floating point numbers, so we are able
+* to calculate 4 points per pass.
+*
+* The active orbits have all been iterated steps times already and are iterated until they escape, turn out to be periodic, or reach max_iter.
+* On return o.iter holds the escape iteration of each escaped orbit (0 for periodic ones) and o.mag_sq holds |z|^2 at the moment of escape.
+* The orbits which reached max_iter are left in o.active, with o.iter = max_iter and z where it stopped, so they can be continued later.
+*
+* Orbits escape once |z|^2 exceeds radius_sq, which is escapeRadiusSq() unless a larger bailout is wanted.
+*
+* When DE is set the derivative of z is carried alongside z (dz/dc for the mandelbrot set and burning ship, dz/dz_0 for the julia set) and
+* |dz|^2 at the moment of escape is written to o.dmag_sq, which is what the distance estimate is built from.
+*/
+template <Fractal::FractalSets F, bool DE>
+void Fractal::orbitAVX(OrbitAVX& o, int steps, int max_iter, double radius_sq)
+{
+	__m256d _radius_sq, _two, _one_d, _sign_bit, _mag, _inside, _periodic, _check_zx, _check_zy, _temp;
+	__m256i _escaped, _one;
+	int period, period_check;
 
-	_one = _mm256_set1_epi64x(1);
 	_two = _mm256_set1_pd(2.0);
-	_max_iter = _mm256_set1_epi64x(bship_max_iter);
+	_one_d = _mm256_set1_pd(1.0);
+	_sign_bit = _mm256_set1_pd(-0.0);
+	_one = _mm256_set1_epi64x(1);
+
+	_radius_sq = _mm256_set1_pd(radius_sq);
+
+	if (_mm256_testz_si256(o.active, o.active))
+		return;
+
+	_check_zx = o.zx;
+	_check_zy = o.zy;
+	period = 10;
+	period_check = std::min(steps + period, max_iter);
+
+	while (steps < max_iter)
+	{
+		for (; steps < period_check; ++steps)
+		{
+			if (DE)
+			{
+				// The derivative is stepped first, since it needs z from before the step
+				_temp = _mm256_fmsub_pd(o.zx, o.dzx, _mm256_mul_pd(o.zy, o.dzy));
+				o.dzy = _mm256_fmadd_pd(o.zx, o.dzy, _mm256_mul_pd(o.zy, o.dzx));
+				if (F == FractalSets::BSHIP)
+				{
+					// The burning ship folds z into the first quadrant before squaring it, z' = (|zx| + i|zy|)^2 + c. Chaining the Jacobian
+					// of the fold, diag(sign(zx), sign(zy)), through the derivative flips the sign of the imaginary part whenever zx * zy < 0
+					o.dzy = _mm256_xor_pd(o.dzy, _mm256_and_pd(_mm256_mul_pd(o.zx, o.zy), _sign_bit));
+				}
+				// dz' = 2 * z * dz + 1, where the + 1 only applies when c is the variable (mandelbrot set and burning ship)
+				o.dzx = _mm256_mul_pd(_two, _temp);
+				o.dzy = _mm256_mul_pd(_two, o.dzy);
+				if (F != FractalSets::JULIA)
+					o.dzx = _mm256_add_pd(o.dzx, _one_d);
+			}
+
+			_temp = _mm256_add_pd(_mm256_fmsub_pd(o.zx, o.zx, _mm256_mul_pd(o.zy, o.zy)), o.cx);	// temp = zx * zx - zy * zy + cx;
+			if (F == FractalSets::BSHIP)
+			{
+				o.zy = _mm256_andnot_pd(_sign_bit, _mm256_mul_pd(_two, _mm256_mul_pd(o.zx, o.zy)));	// zy = std::abs(2 * zx * zy) + cy;
+				o.zy = _mm256_add_pd(o.zy, o.cy);
+			}
+			else
+			{
+				o.zy = _mm256_fmadd_pd(_mm256_add_pd(o.zx, o.zx), o.zy, o.cy);						// zy = (zx + zx) * zy + cy;
+			}
+			o.zx = _temp;
+
+			// The mandelbrot set keeps iterating while |z|^2 <= radius, the julia set and burning ship while |z|^2 < radius^2
+			_mag = _mm256_fmadd_pd(o.zx, o.zx, _mm256_mul_pd(o.zy, o.zy));
+			_inside = _mm256_cmp_pd(_mag, _radius_sq, F == FractalSets::MANDELBROT ? _CMP_LE_OQ : _CMP_LT_OQ);
+
+			// Record |z|^2 (and |dz|^2) of the points which escape on this step
+			_escaped = _mm256_andnot_si256(_mm256_castpd_si256(_inside), o.active);
+			o.mag_sq = _mm256_blendv_pd(o.mag_sq, _mag, _mm256_castsi256_pd(_escaped));
+			if (DE)
+				o.dmag_sq = _mm256_blendv_pd(o.dmag_sq, _mm256_fmadd_pd(o.dzx, o.dzx, _mm256_mul_pd(o.dzy, o.dzy)), _mm256_castsi256_pd(_escaped));
+
+			// Each point that escaped is marked as inactive so that its iteration count it not incremented anymore
+			o.active = _mm256_and_si256(o.active, _mm256_castpd_si256(_inside));
+
+			//if (zx == check_zx && zy == check_zy)
+			_periodic = _mm256_and_pd(_mm256_cmp_pd(o.zx, _check_zx, _CMP_EQ_OQ), _mm256_cmp_pd(o.zy, _check_zy, _CMP_EQ_OQ));
+			_periodic = _mm256_and_pd(_periodic, _mm256_castsi256_pd(o.active));
+			// Each active point with a periodic orbit is in the set, so its iteration count is set to 0 and it is marked as inactive
+			o.iter = _mm256_andnot_si256(_mm256_castpd_si256(_periodic), o.iter);
+			o.active = _mm256_andnot_si256(_mm256_castpd_si256(_periodic), o.active);
+
+			// Check to see if all of the points are inactive. If they are we are done
+			if (_mm256_testz_si256(o.active, o.active))
+				return;
+			// At least one point is still active, so we increment
+			o.iter = _mm256_add_epi64(o.iter, _mm256_and_si256(_one, o.active)); // one AND active
+		}
+
+		_check_zx = o.zx;
+		_check_zy = o.zy;
+		period += period;
+		period_check = std::min(steps + period, max_iter);
+	}
+}
+
+/*
+* Iterate 4 points from the start. On return _iter holds the escape iteration of each point (0 for points which never escaped),
+* and _mag_sq and _dmag_sq hold |z|^2 and |dz|^2 (when DE is set) at the moment of escape.
+*/
+template <Fractal::FractalSets F, bool DE>
+void Fractal::iterateAVX(const __m256d& _px, const __m256d& _py, __m256i& _iter, __m256d& _mag_sq, __m256d& _dmag_sq)
+{
+	OrbitAVX o;
+	if (startOrbitAVX<F>(o, _px, _py))
+		orbitAVX<F, DE>(o, 0, maxIterations(), escapeRadiusSq());
+
+	// Points which reached max_iter are in the set, so set them to 0
+	_iter = _mm256_andnot_si256(o.active, o.iter);
+	_mag_sq = o.mag_sq;
+	_dmag_sq = o.dmag_sq;
+}
+
+/*
+* Lower bound on the distance from an escaped point to the set, taken from the final |z|^2 and |dz|^2 of the point.
+* The classic exterior estimate is 2 * |z| * ln|z| / |dz|, and by the Koebe 1/4 theorem a disk of a quarter of that radius contains no
+* points of the set. Points which did not escape are given a distance of 0.
+*/
+static double distanceEstimate(double mag_sq, double dmag_sq)
+{
+	if (mag_sq <= 1.0 || dmag_sq <= 0.0)
+		return 0.0;
+
+	// 0.5 * |z| * ln|z| / |dz| = 0.25 * sqrt(|z|^2 / |dz|^2) * ln(|z|^2)
+	return 0.25 * std::sqrt(mag_sq / dmag_sq) * std::log(mag_sq);
+}
+
+template <Fractal::FractalSets F>
+void Fractal::tileAVX(int* matrix, int matrix_width, const Tile& tile, const Viewport& vp)
+{
+	__m256d _px, _py, _x_origin, _x_step, _lane, _mag_sq, _dmag_sq;
+	__m256i _iter;
+	alignas(32) long long iter[4];
+	int lanes;
 
-	for (int i = index; i < (matrix_width * matrix_height); i += (stride * 4))
+	_x_origin	= _mm256_set1_pd(static_cast<double>(vp.x_origin));
+	_x_step		= _mm256_set1_pd(static_cast<double>(vp.x_step));
+	_lane		= _mm256_setr_pd(0.0, 1.0, 2.0, 3.0);
+
+	for (int y = tile.y; y < tile.y + tile.height; ++y)
 	{
-		_index = _mm256_set1_pd(static_cast<long double>(i));
-		_index = _mm256_add_pd(_index, _index_add_mask);
-
-		// Convert from flat index to 2-D x and y
-		_zx = _mm256_div_pd(_index, _max_x);
-		_zx = _mm256_floor_pd(_zx);
-		_zx = _mm256_mul_pd(_max_x, _zx);
-		_zx = _mm256_sub_pd(_index, _zx);
-
-		_zy = _mm256_div_pd(_index, _max_x);
-		_zy = _mm256_floor_pd(_zy);
-		_zy = _mm256_sub_pd(_max_y, _zy);
-
-		// Scaling from window pixels to Cartesian X and Y
-		// -julia_radius + (2.0 * julia_radius * (static_cast<long double>(x) / max_x));
-		_zx = _mm256_div_pd(_zx, _max_x);
-		_zx = _mm256_mul_pd(_zx, _radius);
-		_zx = _mm256_fmsub_pd(_zx, _two, _radius);
-		// -julia_radius + (2.0 * julia_radius * (static_cast<long double>(y) / max_y));
-		_zy = _mm256_div_pd(_zy, _max_y);
-		_zy = _mm256_mul_pd(_zy, _radius);
-		_zy = _mm256_fmsub_pd(_zy, _two, _radius);
-
-		// (scaled_x + julia_x_offset) / julia_zoom;
-		_zx = _mm256_add_pd(_zx, _x_offset);
-		_zx = _mm256_div_pd(_zx, _zoom);
-		// (scaled_y + julia_y_offset) / julia_zoom / (static_cast<long double>(max_x) / max_y);
-		_zy = _mm256_add_pd(_zy, _y_offset);
-		_zy = _mm256_div_pd(_zy, _zoom);
-		_zy = _mm256_div_pd(_zy, _mm256_div_pd(_max_x, _max_y));
-
-		_real = _zx;
-		_imag = _zy;
-
-		_iter = _mm256_set1_epi64x(0);
-		_active = _mm256_set1_epi64x(-1);
-		period = 10;
-		period_check = 0;
-
-		_check_zx = _zx;
-		_check_zy = _zy;
-
-	loop:
-		for (; period_check < period; ++period_check)
+		_py = _mm256_set1_pd(static_cast<double>(vp.y_origin + y * vp.y_step));
+		int* row = matrix + static_cast<size_t>(y) * matrix_width;
+
+		for (int x = tile.x; x < tile.x + tile.width; x += 4)
+		{
+			// point_x = x_origin + (x + lane) * x_step
+			_px = _mm256_fmadd_pd(_mm256_add_pd(_mm256_set1_pd(x), _lane), _x_step, _x_origin);
+			iterateAVX<F, false>(_px, _py, _iter, _mag_sq, _dmag_sq);
+
+			// Extract vector values. Lanes which fall past the right edge of the tile are dropped.
+			// These iter values should never get too high, so casting from 64-bit int to 32-bit int should not be a problem
+			_mm256_store_si256((__m256i*)iter, _iter);
+			lanes = std::min(4, tile.x + tile.width - x);
+			for (int k = 0; k < lanes; ++k)
+				row[x + k] = static_cast<int>(iter[k]);
+		}
+	}
+}
+
+/*
+* Convert 4 64-bit integers in [0, 2^52) to doubles. AVX2 has no instruction for this, but placing the integer in the mantissa of 2^52
+* gives 2^52 + v exactly, and subtracting 2^52 leaves v.
+*/
+static inline __m256d int64ToDoubleAVX(const __m256i& _v)
+{
+	const __m256d _magic = _mm256_set1_pd(4503599627370496.0); // 2^52
+	return _mm256_sub_pd(_mm256_castsi256_pd(_mm256_or_si256(_v, _mm256_castpd_si256(_magic))), _magic);
+}
+
+/*
+* Fast base 2 logarithm of 4 positive, normal doubles, accurate to about 1e-6.
+* x = m * 2^e with m in [1, 2), so log2(x) = e + log2(m), and log2(m) = 2 / ln(2) * atanh(t) with t = (m - 1) / (m + 1) in [0, 1/3],
+* whose series t + t^3/3 + t^5/5 + ... converges quickly.
+*/
+static inline __m256d log2AVX(const __m256d& _x)
+{
+	__m256i _bits = _mm256_castpd_si256(_x);
+	__m256d _e = _mm256_sub_pd(int64ToDoubleAVX(_mm256_srli_epi64(_bits, 52)), _mm256_set1_pd(1023.0));
+	__m256d _m = _mm256_castsi256_pd(_mm256_or_si256(_mm256_and_si256(_bits, _mm256_set1_epi64x(0x000FFFFFFFFFFFFFLL)), _mm256_set1_epi64x(0x3FF0000000000000LL)));
+
+	__m256d _one = _mm256_set1_pd(1.0);
+	__m256d _t = _mm256_div_pd(_mm256_sub_pd(_m, _one), _mm256_add_pd(_m, _one));
+	__m256d _t2 = _mm256_mul_pd(_t, _t);
+	__m256d _p = _mm256_fmadd_pd(_t2, _mm256_set1_pd(1.0 / 9.0), _mm256_set1_pd(1.0 / 7.0));
+	_p = _mm256_fmadd_pd(_p, _t2, _mm256_set1_pd(1.0 / 5.0));
+	_p = _mm256_fmadd_pd(_p, _t2, _mm256_set1_pd(1.0 / 3.0));
+	_p = _mm256_fmadd_pd(_p, _t2, _one);
+	_p = _mm256_mul_pd(_p, _t);
+
+	return _mm256_fmadd_pd(_p, _mm256_set1_pd(2.0 / 0.693147180559945309), _e);
+}
+
+/*
+* Same as tileAVX, but each escaped pixel also gets a continuous escape value in smooth, the normalized iteration count
+* mu = n + 1 - log2(ln|z|). Unlike n it does not jump between the bands of equal iteration counts, so colors made from it have no banding.
+* The formula assumes |z| is much larger than the escape radius of the fractal, so orbits are iterated until |z| passes smooth_radius instead,
+* which also shifts the iteration counts by a couple. Pixels which did not escape get 0 in both.
+*/
+template <Fractal::FractalSets F>
+void Fractal::tileSmoothAVX(int* matrix, float* smooth, int matrix_width, const Tile& tile, const Viewport& vp)
+{
+	__m256d _px, _py, _x_origin, _x_step, _lane, _mu;
+	__m256i _iter, _escaped;
+	OrbitAVX o;
+	alignas(32) long long iter[4];
+	alignas(32) double mu[4];
+	int lanes;
+	int max_iter = maxIterations();
+	double radius_sq = std::max(static_cast<double>(smooth_radius * smooth_radius), escapeRadiusSq());
+
+	_x_origin	= _mm256_set1_pd(static_cast<double>(vp.x_origin));
+	_x_step		= _mm256_set1_pd(static_cast<double>(vp.x_step));
+	_lane		= _mm256_setr_pd(0.0, 1.0, 2.0, 3.0);
+
+	for (int y = tile.y; y < tile.y + tile.height; ++y)
+	{
+		_py = _mm256_set1_pd(static_cast<double>(vp.y_origin + y * vp.y_step));
+		size_t row = static_cast<size_t>(y) * matrix_width;
+
+		for (int x = tile.x; x < tile.x + tile.width; x += 4)
+		{
+			_px = _mm256_fmadd_pd(_mm256_add_pd(_mm256_set1_pd(x), _lane), _x_step, _x_origin);
+			if (startOrbitAVX<F>(o, _px, _py))
+				orbitAVX<F, false>(o, 0, max_iter, radius_sq);
+			_iter = _mm256_andnot_si256(o.active, o.iter);
+
+			// ln|z| = ln(2) / 2 * log2(|z|^2), so mu = n + 1 - log2(ln(2) / 2) - log2(log2(|z|^2))
+			_mu = _mm256_add_pd(int64ToDoubleAVX(_iter), _mm256_set1_pd(1.0 - std::log2(0.5 * 0.693147180559945309)));
+			_mu = _mm256_sub_pd(_mu, log2AVX(log2AVX(o.mag_sq)));
+			_escaped = _mm256_cmpgt_epi64(_iter, _mm256_setzero_si256());
+			_mu = _mm256_and_pd(_mu, _mm256_castsi256_pd(_escaped));
+
+			_mm256_store_si256((__m256i*)iter, _iter);
+			_mm256_store_pd(mu, _mu);
+			lanes = std::min(4, tile.x + tile.width - x);
+			for (int k = 0; k < lanes; ++k)
+			{
+				matrix[row + x + k] = static_cast<int>(iter[k]);
+				smooth[row + x + k] = static_cast<float>(std::max(0.0, mu[k]));
+			}
+		}
+	}
+}
+
+/*
+* Same as tileAVX, but the derivative is tracked as well, which gives each escaped pixel a distance estimate (in pixels). With
+* distance_estimation whole blocks of pixels are filled without iterating them, otherwise every pixel is iterated.
+*
+* The tile is split into de_block_size blocks and the 4 corners of each block are iterated first. If all 4 corners escaped on the same
+* iteration and the distance estimate of one of them covers the whole block, the block contains no points of the set. Its edges are
+* iterated next, and if every edge pixel escaped on that iteration as well, the inside is filled with it and with the distance
+* interpolated between the corners. For the Mandelbrot set the filled counts are exact up to rounding: z_n(c) is a polynomial without
+* zeros in a block free of the set, so |z_n| takes both its largest and smallest value on the edge. The iterates of a Julia set may have
+* zeros outside the set, and those of the Burning Ship are not analytic, so there a band of another count which lies entirely inside a
+* block is missed. The interpolated distances are approximations.
+*/
+template <Fractal::FractalSets F>
+void Fractal::tileDistanceAVX(int* matrix, float* distance, int matrix_width, const Tile& tile, const Viewport& vp)
+{
+	__m256d _px, _py, _x_origin, _x_step, _lane, _mag_sq, _dmag_sq;
+	__m256i _iter;
+	alignas(32) long long iter[4];
+	alignas(32) double mag_sq[4];
+	alignas(32) double dmag_sq[4];
+	double radius[4];
+	int lanes;
+
+	double pixel_size = std::abs(static_cast<double>(vp.x_step));
+
+	_x_origin	= _mm256_set1_pd(static_cast<double>(vp.x_origin));
+	_x_step		= _mm256_set1_pd(static_cast<double>(vp.x_step));
+	_lane		= _mm256_setr_pd(0.0, 1.0, 2.0, 3.0);
+
+	// Iterate up to 4 pixels anywhere in the tile, at the same coordinates as a row of them, and write their values. Returns whether all
+	// of them escaped on iteration band
+	auto iteratePixels = [&](const int* xs, const int* ys, int count, long long band) {
+		alignas(32) double px[4], py[4];
+		alignas(32) long long pixel_iter[4];
+		alignas(32) double pixel_mag_sq[4], pixel_dmag_sq[4];
+		for (int k = 0; k < 4; ++k)
 		{
-			_temp = _mm256_add_pd(_mm256_fmsub_pd(_zx, _zx, _mm256_mul_pd(_zy, _zy)), _real);		// temp = zx * zx - zy * zy + real;
-			_zy = _mm256_mul_pd(_two, _mm256_mul_pd(_zx, _zy));	// zy = std::abs(2 * zx * zy) + imag;
-			_zy = _mm256_andnot_pd(_mm256_set1_pd(-0.0), _zy);
-			_zy = _mm256_add_pd(_zy, _imag);
+			int j = std::min(k, count - 1);
+			px[k] = static_cast<double>(xs[j]);
+			py[k] = static_cast<double>(vp.y_origin + ys[j] * vp.y_step);
+		}
+		__m256d _mag, _dmag;
+		__m256i _pixel_iter;
+		iterateAVX<F, true>(_mm256_fmadd_pd(_mm256_load_pd(px), _x_step, _x_origin), _mm256_load_pd(py), _pixel_iter, _mag, _dmag);
+
+		_mm256_store_si256((__m256i*)pixel_iter, _pixel_iter);
+		_mm256_store_pd(pixel_mag_sq, _mag);
+		_mm256_store_pd(pixel_dmag_sq, _dmag);
+		bool same = true;
+		for (int k = 0; k < count; ++k)
+		{
+			size_t i = static_cast<size_t>(ys[k]) * matrix_width + xs[k];
+			matrix[i] = static_cast<int>(pixel_iter[k]);
+			if (distance)
+				distance[i] = static_cast<float>(distanceEstimate(pixel_mag_sq[k], pixel_dmag_sq[k]) / pixel_size);
+			same = same && pixel_iter[k] == band;
+		}
+		return same;
+	};
+
+	for (int block_y = tile.y; block_y < tile.y + tile.height; block_y += de_block_size)
+	{
+		int block_height = std::min(de_block_size, tile.y + tile.height - block_y);
+
+		for (int block_x = tile.x; block_x < tile.x + tile.width; block_x += de_block_size)
+		{
+			int block_width = std::min(de_block_size, tile.x + tile.width - block_x);
+
+			// Blocks without any pixels between their edges have nothing to gain from the corner check
+			if (distance_estimation && block_width > 2 && block_height > 2)
+			{
+				int last_x = block_x + block_width - 1;
+				int last_y = block_y + block_height - 1;
+
+				// Corners in the order top left, top right, bottom left, bottom right
+				_px = _mm256_setr_pd(	static_cast<double>(vp.x_origin + block_x * vp.x_step), static_cast<double>(vp.x_origin + last_x * vp.x_step),
+										static_cast<double>(vp.x_origin + block_x * vp.x_step), static_cast<double>(vp.x_origin + last_x * vp.x_step));
+				_py = _mm256_setr_pd(	static_cast<double>(vp.y_origin + block_y * vp.y_step), static_cast<double>(vp.y_origin + block_y * vp.y_step),
+										static_cast<double>(vp.y_origin + last_y * vp.y_step), static_cast<double>(vp.y_origin + last_y * vp.y_step));
+				iterateAVX<F, true>(_px, _py, _iter, _mag_sq, _dmag_sq);
+
+				_mm256_store_si256((__m256i*)iter, _iter);
+				if (iter[0] != 0 && iter[0] == iter[1] && iter[0] == iter[2] && iter[0] == iter[3])
+				{
+					_mm256_store_pd(mag_sq, _mag_sq);
+					_mm256_store_pd(dmag_sq, _dmag_sq);
+
+					double max_radius = 0.0;
+					for (int k = 0; k < 4; ++k)
+					{
+						radius[k] = distanceEstimate(mag_sq[k], dmag_sq[k]);
+						max_radius = std::max(max_radius, radius[k]);
+					}
+
+					// The point of the block furthest from a corner is the opposite corner
+					double diagonal = std::hypot(static_cast<double>((block_width - 1) * vp.x_step), static_cast<double>((block_height - 1) * vp.y_step));
+					bool uniform = max_radius >= diagonal;
+
+					// The edges, 4 pixels at a time, until one of them escaped on another iteration
+					int xs[4], ys[4];
+					int count = 0;
+					auto addEdgePixel = [&](int x, int y) {
+						xs[count] = x;
+						ys[count] = y;
+						if (++count == 4 && uniform)
+							uniform = iteratePixels(xs, ys, count, iter[0]);
+						count %= 4;
+					};
+					for (int x = block_x; x <= last_x && uniform; ++x)
+					{
+						addEdgePixel(x, block_y);
+						addEdgePixel(x, last_y);
+					}
+					for (int y = block_y + 1; y < last_y && uniform; ++y)
+					{
+						addEdgePixel(block_x, y);
+						addEdgePixel(last_x, y);
+					}
+					if (count > 0 && uniform)
+						uniform = iteratePixels(xs, ys, count, iter[0]);
+
+					if (uniform)
+					{
+						for (int y = block_y + 1; y < last_y; ++y)
+						{
+							size_t row = static_cast<size_t>(y) * matrix_width;
+							double v = static_cast<double>(y - block_y) / (block_height - 1);
+
+							for (int x = block_x + 1; x < last_x; ++x)
+							{
+								matrix[row + x] = static_cast<int>(iter[0]);
+								if (distance)
+								{
+									double u = static_cast<double>(x - block_x) / (block_width - 1);
+									double d = (1.0 - v) * ((1.0 - u) * radius[0] + u * radius[1]) + v * ((1.0 - u) * radius[2] + u * radius[3]);
+									distance[row + x] = static_cast<float>(d / pixel_size);
+								}
+							}
+						}
+						continue;
+					}
+				}
+			}
+
+			// The block could not be skipped, so iterate every pixel in it. The derivative is only needed when the distance is wanted.
+			if (!distance)
+			{
+				tileAVX<F>(matrix, matrix_width, Tile{ block_x, block_y, block_width, block_height }, vp);
+				continue;
+			}
+
+			for (int y = block_y; y < block_y + block_height; ++y)
+			{
+				_py = _mm256_set1_pd(static_cast<double>(vp.y_origin + y * vp.y_step));
+				size_t row = static_cast<size_t>(y) * matrix_width;
+
+				for (int x = block_x; x < block_x + block_width; x += 4)
+				{
+					_px = _mm256_fmadd_pd(_mm256_add_pd(_mm256_set1_pd(x), _lane), _x_step, _x_origin);
+					iterateAVX<F, true>(_px, _py, _iter, _mag_sq, _dmag_sq);
+
+					_mm256_store_si256((__m256i*)iter, _iter);
+					_mm256_store_pd(mag_sq, _mag_sq);
+					_mm256_store_pd(dmag_sq, _dmag_sq);
+					lanes = std::min(4, block_x + block_width - x);
+					for (int k = 0; k < lanes; ++k)
+					{
+						matrix[row + x + k] = static_cast<int>(iter[k]);
+						distance[row + x + k] = static_cast<float>(distanceEstimate(mag_sq[k], dmag_sq[k]) / pixel_size);
+					}
+				}
+			}
+		}
+	}
+}
+
+/*
+* Same as tileAVX, but the orbit of every pixel is kept in state so the tile can be taken further later on.
+* Pixels which are not done have been iterated start times already and are iterated up to end. A group of 4 pixels that is
+* entirely done is skipped, so continuing a tile only costs as much as the pixels which have not escaped yet.
+*/
+template <Fractal::FractalSets F>
+void Fractal::tileStateAVX(int* matrix, const OrbitState& state, int matrix_width, const Tile& tile, const Viewport& vp, int start, int end)
+{
+	__m256d _px, _py, _x_origin, _x_step, _lane;
+	OrbitAVX o;
+	alignas(32) double zx[4], zy[4];
+	alignas(32) long long iter[4], active[4];
+	int lanes;
+
+	_x_origin	= _mm256_set1_pd(static_cast<double>(vp.x_origin));
+	_x_step		= _mm256_set1_pd(static_cast<double>(vp.x_step));
+	_lane		= _mm256_setr_pd(0.0, 1.0, 2.0, 3.0);
+
+	for (int y = tile.y; y < tile.y + tile.height; ++y)
+	{
+		_py = _mm256_set1_pd(static_cast<double>(vp.y_origin + y * vp.y_step));
+		size_t row = static_cast<size_t>(y) * matrix_width;
+
+		for (int x = tile.x; x < tile.x + tile.width; x += 4)
+		{
+			size_t i = row + x;
+			lanes = std::min(4, tile.x + tile.width - x);
+
+			_px = _mm256_fmadd_pd(_mm256_add_pd(_mm256_set1_pd(x), _lane), _x_step, _x_origin);
+
+			if (start == 0)
+			{
+				startOrbitAVX<F>(o, _px, _py);
+			}
+			else
+			{
+				bool pending = false;
+				for (int k = 0; k < 4; ++k)
+				{
+					// Lanes past the right edge of the tile are treated as done
+					bool done = k >= lanes || state.done[i + k];
+					zx[k] = k < lanes ? state.zx[i + k] : 0.0;
+					zy[k] = k < lanes ? state.zy[i + k] : 0.0;
+					active[k] = done ? 0 : -1;
+					pending = pending || !done;
+				}
+				if (!pending)
+					continue;
+
+				startOrbitAVX<F>(o, _px, _py);
+				o.zx = _mm256_load_pd(zx);
+				o.zy = _mm256_load_pd(zy);
+				o.active = _mm256_load_si256((const __m256i*)active);
+				o.iter = _mm256_and_si256(_mm256_set1_epi64x(start), o.active);
+			}
+
+			orbitAVX<F, false>(o, start, end, escapeRadiusSq());
+
+			_mm256_store_pd(zx, o.zx);
+			_mm256_store_pd(zy, o.zy);
+			_mm256_store_si256((__m256i*)iter, o.iter);
+			_mm256_store_si256((__m256i*)active, o.active);
+			for (int k = 0; k < lanes; ++k)
+			{
+				if (start > 0 && state.done[i + k])
+					continue;
+				state.zx[i + k] = zx[k];
+				state.zy[i + k] = zy[k];
+				state.iter[i + k] = static_cast<int>(iter[k]);
+				state.done[i + k] = active[k] == 0;
+				matrix[i + k] = active[k] == 0 ? static_cast<int>(iter[k]) : 0;
+			}
+		}
+	}
+}
+
+/*
+* Results of a point query for point i of a batch, which stopped after iter iterations at z, with |z|^2 = mag_sq. Escaped points keep their
+* iteration count, the others are written as 0, the same as in a matrix.
+*/
+void Fractal::finishPoint(const PointQuery& query, size_t i, long long iter, bool escaped, double zx, double zy, double mag_sq) const
+{
+	query.iterations[i] = escaped ? static_cast<int>(iter) : 0;
+	if (query.final_zx)
+	{
+		query.final_zx[i] = zx;
+		query.final_zy[i] = zy;
+	}
+	if (query.smooth)
+	{
+		// ln|z| = ln(2) / 2 * log2(|z|^2), so mu = n + 1 - log2(ln(2) / 2) - log2(log2(|z|^2)), the same as tileSmoothAVX
+		double mu = escaped && iter > 0 ? static_cast<double>(iter) + 1.0 - std::log2(0.5 * 0.693147180559945309) - std::log2(std::log2(mag_sq)) : 0.0;
+		query.smooth[i] = static_cast<float>(std::max(0.0, mu));
+	}
+}
+
+/*
+* Iterate the points first to end of a query 4 at a time, refilling each lane with the next point as soon as its orbit is done, so lanes
+* are never left idle while the slowest point of a group of 4 finishes. The orbits follow orbitAVX step for step, with the same escape test,
+* periodicity checks and iteration counts, but every lane keeps its own schedule of periodicity checks since lanes start at different times.
+* The orbits stay in registers throughout, and a new point is blended into its lane, as storing the lanes and loading them back after
+* writing single lanes would stall on every refill. Lanes are refilled in batches, see idle_steps, since most orbits are only a few
+* steps long.
+*/
+template <Fractal::FractalSets F>
+void Fractal::pointsAVX(const PointQuery& query, size_t first, size_t end)
+{
+	const int max_iter = maxIterations();
+	const double radius_sq = query.smooth ? std::max(static_cast<double>(smooth_radius * smooth_radius), escapeRadiusSq()) : escapeRadiusSq();
+
+	const __m256d _two = _mm256_set1_pd(2.0);
+	const __m256d _sign_bit = _mm256_set1_pd(-0.0);
+	const __m256d _radius_sq = _mm256_set1_pd(radius_sq);
+	const __m256i _one = _mm256_set1_epi64x(1);
+	const __m256i _max_iter = _mm256_set1_epi64x(max_iter);
+	const __m256i _first_period = _mm256_set1_epi64x(10);
+	const __m256i _first_check = _mm256_set1_epi64x(std::min(10, max_iter));
+	const __m256i _lanes[4] = { _mm256_setr_epi64x(-1, 0, 0, 0), _mm256_setr_epi64x(0, -1, 0, 0), _mm256_setr_epi64x(0, 0, -1, 0), _mm256_setr_epi64x(0, 0, 0, -1) };
+	const __m256d _julia_x = _mm256_set1_pd(static_cast<double>(julia_complex_param.real()));
+	const __m256d _julia_y = _mm256_set1_pd(static_cast<double>(julia_complex_param.imag()));
+
+	__m256d _zx = _mm256_setzero_pd(), _zy = _mm256_setzero_pd(), _cx = _mm256_setzero_pd(), _cy = _mm256_setzero_pd();
+	__m256d _check_zx = _mm256_setzero_pd(), _check_zy = _mm256_setzero_pd(), _mag_sq = _mm256_setzero_pd();
+	__m256d _final_zx = _mm256_setzero_pd(), _final_zy = _mm256_setzero_pd();
+	__m256i _iter = _mm256_setzero_si256(), _check_at = _first_check, _period = _first_period;
+	__m256i _active = _mm256_setzero_si256();
+
+	alignas(32) double zx[4], zy[4], mag_sq[4];
+	alignas(32) long long iter[4], active[4];
+	long long index[4] = { -1, -1, -1, -1 };
+	size_t next = first;
+	int pruned = 0;		// Mandelbrot points of the group of 4 at next which lie in the cardioid or the period 2 bulb, one bit each
+
+	// Idle lane steps worth a refill, which costs about as much as a few steps with branch mispredictions included
+	constexpr int idle_steps = 12;
+	auto bitCount = [](int bits) {
+		return (bits & 1) + ((bits >> 1) & 1) + ((bits >> 2) & 1) + ((bits >> 3) & 1);
+	};
+
+	while (true)
+	{
+		// Empty lanes take the next points. Mandelbrot points in the main cardioid or the period 2 bulb are done without iterating them
+		int filled = 0;
+		for (int k = 0; k < 4; ++k)
+		{
+			while (index[k] < 0 && next < end)
+			{
+				size_t i = next++;
+				if (F == FractalSets::MANDELBROT)
+				{
+					size_t group = (i - first) % 4;
+					if (group == 0)
+					{
+						// The last group repeats its last point past the end of the query
+						size_t last = end - 1;
+						__m256d _x = _mm256_setr_pd(query.x[i], query.x[std::min(i + 1, last)], query.x[std::min(i + 2, last)], query.x[std::min(i + 3, last)]);
+						__m256d _y = _mm256_setr_pd(query.y[i], query.y[std::min(i + 1, last)], query.y[std::min(i + 2, last)], query.y[std::min(i + 3, last)]);
+						pruned = _mm256_movemask_pd(_mm256_or_pd(mandelbrotBulbCheckAVX(_x, _y), mandelbrotCardioidCheckAVX(_x, _y)));
+					}
+					if (pruned & (1 << group))
+					{
+						finishPoint(query, i, 0, false, 0.0, 0.0, 0.0);
+						continue;
+					}
+				}
+
+				index[k] = static_cast<long long>(i);
+				__m256d _lane = _mm256_castsi256_pd(_lanes[k]);
+				__m256d _x = _mm256_set1_pd(query.x[i]);
+				__m256d _y = _mm256_set1_pd(query.y[i]);
+				__m256d _start_x = F == FractalSets::MANDELBROT ? _mm256_setzero_pd() : _x;
+				__m256d _start_y = F == FractalSets::MANDELBROT ? _mm256_setzero_pd() : _y;
+				_zx = _mm256_blendv_pd(_zx, _start_x, _lane);
+				_zy = _mm256_blendv_pd(_zy, _start_y, _lane);
+				_cx = _mm256_blendv_pd(_cx, F == FractalSets::JULIA ? _julia_x : _x, _lane);
+				_cy = _mm256_blendv_pd(_cy, F == FractalSets::JULIA ? _julia_y : _y, _lane);
+				_check_zx = _mm256_blendv_pd(_check_zx, _start_x, _lane);
+				_check_zy = _mm256_blendv_pd(_check_zy, _start_y, _lane);
+				_mag_sq = _mm256_andnot_pd(_lane, _mag_sq);
+				_iter = _mm256_andnot_si256(_lanes[k], _iter);
+				_check_at = _mm256_blendv_epi8(_check_at, _first_check, _lanes[k]);
+				_period = _mm256_blendv_epi8(_period, _first_period, _lanes[k]);
+				_active = _mm256_or_si256(_active, _lanes[k]);
+			}
+			filled += index[k] >= 0;
+		}
+		if (filled == 0)
+			return;
+
+		// Iterate until lanes have been idle for as many steps as a refill costs, or every lane is done. Short orbits are then done 4 at a
+		// time as in orbitAVX, while a long orbit has the lanes around it refilled
+		const int started = _mm256_movemask_pd(_mm256_castsi256_pd(_active));
+		const int refill_after = next < end ? idle_steps : std::numeric_limits<int>::max();
+		int idle = 0;
+		for (int running = started; running != 0 && idle < refill_after; idle += 4 - bitCount(running))
+		{
+			// Lanes which are done go on iterating, as in orbitAVX, so that z does not wait for the active mask. Their final z is kept aside
+			__m256i _was_active = _active;
+			__m256d _temp = _mm256_add_pd(_mm256_fmsub_pd(_zx, _zx, _mm256_mul_pd(_zy, _zy)), _cx);
+			if (F == FractalSets::BSHIP)
+				_zy = _mm256_add_pd(_mm256_andnot_pd(_sign_bit, _mm256_mul_pd(_two, _mm256_mul_pd(_zx, _zy))), _cy);
+			else
+				_zy = _mm256_fmadd_pd(_mm256_add_pd(_zx, _zx), _zy, _cy);
 			_zx = _temp;
 
-			//if (zx * zx + zy * zy < (julia_radius * julia_radius))
-			_mask1 = _mm256_cmp_pd(_mm256_fmadd_pd(_zx, _zx, _mm256_mul_pd(_zy, _zy)), _radius_sq, _CMP_LT_OQ);
-			// Each point that violates the above is marked as inactive so that its iteration count it not incremented anymore
-			_active = _mm256_and_si256(_active, _mm256_castpd_si256(_mask1));
+			__m256d _mag = _mm256_fmadd_pd(_zx, _zx, _mm256_mul_pd(_zy, _zy));
+			__m256d _inside = _mm256_cmp_pd(_mag, _radius_sq, F == FractalSets::MANDELBROT ? _CMP_LE_OQ : _CMP_LT_OQ);
+			__m256i _escaped = _mm256_andnot_si256(_mm256_castpd_si256(_inside), _active);
+			_mag_sq = _mm256_blendv_pd(_mag_sq, _mag, _mm256_castsi256_pd(_escaped));
+			_active = _mm256_and_si256(_active, _mm256_castpd_si256(_inside));
+
+			__m256d _periodic = _mm256_and_pd(_mm256_cmp_pd(_zx, _check_zx, _CMP_EQ_OQ), _mm256_cmp_pd(_zy, _check_zy, _CMP_EQ_OQ));
+			__m256i _periodic_i = _mm256_and_si256(_mm256_castpd_si256(_periodic), _active);
+			_iter = _mm256_andnot_si256(_periodic_i, _iter);
+			_active = _mm256_andnot_si256(_periodic_i, _active);
+			_iter = _mm256_add_epi64(_iter, _mm256_and_si256(_one, _active));
+
+			// Lanes at a checkpoint compare against this z from now on, and wait twice as long for the next checkpoint
+			__m256i _at = _mm256_and_si256(_mm256_cmpeq_epi64(_iter, _check_at), _active);
+			_check_zx = _mm256_blendv_pd(_check_zx, _zx, _mm256_castsi256_pd(_at));
+			_check_zy = _mm256_blendv_pd(_check_zy, _zy, _mm256_castsi256_pd(_at));
+			_period = _mm256_add_epi64(_period, _mm256_and_si256(_period, _at));
+			__m256i _next_at = _mm256_add_epi64(_iter, _period);
+			_next_at = _mm256_blendv_epi8(_next_at, _max_iter, _mm256_cmpgt_epi64(_next_at, _max_iter));
+			_check_at = _mm256_blendv_epi8(_check_at, _next_at, _at);
+
+			// Lanes which reach max_iter are done without escaping
+			_active = _mm256_andnot_si256(_mm256_cmpeq_epi64(_iter, _max_iter), _active);
+
+			__m256d _finished = _mm256_castsi256_pd(_mm256_andnot_si256(_active, _was_active));
+			_final_zx = _mm256_blendv_pd(_final_zx, _zx, _finished);
+			_final_zy = _mm256_blendv_pd(_final_zy, _zy, _finished);
+			running = _mm256_movemask_pd(_mm256_castsi256_pd(_active));
+		}
 
-			//if (zx != check_zx || zy != check_zy)
-			_mask1 = _mm256_or_pd(_mm256_cmp_pd(_zx, _check_zx, _CMP_NEQ_OQ), _mm256_cmp_pd(_zy, _check_zy, _CMP_NEQ_OQ));
-			// Each point that violates the above should have its iteration count set to 0, but only if that point is still active
-			_iter = _mm256_and_si256(_iter, _mm256_or_si256(_mm256_castpd_si256(_mask1), _mm256_xor_si256(_active, _mm256_set1_epi64x(-1))));
-			// Set the points that violate the above as inactive
-			_active = _mm256_and_si256(_active, _mm256_castpd_si256(_mask1));
+		// Escaped lanes are the ones with |z|^2 recorded, which is 0 until then
+		_mm256_store_pd(zx, _final_zx);
+		_mm256_store_pd(zy, _final_zy);
+		_mm256_store_pd(mag_sq, _mag_sq);
+		_mm256_store_si256((__m256i*)iter, _iter);
+		_mm256_store_si256((__m256i*)active, _active);
+		for (int k = 0; k < 4; ++k)
+		{
+			if (index[k] < 0 || active[k] != 0)
+				continue;
+			finishPoint(query, static_cast<size_t>(index[k]), iter[k], mag_sq[k] > 0.0, zx[k], zy[k], mag_sq[k]);
+			index[k] = -1;
+		}
+	}
+}
 
+/*
+* Scalar version of pointsAVX, for processors without AVX2, iterating the same orbits one point at a time in double precision.
+*/
+void Fractal::pointsStandard(const PointQuery& query, size_t first, size_t end)
+{
+	const int max_iter = maxIterations();
+	const double radius_sq = query.smooth ? std::max(static_cast<double>(smooth_radius * smooth_radius), escapeRadiusSq()) : escapeRadiusSq();
+	const double julia_x = static_cast<double>(julia_complex_param.real()), julia_y = static_cast<double>(julia_complex_param.imag());
 
-			// Check to see if all of the points are inactive. If they are we are done and will jump to assign
-			if (_mm256_movemask_pd(_mm256_castsi256_pd(_active)) == 0)
-				goto assign;
-			// At least one point is still active, so we increment
-			_iter = _mm256_add_epi64(_iter, _mm256_and_si256(_one, _active)); // one AND active
+	for (size_t i = first; i < end; ++i)
+	{
+		double x = query.x[i], y = query.y[i];
+		if (fractal_mode == FractalSets::MANDELBROT && mandelbrotPrune(x, y))
+		{
+			finishPoint(query, i, 0, false, 0.0, 0.0, 0.0);
+			continue;
 		}
 
-		// If any points iteration count has reached the max we are done
-		_mask2 = _mm256_cmpeq_epi64(_iter, _max_iter);
-		if (_mm256_movemask_pd(_mm256_castsi256_pd(_mask2)) > 0)
-			goto assign;
+		double zx = fractal_mode == FractalSets::MANDELBROT ? 0.0 : x;
+		double zy = fractal_mode == FractalSets::MANDELBROT ? 0.0 : y;
+		double cx = fractal_mode == FractalSets::JULIA ? julia_x : x;
+		double cy = fractal_mode == FractalSets::JULIA ? julia_y : y;
+		double check_zx = zx, check_zy = zy;
+		long long iter = 0, period = 10, check_at = std::min(10, max_iter);
+		bool escaped = false;
+		double mag = 0.0;
+		while (true)
+		{
+			double temp = zx * zx - zy * zy + cx;
+			zy = fractal_mode == FractalSets::BSHIP ? std::abs(2.0 * zx * zy) + cy : (zx + zx) * zy + cy;
+			zx = temp;
 
-		_check_zx = _zx;
-		_check_zy = _zy;
-		period += period;
-		if (period > bship_max_iter)
-			period = bship_max_iter;
-		goto loop;
-
-	assign:
-
-		// If any of the iteration values = max_iter, set them to 0
-		_mask2 = _mm256_cmpeq_epi64(_iter, _max_iter);
-		_iter = _mm256_andnot_si256(_mask2, _iter);
-
-		// Extract vector values
-		// These iter values should never get too high, so casting from 64-bit int to 32-bit int should not be a problem
-		matrix[i] = static_cast<int>(_iter.m256i_i64[3]);
-		matrix[i + 1] = static_cast<int>(_iter.m256i_i64[2]);
-		matrix[i + 2] = static_cast<int>(_iter.m256i_i64[1]);
-		matrix[i + 3] = static_cast<int>(_iter.m256i_i64[0]);
+			double step_mag = zx * zx + zy * zy;
+			if (fractal_mode == FractalSets::MANDELBROT ? step_mag > radius_sq : step_mag >= radius_sq)
+			{
+				escaped = true;
+				mag = step_mag;
+				break;
+			}
+			if (zx == check_zx && zy == check_zy)
+			{
+				iter = 0;
+				break;
+			}
+			iter += 1;
+			if (iter == check_at)
+			{
+				check_zx = zx;
+				check_zy = zy;
+				period += period;
+				check_at = std::min(iter + period, static_cast<long long>(max_iter));
+			}
+			if (iter == max_iter)
+				break;
+		}
+		finishPoint(query, i, iter, escaped, zx, zy, mag);
 	}
 }
 
-void Fractal::bshipMatrixAVX(int* matrix, int matrix_width, int matrix_height)
+/*
+* Iterate a single tile of the matrix from start to end iterations, keeping the orbit of every pixel in state. With start = 0 the tile is
+* computed from scratch, otherwise the pixels which were not done after start iterations are continued. Pixels which are not done are
+* written to the matrix as 0, the same as points in the set. This path is AVX only and has no distance estimate.
+*/
+void Fractal::computeTileState(int* matrix, const OrbitState& state, int matrix_width, const Tile& tile, const Viewport& vp, int start, int end)
+{
+	if (fractal_mode == FractalSets::MANDELBROT)
+		tileStateAVX<FractalSets::MANDELBROT>(matrix, state, matrix_width, tile, vp, start, end);
+	else if (fractal_mode == FractalSets::JULIA)
+		tileStateAVX<FractalSets::JULIA>(matrix, state, matrix_width, tile, vp, start, end);
+	else
+		tileStateAVX<FractalSets::BSHIP>(matrix, state, matrix_width, tile, vp, start, end);
+}
+
+/*
+* Fill a single tile of the matrix with iteration values of the current fractal, and the distance estimate of each pixel if distance is given,
+* or the smooth escape value of each pixel if smooth is given (which takes precedence, distance is then left untouched). Only with
+* distance_estimation blocks of pixels are filled without iterating them (see tileDistanceAVX).
+* Distance estimation and smooth escape values are carried out by the AVX kernels only, so they take precedence over the instruction set selection.
+*/
+void Fractal::computeTile(int* matrix, float* distance, int matrix_width, const Tile& tile, const Viewport& vp, bool AVX, float* smooth)
 {
-	for (int index = 0; index < t_pool->size; ++index)
+	if (smooth)
 	{
-		t_pool->addJob([=]() {bshipAVXThread(index*4, matrix, matrix_width, matrix_height, t_pool->size); });
+		if (fractal_mode == FractalSets::MANDELBROT)
+			tileSmoothAVX<FractalSets::MANDELBROT>(matrix, smooth, matrix_width, tile, vp);
+		else if (fractal_mode == FractalSets::JULIA)
+			tileSmoothAVX<FractalSets::JULIA>(matrix, smooth, matrix_width, tile, vp);
+		else
+			tileSmoothAVX<FractalSets::BSHIP>(matrix, smooth, matrix_width, tile, vp);
+	}
+	else if (distance_estimation || distance)
+	{
+		if (fractal_mode == FractalSets::MANDELBROT)
+			tileDistanceAVX<FractalSets::MANDELBROT>(matrix, distance, matrix_width, tile, vp);
+		else if (fractal_mode == FractalSets::JULIA)
+			tileDistanceAVX<FractalSets::JULIA>(matrix, distance, matrix_width, tile, vp);
+		else
+			tileDistanceAVX<FractalSets::BSHIP>(matrix, distance, matrix_width, tile, vp);
+	}
+	else if (AVX)
+	{
+		if (fractal_mode == FractalSets::MANDELBROT)
+			tileAVX<FractalSets::MANDELBROT>(matrix, matrix_width, tile, vp);
+		else if (fractal_mode == FractalSets::JULIA)
+			tileAVX<FractalSets::JULIA>(matrix, matrix_width, tile, vp);
+		else
+			tileAVX<FractalSets::BSHIP>(matrix, matrix_width, tile, vp);
+	}
+	else
+	{
+		tileStandard(matrix, matrix_width, tile, vp);
 	}
-	t_pool->synchronize();
 }
 
+/*
+*	Runs one ThreadPool job per tile that will fill the supplied matrix with iteration values of the current fractal.
+*/
+void Fractal::iterationMatrix(int* matrix, float* distance, int matrix_width, int matrix_height, bool AVX)
+{
+	Viewport vp = getViewport(matrix_width, matrix_height);
+	int columns = (matrix_width + tile_size - 1) / tile_size;
+	int rows = (matrix_height + tile_size - 1) / tile_size;
+
+	t_pool->run(columns * rows, [=](int index) {
+		int x = (index % columns) * tile_size;
+		int y = (index / columns) * tile_size;
+		Tile tile{ x, y, std::min(tile_size, matrix_width - x), std::min(tile_size, matrix_height - y) };
+		computeTile(matrix, distance, matrix_width, tile, vp, AVX);
+	});
+}
+
+
+/*
+* Escape counts of arbitrary points, rather than of a raster: for each of the count points (x[i], y[i]), which is c for the mandelbrot set
+* and burning ship and z_0 for the julia set, the iteration count as in a matrix is written to iterations[i]. Optionally the z each orbit
+* stopped at (when it escaped, was found to be periodic, or reached the iteration limit) goes to final_zx and final_zy, and the smooth escape
+* value to smooth, which iterates to the larger bailout of tileSmoothAVX. The arrays are structures of arrays, one per component.
+* Batches of more than a few thousand points are spread over the thread pool, so this must not be called from a pool job.
+*/
+void Fractal::queryPoints(const double* x, const double* y, size_t count, int* iterations, double* final_zx, double* final_zy, float* smooth, bool AVX)
+{
+	PointQuery query{ x, y, iterations, final_zx, final_zy, smooth };
+	auto run = [&](size_t first, size_t end) {
+		if (!AVX)
+			pointsStandard(query, first, end);
+		else if (fractal_mode == FractalSets::MANDELBROT)
+			pointsAVX<FractalSets::MANDELBROT>(query, first, end);
+		else if (fractal_mode == FractalSets::JULIA)
+			pointsAVX<FractalSets::JULIA>(query, first, end);
+		else
+			pointsAVX<FractalSets::BSHIP>(query, first, end);
+	};
+
+	// Blocks of points small enough that the slowest one does not hold up the batch, large enough that each job has work
+	constexpr size_t block = 1024;
+	if (count <= 4 * block)
+	{
+		run(0, count);
+		return;
+	}
+	int blocks = static_cast<int>((count + block - 1) / block);
+	t_pool->run(blocks, [&](int index) {
+		size_t first = static_cast<size_t>(index) * block;
+		run(first, std::min(count, first + block));
+	});
+}
 
 ////////////////////////////////////////////////////////////
 /// Fractal Parameter Adjustment Functions
@@ -827,6 +1398,7 @@ void Fractal::stationaryZoom(int direction, int max_x, int max_y)
 		* To avoid this, we track the change of the center pixel before and after the zoom and change our offsets to match.
 		*/
 
+		// Zooming out undoes zooming in, so zoom levels form a grid and returning to one lines up with the pixels of before (see TileCache).
 		// 0.5 since we are interested in the center pixel value.
 		long double common_x = mandelbrot_x_min + ((mandelbrot_x_max - mandelbrot_x_min) * 0.5) + mandelbrot_x_offset;
 		long double common_y = mandelbrot_y_min + ((mandelbrot_y_max - mandelbrot_y_min) * 0.5) + mandelbrot_y_offset;
@@ -838,7 +1410,7 @@ void Fractal::stationaryZoom(int direction, int max_x, int max_y)
 		}
 		else
 		{
-			mandelbrot_zoom *= (1.0 - mandelbrot_zoom_multiplier);
+			mandelbrot_zoom /= (1.0 + mandelbrot_zoom_multiplier);
 		}
 
 		mandelbrot_x_offset += common_x * (mandelbrot_zoom / old_zoom - 1.0);
@@ -856,7 +1428,7 @@ void Fractal::stationaryZoom(int direction, int max_x, int max_y)
 		}
 		else
 		{
-			julia_zoom *= (1.0 - julia_zoom_multiplier);
+			julia_zoom /= (1.0 + julia_zoom_multiplier);
 		}
 
 		julia_x_offset += common_x * (julia_zoom / old_zoom - 1.0);
@@ -873,7 +1445,7 @@ void Fractal::stationaryZoom(int direction, int max_x, int max_y)
 		}
 		else
 		{
-			bship_zoom *= (1.0 - bship_zoom_multiplier);
+			bship_zoom /= (1.0 + bship_zoom_multiplier);
 		}
 
 		bship_x_offset += common_x * (bship_zoom / old_zoom - 1.0);
@@ -933,64 +1505,76 @@ void Fractal::followingZoom(int direction, int x_pos, int y_pos, int max_x, int
 	}
 }
 
-void Fractal::panUp()
+/*
+* Pans move the view by a whole number of pixels, so that the pixels still in view after a pan line up exactly with the previous frame
+* and can be reused instead of recomputed.
+*
+* @param long double increment : The desired pan distance, in the same unscaled units as the offsets
+* @param long double pixel : The size of one pixel in those units
+*/
+static long double pixelAligned(long double increment, long double pixel)
+{
+	return std::max(1.0L, std::round(increment / pixel)) * pixel;
+}
+
+void Fractal::panUp(int, int max_y)
 {
 	if (fractal_mode == FractalSets::MANDELBROT)
 	{
-		mandelbrot_y_offset += mandelbrot_pan_increment;
+		mandelbrot_y_offset += pixelAligned(mandelbrot_pan_increment, (mandelbrot_y_max - mandelbrot_y_min) / max_y);
 	}
 	else if (fractal_mode == FractalSets::JULIA)
 	{
-		julia_y_offset += julia_pan_increment;
+		julia_y_offset += pixelAligned(julia_pan_increment, 2.0 * julia_radius / max_y);
 	}
 	else if (fractal_mode == FractalSets::BSHIP)
 	{
-		bship_y_offset -= bship_pan_increment;
+		bship_y_offset -= pixelAligned(bship_pan_increment, 2.0 * bship_radius / max_y);
 	}
 }
-void Fractal::panDown()
+void Fractal::panDown(int, int max_y)
 {
 	if (fractal_mode == FractalSets::MANDELBROT)
 	{
-		mandelbrot_y_offset -= mandelbrot_pan_increment;
+		mandelbrot_y_offset -= pixelAligned(mandelbrot_pan_increment, (mandelbrot_y_max - mandelbrot_y_min) / max_y);
 	}
 	else if (fractal_mode == FractalSets::JULIA)
 	{
-		julia_y_offset -= julia_pan_increment;
+		julia_y_offset -= pixelAligned(julia_pan_increment, 2.0 * julia_radius / max_y);
 	}
 	else if (fractal_mode == FractalSets::BSHIP)
 	{
-		bship_y_offset += bship_pan_increment;
+		bship_y_offset += pixelAligned(bship_pan_increment, 2.0 * bship_radius / max_y);
 	}
 }
-void Fractal::panLeft()
+void Fractal::panLeft(int max_x, int)
 {
 	if (fractal_mode == FractalSets::MANDELBROT)
 	{
-		mandelbrot_x_offset -= mandelbrot_pan_increment;
+		mandelbrot_x_offset -= pixelAligned(mandelbrot_pan_increment, (mandelbrot_x_max - mandelbrot_x_min) / max_x);
 	}
 	else if (fractal_mode == FractalSets::JULIA)
 	{
-		julia_x_offset -= julia_pan_increment;
+		julia_x_offset -= pixelAligned(julia_pan_increment, 2.0 * julia_radius / max_x);
 	}
 	else if (fractal_mode == FractalSets::BSHIP)
 	{
-		bship_x_offset -= bship_pan_increment;
+		bship_x_offset -= pixelAligned(bship_pan_increment, 2.0 * bship_radius / max_x);
 	}
 }
-void Fractal::panRight()
+void Fractal::panRight(int max_x, int)
 {
 	if (fractal_mode == FractalSets::MANDELBROT)
 	{
-		mandelbrot_x_offset += mandelbrot_pan_increment;
+		mandelbrot_x_offset += pixelAligned(mandelbrot_pan_increment, (mandelbrot_x_max - mandelbrot_x_min) / max_x);
 	}
 	else if (fractal_mode == FractalSets::JULIA)
 	{
-		julia_x_offset += julia_pan_increment;
+		julia_x_offset += pixelAligned(julia_pan_increment, 2.0 * julia_radius / max_x);
 	}
 	else if (fractal_mode == FractalSets::BSHIP)
 	{
-		bship_x_offset += bship_pan_increment;
+		bship_x_offset += pixelAligned(bship_pan_increment, 2.0 * bship_radius / max_x);
 	}
 }
 
@@ -1083,42 +1667,159 @@ void Fractal::selectFractal(int fractal)
 	fractal_mode = (FractalSets)((fractal) % static_cast<int>(FractalSets::LAST));
 }
 
-void Fractal::generate(int* matrix, int matrix_width, int matrix_height, ColorGenerator& cg, bool AVX)
+static const char* const location_names[] = { "mandelbrot", "julia", "bship" };
+
+/*
+* The current view as a line of text: the fractal set, its zoom, x and y offset, and iteration limit, e.g. "mandelbrot 1 0 0 200".
+* The numbers are written with every digit, so setLocation brings back exactly this view.
+*/
+std::string Fractal::location() const
 {
-#ifdef PRINT_INFO
-	if (AVX)
-		std::cout << "Using AVX instructions..." << std::endl;
+	std::ostringstream out;
+	out.precision(std::numeric_limits<long double>::max_digits10);
+	out << location_names[static_cast<int>(fractal_mode)] << ' ';
+	if (fractal_mode == FractalSets::MANDELBROT)
+		out << mandelbrot_zoom << ' ' << mandelbrot_x_offset << ' ' << mandelbrot_y_offset << ' ' << mandelbrot_max_iter;
+	else if (fractal_mode == FractalSets::JULIA)
+		out << julia_zoom << ' ' << julia_x_offset << ' ' << julia_y_offset << ' ' << julia_max_iter;
 	else
-		std::cout << "Using standard instructions..." << std::endl;
-	std::cout << "Fractal generation: ";
-	START_TIMER
-#endif
+		out << bship_zoom << ' ' << bship_x_offset << ' ' << bship_y_offset << ' ' << bship_max_iter;
+	return out.str();
+}
 
-	int n = 0;
+/*
+* Switch to the view of a line written by location. Returns false, leaving the fractal unchanged, if the line is not a location.
+*/
+bool Fractal::setLocation(const std::string& location)
+{
+	std::istringstream in(location);
+	std::string name;
+	View v;
+	if (!(in >> name >> v.zoom >> v.x_offset >> v.y_offset >> v.max_iter) || v.zoom <= 0 || v.max_iter == 0)
+		return false;
+
+	int mode = 0;
+	while (mode < static_cast<int>(FractalSets::LAST) && name != location_names[mode])
+		++mode;
+	if (mode == static_cast<int>(FractalSets::LAST))
+		return false;
+
+	fractal_mode = static_cast<FractalSets>(mode);
+	setView(v);
+	return true;
+}
+
+Fractal::View Fractal::view() const
+{
+	if (fractal_mode == FractalSets::MANDELBROT)
+		return View{ mandelbrot_zoom, mandelbrot_x_offset, mandelbrot_y_offset, mandelbrot_max_iter };
+	else if (fractal_mode == FractalSets::JULIA)
+		return View{ julia_zoom, julia_x_offset, julia_y_offset, julia_max_iter };
+	return View{ bship_zoom, bship_x_offset, bship_y_offset, bship_max_iter };
+}
+
+void Fractal::setView(const View& v)
+{
 	if (fractal_mode == FractalSets::MANDELBROT)
 	{
-		n = mandelbrot_max_iter;
-		if (AVX)
-			mandelbrotMatrixAVX(matrix, matrix_width, matrix_height);
-		else
-			mandelbrotMatrix(matrix, matrix_width, matrix_height);
+		mandelbrot_zoom = v.zoom;
+		mandelbrot_x_offset = v.x_offset;
+		mandelbrot_y_offset = v.y_offset;
+		mandelbrot_max_iter = v.max_iter;
 	}
 	else if (fractal_mode == FractalSets::JULIA)
 	{
-		n = julia_max_iter;
-		if (AVX)
-			juliaMatrixAVX(matrix, matrix_width, matrix_height);
-		else
-			juliaMatrix(matrix, matrix_width, matrix_height);
+		julia_zoom = v.zoom;
+		julia_x_offset = v.x_offset;
+		julia_y_offset = v.y_offset;
+		julia_max_iter = v.max_iter;
 	}
-	else if (fractal_mode == FractalSets::BSHIP)
+	else
 	{
-		n = bship_max_iter;
-		if (AVX)
-			bshipMatrixAVX(matrix, matrix_width, matrix_height);
-		else
-			bshipMatrix(matrix, matrix_width, matrix_height);
+		bship_zoom = v.zoom;
+		bship_x_offset = v.x_offset;
+		bship_y_offset = v.y_offset;
+		bship_max_iter = v.max_iter;
+	}
+}
+
+// The center of every view is (base + offset) / zoom in each axis
+void Fractal::viewBase(long double& base_x, long double& base_y) const
+{
+	base_x = 0.0L;
+	base_y = 0.0L;
+	if (fractal_mode == FractalSets::MANDELBROT)
+	{
+		base_x = (mandelbrot_x_min + mandelbrot_x_max) / 2;
+		base_y = (mandelbrot_y_min + mandelbrot_y_max) / 2;
 	}
+}
+
+/*
+* Zoom to zoom around the center of the view.
+*/
+void Fractal::setZoom(long double zoom)
+{
+	long double base_x, base_y;
+	viewBase(base_x, base_y);
+	View v = view();
+	v.x_offset = (base_x + v.x_offset) / v.zoom * zoom - base_x;
+	v.y_offset = (base_y + v.y_offset) / v.zoom * zoom - base_y;
+	v.zoom = zoom;
+	setView(v);
+}
+
+/*
+* Switch to the view at t of an exponential zoom from the view of start (t = 0) to the view of end (t = 1), both of this fractal set.
+* The zoom and the iteration limit change by the same factor for every equal step of t, and the center moves in proportion to the width
+* of the view, so the end view is the fixed point which everything on screen streams towards (or away from), as in a hand-made zoom.
+* Returns false, leaving the fractal unchanged, if start and end show different sets.
+*/
+bool Fractal::zoomBetween(const Fractal& start, const Fractal& end, long double t)
+{
+	if (start.fractal_mode != end.fractal_mode)
+		return false;
+
+	fractal_mode = start.fractal_mode;
+	View from = start.view();
+	View to = end.view();
+
+	long double base_x, base_y;
+	viewBase(base_x, base_y);
+
+	long double width = std::pow(from.zoom / to.zoom, t) / from.zoom;
+	// Share of the way from the end view back to the start view, 1 at t = 0 and 0 at t = 1
+	long double remaining = from.zoom == to.zoom ? 1 - t : (width - 1 / to.zoom) / (1 / from.zoom - 1 / to.zoom);
+	auto center = [](const View& v, long double base, long double offset) {
+		return (base + offset) / v.zoom;
+	};
+	long double x = center(to, base_x, to.x_offset) + (center(from, base_x, from.x_offset) - center(to, base_x, to.x_offset)) * remaining;
+	long double y = center(to, base_y, to.y_offset) + (center(from, base_y, from.y_offset) - center(to, base_y, to.y_offset)) * remaining;
+
+	View v;
+	v.zoom = 1 / width;
+	v.x_offset = x * v.zoom - base_x;
+	v.y_offset = y * v.zoom - base_y;
+	v.max_iter = static_cast<unsigned int>(std::llround(from.max_iter * std::pow(static_cast<long double>(to.max_iter) / from.max_iter, t)));
+	setView(v);
+	return true;
+}
+
+void Fractal::generate(int* matrix, int matrix_width, int matrix_height, ColorGenerator& cg, bool AVX, float* distance)
+{
+#ifdef PRINT_INFO
+	if (distance_estimation || distance)
+		std::cout << "Using AVX instructions with distance estimation..." << std::endl;
+	else if (AVX)
+		std::cout << "Using AVX instructions..." << std::endl;
+	else
+		std::cout << "Using standard instructions..." << std::endl;
+	std::cout << "Fractal generation: ";
+	START_TIMER
+#endif
+
+	int n = maxIterations();
+	iterationMatrix(matrix, distance, matrix_width, matrix_height, AVX);
 
 #ifdef PRINT_INFO
 	END_TIMER
@@ -1127,9 +1828,9 @@ void Fractal::generate(int* matrix, int matrix_width, int matrix_height, ColorGe
 #endif
 
 	if (AVX)
-		cg.generateAVX(matrix, matrix_width, matrix_height, n);
+		cg.generateAVX(matrix, matrix_width, matrix_height, n, distance);
 	else
-		cg.generate(matrix, matrix_width, matrix_height, n);
+		cg.generate(matrix, matrix_width, matrix_height, n, distance);
 
 #ifdef PRINT_INFO
 	END_TIMER
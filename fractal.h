@@ -11,6 +11,7 @@
 
 #include <cmath>
 #include <complex>
+#include <string>
 #include <thread>
 #include <vector>
 
@@ -67,40 +68,123 @@ constexpr int bship_max_iter_DEFAULT						= 200;
 constexpr float bship_max_iter_multiplier_DEFAULT			= 1.5;
 constexpr long double bship_radius_DEFAULT					= 2;
 
+/* Rendering */
+constexpr int tile_size_DEFAULT								= 64;	// Width and height of the square tiles a frame is split into for the thread pool
+constexpr int de_block_size_DEFAULT							= 8;	// Width and height of the blocks distance estimation tries to fill without iterating
+constexpr bool distance_estimation_DEFAULT					= false;
+constexpr long double smooth_radius_DEFAULT					= 256.0;	// Escape radius used for smooth escape values, which need |z| to be large
 
 /////////////////////////////////////////////////////////////
 
-struct thread_info;
-
 class Fractal
 {
+public:
+
+	enum class FractalSets { MANDELBROT = 0, JULIA, BSHIP, LAST} fractal_mode;
+
+	// Linear mapping from matrix pixels to the complex plane: point = origin + pixel * step
+	struct Viewport {
+		long double x_origin, y_origin;
+		long double x_step, y_step;
+	};
+
+	// A rectangle of pixels within a matrix
+	struct Tile {
+		int x, y;
+		int width, height;
+	};
+
+	// Everything besides the viewport which determines the iteration values of a frame
+	struct FormulaParams {
+		FractalSets mode;
+		unsigned int max_iter;
+		long double radius;
+		std::complex<long double> julia_complex_param;
+		bool distance_estimation;
+
+		bool operator==(const FormulaParams& other) const;
+		bool operator!=(const FormulaParams& other) const;
+	};
+
+	// Orbit of every pixel of a matrix, in the same layout as the matrix, so that pixels can be iterated further later on
+	struct OrbitState {
+		double* zx;
+		double* zy;
+		int* iter;				// Iterations done so far, or the escape iteration once done (0 for periodic orbits)
+		unsigned char* done;	// The pixel escaped or was found to be periodic
+	};
+
+private:
+
 	ThreadPool* t_pool;
 
 	void mandelbrotScale(long double& scaled_x, long double& scaled_y, int x, int y, int max_x, int max_y);
 	bool mandelbrotBulbCheck(long double x_0, long double y_0);
 	bool mandelbrotCardioidCheck(long double x_0, long double y_0);
 	bool mandelbrotPrune(long double x_0, long double y_0);
-	int mandelbrotSetAtPoint(int x, int y, int max_x, int max_y);
-	void mandelbrotThread(int index, int* matrix, int matrix_width, int matrix_height, int stride);
+	int mandelbrotSetAtPoint(long double x_0, long double y_0);
 
 	__m256d mandelbrotBulbCheckAVX(const __m256d& _x, const __m256d& _y);
 	__m256d mandelbrotCardioidCheckAVX(const __m256d& _x, const __m256d& _y);
 	bool mandelbrotPruneAVX(const __m256d& _x, const __m256d& _y);
-	void mandelbrotAVXThread(int index, int* matrix, int matrix_width, int matrix_height, int stride);
 
 	void juliaScale(long double& scaled_x, long double& scaled_y, int x, int y, int max_x, int max_y);
-	void juliaThread(int index, int* matrix, int matrix_width, int matrix_height, int stride);
-	int juliaSetAtPoint(int x, int y, int max_x, int max_y);
-	void juliaAVXThread(int index, int* matrix, int matrix_width, int matrix_height, int stride);
+	int juliaSetAtPoint(long double zx, long double zy);
 
 	void bshipScale(long double& scaled_x, long double& scaled_y, int x, int y, int max_x, int max_y);
-	void bshipThread(int index, int* matrix, int matrix_width, int matrix_height, int stride);
-	int bshipAtPoint(int x, int y, int max_x, int max_y);
-	void bshipAVXThread(int index, int* matrix, int matrix_width, int matrix_height, int stride);
+	int bshipAtPoint(long double scaled_x, long double scaled_y);
 
-public:
+	// 4 orbits being iterated together by the AVX kernels
+	struct OrbitAVX {
+		__m256d cx, cy;
+		__m256d zx, zy;
+		__m256d dzx, dzy;
+		__m256d mag_sq, dmag_sq;
+		__m256i iter;
+		__m256i active;
+	};
 
-	enum class FractalSets { MANDELBROT = 0, JULIA, BSHIP, LAST} fractal_mode;
+	template <FractalSets F>
+	bool startOrbitAVX(OrbitAVX& o, const __m256d& _px, const __m256d& _py);
+	template <FractalSets F, bool DE>
+	void orbitAVX(OrbitAVX& o, int steps, int max_iter, double radius_sq);
+	template <FractalSets F, bool DE>
+	void iterateAVX(const __m256d& _px, const __m256d& _py, __m256i& _iter, __m256d& _mag_sq, __m256d& _dmag_sq);
+	template <FractalSets F>
+	void tileAVX(int* matrix, int matrix_width, const Tile& tile, const Viewport& vp);
+	template <FractalSets F>
+	void tileDistanceAVX(int* matrix, float* distance, int matrix_width, const Tile& tile, const Viewport& vp);
+	template <FractalSets F>
+	void tileSmoothAVX(int* matrix, float* smooth, int matrix_width, const Tile& tile, const Viewport& vp);
+	template <FractalSets F>
+	void tileStateAVX(int* matrix, const OrbitState& state, int matrix_width, const Tile& tile, const Viewport& vp, int start, int end);
+	void tileStandard(int* matrix, int matrix_width, const Tile& tile, const Viewport& vp);
+
+	// The arrays of a point query, see queryPoints
+	struct PointQuery {
+		const double* x;
+		const double* y;
+		int* iterations;
+		double* final_zx;
+		double* final_zy;
+		float* smooth;
+	};
+	void finishPoint(const PointQuery& query, size_t i, long long iter, bool escaped, double zx, double zy, double mag_sq) const;
+	template <FractalSets F>
+	void pointsAVX(const PointQuery& query, size_t first, size_t end);
+	void pointsStandard(const PointQuery& query, size_t first, size_t end);
+
+	// The numbers of a location
+	struct View {
+		long double zoom;
+		long double x_offset, y_offset;
+		unsigned int max_iter;
+	};
+	View view() const;
+	void setView(const View& view);
+	void viewBase(long double& base_x, long double& base_y) const;
+
+public:
 
 	// Mandelbrot
 	long double mandelbrot_x_min;
@@ -137,27 +221,42 @@ public:
 	float bship_max_iter_multiplier;
 	long double bship_radius;
 
+	// Rendering
+	int tile_size;
+	int de_block_size;
+	bool distance_estimation;
+	long double smooth_radius;
+
 
 	Fractal();
 
 	void stationaryZoom(int direction, int max_x, int max_y);
 	void followingZoom(int direction, int x_pos, int y_pos, int max_x, int max_y);
-	void panUp();
-	void panDown();
-	void panLeft();
-	void panRight();
+	void panUp(int max_x, int max_y);
+	void panDown(int max_x, int max_y);
+	void panLeft(int max_x, int max_y);
+	void panRight(int max_x, int max_y);
 	void increaseIterations();
 	void decreaseIterations();
 	void reset();
 
-	void mandelbrotMatrix(int* matrix, int matrix_width, int matrix_height);
-	void mandelbrotMatrixAVX(int* matrix, int matrix_width, int matrix_height);
-	void juliaMatrix(int* matrix, int matrix_width, int matrix_height);
-	void juliaMatrixAVX(int* matrix, int matrix_width, int matrix_height);
-	void bshipMatrix(int* matrix, int matrix_width, int matrix_height);
-	void bshipMatrixAVX(int* matrix, int matrix_width, int matrix_height);
+	Viewport getViewport(int max_x, int max_y) const;
+	FormulaParams getFormulaParams() const;
+	void setFormulaParams(const FormulaParams& params);
+	int maxIterations() const;
+	void setMaxIterations(unsigned int max_iter);
+	double escapeRadiusSq() const;
+	void computeTile(int* matrix, float* distance, int matrix_width, const Tile& tile, const Viewport& vp, bool AVX, float* smooth = nullptr);
+	void computeTileState(int* matrix, const OrbitState& state, int matrix_width, const Tile& tile, const Viewport& vp, int start, int end);
+	void iterationMatrix(int* matrix, float* distance, int matrix_width, int matrix_height, bool AVX);
+	void queryPoints(const double* x, const double* y, size_t count, int* iterations, double* final_zx = nullptr, double* final_zy = nullptr,
+					 float* smooth = nullptr, bool AVX = true);
 
 	void selectNextFractal();
 	void selectFractal(int fractal);
-	void generate(int* matrix, int matrix_width, int matrix_height, ColorGenerator& cg, bool AVX);
+	std::string location() const;
+	bool setLocation(const std::string& location);
+	void setZoom(long double zoom);
+	bool zoomBetween(const Fractal& start, const Fractal& end, long double t);
+	void generate(int* matrix, int matrix_width, int matrix_height, ColorGenerator& cg, bool AVX, float* distance = nullptr);
 };
\ No newline at end of file
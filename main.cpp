@@ -14,7 +14,9 @@
 * 
 * Color schemes:
 *   Simple(fast, but noisy with more detail)
-*   Histogram(slow, scales with detail better)
+*   Histogram(evenly spread colors, scales with detail better)
+*   Distance(outlines the set using the distance estimate)
+*   Smooth(simple palette without the banding, from continuous escape values)
 * 
 * CONTROLS:
 *   W, A, S, D - Pan up, left, down, and right
@@ -38,10 +40,20 @@
 
 #include <immintrin.h> // AVX instruction set
 
+#include "batch.h"
 #include "color.h"
 #include "fractal.h"
-
+#include "render_cluster.h"
+#include "render_thread.h"
+#include "renderer.h"
+#include "tile_server.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
 #include <iostream>
+#include <string>
+#include <vector>
 #include <stdio.h>
 #include <stdlib.h>
 
@@ -56,15 +68,33 @@ GLuint gl_textureId;
 GLuint gl_pbo;
 GLubyte* gl_textureBufData;
 
+// The texture is scrolled toroidally: screen pixel (x, y) lives at texel ((x + gl_texture_x) % WINDOW_WIDTH, (y + gl_texture_y) % WINDOW_HEIGHT).
+// A pan then only moves this origin and uploads the strips which scrolled into view.
+int gl_texture_x = 0;
+int gl_texture_y = 0;
+
 ////////////////////////////////////////////////////////////
 /// Fratal resources
 ////////////////////////////////////////////////////////////
 
 Fractal fractal;
 ColorGenerator cg;
+RenderThread render_thread;
 
 bool update_fractal = false; // Keeps track of when the fractal has changed, so that we dont render the same fractal multiple times
+bool update_colors = false;  // Only the colors changed, so the iteration values of the last frame are colored again
+bool resume_iterations = true;
+bool progressive = true;     // Show a new frame in passes of increasing resolution
+bool solid_guessing = false;
+bool speculate = true;       // Render the likely next views (zooms, pans) while idle, so they show up right away
+bool cache_tiles = true;     // Keep computed tiles around, so views rendered before are copied rather than computed again
 bool use_AVX = true;
+bool cycle_palette = false;
+float cycle_speed = 1.0f;    // Radians per second the palette phase advances by while cycling
+float frame_budget_ms = 33.0f; // Time spent iterating per frame before the frame is shown, deep areas are finished over the following frames
+int focus_x = -1, focus_y = -1; // Where the user is looking for the next frame, which is rendered outwards from there. -1 for the centre
+const char* tile_store_path = "fractal_tiles.store"; // Tiles computed in earlier sessions (or pre-warmed with --prewarm) are read from it
+const char* server_store_path = "fractal_server.store"; // Tiles served with --serve, kept apart as only one process may write to a store
 
 
 ////////////////////////////////////////////////////////////
@@ -82,19 +112,21 @@ void scroll_callback(GLFWwindow* window, double xoffset, double yoffset)
     glfwGetCursorPos(window, &cursor_x_pos_from_top_left, &cursor_y_pos_from_top_left);
 
     fractal.followingZoom((int)yoffset, (int)cursor_x_pos_from_top_left, (int)cursor_y_pos_from_top_left, WINDOW_WIDTH, WINDOW_HEIGHT);
+    focus_x = (int)cursor_x_pos_from_top_left;
+    focus_y = (int)cursor_y_pos_from_top_left;
 }
 
 void key_callback(GLFWwindow* window, int key, int scancode, int action, int mods)
 {
     // Panning
     if (key == GLFW_KEY_W && action == GLFW_PRESS)
-        fractal.panUp();
+        fractal.panUp(WINDOW_WIDTH, WINDOW_HEIGHT);
     else if (key == GLFW_KEY_A && action == GLFW_PRESS)
-        fractal.panLeft();
+        fractal.panLeft(WINDOW_WIDTH, WINDOW_HEIGHT);
     else if (key == GLFW_KEY_S && action == GLFW_PRESS)
-        fractal.panDown();
+        fractal.panDown(WINDOW_WIDTH, WINDOW_HEIGHT);
     else if (key == GLFW_KEY_D && action == GLFW_PRESS)
-        fractal.panRight();
+        fractal.panRight(WINDOW_WIDTH, WINDOW_HEIGHT);
 
     // Zooming
     else if (key == GLFW_KEY_E && action == GLFW_PRESS)
@@ -126,6 +158,13 @@ void key_callback(GLFWwindow* window, int key, int scancode, int action, int mod
     else if (key == GLFW_KEY_MINUS && action == GLFW_PRESS)
         fractal.decreaseIterations();
 
+    // Print the current view, as a line for the locations file of --prewarm
+    else if (key == GLFW_KEY_L && action == GLFW_PRESS)
+    {
+        std::cout << fractal.location() << std::endl;
+        return;
+    }
+
     // The callback will be called even if a key we dont care about was pressed. In that case just return without changing the update flag.
     else
         return;
@@ -152,8 +191,8 @@ void initGL()
     glBindTexture(GL_TEXTURE_2D, gl_textureId);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
     glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, WINDOW_WIDTH, WINDOW_HEIGHT, 0, GL_RGBA, GL_UNSIGNED_BYTE, (GLvoid*)gl_textureBufData);
     glBindTexture(GL_TEXTURE_2D, 0);
 
@@ -178,30 +217,123 @@ void initGUI(GLFWwindow* window)
 }
 
 /*
-* Generate a new fractal if needed, then render the fractal as a textured fullscreen quad in OpenGL.
+* Upload a rectangle of the PBO (laid out like the screen) to where it lives in the scrolled texture, splitting it where it wraps around
+* the texture's edges. Expects the PBO and texture to be bound.
+*/
+void uploadRect(const Fractal::Tile& rect)
+{
+    int tex_x = (rect.x + gl_texture_x) % WINDOW_WIDTH;
+    int tex_y = (rect.y + gl_texture_y) % WINDOW_HEIGHT;
+    int first_width = std::min(rect.width, (int)WINDOW_WIDTH - tex_x);
+    int first_height = std::min(rect.height, (int)WINDOW_HEIGHT - tex_y);
+
+    const Fractal::Tile pieces[4] = {
+        { 0,           0,            first_width,              first_height },
+        { first_width, 0,            rect.width - first_width, first_height },
+        { 0,           first_height, first_width,              rect.height - first_height },
+        { first_width, first_height, rect.width - first_width, rect.height - first_height },
+    };
+
+    for (const Fractal::Tile& piece : pieces)
+    {
+        if (piece.width <= 0 || piece.height <= 0)
+            continue;
+
+        size_t offset = ((size_t)(rect.y + piece.y) * WINDOW_WIDTH + rect.x + piece.x) * 4;
+        glTexSubImage2D(GL_TEXTURE_2D, 0, (tex_x + piece.x) % WINDOW_WIDTH, (tex_y + piece.y) % WINDOW_HEIGHT, piece.width, piece.height,
+                        GL_RGBA, GL_UNSIGNED_BYTE, (GLvoid*)offset);
+    }
+}
+
+/*
+* Copy count ints to dst with non-temporal stores, which write around the cache. The mapped PBO is usually write-combined memory which is
+* never read back, so this is the fastest way to fill it, and it does not evict the frame from the cache either. Needs an _mm_sfence
+* before the PBO is unmapped.
+*/
+void streamCopy(int* dst, const int* src, size_t count)
+{
+    size_t i = 0;
+
+    // Scalar stores until dst is 32-byte aligned, as _mm256_stream_si256 requires
+    for (; i < count && ((uintptr_t)(dst + i) & 31) != 0; ++i)
+        dst[i] = src[i];
+    for (; i + 8 <= count; i += 8)
+        _mm256_stream_si256((__m256i*)(dst + i), _mm256_loadu_si256((const __m256i*)(src + i)));
+    for (; i < count; ++i)
+        dst[i] = src[i];
+}
+
+/*
+* Stream a rectangle of a completed frame into the mapped PBO, which has the same layout.
+*/
+void streamRect(int* pbo, const int* colors, const Fractal::Tile& rect)
+{
+    for (int y = rect.y; y < rect.y + rect.height; ++y)
+    {
+        size_t i = (size_t)y * WINDOW_WIDTH + rect.x;
+        streamCopy(pbo + i, colors + i, rect.width);
+    }
+}
+
+/*
+* Hand the render thread the current parameters if they changed, then present the last frame it completed (if there is a new one) and
+* render it as a textured fullscreen quad in OpenGL. Only the parts of the frame which changed are uploaded to the texture.
+* Rendering never blocks this thread, so the window and menu stay responsive however long a frame takes.
 */
 void renderFractal()
 {
-    if (update_fractal)
+    if (update_fractal || update_colors)
     {
+        RenderThread::Settings settings{ (int)WINDOW_WIDTH, (int)WINDOW_HEIGHT, use_AVX, resume_iterations, frame_budget_ms, progressive, solid_guessing, focus_x, focus_y, speculate, cache_tiles };
+        render_thread.submit(fractal, cg, settings, !update_fractal);
         update_fractal = false;
-        
-        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, gl_pbo);
-        glBufferData(GL_PIXEL_UNPACK_BUFFER, 4 * WINDOW_HEIGHT * WINDOW_WIDTH, 0, GL_STREAM_DRAW);
+        update_colors = false;
 
-        int* ptr = (int*)glMapBuffer(GL_PIXEL_UNPACK_BUFFER, GL_WRITE_ONLY);
+        // Only a scroll zoom looks at the cursor, everything else (keys, the menu) at the centre
+        focus_x = -1;
+        focus_y = -1;
+    }
+
+    RenderThread::Output output;
+    if (render_thread.acquire(output))
+    {
+        const Renderer::Frame& frame = output.frame;
+
+        // The PBO is allocated once in initGL. Invalidating it on map lets the driver hand out fresh storage while the texture
+        // upload of the last frame may still read the old one, without a new glBufferData (and allocation) every frame
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, gl_pbo);
+        int* ptr = (int*)glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, 4 * (size_t)WINDOW_HEIGHT * WINDOW_WIDTH,
+                                          GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
         if (ptr)
         {
-            fractal.generate(ptr, WINDOW_WIDTH, WINDOW_HEIGHT, cg, use_AVX);
-
+            if (frame.full)
+                streamCopy(ptr, output.colors, (size_t)WINDOW_HEIGHT * WINDOW_WIDTH);
+            else
+                for (int i = 0; i < frame.dirty_count; ++i)
+                    streamRect(ptr, output.colors, frame.dirty[i]);
+            // Make the streamed stores visible before the buffer is handed to OpenGL
+            _mm_sfence();
             glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
-        }
-
 
-        glBindTexture(GL_TEXTURE_2D, gl_textureId);
-        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, gl_pbo);
-        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, WINDOW_WIDTH, WINDOW_HEIGHT, GL_RGBA, GL_UNSIGNED_BYTE, 0);
+            glBindTexture(GL_TEXTURE_2D, gl_textureId);
+            glPixelStorei(GL_UNPACK_ROW_LENGTH, WINDOW_WIDTH);
+            if (frame.full)
+            {
+                gl_texture_x = 0;
+                gl_texture_y = 0;
+                glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, WINDOW_WIDTH, WINDOW_HEIGHT, GL_RGBA, GL_UNSIGNED_BYTE, 0);
+            }
+            else
+            {
+                gl_texture_x = ((gl_texture_x + frame.shift_x) % (int)WINDOW_WIDTH + WINDOW_WIDTH) % WINDOW_WIDTH;
+                gl_texture_y = ((gl_texture_y + frame.shift_y) % (int)WINDOW_HEIGHT + WINDOW_HEIGHT) % WINDOW_HEIGHT;
+                for (int i = 0; i < frame.dirty_count; ++i)
+                    uploadRect(frame.dirty[i]);
+            }
+            glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+        }
         glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        render_thread.release();
     }
     
 
@@ -210,10 +342,12 @@ void renderFractal()
     // Draw fullscreen quad with texture on it
     glBindTexture(GL_TEXTURE_2D, gl_textureId);
     glBegin(GL_QUADS);
-    glTexCoord2f(0.0f, 0.0f); glVertex2f(-1.0f, -1.0f);
-    glTexCoord2f(1.0f, 0.0f); glVertex2f(1.0f, -1.0f);
-    glTexCoord2f(1.0f, 1.0f); glVertex2f(1.0f, 1.0f);
-    glTexCoord2f(0.0f, 1.0f); glVertex2f(-1.0f, 1.0f);
+    float u = (float)gl_texture_x / WINDOW_WIDTH;
+    float v = (float)gl_texture_y / WINDOW_HEIGHT;
+    glTexCoord2f(u, v);               glVertex2f(-1.0f, -1.0f);
+    glTexCoord2f(u + 1.0f, v);        glVertex2f(1.0f, -1.0f);
+    glTexCoord2f(u + 1.0f, v + 1.0f); glVertex2f(1.0f, 1.0f);
+    glTexCoord2f(u, v + 1.0f);        glVertex2f(-1.0f, 1.0f);
     glEnd();
 
     glBindTexture(GL_TEXTURE_2D, 0);
@@ -235,6 +369,39 @@ void renderGUI()
         update_fractal = true;
     }
 
+    // Distance estimation checkbox
+    if (ImGui::Checkbox("Distance estimation", &fractal.distance_estimation))
+    {
+        update_fractal = true;
+    }
+
+    // Keeping the orbits of the pixels lets more iterations continue where the last frame stopped
+    if (ImGui::Checkbox("Resume iterations", &resume_iterations))
+    {
+        update_fractal = true;
+    }
+    if (resume_iterations)
+        ImGui::SliderFloat("Frame budget", &frame_budget_ms, 0.0f, 200.0f, "%.0f ms", ImGuiSliderFlags_None);
+
+    // Coarse to fine passes, optionally filling in the pixels between agreeing coarser ones
+    if (ImGui::Checkbox("Progressive", &progressive))
+    {
+        update_fractal = true;
+    }
+    if (progressive)
+    {
+        if (ImGui::Checkbox("Solid guessing", &solid_guessing))
+            update_fractal = true;
+    }
+    if (ImGui::Checkbox("Speculate", &speculate))
+    {
+        update_fractal = true;
+    }
+    if (ImGui::Checkbox("Tile cache", &cache_tiles))
+    {
+        update_fractal = true;
+    }
+
     // Fractal selection combo box
     int fractal_combo_current = static_cast<int>(fractal.fractal_mode);
     if (ImGui::Combo("Fractal", &fractal_combo_current, "Mandelbrot\0Julia\0Burning Ship\0\0"))
@@ -295,19 +462,24 @@ void renderGUI()
     ImGui::Text("Color options:");
 
     int color_combo_current = static_cast<int>(cg.color_mode);
-    if (ImGui::Combo("Color generator", &color_combo_current, "Simple\0Histogram\0\0"))
+    if (ImGui::Combo("Color generator", &color_combo_current, "Simple\0Histogram\0Distance\0Smooth\0\0"))
     {
         cg.selectMode(color_combo_current);
         update_fractal = true;
     }
-    if (static_cast<ColorGenerator::Generators>(color_combo_current) == ColorGenerator::Generators::SIMPLE)
+    if (static_cast<ColorGenerator::Generators>(color_combo_current) == ColorGenerator::Generators::SIMPLE ||
+        static_cast<ColorGenerator::Generators>(color_combo_current) == ColorGenerator::Generators::SMOOTH)
     {
         ImGui::Text("RGB modifiers:");
-        if (ImGui::SliderFloat("Red", &cg.simple_red_modifier, -3.141f, 3.141f, "%.3f", ImGuiSliderFlags_None)) update_fractal = true;
-        if (ImGui::SliderFloat("Green", &cg.simple_green_modifier, -3.141f, 3.141f, "%.3f", ImGuiSliderFlags_None)) update_fractal = true;
-        if (ImGui::SliderFloat("Blue", &cg.simple_blue_modifier, -3.141f, 3.141f, "%.3f", ImGuiSliderFlags_None)) update_fractal = true;
+        if (ImGui::SliderFloat("Red", &cg.simple_red_modifier, -3.141f, 3.141f, "%.3f", ImGuiSliderFlags_None)) update_colors = true;
+        if (ImGui::SliderFloat("Green", &cg.simple_green_modifier, -3.141f, 3.141f, "%.3f", ImGuiSliderFlags_None)) update_colors = true;
+        if (ImGui::SliderFloat("Blue", &cg.simple_blue_modifier, -3.141f, 3.141f, "%.3f", ImGuiSliderFlags_None)) update_colors = true;
+        ImGui::Checkbox("Cycle palette", &cycle_palette);
+        if (cycle_palette)
+            ImGui::SliderFloat("Cycle speed", &cycle_speed, -10.0f, 10.0f, "%.2f rad/s", ImGuiSliderFlags_None);
     }
-    else if (static_cast<ColorGenerator::Generators>(color_combo_current) == ColorGenerator::Generators::HISTOGRAM)
+    else if (static_cast<ColorGenerator::Generators>(color_combo_current) == ColorGenerator::Generators::HISTOGRAM ||
+             static_cast<ColorGenerator::Generators>(color_combo_current) == ColorGenerator::Generators::DISTANCE)
     {
         ImVec4 strong_color = ImVec4((float)cg.strong.r / 255.0f, (float)cg.strong.g / 255.0f, (float)cg.strong.b / 255.0f, 0.0f);
         ImVec4 weak_color = ImVec4((float)cg.weak.r / 255.0f, (float)cg.weak.g / 255.0f, (float)cg.weak.b / 255.0f, 1.0f);
@@ -317,14 +489,18 @@ void renderGUI()
             cg.strong.r = strong_color.x * 255.0f;
             cg.strong.g = strong_color.y * 255.0f;
             cg.strong.b = strong_color.z * 255.0f;
-            update_fractal = true;
+            update_colors = true;
         }
         if (ImGui::ColorEdit3("Weak", (float*)&weak_color, ImGuiColorEditFlags_NoAlpha | ImGuiColorEditFlags_NoDragDrop | ImGuiColorEditFlags_NoOptions))
         {
             cg.weak.r = weak_color.x * 255.0f;
             cg.weak.g = weak_color.y * 255.0f;
             cg.weak.b = weak_color.z * 255.0f;
-            update_fractal = true;
+            update_colors = true;
+        }
+        if (static_cast<ColorGenerator::Generators>(color_combo_current) == ColorGenerator::Generators::DISTANCE)
+        {
+            if (ImGui::SliderFloat("Falloff", &cg.distance_falloff, 0.5f, 64.0f, "%.1f px", ImGuiSliderFlags_Logarithmic)) update_colors = true;
         }
     }
 
@@ -333,8 +509,128 @@ void renderGUI()
     ImGui_ImplOpenGL2_RenderDrawData(ImGui::GetDrawData());
 }
 
-int main(void)
+/*
+* Batch modes, without arguments the window is opened:
+*   fractal --prewarm <locations file> [--store <path>] [--size <width>x<height>] [--levels <n>]
+*   fractal --export <image file> [--location "<location>"] [--size <width>x<height>] [--colors simple|smooth|distance]
+*           [--workers <address> [--spawn <n>]]
+*   fractal --animate <video file, or - for the standard output> [--from "<location>"] [--to "<location>"] [--frames <n>] [--fps <n>]
+*           [--size <width>x<height>] [--colors simple|smooth|distance] [--workers <address> [--spawn <n>]]
+*   fractal --sweep <contact sheet file> [--location "<location>"] [--axis re|im|iter|zoom=<first>:<last>:<count>]... [--list <file>]
+*           [--size <thumbnail width>x<thumbnail height>] [--colors simple|smooth|distance]
+*   fractal --serve <address> [--store <path>|none] [--cache-mb <n>] [--colors simple|smooth|distance]
+*   fractal --load-test <address> [--fractal mandelbrot|julia|bship] [--clients <n>] [--levels <n>] [--rounds <n>]
+*   fractal --worker <address> [--exit-after <n>]
+* With --workers an export or animation listens on the address for worker processes and has them iterate its tiles, after starting
+* --spawn of them on this machine.
+*/
+int runBatch(int argc, char** argv)
+{
+    std::string mode = argv[1];
+    std::string target = argv[2];
+    std::string store = mode == "--serve" ? server_store_path : tile_store_path;
+    std::string location, from, to, list, fractal_name = "mandelbrot";
+    std::vector<SweepAxis> axes;
+    SweepAxis axis;
+    int width = mode == "--sweep" ? 128 : (int)WINDOW_WIDTH, height = mode == "--sweep" ? 128 : (int)WINDOW_HEIGHT;
+    int levels = 0;
+    int frames = 300, fps = 30;
+    int cache_mb = 512, clients = 8, rounds = 2;
+    std::string workers;
+    int spawn = 0, exit_after = 0;
+    if (mode == "--load-test")
+        levels = 12;
+    ColorGenerator::Generators colors = ColorGenerator::Generators::SMOOTH;
+    for (int i = 3; i + 1 < argc; i += 2)
+    {
+        std::string option = argv[i];
+        std::string value = argv[i + 1];
+        if (option == "--store" && (mode == "--prewarm" || mode == "--serve"))
+            store = value == "none" && mode == "--serve" ? "" : value;
+        else if (option == "--size" && sscanf(value.c_str(), "%dx%d", &width, &height) == 2 && width > 0 && height > 0)
+            continue;
+        else if (option == "--levels" && mode == "--prewarm")
+            levels = std::max(0, atoi(value.c_str()));
+        else if (option == "--levels" && mode == "--load-test" && atoi(value.c_str()) > 0)
+            levels = std::min(atoi(value.c_str()), TileServer::max_zoom + 1);
+        else if (option == "--location" && (mode == "--export" || mode == "--sweep"))
+            location = value;
+        else if (option == "--from" && mode == "--animate")
+            from = value;
+        else if (option == "--to" && mode == "--animate")
+            to = value;
+        else if (option == "--frames" && mode == "--animate" && atoi(value.c_str()) > 0)
+            frames = atoi(value.c_str());
+        else if (option == "--fps" && mode == "--animate" && atoi(value.c_str()) > 0)
+            fps = atoi(value.c_str());
+        else if (option == "--axis" && mode == "--sweep" && axes.size() < 2 && parseSweepAxis(value, axis))
+            axes.push_back(axis);
+        else if (option == "--list" && mode == "--sweep")
+            list = value;
+        else if (option == "--cache-mb" && mode == "--serve" && atoi(value.c_str()) > 0)
+            cache_mb = atoi(value.c_str());
+        else if (option == "--fractal" && mode == "--load-test")
+            fractal_name = value;
+        else if (option == "--clients" && mode == "--load-test" && atoi(value.c_str()) > 0)
+            clients = atoi(value.c_str());
+        else if (option == "--rounds" && mode == "--load-test" && atoi(value.c_str()) > 0)
+            rounds = atoi(value.c_str());
+        else if (option == "--workers" && (mode == "--export" || mode == "--animate"))
+            workers = value;
+        else if (option == "--spawn" && (mode == "--export" || mode == "--animate") && atoi(value.c_str()) >= 0)
+            spawn = atoi(value.c_str());
+        else if (option == "--exit-after" && mode == "--worker" && atoi(value.c_str()) > 0)
+            exit_after = atoi(value.c_str());
+        else if (option == "--colors" && mode != "--prewarm" && mode != "--load-test" && mode != "--worker" && (value == "simple" || value == "smooth" || value == "distance"))
+            colors = value == "simple" ? ColorGenerator::Generators::SIMPLE : value == "smooth" ? ColorGenerator::Generators::SMOOTH : ColorGenerator::Generators::DISTANCE;
+        else
+        {
+            std::cerr << "Unknown option " << option << " " << value << std::endl;
+            return 1;
+        }
+    }
+
+    if (mode == "--worker")
+        return runWorker(target, exit_after);
+
+    RenderCluster cluster;
+    if (spawn > 0 && workers.empty())
+    {
+        std::cerr << "--spawn needs --workers <address> to listen on" << std::endl;
+        return 1;
+    }
+    if (!workers.empty() && !cluster.listen(workers))
+    {
+        std::cerr << "Cannot listen on " << workers << std::endl;
+        return 1;
+    }
+    if (spawn > 0 && !cluster.spawnWorkers(argv[0], spawn))
+    {
+        std::cerr << "Cannot start workers" << std::endl;
+        return 1;
+    }
+    RenderCluster* remote = workers.empty() ? nullptr : &cluster;
+
+    if (mode == "--export")
+        return exportImage(target, location, width, height, colors, remote);
+    if (mode == "--animate")
+        return animateZoom(target, from, to, frames, width, height, colors, fps, remote);
+    if (mode == "--sweep")
+        return sweepParameters(target, location, axes, list, width, height, colors);
+    if (mode == "--serve")
+        return serveTiles(target, store, colors, static_cast<size_t>(cache_mb) * 1024 * 1024);
+    if (mode == "--load-test")
+        return loadTest(target, fractal_name, clients, levels, rounds);
+    return prewarmStore(store, target, width, height, levels);
+}
+
+int main(int argc, char** argv)
 {
+    std::string batch_mode = argc >= 3 ? argv[1] : "";
+    if (batch_mode == "--prewarm" || batch_mode == "--export" || batch_mode == "--animate" || batch_mode == "--sweep" ||
+        batch_mode == "--serve" || batch_mode == "--load-test" || batch_mode == "--worker")
+        return runBatch(argc, argv);
+
     GLFWwindow* window;
 
     /* Initialize the library */
@@ -359,7 +655,18 @@ int main(void)
     glfwSetScrollCallback(window, scroll_callback);
     glfwSetKeyCallback(window, key_callback);
 
+    // Interactive frames estimate the histogram from every 4th pixel, which is off by at most one shade
+    cg.histogram_sample_stride = 4;
+
+    // Tiles of earlier sessions back the tile cache. Without the store every tile is computed, as before
+    if (!render_thread.openStore(tile_store_path))
+        std::cerr << "Cannot open tile store " << tile_store_path << ", tiles are not kept between sessions" << std::endl;
+
+    // Frames are rendered on their own thread, which wakes up the event loop whenever one is completed
+    render_thread.start([]() {glfwPostEmptyEvent(); });
+
     update_fractal = true;
+    double last_time = glfwGetTime();
 
     /* Loop until the user closes the window */
     while (!glfwWindowShouldClose(window))
@@ -367,6 +674,20 @@ int main(void)
         // Poll for input events
         glfwPollEvents();
 
+        // The render thread speculates on a scroll zoom at the cursor
+        double cursor_x, cursor_y;
+        glfwGetCursorPos(window, &cursor_x, &cursor_y);
+        render_thread.hover((int)cursor_x, (int)cursor_y);
+
+        // Palette cycling only recolors the last frame
+        double now = glfwGetTime();
+        if (cycle_palette && (cg.color_mode == ColorGenerator::Generators::SIMPLE || cg.color_mode == ColorGenerator::Generators::SMOOTH))
+        {
+            cg.palette_phase = static_cast<float>(std::fmod(cg.palette_phase + cycle_speed * (now - last_time), 2.0 * 3.14159265358979));
+            update_colors = true;
+        }
+        last_time = now;
+
         // Render the fractal and GUI
         renderFractal();
         renderGUI();
@@ -374,10 +695,13 @@ int main(void)
         // Swap GL buffers
         glfwSwapBuffers(window);
 
-        // Go to sleep and wait for some input
-        glfwWaitEvents();
+        // Go to sleep and wait for some input or a completed frame
+        if (!update_fractal && !update_colors && !cycle_palette)
+            glfwWaitEvents();
     }
 
+    render_thread.stop();
+
     ImGui_ImplOpenGL2_Shutdown();
     ImGui_ImplGlfw_Shutdown();
     ImGui::DestroyContext();
@@ -0,0 +1,238 @@
+#include "mapped_file.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <string>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+MappedFile::MappedFile()
+{
+	data = nullptr;
+	length = 0;
+	writable = false;
+#ifdef _WIN32
+	file = INVALID_HANDLE_VALUE;
+	mapping = nullptr;
+#else
+	file = -1;
+#endif
+}
+
+MappedFile::~MappedFile()
+{
+	close();
+}
+
+/*
+* Open (or with write, create) the file at path and map all of it. A writable file which is empty is grown to minimum_size bytes. With
+* exclusive the file is locked until it is closed, so no other process can open it exclusive meanwhile (it can still open it otherwise).
+* Returns false if the file cannot be opened, locked or mapped, or is empty.
+*/
+bool MappedFile::open(const std::string& path, bool write, size_t minimum_size, bool exclusive)
+{
+	close();
+	writable = write;
+
+#ifdef _WIN32
+	// Other processes may write to the file too, unless they are kept out by the lock
+	file = CreateFileA(path.c_str(), write ? GENERIC_READ | GENERIC_WRITE : GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr,
+					   write ? OPEN_ALWAYS : OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+		return false;
+	if (exclusive)
+	{
+		// Locked bytes cannot be read by other processes, so the lock is on a byte far past the end of any file
+		OVERLAPPED lock_offset = {};
+		lock_offset.OffsetHigh = 0x7FFFFFFF;
+		if (!LockFileEx(file, LOCKFILE_EXCLUSIVE_LOCK | LOCKFILE_FAIL_IMMEDIATELY, 0, 1, 0, &lock_offset))
+		{
+			close();
+			return false;
+		}
+	}
+	LARGE_INTEGER file_size;
+	GetFileSizeEx(file, &file_size);
+	size_t size = static_cast<size_t>(file_size.QuadPart);
+#else
+	// Not inherited by worker processes, which would hold on to the lock
+	file = ::open(path.c_str(), (write ? O_RDWR | O_CREAT : O_RDONLY) | O_CLOEXEC, 0644);
+	if (file < 0)
+		return false;
+	if (exclusive && flock(file, LOCK_EX | LOCK_NB) != 0)
+	{
+		close();
+		return false;
+	}
+	struct stat status;
+	fstat(file, &status);
+	size_t size = static_cast<size_t>(status.st_size);
+#endif
+
+	if (write && size == 0)
+		size = minimum_size;
+	if (!map(size))
+	{
+		close();
+		return false;
+	}
+	return true;
+}
+
+bool MappedFile::map(size_t size)
+{
+	if (size == 0)
+		return false;
+
+#ifdef _WIN32
+	// Mapping a writable file larger than it is grows it
+	ULARGE_INTEGER mapping_size;
+	mapping_size.QuadPart = size;
+	mapping = CreateFileMappingA(file, nullptr, writable ? PAGE_READWRITE : PAGE_READONLY, mapping_size.HighPart, mapping_size.LowPart, nullptr);
+	if (!mapping)
+		return false;
+	data = static_cast<char*>(MapViewOfFile(mapping, writable ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, size));
+	if (!data)
+	{
+		CloseHandle(mapping);
+		mapping = nullptr;
+		return false;
+	}
+#else
+	struct stat status;
+	fstat(file, &status);
+	if (writable && static_cast<size_t>(status.st_size) < size && ftruncate(file, static_cast<off_t>(size)) != 0)
+		return false;
+	void* mapped = mmap(nullptr, size, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, file, 0);
+	if (mapped == MAP_FAILED)
+		return false;
+	data = static_cast<char*>(mapped);
+#endif
+
+	length = size;
+	return true;
+}
+
+void MappedFile::unmap()
+{
+	if (!data)
+		return;
+
+#ifdef _WIN32
+	UnmapViewOfFile(data);
+	CloseHandle(mapping);
+	mapping = nullptr;
+#else
+	munmap(data, length);
+#endif
+	data = nullptr;
+	length = 0;
+}
+
+/*
+* Grow (or shrink) a writable file to size bytes and map it again. Pointers into the old mapping are invalid afterwards.
+*/
+bool MappedFile::resize(size_t size)
+{
+	if (!writable)
+		return false;
+
+	unmap();
+#ifndef _WIN32
+	if (ftruncate(file, static_cast<off_t>(size)) != 0)
+		return false;
+#endif
+	return map(size);
+}
+
+// Granularity of the ranges passed to the system, a page on every x86 system
+constexpr size_t page_bytes = 4096;
+
+/*
+* Write the changed pages back to the file.
+*/
+void MappedFile::flush()
+{
+	flush(0, length);
+}
+
+/*
+* Write the changed pages of bytes bytes from offset back to the file.
+*/
+void MappedFile::flush(size_t offset, size_t bytes)
+{
+	if (!data || !writable || offset >= length)
+		return;
+
+	size_t start = offset / page_bytes * page_bytes;
+	size_t end = std::min(offset + bytes, length);
+#ifdef _WIN32
+	FlushViewOfFile(data + start, end - start);
+	FlushFileBuffers(file);
+#else
+	msync(data + start, end - start, MS_SYNC);
+#endif
+}
+
+/*
+* Drop the pages of bytes bytes from offset from memory, after writing them back if they changed. They are read from the file again
+* when touched, so writing a file much larger than memory keeps only the pages in use resident.
+*/
+void MappedFile::evict(size_t offset, size_t bytes)
+{
+	if (!data || offset >= length)
+		return;
+
+	flush(offset, bytes);
+	size_t start = offset / page_bytes * page_bytes;
+	size_t end = std::min(offset + bytes, length);
+#ifdef _WIN32
+	// Unlocking pages which are not locked removes them from the working set
+	VirtualUnlock(data + start, end - start);
+#else
+	madvise(data + start, end - start, MADV_DONTNEED);
+#endif
+}
+
+void MappedFile::close()
+{
+	unmap();
+#ifdef _WIN32
+	if (file != INVALID_HANDLE_VALUE)
+		CloseHandle(file);
+	file = INVALID_HANDLE_VALUE;
+#else
+	if (file >= 0)
+		::close(file);
+	file = -1;
+#endif
+}
+
+bool MappedFile::isOpen() const
+{
+	return data != nullptr;
+}
+
+bool MappedFile::isWritable() const
+{
+	return writable;
+}
+
+char* MappedFile::bytes() const
+{
+	return data;
+}
+
+size_t MappedFile::size() const
+{
+	return length;
+}
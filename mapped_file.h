@@ -0,0 +1,44 @@
+/*
+* Declares MappedFile, a file mapped into memory for reading and writing, on Windows and POSIX systems alike.
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+class MappedFile
+{
+	char* data;
+	size_t length;
+	bool writable;
+
+#ifdef _WIN32
+	void* file;
+	void* mapping;
+#else
+	int file;
+#endif
+
+	bool map(size_t size);
+	void unmap();
+
+public:
+	MappedFile();
+	~MappedFile();
+
+	bool open(const std::string& path, bool write, size_t minimum_size = 0, bool exclusive = false);
+	bool resize(size_t size);
+	void flush();
+	void flush(size_t offset, size_t bytes);
+	void evict(size_t offset, size_t bytes);
+	void close();
+
+	bool isOpen() const;
+	bool isWritable() const;
+	char* bytes() const;
+	size_t size() const;
+
+	MappedFile(MappedFile const&) = delete;
+	void operator=(MappedFile const&) = delete;
+};
@@ -0,0 +1,230 @@
+#include "png.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+////////////////////////////////////////////////////////////
+/// Checksums
+////////////////////////////////////////////////////////////
+
+static uint32_t crc32(const unsigned char* data, size_t bytes, uint32_t crc = 0)
+{
+	static const std::vector<uint32_t> table = [] {
+		std::vector<uint32_t> t(256);
+		for (uint32_t n = 0; n < 256; ++n)
+		{
+			uint32_t c = n;
+			for (int k = 0; k < 8; ++k)
+				c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+			t[n] = c;
+		}
+		return t;
+	}();
+
+	crc = ~crc;
+	for (size_t i = 0; i < bytes; ++i)
+		crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+	return ~crc;
+}
+
+static uint32_t adler32(const unsigned char* data, size_t bytes)
+{
+	uint32_t a = 1, b = 0;
+	while (bytes > 0)
+	{
+		// The sums cannot overflow within 5552 bytes
+		size_t n = std::min<size_t>(bytes, 5552);
+		for (size_t i = 0; i < n; ++i)
+		{
+			a += data[i];
+			b += a;
+		}
+		a %= 65521;
+		b %= 65521;
+		data += n;
+		bytes -= n;
+	}
+	return b << 16 | a;
+}
+
+////////////////////////////////////////////////////////////
+/// Deflate with fixed Huffman codes
+////////////////////////////////////////////////////////////
+
+// Writes bits least significant first, as deflate packs them
+struct BitWriter {
+	std::string& out;
+	uint64_t bits;
+	int count;
+
+	void put(uint32_t value, int length)
+	{
+		bits |= static_cast<uint64_t>(value) << count;
+		count += length;
+		while (count >= 8)
+		{
+			out.push_back(static_cast<char>(bits & 0xFF));
+			bits >>= 8;
+			count -= 8;
+		}
+	}
+
+	// Huffman codes go most significant bit first
+	void putCode(uint32_t code, int length)
+	{
+		uint32_t reversed = 0;
+		for (int i = 0; i < length; ++i)
+			reversed |= ((code >> i) & 1) << (length - 1 - i);
+		put(reversed, length);
+	}
+
+	void flush()
+	{
+		if (count > 0)
+			out.push_back(static_cast<char>(bits & 0xFF));
+		bits = 0;
+		count = 0;
+	}
+};
+
+static void putLiteral(BitWriter& writer, int symbol)
+{
+	if (symbol < 144)
+		writer.putCode(0x30 + symbol, 8);
+	else if (symbol < 256)
+		writer.putCode(0x190 + symbol - 144, 9);
+	else if (symbol < 280)
+		writer.putCode(symbol - 256, 7);
+	else
+		writer.putCode(0xC0 + symbol - 280, 8);
+}
+
+static void putMatch(BitWriter& writer, int length, int distance)
+{
+	static const int length_base[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+	static const int length_extra[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+	static const int distance_base[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073,
+										   4097, 6145, 8193, 12289, 16385, 24577 };
+	static const int distance_extra[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+
+	int l = 28;
+	while (length_base[l] > length)
+		--l;
+	putLiteral(writer, 257 + l);
+	writer.put(length - length_base[l], length_extra[l]);
+
+	int d = 29;
+	while (distance_base[d] > distance)
+		--d;
+	writer.putCode(d, 5);
+	writer.put(distance - distance_base[d], distance_extra[d]);
+}
+
+/*
+* Compress data as a single deflate block with the fixed Huffman codes. The only matches tried are the pixel to the left (3 bytes back)
+* and the pixel above (row_bytes back), greedily taking the longer one.
+*/
+static void deflate(const unsigned char* data, size_t bytes, size_t row_bytes, std::string& out)
+{
+	constexpr int max_match = 258;
+	constexpr size_t max_distance = 32768;
+	const size_t distances[2] = { 3, row_bytes };
+
+	BitWriter writer{ out, 0, 0 };
+	writer.put(1, 1);	// Last block
+	writer.put(1, 2);	// Fixed Huffman codes
+
+	size_t i = 0;
+	while (i < bytes)
+	{
+		int best_length = 0;
+		size_t best_distance = 0;
+		size_t limit = std::min<size_t>(max_match, bytes - i);
+		for (size_t distance : distances)
+		{
+			if (distance > i || distance > max_distance)
+				continue;
+			size_t length = 0;
+			while (length < limit && data[i + length] == data[i + length - distance])
+				++length;
+			if (static_cast<int>(length) > best_length)
+			{
+				best_length = static_cast<int>(length);
+				best_distance = distance;
+			}
+		}
+
+		if (best_length >= 3)
+		{
+			putMatch(writer, best_length, static_cast<int>(best_distance));
+			i += best_length;
+		}
+		else
+			putLiteral(writer, data[i++]);
+	}
+	putLiteral(writer, 256);	// End of block
+	writer.flush();
+}
+
+////////////////////////////////////////////////////////////
+/// PNG
+////////////////////////////////////////////////////////////
+
+static void putBigEndian(std::string& out, uint32_t value)
+{
+	out.push_back(static_cast<char>(value >> 24));
+	out.push_back(static_cast<char>(value >> 16));
+	out.push_back(static_cast<char>(value >> 8));
+	out.push_back(static_cast<char>(value));
+}
+
+static void putChunk(std::string& png, const char* type, const std::string& data)
+{
+	putBigEndian(png, static_cast<uint32_t>(data.size()));
+	size_t start = png.size();
+	png.append(type, 4);
+	png += data;
+	putBigEndian(png, crc32(reinterpret_cast<const unsigned char*>(png.data() + start), png.size() - start));
+}
+
+/*
+* Encode the width x height rectangle of colors (packed as r | g << 8 | b << 16) whose rows are stride colors apart as an 8-bit RGB PNG
+* image into png.
+*/
+void encodePng(const int* colors, int width, int height, size_t stride, std::string& png)
+{
+	// Every row starts with filter type 0, so the pixel above is always row_bytes back
+	size_t row_bytes = 1 + static_cast<size_t>(width) * 3;
+	std::vector<unsigned char> raw(row_bytes * height);
+	for (int y = 0; y < height; ++y)
+	{
+		unsigned char* out = &raw[y * row_bytes];
+		const int* in = colors + y * stride;
+		*out++ = 0;
+		for (int x = 0; x < width; ++x)
+		{
+			uint32_t color = static_cast<uint32_t>(in[x]);
+			*out++ = static_cast<unsigned char>(color);
+			*out++ = static_cast<unsigned char>(color >> 8);
+			*out++ = static_cast<unsigned char>(color >> 16);
+		}
+	}
+
+	std::string header;
+	putBigEndian(header, static_cast<uint32_t>(width));
+	putBigEndian(header, static_cast<uint32_t>(height));
+	header += std::string("\x08\x02\x00\x00\x00", 5);	// 8 bits per channel, RGB, deflate, standard filters, not interlaced
+
+	// A zlib stream: header, deflate data, and the Adler-32 of the raw data
+	std::string compressed("\x78\x01", 2);
+	deflate(raw.data(), raw.size(), row_bytes, compressed);
+	putBigEndian(compressed, adler32(raw.data(), raw.size()));
+
+	png.assign("\x89PNG\r\n\x1A\n", 8);
+	putChunk(png, "IHDR", header);
+	putChunk(png, "IDAT", compressed);
+	putChunk(png, "IEND", std::string());
+}
@@ -0,0 +1,12 @@
+/*
+* Declares a PNG encoder for rectangles of packed colors, which needs no compression library. Rows are compressed with fixed Huffman
+* codes and matches of the pixel to the left or the pixel above, which is all it takes for the flat areas and smooth gradients of
+* fractal images.
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+void encodePng(const int* colors, int width, int height, size_t stride, std::string& png);
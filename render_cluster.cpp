@@ -0,0 +1,683 @@
+#include "render_cluster.h"
+
+#include "thread_pool.h"
+#include "tile_cache.h"
+#include "tile_codec.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#include <process.h>
+#else
+#include <csignal>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+// A connection which does not introduce itself as a worker within this long is dropped
+constexpr int hello_timeout_ms = 10000;
+// A worker which returns nothing for this long while it has jobs is taken for dead, as a machine which went away may never close the
+// connection
+constexpr int result_timeout_ms = 120000;
+// A render gives up once it had no workers for this long, and a worker once it could not reach the coordinator for this long
+constexpr auto worker_wait = std::chrono::seconds(30);
+// Largest job width and height, and message, accepted
+constexpr int max_job_side = 4096;
+constexpr uint32_t max_message_bytes = 1u << 28;
+
+////////////////////////////////////////////////////////////
+/// Messages
+////////////////////////////////////////////////////////////
+
+// Every message is its type and the length of its payload, 32-bit little endian, followed by the payload. Integers in payloads are
+// 32-bit little endian as well
+enum MessageType : uint32_t {
+	HELLO = 1,		// Worker: hello_magic, then how many jobs it takes at a time
+	FORMULA,		// Coordinator: fractal set, iteration limit, escape radius, Julia constant, flags; applies to the jobs after it
+	JOB,			// Coordinator: job index, width, height, viewport
+	RESULT,			// Worker: job index, bytes of encoded iteration values, bytes of encoded extra values, both encodings
+};
+
+static const char hello_magic[8] = { 'F', 'R', 'A', 'C', 'W', 'R', 'K', '1' };
+
+// FORMULA flags
+constexpr uint32_t formula_distance_estimation = 1;
+constexpr uint32_t formula_distance = 2;
+constexpr uint32_t formula_smooth = 4;
+
+static void putWord(std::string& out, uint32_t value)
+{
+	for (int i = 0; i < 4; ++i)
+		out.push_back(static_cast<char>(value >> (8 * i)));
+}
+
+/*
+* Numbers go as the double nearest to them and the double nearest to what is left, so the extended precision of a viewport survives, and
+* either end may have no more than double precision.
+*/
+static void putNumber(std::string& out, long double value)
+{
+	double parts[2];
+	parts[0] = static_cast<double>(value);
+	parts[1] = static_cast<double>(value - parts[0]);
+	for (double part : parts)
+	{
+		uint64_t bits;
+		std::memcpy(&bits, &part, sizeof(bits));
+		putWord(out, static_cast<uint32_t>(bits));
+		putWord(out, static_cast<uint32_t>(bits >> 32));
+	}
+}
+
+// Reads the fields of a payload in order. Reading past the end clears ok
+struct MessageReader {
+	const std::string& data;
+	size_t at;
+	bool ok;
+
+	uint32_t word()
+	{
+		if (at + 4 > data.size())
+		{
+			ok = false;
+			return 0;
+		}
+		uint32_t value = 0;
+		for (int i = 0; i < 4; ++i)
+			value |= static_cast<uint32_t>(static_cast<unsigned char>(data[at + i])) << (8 * i);
+		at += 4;
+		return value;
+	}
+
+	long double number()
+	{
+		long double value = 0.0L;
+		for (int i = 0; i < 2; ++i)
+		{
+			uint64_t bits = word();
+			bits |= static_cast<uint64_t>(word()) << 32;
+			double part;
+			std::memcpy(&part, &bits, sizeof(part));
+			value += part;
+		}
+		return value;
+	}
+
+	const char* bytes(size_t count)
+	{
+		if (at + count > data.size())
+		{
+			ok = false;
+			return nullptr;
+		}
+		at += count;
+		return data.data() + at - count;
+	}
+};
+
+static void putMessage(std::string& out, uint32_t type, const std::string& payload)
+{
+	putWord(out, type);
+	putWord(out, static_cast<uint32_t>(payload.size()));
+	out += payload;
+}
+
+static bool sendMessage(StreamSocket& socket, uint32_t type, const std::string& payload)
+{
+	std::string message;
+	putMessage(message, type, payload);
+	return socket.sendAll(message.data(), message.size());
+}
+
+static bool receiveMessage(StreamSocket& socket, uint32_t& type, std::string& payload)
+{
+	std::string head(8, '\0');
+	if (!socket.receiveAll(&head[0], head.size()))
+		return false;
+	MessageReader reader{ head, 0, true };
+	type = reader.word();
+	uint32_t bytes = reader.word();
+	if (bytes > max_message_bytes)
+		return false;
+	payload.resize(bytes);
+	return bytes == 0 || socket.receiveAll(&payload[0], bytes);
+}
+
+// The extra values are floats, which the tile codec packs as bit patterns, losslessly
+static void encodeExtra(const float* extra, int width, int height, std::vector<int>& bits, std::string& out)
+{
+	bits.resize(static_cast<size_t>(width) * height);
+	std::memcpy(bits.data(), extra, bits.size() * sizeof(float));
+	size_t start = out.size();
+	out.resize(start + maxEncodedBytes(width, height));
+	out.resize(start + encodeIterations(bits.data(), width, height, width, reinterpret_cast<unsigned char*>(&out[start])));
+}
+
+////////////////////////////////////////////////////////////
+/// Coordinator
+////////////////////////////////////////////////////////////
+
+RenderCluster::RenderCluster()
+{
+	stopping = false;
+	generation = 0;
+	jobs = nullptr;
+	handler = nullptr;
+	remaining = 0;
+	active_handlers = 0;
+	connected = 0;
+	workers_lost = 0;
+	jobs_done = 0;
+	jobs_retried = 0;
+	bytes_received = 0;
+	value_bytes = 0;
+}
+
+RenderCluster::~RenderCluster()
+{
+	close();
+}
+
+/*
+* Listen for workers on address, see StreamSocket.
+*/
+bool RenderCluster::listen(const std::string& listen_address)
+{
+	if (accept_thread.joinable() || !listener.listen(listen_address))
+		return false;
+	address = listen_address;
+	stopping = false;
+	accept_thread = std::thread(&RenderCluster::acceptConnections, this);
+	return true;
+}
+
+/*
+* Start count worker processes on this machine, running program (this one, as argv[0]) with --worker and the address listened on.
+*/
+bool RenderCluster::spawnWorkers(const std::string& program, int count)
+{
+	if (!accept_thread.joinable())
+		return false;
+	std::string mode = "--worker";
+	for (int i = 0; i < count; ++i)
+	{
+		char* arguments[] = { const_cast<char*>(program.c_str()), const_cast<char*>(mode.c_str()), const_cast<char*>(address.c_str()), nullptr };
+#ifdef _WIN32
+		intptr_t child = _spawnvp(_P_NOWAIT, program.c_str(), arguments);
+		if (child == -1)
+			return false;
+#else
+		pid_t child = fork();
+		if (child < 0)
+			return false;
+		if (child == 0)
+		{
+			execvp(program.c_str(), arguments);
+			_exit(127);
+		}
+#endif
+		children.push_back(static_cast<long long>(child));
+	}
+	return true;
+}
+
+/*
+* Stop accepting workers and disconnect them, which ends them. Spawned workers which have not ended a second later are stopped.
+*/
+void RenderCluster::close()
+{
+	if (!accept_thread.joinable())
+		return;
+
+	stopping = true;
+	accept_thread.join();
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		for (StreamSocket* socket : connections)
+			socket->shutdown();
+		work_condition.notify_all();
+		closed_condition.wait(lock, [this] {return connections.empty(); });
+	}
+	listener.close();
+
+#ifndef _WIN32
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+	for (long long child : children)
+	{
+		pid_t pid = static_cast<pid_t>(child);
+		while (waitpid(pid, nullptr, WNOHANG) == 0)
+		{
+			if (std::chrono::steady_clock::now() > deadline)
+			{
+				kill(pid, SIGTERM);
+				waitpid(pid, nullptr, 0);
+				break;
+			}
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		}
+	}
+#endif
+	children.clear();
+}
+
+void RenderCluster::acceptConnections()
+{
+	while (!stopping)
+	{
+		// Polls, so that close is noticed
+		StreamSocket client;
+		if (!listener.accept(client, 100))
+			continue;
+
+		std::unique_ptr<StreamSocket> socket(new StreamSocket(std::move(client)));
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			connections.insert(socket.get());
+		}
+		std::thread(&RenderCluster::serveWorker, this, std::move(socket)).detach();
+	}
+}
+
+/*
+* Hand jobs to a worker and pass its results on, for one render after another, until it goes away or the cluster is closed. Then the jobs
+* it still had are handed out again.
+*/
+void RenderCluster::serveWorker(std::unique_ptr<StreamSocket> socket)
+{
+	uint32_t type = 0;
+	std::string message;
+	size_t slots = 0;
+	if (socket->waitReadable(hello_timeout_ms) && receiveMessage(*socket, type, message) && type == HELLO)
+	{
+		MessageReader reader{ message, 0, true };
+		const char* magic = reader.bytes(sizeof(hello_magic));
+		slots = reader.word();
+		if (!reader.ok || std::memcmp(magic, hello_magic, sizeof(hello_magic)) != 0)
+			slots = 0;
+	}
+
+	size_t worker = 0;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (slots > 0)
+		{
+			worker = worker_jobs.size();
+			worker_jobs.push_back(0);
+			connected += 1;
+			render_condition.notify_all();
+		}
+	}
+
+	// Jobs handed to this worker which it has not returned yet, with the render they belong to. Workers return jobs in the order they got them
+	std::deque<std::pair<long long, int>> outstanding;
+	long long seen_generation = 0;
+	std::vector<int> values, bits;
+	std::vector<float> extra;
+	std::string batch;
+	while (slots > 0)
+	{
+		// Hand out as many jobs as the worker takes, and wait for a render if there is nothing to do
+		batch.clear();
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			work_condition.wait(lock, [&] {return stopping || !outstanding.empty() || (jobs && !queue.empty()); });
+			if (stopping)
+				break;
+			if (jobs && seen_generation != generation)
+			{
+				seen_generation = generation;
+				batch += formula;
+			}
+			while (jobs && outstanding.size() < slots && !queue.empty())
+			{
+				int index = queue.front();
+				queue.pop_front();
+				outstanding.emplace_back(generation, index);
+				const Job& job = (*jobs)[index];
+				std::string payload;
+				putWord(payload, static_cast<uint32_t>(index));
+				putWord(payload, static_cast<uint32_t>(job.width));
+				putWord(payload, static_cast<uint32_t>(job.height));
+				putNumber(payload, job.vp.x_origin);
+				putNumber(payload, job.vp.y_origin);
+				putNumber(payload, job.vp.x_step);
+				putNumber(payload, job.vp.y_step);
+				putMessage(batch, JOB, payload);
+			}
+		}
+		if (!batch.empty() && !socket->sendAll(batch.data(), batch.size()))
+			break;
+
+		// Then take its next result
+		if (outstanding.empty())
+			continue;
+		if (!socket->waitReadable(result_timeout_ms) || !receiveMessage(*socket, type, message) || type != RESULT)
+			break;
+		MessageReader reader{ message, 0, true };
+		int index = static_cast<int>(reader.word());
+		uint32_t encoded_values = reader.word();
+		uint32_t encoded_extra = reader.word();
+		const char* data = reader.bytes(encoded_values + static_cast<size_t>(encoded_extra));
+		if (!reader.ok || index != outstanding.front().second)
+			break;
+		long long job_generation = outstanding.front().first;
+		outstanding.pop_front();
+
+		// A result of a render which gave up is dropped
+		const Job* job = nullptr;
+		const ResultHandler* done = nullptr;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (jobs && job_generation == generation)
+			{
+				job = &(*jobs)[index];
+				done = handler;
+				active_handlers += 1;
+			}
+		}
+		if (!job)
+			continue;
+
+		size_t pixels = static_cast<size_t>(job->width) * job->height;
+		values.resize(pixels);
+		bool decoded = decodeIterations(reinterpret_cast<const unsigned char*>(data), encoded_values, values.data(), job->width, job->height, job->width);
+		if (decoded && encoded_extra > 0)
+		{
+			bits.resize(pixels);
+			extra.resize(pixels);
+			decoded = decodeIterations(reinterpret_cast<const unsigned char*>(data + encoded_values), encoded_extra, bits.data(), job->width, job->height,
+									   job->width);
+			std::memcpy(extra.data(), bits.data(), pixels * sizeof(float));
+		}
+		if (decoded)
+			(*done)(index, values.data(), encoded_extra > 0 ? extra.data() : nullptr);
+
+		std::lock_guard<std::mutex> lock(mutex);
+		active_handlers -= 1;
+		if (!decoded)
+		{
+			outstanding.emplace_front(job_generation, index);
+			render_condition.notify_all();
+			break;
+		}
+		remaining -= 1;
+		worker_jobs[worker] += 1;
+		jobs_done += 1;
+		bytes_received += static_cast<long long>(message.size());
+		value_bytes += static_cast<long long>(pixels * (encoded_extra > 0 ? 2 : 1) * sizeof(int));
+		render_condition.notify_all();
+	}
+
+	socket->close();
+	std::lock_guard<std::mutex> lock(mutex);
+	if (slots > 0)
+	{
+		connected -= 1;
+		if (!stopping)
+		{
+			workers_lost += 1;
+			std::cerr << "Worker " << worker + 1 << " went away, handing out its " << outstanding.size() << " jobs again" << std::endl;
+		}
+	}
+	for (auto job = outstanding.rbegin(); job != outstanding.rend(); ++job)
+	{
+		if (jobs && job->first == generation)
+		{
+			queue.push_front(job->second);
+			jobs_retried += 1;
+		}
+	}
+	work_condition.notify_all();
+	connections.erase(socket.get());
+	render_condition.notify_all();
+	closed_condition.notify_all();
+}
+
+/*
+* Compute every job of jobs for fractal on the workers, with distance estimates or smooth values if asked for, and pass the results to
+* done as they come in. Waits for workers if there are none. Returns false if there were none for worker_wait, then some jobs may not have
+* been passed to done.
+*/
+bool RenderCluster::render(const Fractal& fractal, bool distance, bool smooth, const std::vector<Job>& render_jobs, const ResultHandler& done)
+{
+	if (!accept_thread.joinable())
+		return false;
+
+	Fractal::FormulaParams params = fractal.getFormulaParams();
+	std::string payload;
+	putWord(payload, static_cast<uint32_t>(params.mode));
+	putWord(payload, params.max_iter);
+	putNumber(payload, params.radius);
+	putNumber(payload, params.julia_complex_param.real());
+	putNumber(payload, params.julia_complex_param.imag());
+	putWord(payload, (params.distance_estimation ? formula_distance_estimation : 0) | (distance ? formula_distance : 0) | (smooth ? formula_smooth : 0));
+
+	std::unique_lock<std::mutex> lock(mutex);
+	generation += 1;
+	jobs = &render_jobs;
+	handler = &done;
+	formula.clear();
+	putMessage(formula, FORMULA, payload);
+	queue.clear();
+	for (int i = 0; i < static_cast<int>(render_jobs.size()); ++i)
+		queue.push_back(i);
+	remaining = render_jobs.size();
+	work_condition.notify_all();
+
+	bool waiting = false;
+	auto last_worker = std::chrono::steady_clock::now();
+	while (remaining > 0)
+	{
+		render_condition.wait_for(lock, std::chrono::milliseconds(500));
+		auto now = std::chrono::steady_clock::now();
+		if (connected > 0)
+		{
+			last_worker = now;
+			waiting = false;
+			continue;
+		}
+		if (!waiting)
+			std::cout << "Waiting for workers on " << address << std::endl;
+		waiting = true;
+		if (now - last_worker > worker_wait)
+			break;
+	}
+
+	// Results which are still being passed on have to be, as done goes away after this
+	bool finished = remaining == 0;
+	generation += 1;
+	jobs = nullptr;
+	handler = nullptr;
+	queue.clear();
+	render_condition.wait(lock, [this] {return active_handlers == 0; });
+	return finished;
+}
+
+std::string RenderCluster::statistics()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	std::ostringstream out;
+	out << "Workers: " << worker_jobs.size() << " joined, " << workers_lost << " lost; " << jobs_done << " jobs, " << jobs_retried <<
+		" handed out again; jobs per worker:";
+	for (long long count : worker_jobs)
+		out << " " << count;
+	out << "; " << bytes_received / 1e6 << " MB received for " << value_bytes / 1e6 << " MB of values" << std::endl;
+	return out.str();
+}
+
+////////////////////////////////////////////////////////////
+/// Worker
+////////////////////////////////////////////////////////////
+
+// A job as the worker has it
+struct WorkerJob {
+	uint32_t index;
+	int width, height;
+	Fractal::Viewport vp;
+	std::vector<int> values;
+	std::vector<float> extra;
+	std::vector<int> bits;
+	std::string result;
+};
+
+/*
+* Work for the coordinator at address until it disconnects: take the jobs which have arrived, up to one per thread, compute their tiles
+* on the thread pool, and return their results. Twice as many jobs are taken on as there are threads, so the next ones are already there
+* when a batch is done. With exit_after > 0 the process exits without a word once it has computed that many jobs, as if it crashed.
+* Returns the exit code of the program.
+*/
+int runWorker(const std::string& address, int exit_after)
+{
+	// The coordinator may not be listening yet
+	StreamSocket socket;
+	auto start = std::chrono::steady_clock::now();
+	while (!socket.connect(address))
+	{
+		if (std::chrono::steady_clock::now() - start > worker_wait)
+		{
+			std::cerr << "Cannot connect to a coordinator on " << address << std::endl;
+			return 1;
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(200));
+	}
+
+	ThreadPool& pool = ThreadPool::getInstance();
+	size_t batch_limit = static_cast<size_t>(pool.size) + 1;
+	std::string hello(hello_magic, sizeof(hello_magic));
+	putWord(hello, static_cast<uint32_t>(2 * batch_limit));
+	if (!sendMessage(socket, HELLO, hello))
+		return 1;
+
+	Fractal fractal;
+	bool distance = false, smooth = false;
+	std::vector<WorkerJob> batch;
+	std::vector<Fractal::Tile> tiles;
+	std::vector<int> tile_jobs;
+	uint32_t type = 0;
+	std::string message;
+	bool have_message = false, connected = true;
+	long long computed = 0;
+	while (connected)
+	{
+		// Wait for a job, then take whatever else arrived along with it. A new formula waits until the jobs before it are done
+		size_t count = 0;
+		while (count < batch_limit)
+		{
+			if (!have_message)
+			{
+				if (count > 0 && !socket.waitReadable(0))
+					break;
+				if (!receiveMessage(socket, type, message))
+				{
+					connected = false;
+					break;
+				}
+				have_message = true;
+			}
+
+			MessageReader reader{ message, 0, true };
+			if (type == FORMULA)
+			{
+				if (count > 0)
+					break;
+				Fractal::FormulaParams params;
+				params.mode = static_cast<Fractal::FractalSets>(reader.word());
+				params.max_iter = reader.word();
+				params.radius = reader.number();
+				long double real = reader.number();
+				params.julia_complex_param = std::complex<long double>(real, reader.number());
+				uint32_t flags = reader.word();
+				params.distance_estimation = (flags & formula_distance_estimation) != 0;
+				if (!reader.ok || params.mode >= Fractal::FractalSets::LAST)
+					return 1;
+				fractal.setFormulaParams(params);
+				distance = (flags & formula_distance) != 0;
+				smooth = (flags & formula_smooth) != 0;
+			}
+			else if (type == JOB)
+			{
+				if (batch.size() <= count)
+					batch.emplace_back();
+				WorkerJob& job = batch[count];
+				job.index = reader.word();
+				job.width = static_cast<int>(reader.word());
+				job.height = static_cast<int>(reader.word());
+				job.vp.x_origin = reader.number();
+				job.vp.y_origin = reader.number();
+				job.vp.x_step = reader.number();
+				job.vp.y_step = reader.number();
+				if (!reader.ok || job.width < 1 || job.height < 1 || job.width > max_job_side || job.height > max_job_side)
+					return 1;
+				count += 1;
+			}
+			else
+				return 1;
+			have_message = false;
+		}
+		if (count == 0)
+			continue;
+
+		// The tiles of every job of the batch at once, so small jobs still keep every thread busy
+		constexpr int size = TileCache::tile_size;
+		tiles.clear();
+		tile_jobs.clear();
+		for (size_t i = 0; i < count; ++i)
+		{
+			WorkerJob& job = batch[i];
+			size_t pixels = static_cast<size_t>(job.width) * job.height;
+			job.values.resize(pixels);
+			job.extra.resize(distance || smooth ? pixels : 0);
+			for (int y = 0; y < job.height; y += size)
+			{
+				for (int x = 0; x < job.width; x += size)
+				{
+					tiles.push_back(Fractal::Tile{ x, y, std::min(size, job.width - x), std::min(size, job.height - y) });
+					tile_jobs.push_back(static_cast<int>(i));
+				}
+			}
+		}
+		// Every tile from a viewport of its own, as the coordinator computes tiles itself
+		pool.run(static_cast<int>(tiles.size()), [&](int index) {
+			WorkerJob& job = batch[tile_jobs[index]];
+			const Fractal::Tile& tile = tiles[index];
+			size_t at = static_cast<size_t>(tile.y) * job.width + tile.x;
+			Fractal::Viewport vp{ job.vp.x_origin + tile.x * job.vp.x_step, job.vp.y_origin + tile.y * job.vp.y_step, job.vp.x_step, job.vp.y_step };
+			fractal.computeTile(&job.values[at], distance ? &job.extra[at] : nullptr, job.width, Fractal::Tile{ 0, 0, tile.width, tile.height }, vp, true,
+								smooth ? &job.extra[at] : nullptr);
+		});
+		pool.run(static_cast<int>(count), [&](int index) {
+			WorkerJob& job = batch[index];
+			std::string encoded(maxEncodedBytes(job.width, job.height), '\0');
+			encoded.resize(encodeIterations(job.values.data(), job.width, job.height, job.width, reinterpret_cast<unsigned char*>(&encoded[0])));
+			std::string encoded_extra;
+			if (!job.extra.empty())
+				encodeExtra(job.extra.data(), job.width, job.height, job.bits, encoded_extra);
+			job.result.clear();
+			putWord(job.result, job.index);
+			putWord(job.result, static_cast<uint32_t>(encoded.size()));
+			putWord(job.result, static_cast<uint32_t>(encoded_extra.size()));
+			job.result += encoded;
+			job.result += encoded_extra;
+		});
+
+		for (size_t i = 0; i < count && connected; ++i)
+		{
+			if (exit_after > 0 && ++computed > exit_after)
+			{
+				std::cerr << "Worker exiting after " << exit_after << " jobs, as asked" << std::endl;
+				std::_Exit(3);
+			}
+			connected = sendMessage(socket, RESULT, batch[i].result);
+		}
+	}
+	return 0;
+}
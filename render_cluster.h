@@ -0,0 +1,90 @@
+/*
+* Declares RenderCluster, which spreads the iterating of batch renders over worker processes, on this machine or on others, so that
+* renders are not limited to the cores of one machine.
+*
+* The coordinator listens on an address (see StreamSocket) which workers, started with `fractal --worker <address>`, connect to, and they
+* may join or leave at any time. A render is a list of jobs, rectangles of pixels given by their viewport, all of one fractal. Every
+* worker is handed jobs as it returns results, keeping a few more in flight than it has threads, so faster workers take more of them. A
+* worker returns the iteration values of a job (and its distance estimates or smooth values) packed with the tile codec. The jobs of a
+* worker which disconnects, dies, or stops answering are handed out to the others again.
+*/
+
+#pragma once
+
+#include "fractal.h"
+#include "stream_socket.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+class RenderCluster
+{
+public:
+	// A rectangle of width x height pixels whose top left pixel is at the origin of vp
+	struct Job {
+		Fractal::Viewport vp;
+		int width, height;
+	};
+
+	// Called with the iteration values of the job at index, and its distance estimates or smooth values if they were asked for, width
+	// values per row. Called from several threads at once, for different jobs
+	typedef std::function<void(int index, const int* values, const float* extra)> ResultHandler;
+
+private:
+	StreamSocket listener;
+	std::string address;
+	std::thread accept_thread;
+	std::atomic<bool> stopping;
+	std::vector<long long> children;			// Spawned worker processes
+
+	std::mutex mutex;
+	std::condition_variable work_condition;		// Signalled when there are jobs to hand out
+	std::condition_variable render_condition;	// Signalled when a job is done, or a worker comes or goes
+	std::condition_variable closed_condition;	// Signalled when a connection is closed
+	std::set<StreamSocket*> connections;
+
+	// The render in progress, under mutex
+	long long generation;						// Counts renders, so workers notice a new one
+	const std::vector<Job>* jobs;				// nullptr between renders
+	const ResultHandler* handler;
+	std::string formula;						// Message with the fractal and what to compute besides the iteration values
+	std::deque<int> queue;						// Jobs not handed out yet
+	size_t remaining;							// Jobs without a result yet
+	int active_handlers;
+
+	// Statistics, under mutex
+	int connected;
+	std::vector<long long> worker_jobs;			// Per worker, in the order they joined
+	long long workers_lost;
+	long long jobs_done;
+	long long jobs_retried;
+	long long bytes_received;
+	long long value_bytes;						// What bytes_received came to once decoded
+
+	void acceptConnections();
+	void serveWorker(std::unique_ptr<StreamSocket> socket);
+
+public:
+	RenderCluster();
+	~RenderCluster();
+
+	bool listen(const std::string& address);
+	bool spawnWorkers(const std::string& program, int count);
+	bool render(const Fractal& fractal, bool distance, bool smooth, const std::vector<Job>& jobs, const ResultHandler& done);
+	void close();
+	std::string statistics();
+
+	RenderCluster(RenderCluster const&) = delete;
+	void operator=(RenderCluster const&) = delete;
+};
+
+int runWorker(const std::string& address, int exit_after);
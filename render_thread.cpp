@@ -0,0 +1,416 @@
+#include "render_thread.h"
+
+#include "color.h"
+#include "fractal.h"
+#include "renderer.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <immintrin.h> // _mm_malloc
+
+RenderThread::RenderThread()
+{
+	settings = Settings{ 0, 0, true, true, 0.0, false, false, -1, -1, false, false };
+	requested_settings = settings;
+	requested = false;
+	requested_render = false;
+	continuing = false;
+	terminate = false;
+	generation = 0;
+	speculation_generation = 0;
+
+	renderer = &renderers[0];
+	for (int i = 0; i < speculation_slots; ++i)
+	{
+		spares[i] = &renderers[1 + i];
+		spare_used[i] = 0;
+	}
+	use_clock = 0;
+	speculation_buffer = nullptr;
+	speculation_capacity = 0;
+	last_move = -1;
+	speculation_hits = 0;
+	speculation_misses = 0;
+	cursor_x = -1;
+	cursor_y = -1;
+	speculating = false;
+
+	for (int i = 0; i < 2; ++i)
+	{
+		buffers[i] = nullptr;
+		buffer_capacity[i] = 0;
+		outputs[i] = Output{ nullptr, 0, 0, Renderer::Frame{ true, 0, 0, nullptr, 0, 0, false, false } };
+	}
+	back = 0;
+	ready = false;
+}
+
+RenderThread::~RenderThread()
+{
+	stop();
+	_mm_free(buffers[0]);
+	_mm_free(buffers[1]);
+	_mm_free(speculation_buffer);
+}
+
+/*
+* Open (or create) the tile store at path, which then backs the tile cache of every renderer. Call before start. If another process
+* writes to the store, its tiles are only read. Returns false if it cannot be opened, in which case frames are rendered without it.
+*/
+bool RenderThread::openStore(const std::string& path)
+{
+	if (!tile_store.open(path, true))
+		return false;
+	if (!tile_store.isWritable())
+		std::cerr << "Tile store " << path << " is written by another process, the tiles of this session are not kept" << std::endl;
+	return true;
+}
+
+/*
+* Start the render thread. frame_callback is called from the render thread whenever a frame was completed, to wake up the UI thread.
+*/
+void RenderThread::start(std::function<void()> frame_callback)
+{
+	on_frame = frame_callback;
+	terminate = false;
+	thread = std::thread(&RenderThread::renderLoop, this);
+}
+
+void RenderThread::stop()
+{
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		terminate = true;
+	}
+	request_condition.notify_all();
+	present_condition.notify_all();
+	if (thread.joinable())
+		thread.join();
+}
+
+/*
+* Hand the render thread a copy of the current parameters. Only the latest submission is rendered, so submitting faster than frames
+* complete simply skips the frames in between. Unless colors_only, the frame being rendered is cancelled as well, so new input starts
+* rendering within a tile's time. With colors_only the last frame is recolored instead, unless an earlier submission which has not been
+* picked up yet needs a full render. Either way a speculative render in flight is cancelled.
+*/
+void RenderThread::submit(const Fractal& fractal, const ColorGenerator& cg, const Settings& settings, bool colors_only)
+{
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		requested_fractal = fractal;
+		requested_cg.copyParameters(cg);
+		requested_settings = settings;
+		requested = true;
+		requested_render = requested_render || !colors_only;
+		if (!colors_only)
+			generation.fetch_add(1);
+		speculation_generation.fetch_add(1);
+	}
+	request_condition.notify_one();
+}
+
+/*
+* Get the last completed frame, if there is one the UI has not presented yet. It stays valid, and the render thread will not hand over
+* another frame, until release is called.
+*/
+bool RenderThread::acquire(Output& output)
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	if (!ready)
+		return false;
+
+	output = outputs[1 - back];
+	return true;
+}
+
+void RenderThread::release()
+{
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		ready = false;
+	}
+	present_condition.notify_one();
+}
+
+/*
+* Tell the render thread where the cursor is, which is where a scroll zoom would follow it to. Does not render anything by itself,
+* but while idle the zooms at the new position are speculated on.
+*/
+void RenderThread::hover(int x, int y)
+{
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		if (x == cursor_x && y == cursor_y)
+			return;
+		cursor_x = x;
+		cursor_y = y;
+		speculating = settings.speculate && !continuing;
+	}
+	request_condition.notify_one();
+}
+
+////////////////////////////////////////////////////////////
+/// Speculation
+////////////////////////////////////////////////////////////
+
+void RenderThread::applyMove(Fractal& fractal, Move move, int cursor_x, int cursor_y, int width, int height)
+{
+	switch (move)
+	{
+	case Move::FOLLOWING_ZOOM_IN: fractal.followingZoom(1, cursor_x, cursor_y, width, height); break;
+	case Move::FOLLOWING_ZOOM_OUT: fractal.followingZoom(-1, cursor_x, cursor_y, width, height); break;
+	case Move::ZOOM_IN: fractal.stationaryZoom(1, width, height); break;
+	case Move::ZOOM_OUT: fractal.stationaryZoom(-1, width, height); break;
+	case Move::PAN_UP: fractal.panUp(width, height); break;
+	case Move::PAN_DOWN: fractal.panDown(width, height); break;
+	case Move::PAN_LEFT: fractal.panLeft(width, height); break;
+	case Move::PAN_RIGHT: fractal.panRight(width, height); break;
+	default: break;
+	}
+}
+
+bool RenderThread::sameView(const Fractal& a, const Fractal& b, int width, int height)
+{
+	Fractal::Viewport va = a.getViewport(width, height);
+	Fractal::Viewport vb = b.getViewport(width, height);
+	return a.getFormulaParams() == b.getFormulaParams() && va.x_origin == vb.x_origin && va.y_origin == vb.y_origin &&
+		   va.x_step == vb.x_step && va.y_step == vb.y_step;
+}
+
+/*
+* The moves worth rendering ahead, most likely first: the move which led to the current view, then the default order of Move.
+* The zooms which follow the cursor are left out while it is outside the window. Call with mutex held.
+*/
+int RenderThread::predictedMoves(Move* moves) const
+{
+	bool cursor = cursor_x >= 0 && cursor_x < settings.width && cursor_y >= 0 && cursor_y < settings.height;
+	int count = 0;
+	for (int i = -1; i < static_cast<int>(Move::COUNT) && count < speculation_slots; ++i)
+	{
+		Move move = static_cast<Move>(i < 0 ? last_move : i);
+		if ((i < 0 && last_move < 0) || (!cursor && (move == Move::FOLLOWING_ZOOM_IN || move == Move::FOLLOWING_ZOOM_OUT)))
+			continue;
+		if (std::find(moves, moves + count, move) == moves + count)
+			moves[count++] = move;
+	}
+	return count;
+}
+
+/*
+* Pick the most likely view which no renderer holds yet, and the spare to render it with: the least recently used one among those
+* which do not hold a likely view. Returns false if every likely view is rendered already. Call with mutex held.
+*/
+bool RenderThread::nextSpeculation(Fractal& view, int& slot)
+{
+	if (!settings.speculate)
+		return false;
+
+	Move moves[speculation_slots];
+	int count = predictedMoves(moves);
+	bool likely[speculation_slots] = {};
+	bool found = false;
+	for (int i = 0; i < count; ++i)
+	{
+		Fractal candidate = fractal;
+		applyMove(candidate, moves[i], cursor_x, cursor_y, settings.width, settings.height);
+		if (sameView(candidate, fractal, settings.width, settings.height))
+			continue;
+
+		bool held = false;
+		for (int s = 0; s < speculation_slots; ++s)
+		{
+			if (spares[s]->holds(candidate, cg, settings.width, settings.height, settings.AVX))
+			{
+				likely[s] = true;
+				held = true;
+			}
+		}
+		if (!held && !found)
+		{
+			view = candidate;
+			found = true;
+		}
+	}
+	if (!found)
+		return false;
+
+	slot = -1;
+	for (int s = 0; s < speculation_slots; ++s)
+	{
+		if (!likely[s] && (slot < 0 || spare_used[s] < spare_used[slot]))
+			slot = s;
+	}
+	return slot >= 0;
+}
+
+/*
+* Render view with a spare renderer, to completion and without coloring it for display. Cancelled by any submission, which leaves the
+* spare holding nothing.
+*/
+void RenderThread::speculate(const Fractal& view, int slot)
+{
+	size_t pixels = static_cast<size_t>(settings.width) * settings.height;
+	if (pixels > speculation_capacity)
+	{
+		_mm_free(speculation_buffer);
+		speculation_buffer = static_cast<int*>(_mm_malloc(((pixels + 7) & ~static_cast<size_t>(7)) * sizeof(int), 64));
+		speculation_capacity = pixels;
+	}
+
+	Renderer& spare = *spares[slot];
+	spare.resume_iterations = settings.resume_iterations;
+	spare.frame_budget_ms = 0.0;
+	spare.progressive = false;
+	spare.solid_guessing = false;
+	spare.focus_x = -1;
+	spare.focus_y = -1;
+	spare.tile_cache = settings.cache_tiles ? &tile_cache : nullptr;
+	spare.tile_store = tile_store.isOpen() ? &tile_store : nullptr;
+	spare_used[slot] = ++use_clock;
+
+	Fractal speculated = view;
+	spare.render(speculated, cg, speculation_buffer, settings.width, settings.height, settings.AVX);
+}
+
+////////////////////////////////////////////////////////////
+/// Render loop
+////////////////////////////////////////////////////////////
+
+/*
+* Waits for new parameters (or keeps going while the last frame is pending), renders them into the back buffer, and hands the frame
+* over to the UI once it released the previous one. With nothing else to do it renders the likely next views ahead, and a submission
+* of one of those only has to recolor it.
+*/
+void RenderThread::renderLoop()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	while (true)
+	{
+		request_condition.wait(lock, [this] {return requested || continuing || speculating || terminate; });
+		if (terminate)
+			return;
+
+		if (!requested && !continuing)
+		{
+			Fractal view;
+			int slot;
+			if (!nextSpeculation(view, slot))
+			{
+				speculating = false;
+				continue;
+			}
+			spares[slot]->current_generation = &speculation_generation;
+			spares[slot]->generation = speculation_generation.load();
+			lock.unlock();
+			speculate(view, slot);
+			lock.lock();
+			continue;
+		}
+
+		bool render = continuing;
+		if (requested)
+		{
+			// Remember which move led here, it is the most likely next one
+			if (requested_render && requested_settings.width == settings.width && requested_settings.height == settings.height)
+			{
+				last_move = -1;
+				for (int i = 0; i < static_cast<int>(Move::COUNT) && last_move < 0; ++i)
+				{
+					Fractal moved = fractal;
+					applyMove(moved, static_cast<Move>(i), cursor_x, cursor_y, settings.width, settings.height);
+					if (sameView(moved, requested_fractal, settings.width, settings.height))
+						last_move = i;
+				}
+			}
+
+			fractal = requested_fractal;
+			cg.copyParameters(requested_cg);
+			settings = requested_settings;
+			render = render || requested_render;
+			requested = false;
+			requested_render = false;
+
+			// A spare which already holds the new view takes the place of the renderer, which keeps the previous view as a spare
+			if (render && settings.speculate)
+			{
+				bool hit = false;
+				for (int s = 0; s < speculation_slots && !hit; ++s)
+				{
+					if (spares[s]->holds(fractal, cg, settings.width, settings.height, settings.AVX))
+					{
+						std::swap(renderer, spares[s]);
+						spare_used[s] = ++use_clock;
+						hit = true;
+					}
+				}
+				if (hit)
+					speculation_hits += 1;
+				else
+					speculation_misses += 1;
+#ifdef PRINT_INFO
+				std::cout << "Speculated " << speculation_hits << " of " << speculation_hits + speculation_misses << " views" << (hit ? ", presenting one" : "") << std::endl;
+#endif
+			}
+		}
+		renderer->current_generation = &generation;
+		renderer->generation = generation.load();
+		lock.unlock();
+
+		size_t pixels = static_cast<size_t>(settings.width) * settings.height;
+		if (pixels > buffer_capacity[back])
+		{
+			_mm_free(buffers[back]);
+			buffers[back] = static_cast<int*>(_mm_malloc(((pixels + 7) & ~static_cast<size_t>(7)) * sizeof(int), 64));
+			buffer_capacity[back] = pixels;
+		}
+
+		Renderer::Frame frame{ true, 0, 0, nullptr, 0, 0, false, false };
+		if (render || !renderer->recolor(cg, buffers[back], settings.AVX))
+		{
+			renderer->resume_iterations = settings.resume_iterations;
+			renderer->frame_budget_ms = settings.frame_budget_ms;
+			renderer->progressive = settings.progressive;
+			renderer->solid_guessing = settings.solid_guessing;
+			renderer->focus_x = settings.focus_x;
+			renderer->focus_y = settings.focus_y;
+			renderer->tile_cache = settings.cache_tiles ? &tile_cache : nullptr;
+			renderer->tile_store = tile_store.isOpen() ? &tile_store : nullptr;
+			frame = renderer->render(fractal, cg, buffers[back], settings.width, settings.height, settings.AVX);
+		}
+
+		// A newer submission is waiting, and the render of it picks up the tiles this one finished
+		if (frame.cancelled)
+		{
+			lock.lock();
+			continue;
+		}
+
+		// The dirty rectangles point into the renderer, which reuses them for the next frame
+		dirty[back].assign(frame.dirty, frame.dirty + frame.dirty_count);
+		frame.dirty = dirty[back].data();
+		outputs[back] = Output{ buffers[back], settings.width, settings.height, frame };
+
+		lock.lock();
+		present_condition.wait(lock, [this] {return !ready || terminate; });
+		if (terminate)
+			return;
+
+		ready = true;
+		back = 1 - back;
+		continuing = frame.pending;
+		speculating = settings.speculate && !continuing;
+
+		if (on_frame)
+			on_frame();
+	}
+}
@@ -0,0 +1,134 @@
+/*
+* Declares RenderThread, which renders frames on a thread of its own so that the window and menu stay responsive no matter how long a
+* frame takes. The UI thread submits copies of its fractal and color parameters, and presents whichever frame was completed last.
+*/
+
+#pragma once
+
+#include "color.h"
+#include "fractal.h"
+#include "renderer.h"
+#include "tile_cache.h"
+#include "tile_store.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+class RenderThread
+{
+public:
+	// How the UI wants frames rendered, besides the fractal and color parameters
+	struct Settings {
+		int width, height;
+		bool AVX;
+		bool resume_iterations;
+		double frame_budget_ms;
+		bool progressive;
+		bool solid_guessing;
+		int focus_x, focus_y;		// See Renderer::focus_x
+		bool speculate;				// Render the likely next views while idle
+		bool cache_tiles;			// Keep the tiles of completed frames in the tile cache, and copy them into new frames
+	};
+
+	// A completed frame. Like the output of Renderer::render, only the dirty rectangles of colors are current unless frame.full
+	struct Output {
+		const int* colors;
+		int width, height;
+		Renderer::Frame frame;		// frame.dirty points into the RenderThread, and stays valid until release
+	};
+
+private:
+	// Inputs which lead from one view to the next, in the order they are speculated on when nothing hints at another one
+	enum class Move {
+		FOLLOWING_ZOOM_IN,
+		ZOOM_IN,
+		ZOOM_OUT,
+		FOLLOWING_ZOOM_OUT,
+		PAN_UP,
+		PAN_DOWN,
+		PAN_LEFT,
+		PAN_RIGHT,
+		COUNT
+	};
+
+	// Number of views kept rendered ahead
+	static constexpr int speculation_slots = 3;
+
+	std::thread thread;
+	std::function<void()> on_frame;
+
+	// Owned by the render thread. The UI thread never touches these, so they stay the same for the whole frame.
+	// renderer points into renderers, and so does every spare. When a submitted view is held by a spare the two are swapped
+	Renderer renderers[1 + speculation_slots];
+	Renderer* renderer;
+	TileCache tile_cache;		// Shared by all renderers
+	TileStore tile_store;		// Behind tile_cache, when open
+	Fractal fractal;
+	ColorGenerator cg;
+	Settings settings;
+
+	// The latest parameters submitted by the UI thread, guarded by mutex
+	std::mutex mutex;
+	std::condition_variable request_condition;
+	Fractal requested_fractal;
+	ColorGenerator requested_cg;
+	Settings requested_settings;
+	bool requested;				// New parameters were submitted
+	bool requested_render;		// Some of them need the fractal rendered again, rather than only recolored
+	bool continuing;			// The last frame is pending, so keep rendering without a new request
+	bool terminate;
+
+	// Idle-time speculation: while no frame is wanted the spare renderers render the views the next input most likely asks for.
+	// Every submission cancels them through speculation_generation, even one which only changes the colors
+	Renderer* spares[speculation_slots];
+	unsigned long long spare_used[speculation_slots];	// For least recently used eviction
+	unsigned long long use_clock;
+	int* speculation_buffer;		// Output of speculative renders, which is never shown
+	size_t speculation_capacity;
+	int last_move;					// Move which led to the current view, which is the one most likely repeated. -1 if unknown
+	long long speculation_hits;
+	long long speculation_misses;
+	std::atomic<unsigned int> speculation_generation;
+	int cursor_x, cursor_y;			// Last known cursor position, for the zooms which follow it. Guarded by mutex
+	bool speculating;				// There may be a likely view which is not rendered yet. Guarded by mutex
+
+	// Advanced by every submission which needs the fractal rendered again, which cancels the frame in flight (see Renderer::generation)
+	std::atomic<unsigned int> generation;
+
+	// Two frame buffers: the render thread draws into back while the other one may hold a completed frame the UI has not presented yet.
+	// The render thread only hands over a frame once the UI has released the previous one, so the UI never misses dirty rectangles
+	std::condition_variable present_condition;
+	int* buffers[2];
+	size_t buffer_capacity[2];
+	Output outputs[2];
+	std::vector<Fractal::Tile> dirty[2];
+	int back;
+	bool ready;					// buffers[1 - back] holds a completed frame which has not been released yet
+
+	void renderLoop();
+	static void applyMove(Fractal& fractal, Move move, int cursor_x, int cursor_y, int width, int height);
+	static bool sameView(const Fractal& a, const Fractal& b, int width, int height);
+	int predictedMoves(Move* moves) const;
+	bool nextSpeculation(Fractal& view, int& slot);
+	void speculate(const Fractal& view, int slot);
+
+public:
+	RenderThread();
+	~RenderThread();
+
+	bool openStore(const std::string& path);
+	void start(std::function<void()> frame_callback);
+	void stop();
+	void submit(const Fractal& fractal, const ColorGenerator& cg, const Settings& settings, bool colors_only);
+	bool acquire(Output& output);
+	void release();
+	void hover(int x, int y);
+
+	RenderThread(RenderThread const&) = delete;
+	void operator=(RenderThread const&) = delete;
+};
@@ -0,0 +1,1328 @@
+#include "renderer.h"
+
+#include "color.h"
+#include "fractal.h"
+#include "thread_pool.h"
+#include "tile_codec.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <utility>
+#include <vector>
+
+#include <immintrin.h> // _mm_malloc
+
+#ifdef __linux__
+#include <sys/mman.h> // madvise
+#endif
+
+#include <iostream>
+
+// How close (in pixels) a pixel of the new frame has to land on a pixel of the previous frame for its value to be reused
+constexpr long double reuse_tolerance = 1e-6L;
+
+// Iterations the first slice of a frame goes up to when the frame time is limited, and the smallest a slice is allowed to shrink to
+constexpr int initial_slice = 64;
+constexpr int min_slice = 16;
+
+// Stride of the first pass of a progressive render. Each following pass halves it, down to 1
+constexpr int coarsest_stride = 8;
+constexpr int min_pass_tile_size = 16;
+
+// Tiles whose centre lies within this many pixels of the focus make up the region the user is looking at
+constexpr int focus_radius = 160;
+
+// Iteration value of the pixels a cancelled render did not get to
+constexpr int missing_iteration = -1;
+
+// Frames at least this large are aligned to and backed by huge pages where the OS allows it
+constexpr size_t huge_page_size = 2 * 1024 * 1024;
+
+/*
+* Allocate a 64-byte aligned (one cache line) frame buffer, padded so the AVX color generator can always work 8 values at a time.
+* On Linux large frames are aligned to a huge page and the kernel is asked to back them with huge pages, which cuts down on TLB misses
+* when a pass walks the whole frame.
+*/
+static int* allocateFrame(size_t pixels)
+{
+	size_t bytes = ((pixels + 7) & ~static_cast<size_t>(7)) * sizeof(int);
+#ifdef __linux__
+	if (bytes >= huge_page_size)
+	{
+		bytes = (bytes + huge_page_size - 1) & ~(huge_page_size - 1);
+		void* frame = _mm_malloc(bytes, huge_page_size);
+		if (frame)
+			madvise(frame, bytes, MADV_HUGEPAGE);
+		return static_cast<int*>(frame);
+	}
+#endif
+	return static_cast<int*>(_mm_malloc(bytes, 64));
+}
+
+Renderer::Renderer()
+{
+	colors = nullptr;
+	colors_capacity = 0;
+
+	valid = false;
+	width = 0;
+	height = 0;
+	use_AVX = false;
+	has_distance = false;
+	has_smooth = false;
+	has_state = false;
+	limit = 0;
+	slice = initial_slice;
+	incomplete = false;
+	pass_stride = 1;
+	region_ms = -1.0;
+	viewport = Fractal::Viewport{};
+	params = Fractal::FormulaParams{};
+
+	resume_iterations = true;
+	frame_budget_ms = 0.0;
+	fused_coloring = true;
+	progressive = false;
+	solid_guessing = false;
+	focus_x = -1;
+	focus_y = -1;
+	tile_cache = nullptr;
+	tile_store = nullptr;
+	current_generation = nullptr;
+	generation = 0;
+
+	t_pool = &ThreadPool::getInstance();
+}
+
+Renderer::~Renderer()
+{
+	_mm_free(colors);
+}
+
+/*
+* Forget the previous frame, so that the next render computes every pixel.
+*/
+void Renderer::invalidate()
+{
+	valid = false;
+}
+
+/*
+* Move the previous frame's values by a whole number of pixels, so that new pixel (x, y) holds old pixel (x + dx, y + dy).
+* The rows are moved in an order which never overwrites a row before it has been read. The strips that scrolled into view are added to exposed.
+*/
+void Renderer::shift(int dx, int dy, std::vector<Fractal::Tile>& exposed)
+{
+	int x_begin = std::max(0, -dx);
+	int x_end = std::min(width, width - dx);
+	int y_begin = std::max(0, -dy);
+	int y_end = std::min(height, height - dy);
+	size_t count = static_cast<size_t>(x_end - x_begin);
+
+	auto move_row = [&](int y) {
+		size_t dst = static_cast<size_t>(y) * width + x_begin;
+		size_t src = static_cast<size_t>(y + dy) * width + x_begin + dx;
+		std::memmove(&iterations[dst], &iterations[src], count * sizeof(int));
+		if (has_distance)
+			std::memmove(&distance[dst], &distance[src], count * sizeof(float));
+		if (has_smooth)
+			std::memmove(&smooth[dst], &smooth[src], count * sizeof(float));
+		if (has_state)
+		{
+			std::memmove(&orbit_zx[dst], &orbit_zx[src], count * sizeof(double));
+			std::memmove(&orbit_zy[dst], &orbit_zy[src], count * sizeof(double));
+			std::memmove(&orbit_iter[dst], &orbit_iter[src], count * sizeof(int));
+			std::memmove(&orbit_done[dst], &orbit_done[src], count * sizeof(unsigned char));
+		}
+	};
+
+	if (dy > 0)
+	{
+		for (int y = y_begin; y < y_end; ++y)
+			move_row(y);
+	}
+	else
+	{
+		for (int y = y_end - 1; y >= y_begin; --y)
+			move_row(y);
+	}
+
+	// Columns exposed on the left or right, across the full height
+	if (dx > 0)
+		exposed.push_back(Fractal::Tile{ width - dx, 0, dx, height });
+	else if (dx < 0)
+		exposed.push_back(Fractal::Tile{ 0, 0, -dx, height });
+
+	// Rows exposed on the top or bottom, minus the columns above
+	if (dy > 0)
+		exposed.push_back(Fractal::Tile{ x_begin, height - dy, x_end - x_begin, dy });
+	else if (dy < 0)
+		exposed.push_back(Fractal::Tile{ x_begin, 0, x_end - x_begin, -dy });
+}
+
+/*
+* After a zoom the pixel grids of the two frames no longer line up, but some rows and columns of the new frame still land exactly on rows
+* and columns of the previous one (every 9th or 10th for the default 10% zoom steps, every other one for a 2x zoom). The pixels where both
+* do are carried over, and everything else is added to exposed. Returns false if no pixel could be reused.
+*/
+bool Renderer::resample(const Fractal::Viewport& vp, std::vector<Fractal::Tile>& exposed)
+{
+	auto map_axis = [](int* map, int size, long double new_origin, long double new_step, long double old_origin, long double old_step) {
+		int mapped = 0;
+		for (int i = 0; i < size; ++i)
+		{
+			long double position = (new_origin + i * new_step - old_origin) / old_step;
+			long double nearest = std::round(position);
+			map[i] = -1;
+			if (std::abs(position - nearest) < reuse_tolerance && nearest >= 0 && nearest < size)
+			{
+				map[i] = static_cast<int>(nearest);
+				mapped += 1;
+			}
+		}
+		return mapped;
+	};
+
+	int* column_map = scratch.allocate<int>(width);
+	int* row_map = scratch.allocate<int>(height);
+	if (map_axis(column_map, width, vp.x_origin, vp.x_step, viewport.x_origin, viewport.x_step) == 0 ||
+		map_axis(row_map, height, vp.y_origin, vp.y_step, viewport.y_origin, viewport.y_step) == 0)
+		return false;
+
+	resampled_iterations.resize(iterations.size());
+	if (has_distance)
+		resampled_distance.resize(distance.size());
+	if (has_smooth)
+		resampled_smooth.resize(smooth.size());
+	if (has_state)
+	{
+		resampled_zx.resize(orbit_zx.size());
+		resampled_zy.resize(orbit_zy.size());
+		resampled_iter.resize(orbit_iter.size());
+		resampled_done.resize(orbit_done.size());
+	}
+
+	// Distances are stored in pixels, which changed size
+	float distance_scale = static_cast<float>(viewport.x_step / vp.x_step);
+
+	int unmapped_rows_begin = -1;
+	for (int y = 0; y <= height; ++y)
+	{
+		if (y < height && row_map[y] < 0)
+		{
+			if (unmapped_rows_begin < 0)
+				unmapped_rows_begin = y;
+			continue;
+		}
+
+		// A run of rows without a match ended, so all of it has to be computed
+		if (unmapped_rows_begin >= 0)
+		{
+			exposed.push_back(Fractal::Tile{ 0, unmapped_rows_begin, width, y - unmapped_rows_begin });
+			unmapped_rows_begin = -1;
+		}
+		if (y == height)
+			break;
+
+		size_t dst_row = static_cast<size_t>(y) * width;
+		size_t src_row = static_cast<size_t>(row_map[y]) * width;
+		int unmapped_columns_begin = -1;
+		for (int x = 0; x <= width; ++x)
+		{
+			if (x < width && column_map[x] < 0)
+			{
+				if (unmapped_columns_begin < 0)
+					unmapped_columns_begin = x;
+				continue;
+			}
+
+			if (unmapped_columns_begin >= 0)
+			{
+				exposed.push_back(Fractal::Tile{ unmapped_columns_begin, y, x - unmapped_columns_begin, 1 });
+				unmapped_columns_begin = -1;
+			}
+			if (x == width)
+				break;
+
+			resampled_iterations[dst_row + x] = iterations[src_row + column_map[x]];
+			if (has_distance)
+				resampled_distance[dst_row + x] = distance[src_row + column_map[x]] * distance_scale;
+			if (has_smooth)
+				resampled_smooth[dst_row + x] = smooth[src_row + column_map[x]];
+			if (has_state)
+			{
+				resampled_zx[dst_row + x] = orbit_zx[src_row + column_map[x]];
+				resampled_zy[dst_row + x] = orbit_zy[src_row + column_map[x]];
+				resampled_iter[dst_row + x] = orbit_iter[src_row + column_map[x]];
+				resampled_done[dst_row + x] = orbit_done[src_row + column_map[x]];
+			}
+		}
+	}
+
+	std::swap(iterations, resampled_iterations);
+	if (has_distance)
+		std::swap(distance, resampled_distance);
+	if (has_smooth)
+		std::swap(smooth, resampled_smooth);
+	if (has_state)
+	{
+		std::swap(orbit_zx, resampled_zx);
+		std::swap(orbit_zy, resampled_zy);
+		std::swap(orbit_iter, resampled_iter);
+		std::swap(orbit_done, resampled_done);
+	}
+	return true;
+}
+
+Fractal::OrbitState Renderer::orbitState()
+{
+	return Fractal::OrbitState{ orbit_zx.data(), orbit_zy.data(), orbit_iter.data(), orbit_done.data() };
+}
+
+/*
+* Squared distance in pixels from the focus to the centre of a rectangle of the frame, which orders tiles by how soon they are wanted.
+*/
+long long Renderer::focusDistance(const Fractal::Tile& rect) const
+{
+	long long x = focus_x < 0 ? width / 2 : focus_x;
+	long long y = focus_y < 0 ? height / 2 : focus_y;
+	long long dx = 2 * rect.x + rect.width - 2 * x;
+	long long dy = 2 * rect.y + rect.height - 2 * y;
+	return (dx * dx + dy * dy) / 4;
+}
+
+/*
+* Called by the job which finished the last tile around the focus, to time how long the user waited for the part they are looking at.
+*/
+void Renderer::regionDone()
+{
+	std::chrono::duration<double, std::milli> elapsed = std::chrono::high_resolution_clock::now() - frame_start;
+	region_ms = elapsed.count();
+}
+
+/*
+* Whether a newer render generation was started since this render began.
+*/
+bool Renderer::cancelled() const
+{
+	return current_generation && current_generation->load(std::memory_order_relaxed) != generation;
+}
+
+void Renderer::markMissing(const Fractal::Tile& rect)
+{
+	for (int y = rect.y; y < rect.y + rect.height; ++y)
+	{
+		int* row = &iterations[static_cast<size_t>(y) * width];
+		std::fill(row + rect.x, row + rect.x + rect.width, missing_iteration);
+	}
+}
+
+/*
+* After a cancelled render the pixels it skipped hold missing_iteration, wherever the shift or resample since moved them. Every rectangle
+* in exposed is marked as missing as well, and exposed is rebuilt from the frame as the rows of each tile which have any missing pixels,
+* so that no pixel is computed twice and the tiles the cancelled render finished are kept.
+*/
+void Renderer::collectMissing(int tile_size)
+{
+	for (const Fractal::Tile& rect : exposed)
+		markMissing(rect);
+	exposed.clear();
+
+	for (int tile_y = 0; tile_y < height; tile_y += tile_size)
+	{
+		int tile_height = std::min(tile_size, height - tile_y);
+		for (int tile_x = 0; tile_x < width; tile_x += tile_size)
+		{
+			int tile_width = std::min(tile_size, width - tile_x);
+			int first = -1;
+			int last = -1;
+			for (int y = tile_y; y < tile_y + tile_height; ++y)
+			{
+				const int* row = &iterations[static_cast<size_t>(y) * width + tile_x];
+				if (std::find(row, row + tile_width, missing_iteration) == row + tile_width)
+					continue;
+				if (first < 0)
+					first = y;
+				last = y;
+			}
+			if (first >= 0)
+				exposed.push_back(Fractal::Tile{ tile_x, first, tile_width, last - first + 1 });
+		}
+	}
+}
+
+/*
+* Compute one pass of a progressive render. The first pass computes every stride-th pixel of every stride-th row. Each following pass,
+* at half the stride of the one before, computes the pixels of its grid which the coarser passes did not, those at an odd multiple of
+* the stride in x or y. Those are three regular grids with twice the stride, offset by (stride, 0), (0, stride) and (stride, stride).
+* Every grid is computed as a small matrix of its own with a coarser viewport, tile by tile, and each tile is scattered into the frame
+* right away, so no pixel is ever computed twice and a cancelled pass keeps the tiles it finished. The tiles of all grids are computed
+* in one batch, those closest to the focus first. Returns false if it was cancelled.
+*/
+bool Renderer::computePass(Fractal& fractal, const Fractal::Viewport& vp, bool AVX, bool want_distance, int stride, bool first)
+{
+	struct Grid {
+		int x, y;
+		int step;
+		int columns = 0, rows = 0;
+		int* matrix = nullptr;
+		float* dist = nullptr;
+		float* smo = nullptr;
+		Fractal::OrbitState orbit = {};
+		Fractal::Viewport vp = {};
+	};
+	// A tile of one of the grids, in pixels of the grid
+	struct PassTile {
+		int grid;
+		Fractal::Tile tile;
+		long long priority;
+	};
+
+	Grid grids[3] = { { first ? 0 : stride, 0, first ? stride : stride * 2 }, { 0, stride, stride * 2 }, { stride, stride, stride * 2 } };
+	int grid_count = first ? 1 : 3;
+	bool guess = solid_guessing && !first && !has_distance && !has_smooth;
+
+	// The coarse grids are small, so their tiles are made smaller as well to still give every pool thread some work
+	int tile_size = std::max(min_pass_tile_size, fractal.tile_size * 2 / grids[0].step);
+	int tile_count = 0;
+	for (int g = 0; g < grid_count; ++g)
+	{
+		Grid& grid = grids[g];
+		grid.columns = std::max(0, (width - grid.x + grid.step - 1) / grid.step);
+		grid.rows = std::max(0, (height - grid.y + grid.step - 1) / grid.step);
+
+		size_t count = static_cast<size_t>(grid.columns) * grid.rows;
+		grid.matrix = scratch.allocate<int>(count);
+		grid.dist = want_distance ? scratch.allocate<float>(count) : nullptr;
+		grid.smo = has_smooth ? scratch.allocate<float>(count) : nullptr;
+		grid.orbit = Fractal::OrbitState{ nullptr, nullptr, nullptr, nullptr };
+		if (has_state)
+			grid.orbit = Fractal::OrbitState{ scratch.allocate<double>(count), scratch.allocate<double>(count), scratch.allocate<int>(count), scratch.allocate<unsigned char>(count) };
+		grid.vp = Fractal::Viewport{ vp.x_origin + grid.x * vp.x_step, vp.y_origin + grid.y * vp.y_step, vp.x_step * grid.step, vp.y_step * grid.step };
+
+		tile_count += ((grid.columns + tile_size - 1) / tile_size) * ((grid.rows + tile_size - 1) / tile_size);
+	}
+
+	PassTile* tiles = scratch.allocate<PassTile>(tile_count);
+	int count = 0;
+	for (int g = 0; g < grid_count; ++g)
+	{
+		const Grid& grid = grids[g];
+		for (int y = 0; y < grid.rows; y += tile_size)
+		{
+			for (int x = 0; x < grid.columns; x += tile_size)
+			{
+				Fractal::Tile tile{ x, y, std::min(tile_size, grid.columns - x), std::min(tile_size, grid.rows - y) };
+				Fractal::Tile covered{ grid.x + x * grid.step, grid.y + y * grid.step, tile.width * grid.step, tile.height * grid.step };
+				tiles[count++] = PassTile{ g, tile, focusDistance(covered) };
+			}
+		}
+	}
+	std::sort(tiles, tiles + count, [](const PassTile& a, const PassTile& b) {return a.priority < b.priority; });
+
+	// Only the last pass finishes the region around the focus
+	int region = 0;
+	while (stride == 1 && region < count && tiles[region].priority <= static_cast<long long>(focus_radius) * focus_radius)
+		region += 1;
+	std::atomic<int> region_left(region);
+
+	std::atomic<bool> skipped(false);
+	t_pool->run(count, [&](int index) {
+		if (cancelled())
+		{
+			skipped.store(true, std::memory_order_relaxed);
+			return;
+		}
+
+		const Grid& grid = grids[tiles[index].grid];
+		const Fractal::Tile& tile = tiles[index].tile;
+		if (!guess || !guessTile(stride, tile, grid.x, grid.y, grid.step))
+		{
+			if (has_state)
+				fractal.computeTileState(grid.matrix, grid.orbit, grid.columns, tile, grid.vp, 0, limit);
+			else
+				fractal.computeTile(grid.matrix, grid.dist, grid.columns, tile, grid.vp, AVX, grid.smo);
+
+			for (int row = tile.y; row < tile.y + tile.height; ++row)
+			{
+				for (int column = tile.x; column < tile.x + tile.width; ++column)
+				{
+					size_t src = static_cast<size_t>(row) * grid.columns + column;
+					size_t dst = static_cast<size_t>(grid.y + row * grid.step) * width + grid.x + column * grid.step;
+					iterations[dst] = grid.matrix[src];
+					// Distances are in pixels of the grid
+					if (grid.dist)
+						distance[dst] = grid.dist[src] * grid.step;
+					if (grid.smo)
+						smooth[dst] = grid.smo[src];
+					if (has_state)
+					{
+						orbit_zx[dst] = grid.orbit.zx[src];
+						orbit_zy[dst] = grid.orbit.zy[src];
+						orbit_iter[dst] = grid.orbit.iter[src];
+						orbit_done[dst] = grid.orbit.done[src];
+					}
+				}
+			}
+		}
+
+		if (index < region && region_left.fetch_sub(1) == 1)
+			regionDone();
+	});
+
+	return !skipped.load();
+}
+
+/*
+* The key of the lattice of the tile cache the frame lies on, with the values this renderer keeps, see TileCache::latticeKey.
+*/
+void Renderer::cacheLattice(const Fractal::Viewport& vp, const Fractal::FormulaParams& formula, bool AVX, TileCache::Key& key, long long& origin_x, long long& origin_y) const
+{
+	int layout = (has_distance ? TileCache::DISTANCE : 0) | (has_smooth ? TileCache::SMOOTH : 0) | (has_state ? TileCache::STATE : 0);
+	// Only the standard kernel iterates in long double, the others agree with each other to the last bit
+	bool extended = !AVX && !has_distance && !has_smooth && !has_state && !formula.distance_estimation;
+	key = TileCache::latticeKey(vp, formula, layout, extended ? TileCache::EXTENDED : TileCache::DOUBLE, origin_x, origin_y);
+}
+
+// Rounds towards negative infinity, for lattice coordinates left of or above the origin
+static long long floorDiv(long long a, long long b)
+{
+	return a / b - ((a % b != 0) && ((a < 0) != (b < 0)));
+}
+
+/*
+* Copy the cached tiles which overlap the exposed rectangles into the frame, from the tile store when the cache does not have them. If
+* there are any, the rest of the exposed rectangles is marked as missing and exposed is cleared, to be collected again with collectMissing.
+* Returns the number of pixels copied.
+*/
+long long Renderer::fillFromCache(const Fractal::Viewport& vp, const Fractal::FormulaParams& formula, bool AVX)
+{
+	// A cached tile and the part of an exposed rectangle it covers
+	struct Piece {
+		size_t tile;					// Index into found
+		Fractal::Tile rect;
+		int x, y;						// Top left pixel of the tile in the frame
+	};
+
+	constexpr int size = TileCache::tile_size;
+	TileCache::Key key;
+	long long origin_x, origin_y;
+	cacheLattice(vp, formula, AVX, key, origin_x, origin_y);
+
+	// Every tile which overlaps an exposed rectangle is looked up once, however many rectangles overlap it
+	long long first_x = floorDiv(origin_x + exposed[0].x, size), first_y = floorDiv(origin_y + exposed[0].y, size);
+	long long last_x = first_x, last_y = first_y;
+	size_t piece_count = 0;
+	for (const Fractal::Tile& rect : exposed)
+	{
+		long long left = floorDiv(origin_x + rect.x, size), right = floorDiv(origin_x + rect.x + rect.width - 1, size);
+		long long top = floorDiv(origin_y + rect.y, size), bottom = floorDiv(origin_y + rect.y + rect.height - 1, size);
+		first_x = std::min(first_x, left);
+		first_y = std::min(first_y, top);
+		last_x = std::max(last_x, right);
+		last_y = std::max(last_y, bottom);
+		piece_count += static_cast<size_t>((right - left + 1) * (bottom - top + 1));
+	}
+	int columns = static_cast<int>(last_x - first_x + 1);
+	size_t tile_count = static_cast<size_t>(columns) * (last_y - first_y + 1);
+	// Per tile: 0 not looked up yet, 1 found, 2 neither cached nor stored. Stored tiles are copied straight out of the mapped file
+	TileCache::Tile* found = scratch.allocate<TileCache::Tile>(tile_count);
+	unsigned char* looked_up = scratch.allocate<unsigned char>(tile_count);
+	std::memset(looked_up, 0, tile_count);
+
+	Piece* pieces = scratch.allocate<Piece>(piece_count);
+	int count = 0;
+	long long filled = 0;
+	for (const Fractal::Tile& rect : exposed)
+	{
+		for (long long ty = floorDiv(origin_y + rect.y, size); ty <= floorDiv(origin_y + rect.y + rect.height - 1, size); ++ty)
+		{
+			for (long long tx = floorDiv(origin_x + rect.x, size); tx <= floorDiv(origin_x + rect.x + rect.width - 1, size); ++tx)
+			{
+				size_t t = static_cast<size_t>(ty - first_y) * columns + (tx - first_x);
+				if (!looked_up[t])
+				{
+					key.tile_x = tx;
+					key.tile_y = ty;
+					const TileCache::Tile* cached = tile_cache->find(key);
+					if (cached)
+						found[t] = *cached;
+					looked_up[t] = cached || (tile_store && tile_store->find(key, found[t])) ? 1 : 2;
+				}
+				if (looked_up[t] != 1)
+					continue;
+
+				int x = static_cast<int>(tx * size - origin_x);
+				int y = static_cast<int>(ty * size - origin_y);
+				int left = std::max(x, rect.x);
+				int top = std::max(y, rect.y);
+				int right = std::min(x + size, rect.x + rect.width);
+				int bottom = std::min(y + size, rect.y + rect.height);
+				pieces[count++] = Piece{ t, Fractal::Tile{ left, top, right - left, bottom - top }, x, y };
+				filled += static_cast<long long>(right - left) * (bottom - top);
+			}
+		}
+	}
+	if (count == 0)
+		return 0;
+
+	// Whatever the cache does not cover is left missing, for collectMissing to gather into the rectangles to compute
+	for (const Fractal::Tile& rect : exposed)
+		markMissing(rect);
+	exposed.clear();
+
+	// The pieces of a tile are copied by one job, which unpacks its iteration values once. A resampled frame exposes many short spans
+	int* tile_pieces = scratch.allocate<int>(tile_count + 1);
+	std::memset(tile_pieces, 0, (tile_count + 1) * sizeof(int));
+	for (int i = 0; i < count; ++i)
+		tile_pieces[pieces[i].tile + 1] += 1;
+	int* job_tiles = scratch.allocate<int>(tile_count);
+	int job_count = 0;
+	for (size_t t = 0; t < tile_count; ++t)
+	{
+		if (tile_pieces[t + 1] > 0)
+			job_tiles[job_count++] = static_cast<int>(t);
+		tile_pieces[t + 1] += tile_pieces[t];
+	}
+	Piece* sorted = scratch.allocate<Piece>(count);
+	int* next_piece = scratch.allocate<int>(tile_count);
+	std::memcpy(next_piece, tile_pieces, tile_count * sizeof(int));
+	for (int i = 0; i < count; ++i)
+		sorted[next_piece[pieces[i].tile]++] = pieces[i];
+
+#ifdef PRINT_INFO
+	auto decode_start = std::chrono::high_resolution_clock::now();
+#endif
+	t_pool->run(job_count, [&](int job) {
+		int t = job_tiles[job];
+		const TileCache::Tile& tile = found[t];
+		const Piece* first = sorted + tile_pieces[t];
+		const Piece* last = sorted + tile_pieces[t + 1];
+
+		// A whole tile is unpacked right into the frame, part of one into a tile of its own first
+		int unpacked[size * size];
+		bool whole = last - first == 1 && first->rect.width == size && first->rect.height == size;
+		int* values = whole ? &iterations[static_cast<size_t>(first->y) * width + first->x] : unpacked;
+		if (!decodeIterations(tile.iterations, tile.iterations_bytes, values, size, size, whole ? width : size))
+		{
+			// Left for collectMissing, to be computed
+			for (const Piece* piece = first; piece != last; ++piece)
+				markMissing(piece->rect);
+			return;
+		}
+
+		for (const Piece* piece = first; piece != last; ++piece)
+		{
+			for (int row = piece->rect.y; row < piece->rect.y + piece->rect.height; ++row)
+			{
+				size_t src = static_cast<size_t>(row - piece->y) * size + piece->rect.x - piece->x;
+				size_t dst = static_cast<size_t>(row) * width + piece->rect.x;
+				size_t n = piece->rect.width;
+				if (!whole)
+					std::memcpy(&iterations[dst], unpacked + src, n * sizeof(int));
+				if (tile.distance)
+					std::memcpy(&distance[dst], tile.distance + src, n * sizeof(float));
+				if (tile.smooth)
+					std::memcpy(&smooth[dst], tile.smooth + src, n * sizeof(float));
+				if (tile.zx)
+				{
+					std::memcpy(&orbit_zx[dst], tile.zx + src, n * sizeof(double));
+					std::memcpy(&orbit_zy[dst], tile.zy + src, n * sizeof(double));
+					std::memcpy(&orbit_iter[dst], tile.iter + src, n * sizeof(int));
+					std::memcpy(&orbit_done[dst], tile.done + src, n * sizeof(unsigned char));
+				}
+			}
+		}
+	});
+#ifdef PRINT_INFO
+	double decode_ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - decode_start).count();
+	std::cout << "Tile codec: unpacked " << job_count << " tiles, " << static_cast<double>(job_count) * size * size * sizeof(int) / 1e6 / decode_ms <<
+		" GB/s with copying" << std::endl;
+#endif
+	return filled;
+}
+
+/*
+* Store the cache tiles which lie entirely within the (complete) frame and are not cached yet. The ones which are get marked as recently
+* used, so the tiles of the current view are the last to be evicted. A writable tile store gets every such tile it does not have yet.
+*/
+void Renderer::storeInCache()
+{
+	struct Piece {
+		TileCache::Tile tile;
+		int x, y;
+	};
+
+	constexpr int size = TileCache::tile_size;
+	TileCache::Key key;
+	long long origin_x, origin_y;
+	cacheLattice(viewport, params, use_AVX, key, origin_x, origin_y);
+
+	long long first_x = floorDiv(origin_x + size - 1, size);
+	long long first_y = floorDiv(origin_y + size - 1, size);
+	long long end_x = floorDiv(origin_x + width, size);
+	long long end_y = floorDiv(origin_y + height, size);
+	if (end_x <= first_x || end_y <= first_y)
+		return;
+
+	// Iteration values are packed in parallel, then the tiles are inserted at their packed size and filled in
+	struct Packed {
+		int x, y;
+		unsigned char* data;
+		size_t bytes;
+	};
+	size_t max_packed = maxEncodedBytes(size, size);
+	size_t candidates = static_cast<size_t>((end_x - first_x) * (end_y - first_y));
+	Packed* packed = scratch.allocate<Packed>(candidates);
+	unsigned char* packed_data = scratch.allocate<unsigned char>(candidates * max_packed);
+	int count = 0;
+	for (long long ty = first_y; ty < end_y; ++ty)
+	{
+		for (long long tx = first_x; tx < end_x; ++tx)
+		{
+			key.tile_x = tx;
+			key.tile_y = ty;
+			if (tile_cache->touch(key))
+				continue;
+			packed[count] = Packed{ static_cast<int>(tx * size - origin_x), static_cast<int>(ty * size - origin_y), packed_data + count * max_packed, 0 };
+			count += 1;
+		}
+	}
+
+#ifdef PRINT_INFO
+	auto encode_start = std::chrono::high_resolution_clock::now();
+#endif
+	t_pool->run(count, [&](int index) {
+		Packed& tile = packed[index];
+		tile.bytes = encodeIterations(&iterations[static_cast<size_t>(tile.y) * width + tile.x], size, size, width, tile.data);
+	});
+#ifdef PRINT_INFO
+	double encode_ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - encode_start).count();
+	size_t packed_bytes = 0;
+	for (int i = 0; i < count; ++i)
+		packed_bytes += packed[i].bytes;
+	if (count > 0)
+		std::cout << "Tile codec: packed " << count << " tiles " << static_cast<double>(count) * size * size * sizeof(int) / packed_bytes << ":1, " <<
+			static_cast<double>(count) * size * size * sizeof(int) / 1e6 / encode_ms << " GB/s" << std::endl;
+#endif
+
+	// Tiles inserted by this call must not evict each other before they are filled in
+	size_t limit_bytes = tile_cache->capacity() / 2;
+	size_t batch_bytes = 0;
+	Piece* pieces = scratch.allocate<Piece>(count);
+	int piece_count = 0;
+	for (int i = 0; i < count; ++i)
+	{
+		key.tile_x = floorDiv(origin_x + packed[i].x, size);
+		key.tile_y = floorDiv(origin_y + packed[i].y, size);
+		batch_bytes += TileCache::tileBytes(key.layout, packed[i].bytes);
+		if (piece_count > 0 && batch_bytes > limit_bytes)
+			break;
+		pieces[piece_count++] = Piece{ *tile_cache->insert(key, packed[i].bytes), packed[i].x, packed[i].y };
+		std::memcpy(pieces[piece_count - 1].tile.iterations, packed[i].data, packed[i].bytes);
+	}
+
+	t_pool->run(piece_count, [&](int index) {
+		const Piece& piece = pieces[index];
+		const TileCache::Tile& tile = piece.tile;
+		for (int row = 0; row < size; ++row)
+		{
+			size_t src = static_cast<size_t>(piece.y + row) * width + piece.x;
+			size_t dst = static_cast<size_t>(row) * size;
+			if (tile.distance)
+				std::memcpy(tile.distance + dst, &distance[src], size * sizeof(float));
+			if (tile.smooth)
+				std::memcpy(tile.smooth + dst, &smooth[src], size * sizeof(float));
+			if (tile.zx)
+			{
+				std::memcpy(tile.zx + dst, &orbit_zx[src], size * sizeof(double));
+				std::memcpy(tile.zy + dst, &orbit_zy[src], size * sizeof(double));
+				std::memcpy(tile.iter + dst, &orbit_iter[src], size * sizeof(int));
+				std::memcpy(tile.done + dst, &orbit_done[src], size * sizeof(unsigned char));
+			}
+		}
+	});
+
+	// Appending to the store is serial, as it may have to map the file again
+	if (!tile_store || !tile_store->isWritable())
+		return;
+	for (long long ty = first_y; ty < end_y; ++ty)
+	{
+		for (long long tx = first_x; tx < end_x; ++tx)
+		{
+			key.tile_x = tx;
+			key.tile_y = ty;
+			const TileCache::Tile* tile = tile_cache->touch(key);
+			if (tile && !tile_store->contains(key))
+				tile_store->insert(key, *tile);
+		}
+	}
+}
+
+/*
+* Solid guessing: a pixel of a pass lies within a square of the previous pass's grid (twice the stride across), and if the 4 corners of
+* that square have the same iteration value (and are done, with orbit state) the pixel most likely has it too. If that holds for every
+* pixel of the tile it is filled in without computing it. Returns false, leaving the frame untouched, if any pixel has to be computed.
+*/
+bool Renderer::guessTile(int stride, const Fractal::Tile& tile, int grid_x, int grid_y, int step)
+{
+	int cell = stride * 2;
+	for (int pass = 0; pass < 2; ++pass)
+	{
+		for (int row = tile.y; row < tile.y + tile.height; ++row)
+		{
+			int y = grid_y + row * step;
+			int y0 = y - y % cell;
+			if (y0 + cell >= height)
+				return false;
+
+			for (int column = tile.x; column < tile.x + tile.width; ++column)
+			{
+				int x = grid_x + column * step;
+				int x0 = x - x % cell;
+				if (x0 + cell >= width)
+					return false;
+
+				size_t corners[4] = {
+					static_cast<size_t>(y0) * width + x0, static_cast<size_t>(y0) * width + x0 + cell,
+					static_cast<size_t>(y0 + cell) * width + x0, static_cast<size_t>(y0 + cell) * width + x0 + cell
+				};
+				int value = iterations[corners[0]];
+				for (size_t corner : corners)
+				{
+					if (iterations[corner] != value || (has_state && !orbit_done[corner]))
+						return false;
+				}
+
+				// The first pass only checks, the second fills in
+				if (pass == 1)
+				{
+					size_t i = static_cast<size_t>(y) * width + x;
+					iterations[i] = value;
+					if (has_state)
+					{
+						orbit_iter[i] = orbit_iter[corners[0]];
+						orbit_done[i] = 1;
+					}
+				}
+			}
+		}
+	}
+	return true;
+}
+
+/*
+* Show a pass of a progressive render. The pixels computed so far (every stride-th one of every stride-th row) are gathered into a small
+* matrix and colored, and every color is written into output as a stride x stride block.
+*/
+void Renderer::previewPass(ColorGenerator& cg, int* output, int stride, int n, bool AVX, bool want_distance)
+{
+	int columns = (width + stride - 1) / stride;
+	int rows = (height + stride - 1) / stride;
+	size_t count = static_cast<size_t>(columns) * rows;
+	size_t padded = (count + 7) & ~static_cast<size_t>(7);
+	int* preview = scratch.allocate<int>(padded);
+	float* preview_distance = want_distance ? scratch.allocate<float>(padded) : nullptr;
+	float* preview_smooth = has_smooth ? scratch.allocate<float>(padded) : nullptr;
+	int* line = scratch.allocate<int>(width);
+
+	for (int row = 0; row < rows; ++row)
+	{
+		for (int column = 0; column < columns; ++column)
+		{
+			size_t src = static_cast<size_t>(row) * stride * width + static_cast<size_t>(column) * stride;
+			size_t dst = static_cast<size_t>(row) * columns + column;
+			preview[dst] = iterations[src];
+			// Distances are in pixels of the preview
+			if (preview_distance)
+				preview_distance[dst] = distance[src] / stride;
+			if (preview_smooth)
+				preview_smooth[dst] = smooth[src];
+		}
+	}
+	std::fill(preview + count, preview + padded, 0);
+
+	if (AVX)
+		cg.generateAVX(preview, columns, rows, n, preview_distance, preview_smooth);
+	else
+		cg.generate(preview, columns, rows, n, preview_distance, preview_smooth);
+
+	for (int row = 0; row < rows; ++row)
+	{
+		for (int x = 0; x < width; ++x)
+			line[x] = preview[static_cast<size_t>(row) * columns + x / stride];
+		for (int y = row * stride; y < std::min(height, (row + 1) * stride); ++y)
+			std::memcpy(output + static_cast<size_t>(y) * width, line, width * sizeof(int));
+	}
+}
+
+/*
+* Runs ThreadPool jobs that compute the given rectangles of the iteration matrix. Large rectangles are split into tiles, and small ones
+* (like the single row spans left over by a resample) are batched together so that each job does a tile's worth of work.
+* The tiles of all jobs are laid out in the frame's scratch arena, job i working on tiles job_begin[i] to job_begin[i + 1].
+* Once the render is cancelled the remaining tiles are marked as missing instead of computed, and false is returned.
+* With orbit state the pixels are iterated from start to end iterations, otherwise start and end are ignored.
+* If cg is given, each tile is also handed to it to be colored as soon as it has been computed (see ColorGenerator::beginTiles).
+*/
+bool Renderer::computeTiles(Fractal& fractal, const Fractal::Tile* rects, int rect_count, const Fractal::Viewport& vp, bool AVX, bool want_distance, int start, int end, ColorGenerator* cg)
+{
+	int* tile_colors = colors;
+	int* matrix = iterations.data();
+	float* dist = want_distance ? distance.data() : nullptr;
+	float* smo = has_smooth ? smooth.data() : nullptr;
+	bool state = has_state;
+	Fractal::OrbitState orbit = orbitState();
+	int matrix_width = width;
+	int tile_size = fractal.tile_size;
+	long long batch_pixels = static_cast<long long>(tile_size) * tile_size;
+
+	int tile_count = 0;
+	for (int r = 0; r < rect_count; ++r)
+		tile_count += ((rects[r].width + tile_size - 1) / tile_size) * ((rects[r].height + tile_size - 1) / tile_size);
+
+	Fractal::Tile* tiles = scratch.allocate<Fractal::Tile>(tile_count);
+	int* job_begin = scratch.allocate<int>(static_cast<size_t>(tile_count) + 1);
+	int count = 0;
+	for (int r = 0; r < rect_count; ++r)
+	{
+		const Fractal::Tile& rect = rects[r];
+		for (int y = rect.y; y < rect.y + rect.height; y += tile_size)
+		{
+			for (int x = rect.x; x < rect.x + rect.width; x += tile_size)
+				tiles[count++] = Fractal::Tile{ x, y, std::min(tile_size, rect.x + rect.width - x), std::min(tile_size, rect.y + rect.height - y) };
+		}
+	}
+
+	// The pool hands out jobs in order, so sorting the tiles computes those closest to the focus first
+	std::sort(tiles, tiles + count, [this](const Fractal::Tile& a, const Fractal::Tile& b) {return focusDistance(a) < focusDistance(b); });
+
+	int jobs = 0;
+	long long pixels = 0;
+	job_begin[0] = 0;
+	for (int i = 0; i < count; ++i)
+	{
+		pixels += static_cast<long long>(tiles[i].width) * tiles[i].height;
+		if (pixels >= batch_pixels)
+		{
+			job_begin[++jobs] = i + 1;
+			pixels = 0;
+		}
+	}
+	if (count > job_begin[jobs])
+		job_begin[++jobs] = count;
+
+	// Only computing from scratch finishes the tiles around the focus
+	int region = 0;
+	while (start == 0 && region < count && focusDistance(tiles[region]) <= static_cast<long long>(focus_radius) * focus_radius)
+		region += 1;
+	std::atomic<int> region_left(region);
+
+	std::atomic<bool> skipped(false);
+	t_pool->run(jobs, [&](int job) {
+		for (int i = job_begin[job]; i < job_begin[job + 1]; ++i)
+		{
+			const Fractal::Tile& tile = tiles[i];
+			if (cancelled())
+			{
+				markMissing(tile);
+				skipped.store(true, std::memory_order_relaxed);
+				continue;
+			}
+			if (state)
+				fractal.computeTileState(matrix, orbit, matrix_width, tile, vp, start, end);
+			else
+				fractal.computeTile(matrix, dist, matrix_width, tile, vp, AVX, smo);
+			if (cg)
+				cg->colorTile(matrix, dist, smo, tile_colors, matrix_width, tile.x, tile.y, tile.width, tile.height, AVX);
+			if (i < region && region_left.fetch_sub(1) == 1)
+				regionDone();
+		}
+	});
+	return !skipped.load();
+}
+
+/*
+* The color generators work on a whole matrix in place, so a rectangle is gathered into its own small matrix, colored, and written
+* back to the same rectangle of the colors. The scratch matrix is padded so the AVX generator can always work 8 values at a time.
+*/
+void Renderer::colorRect(ColorGenerator& cg, const Fractal::Tile& rect, int n, bool AVX, bool want_distance)
+{
+	size_t area = static_cast<size_t>(rect.width) * rect.height;
+	size_t padded = (area + 7) & ~static_cast<size_t>(7);
+
+	int* color_scratch = scratch.allocate<int>(padded);
+	float* distance_scratch = want_distance ? scratch.allocate<float>(padded) : nullptr;
+	float* smooth_scratch = has_smooth ? scratch.allocate<float>(padded) : nullptr;
+
+	for (int y = 0; y < rect.height; ++y)
+	{
+		size_t src = static_cast<size_t>(rect.y + y) * width + rect.x;
+		std::memcpy(color_scratch + static_cast<size_t>(y) * rect.width, &iterations[src], rect.width * sizeof(int));
+		if (want_distance)
+			std::memcpy(distance_scratch + static_cast<size_t>(y) * rect.width, &distance[src], rect.width * sizeof(float));
+		if (has_smooth)
+			std::memcpy(smooth_scratch + static_cast<size_t>(y) * rect.width, &smooth[src], rect.width * sizeof(float));
+	}
+	std::fill(color_scratch + area, color_scratch + padded, 0);
+
+	if (AVX)
+		cg.generateAVX(color_scratch, rect.width, rect.height, n, distance_scratch, smooth_scratch);
+	else
+		cg.generate(color_scratch, rect.width, rect.height, n, distance_scratch, smooth_scratch);
+
+	for (int y = 0; y < rect.height; ++y)
+	{
+		size_t dst = static_cast<size_t>(rect.y + y) * width + rect.x;
+		std::memcpy(colors + dst, color_scratch + static_cast<size_t>(y) * rect.width, rect.width * sizeof(int));
+	}
+}
+
+/*
+* Write a rectangle of the colors to the same rectangle of the output, one row at a time. The output is read right after (to fill the
+* pixel buffer), so it is written through the cache.
+*/
+void Renderer::copyRect(int* output, const Fractal::Tile& rect)
+{
+	for (int y = rect.y; y < rect.y + rect.height; ++y)
+	{
+		size_t i = static_cast<size_t>(y) * width + rect.x;
+		std::memcpy(output + i, colors + i, rect.width * sizeof(int));
+	}
+}
+
+/*
+* Color the iteration values of the last frame again, for when only the color generator changed. The fractal is not touched, so this
+* costs the same at any zoom depth or iteration limit. Returns false if there is no frame to recolor (or it lacks the distance estimates
+* or smooth escape values the generator needs, or was cancelled), in which case render has to be called instead.
+*/
+bool Renderer::recolor(ColorGenerator& cg, int* output, bool AVX)
+{
+	bool want_distance = cg.color_mode == ColorGenerator::Generators::DISTANCE;
+	bool want_smooth = cg.color_mode == ColorGenerator::Generators::SMOOTH;
+	if (!valid || incomplete || pass_stride > 1 || want_distance != has_distance || want_smooth != has_smooth)
+		return false;
+
+	size_t pixels = static_cast<size_t>(width) * height;
+	std::memcpy(colors, iterations.data(), pixels * sizeof(int));
+	if (AVX)
+		cg.generateAVX(colors, width, height, params.max_iter, want_distance ? distance.data() : nullptr, want_smooth ? smooth.data() : nullptr);
+	else
+		cg.generate(colors, width, height, params.max_iter, want_distance ? distance.data() : nullptr, want_smooth ? smooth.data() : nullptr);
+
+	copyRect(output, Fractal::Tile{ 0, 0, width, height });
+	return true;
+}
+
+/*
+* Whether the last frame is complete and shows exactly this view, computed the way render would compute it now, so that rendering it
+* would only recolor it.
+*/
+bool Renderer::holds(const Fractal& fractal, const ColorGenerator& cg, int matrix_width, int matrix_height, bool AVX) const
+{
+	bool want_distance = cg.color_mode == ColorGenerator::Generators::DISTANCE;
+	bool want_smooth = cg.color_mode == ColorGenerator::Generators::SMOOTH;
+	bool want_state = resume_iterations && AVX && !want_distance && !want_smooth && !fractal.distance_estimation;
+	if (!valid || incomplete || pass_stride > 1 || width != matrix_width || height != matrix_height || use_AVX != AVX ||
+		has_distance != want_distance || has_smooth != want_smooth || has_state != want_state || params != fractal.getFormulaParams())
+		return false;
+	if (has_state && limit < fractal.maxIterations())
+		return false;
+
+	Fractal::Viewport vp = fractal.getViewport(matrix_width, matrix_height);
+	return std::abs(vp.x_step - viewport.x_step) <= std::abs(viewport.x_step) * 1e-9L &&
+		   std::abs(vp.y_step - viewport.y_step) <= std::abs(viewport.y_step) * 1e-9L &&
+		   std::abs((vp.x_origin - viewport.x_origin) / vp.x_step) < reuse_tolerance &&
+		   std::abs((vp.y_origin - viewport.y_origin) / vp.y_step) < reuse_tolerance;
+}
+
+/*
+* Render the current fractal into output, reusing as much of the previous frame as the change in viewport allows:
+*	- A pan by a whole number of pixels moves the old values and only computes the strips which scrolled into view.
+*	  With a per-pixel color generator only those strips are colored, and the returned frame lists them as the only dirty rectangles.
+*	- A zoom carries over the pixels which land exactly on the previous frame's grid and computes the remainder.
+*	- Any change to the formula (fractal, iterations, radius, ...) or the size of the frame computes every pixel.
+*
+* With resume_iterations (AVX only, no distance estimation) the orbit of every pixel is kept as well. Raising the iteration limit then
+* only continues the pixels which had not escaped, from where they stopped. With a frame_budget_ms the pixels are also iterated in slices
+* across several frames, sized to fit the budget, and the returned frame is pending until every pixel reached the iteration limit.
+*
+* A render which is cancelled through the generation token stops within one tile, writes nothing to output and returns a cancelled frame.
+* The tiles it finished are kept: the next render only computes what is still missing (after moving it along with a pan or zoom), and
+* outputs a full frame, as the cancelled one was never shown.
+*
+* With progressive, a whole new frame is computed over several renders instead: first every 8th pixel of every 8th row, then the pixels
+* in between at 1/4, 1/2 and full resolution, each pass only computing the pixels the coarser ones did not (see computePass). Every
+* render shows the frame so far in blocks and is pending until the last pass. A pan or zoom between passes keeps what was computed.
+*
+* Everything a frame needs for itself comes from the scratch arena, which is reset here, so once the buffers have grown to the frame
+* size a steady stream of frames makes no heap allocations (see heapAllocations).
+*/
+Renderer::Frame Renderer::render(Fractal& fractal, ColorGenerator& cg, int* output, int matrix_width, int matrix_height, bool AVX)
+{
+	Frame frame{ true, 0, 0, nullptr, 0, 0, false, false };
+	scratch.reset();
+#if defined(PRINT_INFO) && defined(COUNT_ALLOCATIONS)
+	long long allocations = heapAllocations();
+#endif
+
+	Fractal::Viewport vp = fractal.getViewport(matrix_width, matrix_height);
+	Fractal::FormulaParams new_params = fractal.getFormulaParams();
+	bool want_distance = cg.color_mode == ColorGenerator::Generators::DISTANCE;
+	bool want_smooth = cg.color_mode == ColorGenerator::Generators::SMOOTH;
+	bool want_state = resume_iterations && AVX && !want_distance && !want_smooth && !fractal.distance_estimation;
+	int max_iter = fractal.maxIterations();
+	size_t pixels = static_cast<size_t>(matrix_width) * matrix_height;
+
+	// With orbit state a higher iteration limit continues from the previous one, so only the rest of the formula has to match
+	Fractal::FormulaParams old_params = params;
+	bool more_iterations = has_state && new_params.max_iter > params.max_iter;
+	if (more_iterations)
+		old_params.max_iter = new_params.max_iter;
+
+	exposed.clear();
+	bool reusable = valid && width == matrix_width && height == matrix_height && old_params == new_params && use_AVX == AVX &&
+					has_distance == want_distance && has_smooth == want_smooth && has_state == want_state;
+
+	if (!reusable)
+	{
+		width = matrix_width;
+		height = matrix_height;
+		iterations.resize(pixels);
+		if (pixels > colors_capacity)
+		{
+			_mm_free(colors);
+			colors = allocateFrame(pixels);
+			colors_capacity = pixels;
+		}
+		has_distance = want_distance;
+		if (has_distance)
+			distance.resize(pixels);
+		has_smooth = want_smooth;
+		if (has_smooth)
+			smooth.resize(pixels);
+		has_state = want_state;
+		if (has_state)
+		{
+			orbit_zx.resize(pixels);
+			orbit_zy.resize(pixels);
+			orbit_iter.resize(pixels);
+			orbit_done.resize(pixels);
+		}
+		limit = has_state && frame_budget_ms > 0.0 ? std::min(max_iter, slice) : max_iter;
+		exposed.push_back(Fractal::Tile{ 0, 0, width, height });
+	}
+	else if (std::abs(vp.x_step - viewport.x_step) <= std::abs(viewport.x_step) * 1e-9L &&
+			 std::abs(vp.y_step - viewport.y_step) <= std::abs(viewport.y_step) * 1e-9L)
+	{
+		long double dx = (vp.x_origin - viewport.x_origin) / vp.x_step;
+		long double dy = (vp.y_origin - viewport.y_origin) / vp.y_step;
+		long double ix = std::round(dx);
+		long double iy = std::round(dy);
+
+		if (std::abs(dx - ix) < reuse_tolerance && std::abs(dy - iy) < reuse_tolerance && std::abs(ix) < width && std::abs(iy) < height)
+		{
+			frame.shift_x = static_cast<int>(ix);
+			frame.shift_y = static_cast<int>(iy);
+			shift(frame.shift_x, frame.shift_y, exposed);
+			// Nothing moved, so only the colors can have changed and every pixel is recolored
+			frame.full = exposed.empty();
+		}
+		else
+		{
+			exposed.push_back(Fractal::Tile{ 0, 0, width, height });
+		}
+	}
+	else if (!resample(vp, exposed))
+	{
+		exposed.push_back(Fractal::Tile{ 0, 0, width, height });
+	}
+
+	// A progressive render goes on with its next pass as long as the view stays the same. Otherwise the pixels its passes did not get to
+	// yet are missing, and are filled in like those of a cancelled render
+	bool continue_passes = reusable && exposed.empty() && pass_stride > 1;
+	if (pass_stride > 1 && !continue_passes)
+	{
+		incomplete = incomplete || reusable;
+		pass_stride = 1;
+	}
+
+	if (reusable && incomplete)
+	{
+		collectMissing(fractal.tile_size);
+		frame.full = true;
+	}
+
+	// Tiles cached from earlier frames are copied in rather than computed. With orbit state they hold the orbits at the iteration limit,
+	// so they only fit a frame which iterates straight to it, which a new frame is then made to do
+	long long cached = 0;
+	if (tile_cache && !continue_passes && !exposed.empty() && (!has_state || limit == max_iter || !reusable))
+	{
+		cached = fillFromCache(vp, new_params, AVX);
+		if (cached > 0)
+		{
+			collectMissing(fractal.tile_size);
+			frame.full = true;
+			if (has_state)
+				limit = max_iter;
+		}
+	}
+
+	long long computed = 0;
+	for (const Fractal::Tile& rect : exposed)
+		computed += static_cast<long long>(rect.width) * rect.height;
+
+	auto render_start = std::chrono::high_resolution_clock::now();
+	if (!continue_passes)
+	{
+		frame_start = render_start;
+		region_ms = -1.0;
+	}
+
+	// A whole new frame is computed in progressive passes, one per render. Until the last one every render only shows the frame so far
+	bool start_passes = progressive && !continue_passes && computed == static_cast<long long>(pixels);
+	bool complete = true;
+	int stride = 1;
+	if (start_passes || continue_passes)
+	{
+		stride = start_passes ? coarsest_stride : pass_stride / 2;
+		if (start_passes)
+			markMissing(Fractal::Tile{ 0, 0, width, height });
+		complete = computePass(fractal, vp, AVX, want_distance, stride, start_passes);
+		exposed.clear();
+		computed = static_cast<long long>(pixels) / (stride * stride) - (start_passes ? 0 : static_cast<long long>(pixels) / (stride * stride * 4));
+		frame.full = true;
+	}
+	frame.reused_pixels = static_cast<long long>(pixels) - computed;
+
+	// When every pixel that needs a new color passes through a tile job, each tile is colored right after it is computed. That is the case
+	// when the whole frame is computed or continued, and for a pan with a generator which colors each pixel on its own
+	bool histogram = cg.color_mode == ColorGenerator::Generators::HISTOGRAM;
+	bool advance = stride == 1 && has_state && limit < max_iter && computed < static_cast<long long>(pixels);
+	bool whole = advance || computed == static_cast<long long>(pixels);
+	bool fused = stride == 1 && fused_coloring && (whole || (!frame.full && !histogram)) &&
+				 cg.beginTiles(width, height, max_iter, want_distance ? distance.data() : nullptr, want_smooth ? smooth.data() : nullptr);
+	ColorGenerator* tile_cg = fused ? &cg : nullptr;
+
+	// Pixels which scrolled into view are brought up to the same iteration count as the rest of the frame
+	if (complete)
+		complete = computeTiles(fractal, exposed.data(), static_cast<int>(exposed.size()), vp, AVX, want_distance, 0, limit, advance ? nullptr : tile_cg);
+
+	// Continue every pixel which has not escaped yet, by one slice or all the way to the iteration limit. If this is cancelled the tiles
+	// which were not continued are recomputed from scratch later, so every pixel which is not missing is at the new limit
+	if (advance && complete)
+	{
+		int end = frame_budget_ms > 0.0 ? std::min(max_iter, limit + slice) : max_iter;
+		Fractal::Tile whole_frame{ 0, 0, width, height };
+		complete = computeTiles(fractal, &whole_frame, 1, vp, AVX, want_distance, limit, end, tile_cg);
+		limit = end;
+		frame.full = true;
+	}
+	frame.pending = (has_state && limit < max_iter) || stride > 1;
+
+	valid = true;
+	use_AVX = AVX;
+	viewport = vp;
+	params = new_params;
+	incomplete = !complete;
+	pass_stride = complete ? stride : 1;
+
+	if (!complete)
+	{
+		frame.cancelled = true;
+#ifdef PRINT_INFO
+		std::cout << "Cancelled" << std::endl;
+#endif
+		return frame;
+	}
+
+	// Size the next slice so that a frame takes about frame_budget_ms
+	if (has_state && frame_budget_ms > 0.0 && stride == 1)
+	{
+		std::chrono::duration<double, std::milli> elapsed = std::chrono::high_resolution_clock::now() - render_start;
+		if (elapsed.count() < frame_budget_ms * 0.5)
+			slice = std::min(slice * 2, std::max(max_iter, initial_slice));
+		else if (elapsed.count() > frame_budget_ms)
+			slice = std::max(slice / 2, min_slice);
+	}
+
+#ifdef PRINT_INFO
+	std::cout << "Reused " << frame.reused_pixels << " of " << pixels << " pixels" << std::endl;
+	if (stride > 1)
+		std::cout << "Progressive pass at 1/" << stride << " resolution" << std::endl;
+	if (stride == 1 && region_ms >= 0.0)
+	{
+		std::chrono::duration<double, std::milli> frame_ms = std::chrono::high_resolution_clock::now() - frame_start;
+		std::cout << "Region around the focus after " << region_ms << " ms, whole frame after " << frame_ms.count() << " ms" << std::endl;
+	}
+	if (has_state)
+		std::cout << "Iterated up to " << limit << " of " << max_iter << " iterations" << std::endl;
+#endif
+
+	// The histogram generator depends on every pixel of the frame
+	int n = max_iter;
+	if (histogram)
+		frame.full = true;
+
+	if (fused)
+		cg.endTiles(iterations.data(), colors, width, height, AVX);
+
+	if (stride > 1)
+	{
+		frame.shift_x = 0;
+		frame.shift_y = 0;
+		previewPass(cg, output, stride, n, AVX, want_distance);
+	}
+	else if (frame.full)
+	{
+		frame.shift_x = 0;
+		frame.shift_y = 0;
+		if (!fused)
+		{
+			std::memcpy(colors, iterations.data(), pixels * sizeof(int));
+			if (AVX)
+				cg.generateAVX(colors, width, height, n, want_distance ? distance.data() : nullptr, want_smooth ? smooth.data() : nullptr);
+			else
+				cg.generate(colors, width, height, n, want_distance ? distance.data() : nullptr, want_smooth ? smooth.data() : nullptr);
+		}
+		copyRect(output, Fractal::Tile{ 0, 0, width, height });
+	}
+	else
+	{
+		for (const Fractal::Tile& rect : exposed)
+		{
+			if (!fused)
+				colorRect(cg, rect, n, AVX, want_distance);
+			copyRect(output, rect);
+		}
+		frame.dirty = exposed.data();
+		frame.dirty_count = static_cast<int>(exposed.size());
+	}
+
+	// Keep what was computed for later frames, once it is final
+	if (tile_cache && stride == 1 && (computed > 0 || advance) && (!has_state || limit == max_iter))
+		storeInCache();
+
+#ifdef PRINT_INFO
+	if (tile_cache)
+	{
+		TileCache::Stats stats = tile_cache->statistics();
+		std::cout << "Tile cache: copied " << cached << " pixels, " << stats.hits << " hits, " << stats.misses << " misses, " <<
+			tile_cache->size() << " tiles in " << tile_cache->bytes() / (1024 * 1024) << " of " << tile_cache->capacity() / (1024 * 1024) << " MiB" << std::endl;
+	}
+	if (tile_cache && tile_store)
+	{
+		TileStore::Stats stats = tile_store->statistics();
+		std::cout << "Tile store: " << stats.hits << " hits, " << stats.misses << " misses, " << stats.insertions << " stored, " <<
+			stats.corrupt << " corrupt, " << tile_store->size() << " tiles" << std::endl;
+	}
+	std::cout << "Scratch arena: " << scratch.capacity() / 1024 << " KiB";
+#ifdef COUNT_ALLOCATIONS
+	std::cout << ", heap allocations: " << heapAllocations() - allocations;
+#endif
+	std::cout << std::endl;
+#endif
+
+	return frame;
+}
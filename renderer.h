@@ -0,0 +1,121 @@
+/*
+* Declares Renderer, which turns the current Fractal and ColorGenerator state into a frame of colors while keeping the iteration values
+* of the previous frame around, so that pans and zooms only compute the pixels which were not already in view.
+*/
+
+#pragma once
+
+#include "arena.h"
+#include "color.h"
+#include "fractal.h"
+#include "thread_pool.h"
+#include "tile_cache.h"
+#include "tile_store.h"
+
+#include <atomic>
+#include <chrono>
+#include <vector>
+
+class Renderer
+{
+	ThreadPool* t_pool;
+
+	// Iteration values (and distance estimates or smooth escape values) of the last frame, in the same layout as the output matrix
+	std::vector<int> iterations;
+	std::vector<float> distance;
+	std::vector<float> smooth;
+	std::vector<int> resampled_iterations;
+	std::vector<float> resampled_distance;
+	std::vector<float> resampled_smooth;
+
+	// Orbit of every pixel, so that raising the iteration limit only continues the pixels which have not escaped yet
+	std::vector<double> orbit_zx, orbit_zy;
+	std::vector<int> orbit_iter;
+	std::vector<unsigned char> orbit_done;
+	std::vector<double> resampled_zx, resampled_zy;
+	std::vector<int> resampled_iter;
+	std::vector<unsigned char> resampled_done;
+
+	// Colors of the last frame. They are kept in host memory so the color stage never reads back from the output, and are copied into it
+	// once they are final. Only the dirty rectangles of a frame are current
+	int* colors;
+	size_t colors_capacity;
+
+	// Temporaries of a single frame (tile lists, resample maps, scratch matrices), all freed at once when the next frame starts.
+	// After the first few frames it holds everything a frame needs, so rendering does not touch the heap
+	Arena scratch;
+	// Rectangles of the frame which had to be computed, kept between frames for their capacity
+	std::vector<Fractal::Tile> exposed;
+
+	// What the last frame was rendered with
+	bool valid;
+	int width;
+	int height;
+	bool use_AVX;
+	bool has_distance;
+	bool has_smooth;
+	bool has_state;
+	int limit;							// With orbit state, every pixel which is not done has been iterated this many times
+	int slice;							// Iterations to advance by per frame when the frame time is limited
+	bool incomplete;					// The last render was cancelled: the tiles it skipped hold missing_iteration, and it was never output
+	int pass_stride;					// Stride of the last pass of a progressive render, 1 once every pixel has been computed
+	std::chrono::high_resolution_clock::time_point frame_start;	// When the current frame (or its first pass) started rendering
+	double region_ms;					// Time from frame_start until the tiles around the focus were computed, < 0 until then
+	Fractal::Viewport viewport;
+	Fractal::FormulaParams params;
+
+	void shift(int dx, int dy, std::vector<Fractal::Tile>& exposed);
+	bool resample(const Fractal::Viewport& vp, std::vector<Fractal::Tile>& exposed);
+	Fractal::OrbitState orbitState();
+	long long focusDistance(const Fractal::Tile& rect) const;
+	void regionDone();
+	bool cancelled() const;
+	void markMissing(const Fractal::Tile& rect);
+	void collectMissing(int tile_size);
+	bool computePass(Fractal& fractal, const Fractal::Viewport& vp, bool AVX, bool want_distance, int stride, bool first);
+	void cacheLattice(const Fractal::Viewport& vp, const Fractal::FormulaParams& formula, bool AVX, TileCache::Key& key, long long& origin_x, long long& origin_y) const;
+	long long fillFromCache(const Fractal::Viewport& vp, const Fractal::FormulaParams& formula, bool AVX);
+	void storeInCache();
+	bool guessTile(int stride, const Fractal::Tile& tile, int grid_x, int grid_y, int step);
+	void previewPass(ColorGenerator& cg, int* output, int stride, int n, bool AVX, bool want_distance);
+	bool computeTiles(Fractal& fractal, const Fractal::Tile* rects, int rect_count, const Fractal::Viewport& vp, bool AVX, bool want_distance, int start, int end, ColorGenerator* cg);
+	void colorRect(ColorGenerator& cg, const Fractal::Tile& rect, int n, bool AVX, bool want_distance);
+	void copyRect(int* output, const Fractal::Tile& rect);
+
+public:
+	struct Frame {
+		bool full;							// The whole output was written
+		int shift_x, shift_y;				// The previous frame moved by this many pixels, i.e. new pixel (x, y) is old pixel (x + shift_x, y + shift_y)
+		const Fractal::Tile* dirty;			// When not full, the only rectangles of the output which were written. Valid until the next render
+		int dirty_count;
+		long long reused_pixels;
+		bool pending;						// Some pixels have not been computed at full resolution or iterated up to the iteration limit yet,
+											// so render again to continue them
+		bool cancelled;						// The render was cancelled and nothing was written to the output
+	};
+
+	bool resume_iterations;		// Keep the orbit of every pixel, which only works with AVX and without distance estimation or smooth escape values
+	double frame_budget_ms;		// Time to spend iterating per frame before showing what is there. 0 iterates every pixel to completion
+	bool fused_coloring;		// Color each tile right after computing it rather than in a second pass over the frame
+	bool progressive;			// Compute a whole new frame in passes of increasing resolution, showing each one as it completes
+	bool solid_guessing;		// In progressive passes, fill in the pixels between coarser pixels which all agree instead of computing them
+	int focus_x, focus_y;		// Pixel the user is looking at, the tiles closest to it are computed first. -1 for the centre of the frame
+	TileCache* tile_cache;		// Completed frames are stored in it and new frames copy what it has rather than computing it. nullptr for none
+	TileStore* tile_store;		// Consulted when tile_cache misses, and if writable stored into along with it. Only used with a tile_cache
+
+	// Render generation token. A render stops computing tiles as soon as *current_generation no longer equals generation, and returns a
+	// cancelled frame. The tiles it did compute are kept for the next render. nullptr never cancels
+	const std::atomic<unsigned int>* current_generation;
+	unsigned int generation;
+
+	Renderer();
+	~Renderer();
+
+	Frame render(Fractal& fractal, ColorGenerator& cg, int* output, int matrix_width, int matrix_height, bool AVX);
+	bool recolor(ColorGenerator& cg, int* output, bool AVX);
+	bool holds(const Fractal& fractal, const ColorGenerator& cg, int matrix_width, int matrix_height, bool AVX) const;
+	void invalidate();
+
+	Renderer(Renderer const&) = delete;
+	void operator=(Renderer const&) = delete;
+};
@@ -0,0 +1,326 @@
+#include "stream_socket.h"
+
+#include <cstring>
+#include <string>
+#include <utility>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#pragma comment(lib, "ws2_32.lib")
+#else
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+#ifdef _WIN32
+typedef SOCKET SocketHandle;
+static const uintptr_t no_socket = static_cast<uintptr_t>(INVALID_SOCKET);
+static const int send_flags = 0;
+
+// Winsock has to be started once per process before any socket is made
+static bool startSockets()
+{
+	static bool started = [] {
+		WSADATA data;
+		return WSAStartup(MAKEWORD(2, 2), &data) == 0;
+	}();
+	return started;
+}
+
+static int pollSocket(pollfd* fd, int timeout_ms)
+{
+	return WSAPoll(fd, 1, timeout_ms);
+}
+
+static void closeSocket(SocketHandle handle)
+{
+	closesocket(static_cast<SOCKET>(handle));
+}
+
+// Winsock handles are not inherited by processes started with _spawn
+static void keepFromChildren(SocketHandle)
+{
+}
+#else
+typedef int SocketHandle;
+static const int no_socket = -1;
+// A peer which went away fails the send instead of raising SIGPIPE
+static const int send_flags = MSG_NOSIGNAL;
+
+static bool startSockets()
+{
+	return true;
+}
+
+static int pollSocket(pollfd* fd, int timeout_ms)
+{
+	return poll(fd, 1, timeout_ms);
+}
+
+static void closeSocket(SocketHandle handle)
+{
+	::close(handle);
+}
+
+// Processes started from this one (like spawned workers) do not inherit the socket, so it closes when this process closes it
+static void keepFromChildren(SocketHandle handle)
+{
+	fcntl(handle, F_SETFD, fcntl(handle, F_GETFD) | FD_CLOEXEC);
+}
+#endif
+
+StreamSocket::StreamSocket()
+{
+	handle = no_socket;
+}
+
+StreamSocket::~StreamSocket()
+{
+	close();
+}
+
+StreamSocket::StreamSocket(StreamSocket&& other)
+{
+	handle = other.handle;
+	unix_path = std::move(other.unix_path);
+	other.handle = no_socket;
+	other.unix_path.clear();
+}
+
+StreamSocket& StreamSocket::operator=(StreamSocket&& other)
+{
+	if (this != &other)
+	{
+		close();
+		handle = other.handle;
+		unix_path = std::move(other.unix_path);
+		other.handle = no_socket;
+		other.unix_path.clear();
+	}
+	return *this;
+}
+
+/*
+* Resolve address into a socket address of its family. Returns false if it is not an address, or a Unix domain socket on a system
+* without them. Unix domain socket paths are returned in path.
+*/
+static bool resolve(const std::string& address, bool passive, sockaddr_storage& resolved, socklen_t& length, std::string& path)
+{
+	std::memset(&resolved, 0, sizeof(resolved));
+	path = address.compare(0, 5, "unix:") == 0 ? address.substr(5) : address.find('/') != std::string::npos ? address : "";
+	if (!path.empty())
+	{
+#ifdef _WIN32
+		return false;
+#else
+		sockaddr_un* local = reinterpret_cast<sockaddr_un*>(&resolved);
+		if (path.size() >= sizeof(local->sun_path))
+			return false;
+		local->sun_family = AF_UNIX;
+		std::memcpy(local->sun_path, path.c_str(), path.size() + 1);
+		length = static_cast<socklen_t>(sizeof(sockaddr_un));
+		return true;
+#endif
+	}
+
+	size_t colon = address.rfind(':');
+	std::string host = colon == std::string::npos ? "127.0.0.1" : address.substr(0, colon);
+	std::string port = colon == std::string::npos ? address : address.substr(colon + 1);
+	if (host.empty() || port.empty())
+		return false;
+
+	addrinfo hints;
+	std::memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = passive ? AI_PASSIVE : 0;
+	addrinfo* found = nullptr;
+	if (getaddrinfo(host.c_str(), port.c_str(), &hints, &found) != 0 || !found)
+		return false;
+	std::memcpy(&resolved, found->ai_addr, found->ai_addrlen);
+	length = static_cast<socklen_t>(found->ai_addrlen);
+	freeaddrinfo(found);
+	return true;
+}
+
+// Small messages (requests, job headers) go out at once rather than waiting to be coalesced with more
+static void sendImmediately(SocketHandle handle, int family)
+{
+	if (family == AF_INET || family == AF_INET6)
+	{
+		int on = 1;
+		setsockopt(handle, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char*>(&on), sizeof(on));
+	}
+}
+
+/*
+* Listen on address for connections. A stale Unix domain socket file left by a process which was killed is replaced.
+*/
+bool StreamSocket::listen(const std::string& address)
+{
+	close();
+	sockaddr_storage resolved;
+	socklen_t length;
+	std::string path;
+	if (!startSockets() || !resolve(address, true, resolved, length, path))
+		return false;
+
+	SocketHandle created = socket(resolved.ss_family, SOCK_STREAM, 0);
+	if (created == no_socket)
+		return false;
+	handle = created;
+	keepFromChildren(handle);
+
+	if (path.empty())
+	{
+		int on = 1;
+		setsockopt(handle, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<const char*>(&on), sizeof(on));
+	}
+#ifndef _WIN32
+	else
+		::unlink(path.c_str());
+#endif
+
+	if (bind(handle, reinterpret_cast<const sockaddr*>(&resolved), length) != 0 || ::listen(handle, SOMAXCONN) != 0)
+	{
+		close();
+		return false;
+	}
+	unix_path = path;
+	return true;
+}
+
+bool StreamSocket::connect(const std::string& address)
+{
+	close();
+	sockaddr_storage resolved;
+	socklen_t length;
+	std::string path;
+	if (!startSockets() || !resolve(address, false, resolved, length, path))
+		return false;
+
+	SocketHandle created = socket(resolved.ss_family, SOCK_STREAM, 0);
+	if (created == no_socket)
+		return false;
+	handle = created;
+	keepFromChildren(handle);
+	if (::connect(handle, reinterpret_cast<const sockaddr*>(&resolved), length) != 0)
+	{
+		close();
+		return false;
+	}
+	sendImmediately(handle, resolved.ss_family);
+	return true;
+}
+
+/*
+* Wait up to timeout_ms (-1 for ever) for a connection to a listening socket and hand it to client. Returns false on a timeout or error.
+*/
+bool StreamSocket::accept(StreamSocket& client, int timeout_ms)
+{
+	if (!waitReadable(timeout_ms))
+		return false;
+
+	sockaddr_storage peer;
+	socklen_t length = sizeof(peer);
+	SocketHandle accepted = ::accept(handle, reinterpret_cast<sockaddr*>(&peer), &length);
+	if (accepted == no_socket)
+		return false;
+	client.close();
+	client.handle = accepted;
+	keepFromChildren(accepted);
+	sendImmediately(accepted, peer.ss_family);
+	return true;
+}
+
+/*
+* Wait up to timeout_ms (-1 for ever) until data (or a connection, or the end of the stream) can be received without blocking.
+*/
+bool StreamSocket::waitReadable(int timeout_ms)
+{
+	if (handle == no_socket)
+		return false;
+	pollfd fd;
+	fd.fd = handle;
+	fd.events = POLLIN;
+	fd.revents = 0;
+	return pollSocket(&fd, timeout_ms) > 0;
+}
+
+bool StreamSocket::sendAll(const void* data, size_t bytes)
+{
+	const char* p = static_cast<const char*>(data);
+	while (bytes > 0)
+	{
+		int chunk = static_cast<int>(bytes < (1u << 30) ? bytes : (1u << 30));
+		auto sent = ::send(handle, p, chunk, send_flags);
+		if (sent <= 0)
+			return false;
+		p += sent;
+		bytes -= static_cast<size_t>(sent);
+	}
+	return true;
+}
+
+/*
+* Receive whatever has arrived, up to bytes, waiting for at least one byte. Returns 0 once the peer closed the stream, < 0 on an error.
+*/
+long long StreamSocket::receive(void* data, size_t bytes)
+{
+	int chunk = static_cast<int>(bytes < (1u << 30) ? bytes : (1u << 30));
+	return static_cast<long long>(::recv(handle, static_cast<char*>(data), chunk, 0));
+}
+
+bool StreamSocket::receiveAll(void* data, size_t bytes)
+{
+	char* p = static_cast<char*>(data);
+	while (bytes > 0)
+	{
+		long long received = receive(p, bytes);
+		if (received <= 0)
+			return false;
+		p += received;
+		bytes -= static_cast<size_t>(received);
+	}
+	return true;
+}
+
+/*
+* Stop sending and receiving, which wakes up a thread blocked on the socket, without giving up the handle yet.
+*/
+void StreamSocket::shutdown()
+{
+	if (handle == no_socket)
+		return;
+#ifdef _WIN32
+	::shutdown(handle, SD_BOTH);
+#else
+	::shutdown(handle, SHUT_RDWR);
+#endif
+}
+
+void StreamSocket::close()
+{
+	if (handle == no_socket)
+		return;
+	closeSocket(handle);
+	handle = no_socket;
+#ifndef _WIN32
+	if (!unix_path.empty())
+		::unlink(unix_path.c_str());
+#endif
+	unix_path.clear();
+}
+
+bool StreamSocket::isOpen() const
+{
+	return handle != no_socket;
+}
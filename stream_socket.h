@@ -0,0 +1,44 @@
+/*
+* Declares StreamSocket, a listening or connected stream socket over TCP or a Unix domain socket, on Windows and POSIX systems alike.
+*
+* Addresses are written as text: "unix:<path>" (or any path containing a slash) for a Unix domain socket, "<host>:<port>" for TCP, and
+* a bare "<port>" for TCP on the loopback interface, so a listening socket is only reachable from the same machine unless asked otherwise.
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+class StreamSocket
+{
+#ifdef _WIN32
+	uintptr_t handle;
+#else
+	int handle;
+#endif
+	std::string unix_path;		// File of a listening Unix domain socket, removed again on close
+
+public:
+	StreamSocket();
+	~StreamSocket();
+	StreamSocket(StreamSocket&& other);
+	StreamSocket& operator=(StreamSocket&& other);
+
+	bool listen(const std::string& address);
+	bool connect(const std::string& address);
+	bool accept(StreamSocket& client, int timeout_ms);
+	bool waitReadable(int timeout_ms);
+
+	bool sendAll(const void* data, size_t bytes);
+	long long receive(void* data, size_t bytes);
+	bool receiveAll(void* data, size_t bytes);
+
+	void shutdown();
+	void close();
+	bool isOpen() const;
+
+	StreamSocket(StreamSocket const&) = delete;
+	void operator=(StreamSocket const&) = delete;
+};
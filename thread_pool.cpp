@@ -6,11 +6,20 @@
 #include <thread>
 #include <vector>
 
+// Index of the pool thread running on this thread, -1 on any other thread
+static thread_local int worker_index = -1;
+
 ThreadPool::ThreadPool()
 {
 	terminate = false;
+	active_jobs = 0;
+	batch_call = nullptr;
+	batch_context = nullptr;
+	batch_count = 0;
+	batch_next = 0;
+	batch_done = 0;
 	for (unsigned int i = 0; i < std::thread::hardware_concurrency() - 1; ++i)
-		pool.push_back(std::thread(&ThreadPool::threadWork, this));
+		pool.push_back(std::thread(&ThreadPool::threadWork, this, static_cast<int>(i)));
 	size = static_cast<int>(pool.size());
 }
 
@@ -22,18 +31,31 @@ ThreadPool::~ThreadPool()
 
 // Each thread will loop forever, waiting on the job queue for its next task.
 // When it sees a task it will execute it.
-void ThreadPool::threadWork()
+void ThreadPool::threadWork(int index)
 {
 	std::function<void()> job;
+	worker_index = index;
 
 	while (true)
 	{
 		{
 			std::unique_lock<std::mutex> lock(job_queue_mutex);
-			job_queue_condition.wait(lock, [this] {return !job_queue.empty() || terminate; });
+			job_queue_condition.wait(lock, [this] {return !job_queue.empty() || batch_next < batch_count || terminate; });
 			if (terminate)
 				return;
 
+			// Jobs of a batch take priority over the queue
+			if (batch_next < batch_count)
+			{
+				int index = batch_next++;
+				lock.unlock();
+				batch_call(batch_context, index);
+				lock.lock();
+				if (++batch_done == batch_count)
+					batch_condition.notify_all();
+				continue;
+			}
+
 			job = job_queue.front();
 			job_queue.pop();
 
@@ -66,6 +88,12 @@ ThreadPool& ThreadPool::getInstance()
 	return instance;
 }
 
+// Lets a job keep per-thread data, like private counters, without any locking. Returns a value in [0, size) on a pool thread, else -1
+int ThreadPool::workerIndex()
+{
+	return worker_index;
+}
+
 void ThreadPool::addJob(const std::function<void()> job)
 {
 	{
@@ -76,6 +104,35 @@ void ThreadPool::addJob(const std::function<void()> job)
 	job_queue_condition.notify_one();
 }
 
+void ThreadPool::runBatch(int count, void (*call)(const void* context, int index), const void* context)
+{
+	if (count <= 0)
+		return;
+
+	std::unique_lock<std::mutex> lock(job_queue_mutex);
+	batch_call = call;
+	batch_context = context;
+	batch_count = count;
+	batch_next = 0;
+	batch_done = 0;
+	job_queue_condition.notify_all();
+
+	// Rather than sitting idle the calling thread works on the batch as well
+	while (batch_next < batch_count)
+	{
+		int index = batch_next++;
+		lock.unlock();
+		call(context, index);
+		lock.lock();
+		++batch_done;
+	}
+	batch_condition.wait(lock, [this] {return batch_done == batch_count; });
+
+	batch_count = 0;
+	batch_next = 0;
+	batch_done = 0;
+}
+
 void ThreadPool::synchronize()
 {
 	std::unique_lock<std::mutex> lock(synchronize_mutex);
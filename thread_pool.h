@@ -24,21 +24,39 @@ class ThreadPool
 	std::condition_variable job_queue_condition;
 	std::queue<std::function<void()>> job_queue;
 
-
+	// The indexed jobs started by run, which are claimed under job_queue_mutex
+	void (*batch_call)(const void* context, int index);
+	const void* batch_context;
+	int batch_count;
+	int batch_next;
+	int batch_done;
+	std::condition_variable batch_condition;
 
 	ThreadPool();
 	~ThreadPool();
 
-	void threadWork();
+	void threadWork(int index);
 	void joinThreads();
+	void runBatch(int count, void (*call)(const void* context, int index), const void* context);
 
 public:
 	int size;
 
 	static ThreadPool& getInstance();
+	static int workerIndex();
 	void addJob(std::function<void()> job);
 	void synchronize();
 
+	/*
+	* Run job(0) to job(count - 1) on the pool threads, and the calling thread, and wait for all of them to finish.
+	* Unlike addJob this never allocates, as the job is only referenced for the duration of the call.
+	*/
+	template <typename Job>
+	void run(int count, const Job& job)
+	{
+		runBatch(count, [](const void* context, int index) {(*static_cast<const Job*>(context))(index); }, &job);
+	}
+
 	ThreadPool(ThreadPool const&) = delete;
 	void operator=(ThreadPool const&) = delete;
 };
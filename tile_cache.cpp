@@ -0,0 +1,383 @@
+#include "tile_cache.h"
+
+#include "fractal.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <vector>
+
+#include <immintrin.h> // _mm_malloc
+
+constexpr size_t tile_pixels = static_cast<size_t>(TileCache::tile_size) * TileCache::tile_size;
+
+// Memory of tiles is allocated in multiples of this, so tiles of about the same size can take each other's memory
+constexpr size_t granularity = 4096;
+
+bool TileCache::Key::operator==(const Key& other) const
+{
+	return params == other.params && layout == other.layout && precision == other.precision && step_x == other.step_x && step_y == other.step_y &&
+		   phase_x == other.phase_x && phase_y == other.phase_y && tile_x == other.tile_x && tile_y == other.tile_y;
+}
+
+TileCache::TileCache(size_t bytes)
+{
+	max_bytes = std::max(bytes, granularity);
+	used_bytes = 0;
+	tile_count = 0;
+	newest = -1;
+	oldest = -1;
+
+	// Every tile takes at least granularity bytes, which bounds the number of tiles
+	size_t bucket_count = 16;
+	while (bucket_count < max_bytes / granularity * 2)
+		bucket_count *= 2;
+	buckets.assign(bucket_count, -1);
+	bucket_mask = bucket_count - 1;
+
+	stats = Stats{ 0, 0, 0, 0, 0, 0 };
+}
+
+TileCache::~TileCache()
+{
+	for (Entry& entry : entries)
+		_mm_free(entry.data);
+}
+
+////////////////////////////////////////////////////////////
+/// Hash table and recency list
+////////////////////////////////////////////////////////////
+
+size_t TileCache::hash(const Key& key)
+{
+	uint64_t h = 0x9E3779B97F4A7C15ull;
+	auto mix = [&h](uint64_t value) {
+		h ^= value + 0x9E3779B97F4A7C15ull + (h << 6) + (h >> 2);
+	};
+	auto bits = [](long double value) {
+		double d = static_cast<double>(value);
+		uint64_t b;
+		std::memcpy(&b, &d, sizeof(b));
+		return b;
+	};
+
+	mix(static_cast<uint64_t>(key.params.mode));
+	mix(key.params.max_iter);
+	mix(bits(key.params.radius));
+	mix(bits(key.params.julia_complex_param.real()));
+	mix(bits(key.params.julia_complex_param.imag()));
+	mix(key.params.distance_estimation);
+	mix(static_cast<uint64_t>(key.layout));
+	mix(static_cast<uint64_t>(key.precision));
+	mix(static_cast<uint64_t>(key.step_x));
+	mix(static_cast<uint64_t>(key.step_y));
+	mix(static_cast<uint64_t>(key.phase_x));
+	mix(static_cast<uint64_t>(key.phase_y));
+	mix(static_cast<uint64_t>(key.tile_x));
+	mix(static_cast<uint64_t>(key.tile_y));
+
+	// Finalizer of splitmix64, so that neighbouring tiles spread over the table
+	h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ull;
+	h = (h ^ (h >> 27)) * 0x94D049BB133111EBull;
+	return static_cast<size_t>(h ^ (h >> 31));
+}
+
+// Index of the entry with this key, or -1
+int TileCache::lookup(const Key& key) const
+{
+	for (size_t i = hash(key) & bucket_mask; buckets[i] >= 0; i = (i + 1) & bucket_mask)
+	{
+		if (entries[buckets[i]].key == key)
+			return buckets[i];
+	}
+	return -1;
+}
+
+void TileCache::unlink(int index)
+{
+	Entry& entry = entries[index];
+	if (entry.prev >= 0)
+		entries[entry.prev].next = entry.next;
+	else
+		newest = entry.next;
+	if (entry.next >= 0)
+		entries[entry.next].prev = entry.prev;
+	else
+		oldest = entry.prev;
+}
+
+void TileCache::pushNewest(int index)
+{
+	Entry& entry = entries[index];
+	entry.prev = -1;
+	entry.next = newest;
+	if (newest >= 0)
+		entries[newest].prev = index;
+	newest = index;
+	if (oldest < 0)
+		oldest = index;
+}
+
+/*
+* Remove an entry from the hash table. The entries after it in its probe sequence are moved back into the gap, so lookups never need
+* tombstones.
+*/
+void TileCache::erase(int index)
+{
+	size_t i = hash(entries[index].key) & bucket_mask;
+	while (buckets[i] != index)
+		i = (i + 1) & bucket_mask;
+
+	for (size_t j = (i + 1) & bucket_mask; buckets[j] >= 0; j = (j + 1) & bucket_mask)
+	{
+		size_t home = hash(entries[buckets[j]].key) & bucket_mask;
+		// The entry at j can move to i unless its home bucket lies cyclically within (i, j]
+		bool between = i <= j ? (home > i && home <= j) : (home > i || home <= j);
+		if (!between)
+		{
+			buckets[i] = buckets[j];
+			i = j;
+		}
+	}
+	buckets[i] = -1;
+}
+
+/*
+* Take an entry out of the hash table and the recency list, and put it on the free list with its memory.
+*/
+void TileCache::release(int index)
+{
+	erase(index);
+	unlink(index);
+	free_entries.push_back(index);
+	tile_count -= 1;
+}
+
+////////////////////////////////////////////////////////////
+/// Cache
+////////////////////////////////////////////////////////////
+
+/*
+* The key of the lattice of tiles a pixel grid with viewport vp lies on (with tile_x and tile_y left at 0), and the lattice point of its
+* top left pixel. Steps within about 1e-9 of each other, and sub-pixel phases within the reuse tolerance, share a lattice.
+*/
+TileCache::Key TileCache::latticeKey(const Fractal::Viewport& vp, const Fractal::FormulaParams& formula, int layout, int precision, long long& origin_x, long long& origin_y)
+{
+	constexpr long double step_scale = 1073741824.0L;
+	constexpr long long phase_scale = 1 << 20;
+	auto quantizeStep = [](long double step) {
+		long long q = std::llround(std::log2(std::abs(step)) * step_scale);
+		return step < 0 ? -q - 1 : q;
+	};
+	auto quantizePhase = [](long double position, long long& index) {
+		long double whole = std::floor(position);
+		long long phase = std::llround((position - whole) * phase_scale);
+		index = static_cast<long long>(whole);
+		if (phase == phase_scale)
+		{
+			phase = 0;
+			index += 1;
+		}
+		return phase;
+	};
+
+	Key key;
+	key.params = formula;
+	key.layout = layout;
+	key.precision = precision;
+	key.step_x = quantizeStep(vp.x_step);
+	key.step_y = quantizeStep(vp.y_step);
+	key.phase_x = quantizePhase(vp.x_origin / vp.x_step, origin_x);
+	key.phase_y = quantizePhase(vp.y_origin / vp.y_step, origin_y);
+	key.tile_x = 0;
+	key.tile_y = 0;
+	return key;
+}
+
+/*
+* Bytes the values of a tile with this layout take up, with its iteration values packed into iterations_bytes.
+*/
+size_t TileCache::tileBytes(int layout, size_t iterations_bytes)
+{
+	size_t bytes = iterations_bytes;
+	if (layout & DISTANCE)
+		bytes += tile_pixels * sizeof(float);
+	if (layout & SMOOTH)
+		bytes += tile_pixels * sizeof(float);
+	if (layout & STATE)
+		bytes += tile_pixels * (2 * sizeof(double) + sizeof(int) + sizeof(unsigned char));
+	return bytes;
+}
+
+/*
+* The values of a tile with this layout stored at data, one after another in the order of the members of Tile except that the packed
+* iteration values come last. Every array but those starts on a multiple of 64 bytes from data.
+*/
+TileCache::Tile TileCache::tileAt(void* data, int layout, size_t iterations_bytes)
+{
+	char* p = static_cast<char*>(data);
+	auto take = [&p](size_t bytes) {
+		char* taken = p;
+		p += bytes;
+		return taken;
+	};
+
+	Tile tile{};
+	if (layout & DISTANCE)
+		tile.distance = reinterpret_cast<float*>(take(tile_pixels * sizeof(float)));
+	if (layout & SMOOTH)
+		tile.smooth = reinterpret_cast<float*>(take(tile_pixels * sizeof(float)));
+	if (layout & STATE)
+	{
+		tile.zx = reinterpret_cast<double*>(take(tile_pixels * sizeof(double)));
+		tile.zy = reinterpret_cast<double*>(take(tile_pixels * sizeof(double)));
+		tile.iter = reinterpret_cast<int*>(take(tile_pixels * sizeof(int)));
+		tile.done = reinterpret_cast<unsigned char*>(take(tile_pixels * sizeof(unsigned char)));
+	}
+	tile.iterations = reinterpret_cast<unsigned char*>(take(iterations_bytes));
+	tile.iterations_bytes = iterations_bytes;
+	return tile;
+}
+
+/*
+* The tile with this key, or nullptr. A tile which is found becomes the most recently used one.
+*/
+const TileCache::Tile* TileCache::find(const Key& key)
+{
+	int index = lookup(key);
+	if (index < 0)
+	{
+		stats.misses += 1;
+		return nullptr;
+	}
+
+	stats.hits += 1;
+	unlink(index);
+	pushNewest(index);
+	return &entries[index].tile;
+}
+
+/*
+* Like find, but without counting a hit or miss, for keeping the tiles of the current view from being evicted.
+*/
+const TileCache::Tile* TileCache::touch(const Key& key)
+{
+	int index = lookup(key);
+	if (index < 0)
+		return nullptr;
+
+	unlink(index);
+	pushNewest(index);
+	return &entries[index].tile;
+}
+
+/*
+* Room for the tile with this key and iteration values packed into iterations_bytes, which the caller fills in. Once the cache is full
+* the least recently used tiles are evicted and their memory reused. The tile stays valid until the next insert.
+*/
+TileCache::Tile* TileCache::insert(const Key& key, size_t iterations_bytes)
+{
+	size_t needed = (tileBytes(key.layout, iterations_bytes) + granularity - 1) / granularity * granularity;
+	int index = lookup(key);
+	if (index >= 0)
+		release(index);
+
+	auto freeEntry = [this](size_t least_capacity) {
+		auto found = std::find_if(free_entries.begin(), free_entries.end(), [&](int i) {return entries[i].capacity >= least_capacity; });
+		if (found == free_entries.end())
+			return -1;
+		int i = *found;
+		*found = free_entries.back();
+		free_entries.pop_back();
+		return i;
+	};
+
+	for (index = freeEntry(needed); index < 0; index = freeEntry(needed))
+	{
+		// Free memory of other entries goes first, then the least recently used tiles. A tile larger than the whole budget is still taken
+		if (used_bytes + needed <= max_bytes || (oldest < 0 && used_bytes == 0))
+		{
+			void* data = _mm_malloc(needed, 64);
+			if (!data)
+				throw std::bad_alloc();
+			index = freeEntry(0);
+			if (index < 0)
+			{
+				entries.push_back(Entry{});
+				index = static_cast<int>(entries.size()) - 1;
+			}
+			entries[index].data = data;
+			entries[index].capacity = needed;
+			used_bytes += needed;
+			break;
+		}
+
+		auto holding = std::find_if(free_entries.begin(), free_entries.end(), [&](int i) {return entries[i].capacity > 0; });
+		if (holding != free_entries.end())
+		{
+			Entry& entry = entries[*holding];
+			_mm_free(entry.data);
+			used_bytes -= entry.capacity;
+			entry.data = nullptr;
+			entry.capacity = 0;
+		}
+		else
+		{
+			release(oldest);
+			stats.evictions += 1;
+		}
+	}
+
+	Entry& entry = entries[index];
+	entry.key = key;
+	entry.tile = tileAt(entry.data, key.layout, iterations_bytes);
+	size_t i = hash(key) & bucket_mask;
+	while (buckets[i] >= 0)
+		i = (i + 1) & bucket_mask;
+	buckets[i] = index;
+	pushNewest(index);
+	tile_count += 1;
+
+	stats.insertions += 1;
+	stats.unpacked_bytes += static_cast<long long>(tile_pixels * sizeof(int));
+	stats.packed_bytes += static_cast<long long>(iterations_bytes);
+	return &entry.tile;
+}
+
+/*
+* Forget every tile and free their memory.
+*/
+void TileCache::clear()
+{
+	std::fill(buckets.begin(), buckets.end(), -1);
+	for (Entry& entry : entries)
+		_mm_free(entry.data);
+	entries.clear();
+	free_entries.clear();
+	used_bytes = 0;
+	tile_count = 0;
+	newest = -1;
+	oldest = -1;
+}
+
+int TileCache::size() const
+{
+	return tile_count;
+}
+
+size_t TileCache::bytes() const
+{
+	return used_bytes;
+}
+
+size_t TileCache::capacity() const
+{
+	return max_bytes;
+}
+
+TileCache::Stats TileCache::statistics() const
+{
+	return stats;
+}
@@ -0,0 +1,121 @@
+/*
+* Declares TileCache, a bounded cache of computed tiles of iteration values (and the distance estimates, smooth escape values or orbit
+* state that go with them) which outlives the frames they were computed for, so going back to a view rendered before costs a copy.
+* Iteration values are kept packed with the tile codec (see tile_codec.h), which usually takes a fraction of their 4 bytes per pixel.
+*/
+
+#pragma once
+
+#include "fractal.h"
+
+#include <cstddef>
+#include <vector>
+
+class TileCache
+{
+public:
+	// Width and height of every cached tile
+	static constexpr int tile_size = 64;
+
+	// Which values a tile holds besides the iteration values
+	enum Layout {
+		DISTANCE = 1,
+		SMOOTH = 2,
+		STATE = 4
+	};
+
+	// Which kernels computed a tile: the AVX ones iterate in double precision, the standard one in long double
+	enum Precision {
+		DOUBLE = 0,
+		EXTENDED = 1
+	};
+
+	/*
+	* Tiles live on a lattice of points per zoom level: every pixel grid with the same step and the same sub-pixel phase lines up with it,
+	* which is what pans by whole pixels, returning to a previous zoom level, reset() and switching fractals back and forth produce.
+	* step and phase are quantized, tile_x and tile_y count tiles along the lattice.
+	*/
+	struct Key {
+		Fractal::FormulaParams params;
+		int layout;
+		int precision;
+		long long step_x, step_y;
+		long long phase_x, phase_y;
+		long long tile_x, tile_y;
+
+		bool operator==(const Key& other) const;
+	};
+
+	// Values of a tile, tile_size * tile_size each in rows. Those the layout of the tile does not have are nullptr
+	struct Tile {
+		unsigned char* iterations;	// Packed with encodeIterations
+		size_t iterations_bytes;
+		float* distance;
+		float* smooth;
+		double* zx;
+		double* zy;
+		int* iter;
+		unsigned char* done;
+	};
+
+	struct Stats {
+		long long hits;
+		long long misses;
+		long long insertions;
+		long long evictions;
+		long long unpacked_bytes;	// Iteration values of the inserted tiles, before and after packing
+		long long packed_bytes;
+	};
+
+private:
+	struct Entry {
+		Key key;
+		Tile tile;
+		void* data;
+		size_t capacity;			// Bytes at data
+		int prev, next;				// Neighbours in the recency list, -1 at its ends
+	};
+
+	// Evicted entries keep their memory on the free list, to be reused by tiles which fit, so a warm cache rarely allocates.
+	// The budget covers the memory of every entry, free or not
+	std::vector<Entry> entries;
+	std::vector<int> free_entries;
+	size_t max_bytes;
+	size_t used_bytes;
+	int tile_count;
+	int newest, oldest;
+
+	// Open addressing hash table of entry indices with linear probing, -1 for empty buckets
+	std::vector<int> buckets;
+	size_t bucket_mask;
+
+	Stats stats;
+
+	static size_t hash(const Key& key);
+	int lookup(const Key& key) const;
+	void unlink(int index);
+	void pushNewest(int index);
+	void erase(int index);
+	void release(int index);
+
+public:
+	TileCache(size_t bytes = 256 * 1024 * 1024);
+	~TileCache();
+
+	static Key latticeKey(const Fractal::Viewport& vp, const Fractal::FormulaParams& formula, int layout, int precision, long long& origin_x, long long& origin_y);
+	static size_t tileBytes(int layout, size_t iterations_bytes);
+	static Tile tileAt(void* data, int layout, size_t iterations_bytes);
+
+	const Tile* find(const Key& key);
+	const Tile* touch(const Key& key);
+	Tile* insert(const Key& key, size_t iterations_bytes);
+	void clear();
+
+	int size() const;
+	size_t bytes() const;
+	size_t capacity() const;
+	Stats statistics() const;
+
+	TileCache(TileCache const&) = delete;
+	void operator=(TileCache const&) = delete;
+};
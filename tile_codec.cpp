@@ -0,0 +1,235 @@
+#include "tile_codec.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include <immintrin.h> // AVX intrinsics
+
+static uint32_t zigzag(int value, int predicted)
+{
+	uint32_t difference = static_cast<uint32_t>(value) - static_cast<uint32_t>(predicted);
+	return (difference << 1) ^ static_cast<uint32_t>(static_cast<int32_t>(difference) >> 31);
+}
+
+/*
+* differences[i] = zigzag(values[i], values[i - 1]) for 0 < i < n, 8 at a time. Returns the largest of them.
+*/
+static uint32_t zigzagDifferences(const int* values, int n, uint32_t* differences)
+{
+	__m256i _largest = _mm256_setzero_si256();
+	int i = 1;
+	for (; i + 8 <= n; i += 8)
+	{
+		__m256i _d = _mm256_sub_epi32(_mm256_loadu_si256((const __m256i*)(values + i)), _mm256_loadu_si256((const __m256i*)(values + i - 1)));
+		__m256i _z = _mm256_xor_si256(_mm256_slli_epi32(_d, 1), _mm256_srai_epi32(_d, 31));
+		_mm256_storeu_si256((__m256i*)(differences + i), _z);
+		_largest = _mm256_max_epu32(_largest, _z);
+	}
+
+	alignas(32) uint32_t lanes[8];
+	_mm256_store_si256((__m256i*)lanes, _largest);
+	uint32_t largest = *std::max_element(lanes, lanes + 8);
+	for (; i < n; ++i)
+	{
+		differences[i] = zigzag(values[i], values[i - 1]);
+		largest = std::max(largest, differences[i]);
+	}
+	return largest;
+}
+
+/*
+* Bytes encodeIterations writes at most for a rectangle of this size.
+*/
+size_t maxEncodedBytes(int width, int height)
+{
+	// Every value takes at most 4 bytes and a control byte of its own
+	return 1 + static_cast<size_t>(width) * height * 5;
+}
+
+// Encodes the rows of a rectangle with differences of BYTES bytes each, see encodeIterations. Rows are taken in segments of 128 values,
+// which is the most a token holds, with their differences worked out up front
+template <int BYTES>
+static size_t encodeRows(const int* values, int width, int height, size_t stride, unsigned char* data)
+{
+	constexpr int min_run = BYTES == 1 ? 3 : 2;
+	constexpr int segment = 128;
+	uint32_t differences[segment];
+
+	unsigned char* out = data;
+	for (int y = 0; y < height; ++y)
+	{
+		const int* row = values + y * stride;
+		for (int start = 0; start < width; start += segment)
+		{
+			int n = std::min(segment, width - start);
+			zigzagDifferences(row + start, n, differences);
+			differences[0] = zigzag(row[start], start > 0 ? row[start - 1] : y > 0 ? row[-static_cast<ptrdiff_t>(stride)] : 0);
+
+			int i = 0;
+			while (i < n)
+			{
+				int run = 0;
+				while (i + run < n && differences[i + run] == 0)
+					++run;
+				if (run >= min_run)
+				{
+					*out++ = static_cast<unsigned char>(127 + run);
+					i += run;
+					continue;
+				}
+
+				// A block of differences, up to the next run worth encoding as one
+				int end = i + std::max(run, 1);
+				while (end < n)
+				{
+					int zeros = 0;
+					while (end + zeros < n && zeros < min_run && differences[end + zeros] == 0)
+						++zeros;
+					if (zeros >= min_run)
+						break;
+					end += std::max(zeros, 1);
+				}
+
+				*out++ = static_cast<unsigned char>(end - i - 1);
+				for (; i < end; ++i)
+				{
+					std::memcpy(out, &differences[i], BYTES);	// Little endian, so these are the low bytes
+					out += BYTES;
+				}
+			}
+		}
+	}
+	return static_cast<size_t>(out - data);
+}
+
+/*
+* Encode the width x height rectangle of values whose rows are stride ints apart into data, which must have room for
+* maxEncodedBytes(width, height). Returns the number of bytes written.
+*/
+size_t encodeIterations(const int* values, int width, int height, size_t stride, unsigned char* data)
+{
+	// The largest difference decides how many bytes every difference takes
+	constexpr int segment = 128;
+	uint32_t differences[segment];
+	uint32_t largest = 0;
+	for (int y = 0; y < height; ++y)
+	{
+		const int* row = values + y * stride;
+		largest = std::max(largest, zigzag(row[0], y > 0 ? row[-static_cast<ptrdiff_t>(stride)] : 0));
+		for (int start = 0; start < width; start += segment - 1)
+			largest = std::max(largest, zigzagDifferences(row + start, std::min(segment, width - start), differences));
+	}
+	int bytes = largest <= 0xFF ? 1 : largest <= 0xFFFF ? 2 : 4;
+
+	data[0] = static_cast<unsigned char>(bytes);
+	if (bytes == 1)
+		return 1 + encodeRows<1>(values, width, height, stride, data + 1);
+	if (bytes == 2)
+		return 1 + encodeRows<2>(values, width, height, stride, data + 1);
+	return 1 + encodeRows<4>(values, width, height, stride, data + 1);
+}
+
+/*
+* Turn n zigzag-encoded differences of BYTES bytes each into values, starting from previous. 8 at a time: widen, undo the zigzag, and
+* take the prefix sum across the 8 lanes.
+*/
+template <int BYTES>
+static void decodeDifferences(const unsigned char* in, int n, int* out, int previous)
+{
+	const __m256i _one = _mm256_set1_epi32(1);
+	const __m256i _last = _mm256_set1_epi32(7);
+	__m256i _base = _mm256_set1_epi32(previous);
+
+	int i = 0;
+	for (; i + 8 <= n; i += 8)
+	{
+		__m256i _u;
+		if (BYTES == 1)
+			_u = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(in + i)));
+		else if (BYTES == 2)
+			_u = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(in + 2 * i)));
+		else
+			_u = _mm256_loadu_si256((const __m256i*)(in + 4 * i));
+
+		__m256i _d = _mm256_xor_si256(_mm256_srli_epi32(_u, 1), _mm256_sub_epi32(_mm256_setzero_si256(), _mm256_and_si256(_u, _one)));
+
+		// Prefix sum within each 128-bit half, then carry the sum of the low half into the high one
+		_d = _mm256_add_epi32(_d, _mm256_slli_si256(_d, 4));
+		_d = _mm256_add_epi32(_d, _mm256_slli_si256(_d, 8));
+		__m256i _low_sum = _mm256_shuffle_epi32(_d, 0xFF);
+		_d = _mm256_add_epi32(_d, _mm256_permute2x128_si256(_low_sum, _low_sum, 0x08));
+
+		_d = _mm256_add_epi32(_d, _base);
+		_mm256_storeu_si256((__m256i*)(out + i), _d);
+		_base = _mm256_permutevar8x32_epi32(_d, _last);
+	}
+
+	int value = i > 0 ? out[i - 1] : previous;
+	for (; i < n; ++i)
+	{
+		uint32_t u = 0;
+		std::memcpy(&u, in + static_cast<size_t>(i) * BYTES, BYTES);
+		value = static_cast<int>(static_cast<uint32_t>(value) + ((u >> 1) ^ (0u - (u & 1))));
+		out[i] = value;
+	}
+}
+
+// Decodes the rows of an encoding whose differences take BYTES bytes each, see decodeIterations
+template <int BYTES>
+static bool decodeRows(const unsigned char* in, const unsigned char* end, int* values, int width, int height, size_t stride)
+{
+	for (int y = 0; y < height; ++y)
+	{
+		int* row = values + y * stride;
+		int previous = y > 0 ? row[-static_cast<ptrdiff_t>(stride)] : 0;
+		int x = 0;
+		while (x < width)
+		{
+			if (in == end)
+				return false;
+			int control = *in++;
+			int n = control >= 128 ? control - 127 : control + 1;
+			if (n > width - x)
+				return false;
+
+			if (control >= 128)
+			{
+				__m256i _previous = _mm256_set1_epi32(previous);
+				int i = 0;
+				for (; i + 8 <= n; i += 8)
+					_mm256_storeu_si256((__m256i*)(row + x + i), _previous);
+				for (; i < n; ++i)
+					row[x + i] = previous;
+			}
+			else
+			{
+				if (static_cast<size_t>(end - in) < static_cast<size_t>(n) * BYTES)
+					return false;
+				decodeDifferences<BYTES>(in, n, row + x, previous);
+				in += static_cast<size_t>(n) * BYTES;
+				previous = row[x + n - 1];
+			}
+			x += n;
+		}
+	}
+	return in == end;
+}
+
+/*
+* Decode bytes of data written by encodeIterations into the width x height rectangle of values whose rows are stride ints apart.
+* Returns false if data is not exactly one encoded rectangle of that size, in which case values may be partly written.
+*/
+bool decodeIterations(const unsigned char* data, size_t bytes, int* values, int width, int height, size_t stride)
+{
+	if (bytes < 1)
+		return false;
+	if (data[0] == 1)
+		return decodeRows<1>(data + 1, data + bytes, values, width, height, stride);
+	if (data[0] == 2)
+		return decodeRows<2>(data + 1, data + bytes, values, width, height, stride);
+	if (data[0] == 4)
+		return decodeRows<4>(data + 1, data + bytes, values, width, height, stride);
+	return false;
+}
@@ -0,0 +1,17 @@
+/*
+* Declares a lossless codec for rectangles of iteration values. Neighbouring values are mostly equal or close, so each value is stored as
+* the difference to its left neighbour (the first one of a row to the one above it), in 1, 2 or 4 bytes per value depending on the
+* largest difference of the rectangle, and runs of equal values are run-length encoded.
+*
+* Encoded data is a byte giving the width of the differences, followed by the tokens of every row in turn. A token is a control byte c,
+* either c < 128 followed by c + 1 zigzag-encoded differences, or c >= 128 for a run of c - 127 values equal to the last one. Tokens never
+* span two rows, so rows decode independently of how they were split, and blocks of differences decode 8 at a time with AVX2.
+*/
+
+#pragma once
+
+#include <cstddef>
+
+size_t maxEncodedBytes(int width, int height);
+size_t encodeIterations(const int* values, int width, int height, size_t stride, unsigned char* data);
+bool decodeIterations(const unsigned char* data, size_t bytes, int* values, int width, int height, size_t stride);
@@ -0,0 +1,934 @@
+#include "tile_server.h"
+
+#include "png.h"
+#include "thread_pool.h"
+#include "tile_codec.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <vector>
+
+// Requests with a longer head than this are refused
+constexpr size_t max_head_bytes = 8192;
+
+bool TileServer::TileId::operator<(const TileId& other) const
+{
+	return std::tie(mode, z, x, y) < std::tie(other.mode, other.z, other.x, other.y);
+}
+
+static double millisecondsSince(std::chrono::steady_clock::time_point start)
+{
+	return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+// The p-th percentile (0 to 100) of values, or 0 if there are none
+static float percentile(std::vector<float> values, double p)
+{
+	if (values.empty())
+		return 0.0f;
+	size_t rank = std::min(values.size() - 1, static_cast<size_t>(p / 100.0 * values.size()));
+	std::nth_element(values.begin(), values.begin() + rank, values.end());
+	return values[rank];
+}
+
+static std::string latencySummary(const std::vector<float>& latencies)
+{
+	std::ostringstream out;
+	out.precision(3);
+	out << "p50 " << percentile(latencies, 50) << " ms, p90 " << percentile(latencies, 90) << " ms, p99 " << percentile(latencies, 99) <<
+		" ms, max " << percentile(latencies, 100) << " ms over " << latencies.size() << " requests";
+	return out.str();
+}
+
+// Bucket k of a LatencyHistogram holds the latencies from latency_floor * latency_growth^(k - 1) up to latency_floor * latency_growth^k,
+// the last bucket everything longer (over 3 hours)
+constexpr double latency_floor = 0.001;
+constexpr double latency_growth = 1.05;
+constexpr int latency_buckets = 512;
+
+TileServer::LatencyHistogram::LatencyHistogram() : counts(latency_buckets, 0)
+{
+	total = 0;
+	max = 0.0f;
+}
+
+void TileServer::LatencyHistogram::add(float ms)
+{
+	int bucket = ms <= latency_floor ? 0 : static_cast<int>(std::ceil(std::log(ms / latency_floor) / std::log(latency_growth)));
+	counts[std::min(bucket, latency_buckets - 1)] += 1;
+	total += 1;
+	max = std::max(max, ms);
+}
+
+// The p-th percentile (0 to 100), as the upper end of its bucket, so within 5% of the true one. 0 if there are none
+float TileServer::LatencyHistogram::percentile(double p) const
+{
+	if (total == 0)
+		return 0.0f;
+	long long rank = std::min(total - 1, static_cast<long long>(p / 100.0 * total));
+	long long below = 0;
+	for (int k = 0; k < latency_buckets; ++k)
+	{
+		below += counts[k];
+		if (below > rank)
+			return std::min(max, static_cast<float>(latency_floor * std::pow(latency_growth, k)));
+	}
+	return max;
+}
+
+static std::string latencySummary(const TileServer::LatencyHistogram& latencies)
+{
+	std::ostringstream out;
+	out.precision(3);
+	out << "p50 " << latencies.percentile(50) << " ms, p90 " << latencies.percentile(90) << " ms, p99 " << latencies.percentile(99) <<
+		" ms, max " << latencies.max << " ms over " << latencies.total << " requests";
+	return out.str();
+}
+
+/*
+* Receive up to the end of the head of an HTTP message ("\r\n\r\n") into head, keeping whatever arrived after it in buffer for the body
+* or the next message. Returns false once the connection is closed, or the head is too long.
+*/
+static bool receiveHead(StreamSocket& socket, std::string& buffer, std::string& head)
+{
+	size_t end;
+	while ((end = buffer.find("\r\n\r\n")) == std::string::npos)
+	{
+		if (buffer.size() > max_head_bytes)
+			return false;
+		char chunk[4096];
+		long long received = socket.receive(chunk, sizeof(chunk));
+		if (received <= 0)
+			return false;
+		buffer.append(chunk, static_cast<size_t>(received));
+	}
+	head = buffer.substr(0, end);
+	buffer.erase(0, end + 4);
+	return true;
+}
+
+// The value of a header of an HTTP message head, compared case insensitively, or an empty string
+static std::string headerValue(const std::string& head, const std::string& name)
+{
+	std::istringstream lines(head);
+	std::string line;
+	while (std::getline(lines, line))
+	{
+		if (line.size() <= name.size() || line[name.size()] != ':')
+			continue;
+		bool same = std::equal(name.begin(), name.end(), line.begin(), [](char a, char b) {return std::tolower(a) == std::tolower(b); });
+		if (!same)
+			continue;
+		size_t start = line.find_first_not_of(" \t", name.size() + 1);
+		size_t end = line.find_last_not_of(" \t\r");
+		return start == std::string::npos ? "" : line.substr(start, end - start + 1);
+	}
+	return "";
+}
+
+static bool parseNumber(const std::string& text, long long& value)
+{
+	if (text.empty() || text.size() > 18 || text.find_first_not_of("-0123456789") != std::string::npos)
+		return false;
+	value = std::strtoll(text.c_str(), nullptr, 10);
+	return true;
+}
+
+// The fractal a name of a location stands for, see Fractal::location
+static bool fractalMode(const std::string& name, int& mode)
+{
+	Fractal fractal;
+	if (!fractal.setLocation(name + " 1 0 0 1"))
+		return false;
+	mode = static_cast<int>(fractal.fractal_mode);
+	return true;
+}
+
+/*
+* Tile (0, 0) of zoom level 0 of the pyramid of a fractal, as the viewport of its pixels: the square around the fractal's default view, with
+* its corner moved to a multiple of a quarter of its side. Then the corner of every cache tile of every level lies on a point of the tile
+* cache's lattice.
+*/
+static Fractal::Viewport pyramidBase(int mode)
+{
+	constexpr int size = TileServer::tile_pixels;
+	Fractal fractal;
+	fractal.selectFractal(mode);
+	Fractal::Viewport vp = fractal.getViewport(size, size);
+	long double side = size * std::max(std::abs(vp.x_step), std::abs(vp.y_step));
+	auto corner = [side](long double origin, long double step) {
+		long double centre = origin + size / 2 * step;
+		return std::round((centre - std::copysign(side, step) / 2) / side * 4) * side / 4;
+	};
+	return Fractal::Viewport{ corner(vp.x_origin, vp.x_step), corner(vp.y_origin, vp.y_step), std::copysign(side, vp.x_step) / size,
+							  std::copysign(side, vp.y_step) / size };
+}
+
+/*
+* The tile of a request target "/{fractal}/{z}/{x}/{y}.png[?priority=<n>]". Returns false if it is not a tile of the pyramid.
+*/
+static bool parseTileTarget(const std::string& target, int& mode, int& z, long long& x, long long& y, int& priority)
+{
+	std::string path = target.substr(0, target.find('?'));
+	std::string query = target.size() > path.size() ? target.substr(path.size() + 1) : "";
+
+	std::vector<std::string> parts;
+	std::istringstream in(path);
+	std::string part;
+	std::getline(in, part, '/');	// Empty, before the leading slash
+	while (std::getline(in, part, '/'))
+		parts.push_back(part);
+	if (parts.size() != 4 || parts[3].size() <= 4 || parts[3].compare(parts[3].size() - 4, 4, ".png") != 0)
+		return false;
+
+	long long zoom;
+	if (!fractalMode(parts[0], mode) || !parseNumber(parts[1], zoom) || !parseNumber(parts[2], x) || !parseNumber(parts[3].substr(0, parts[3].size() - 4), y))
+		return false;
+	if (zoom < 0 || zoom > TileServer::max_zoom || x < 0 || y < 0 || x >= (1ll << zoom) || y >= (1ll << zoom))
+		return false;
+	z = static_cast<int>(zoom);
+
+	long long p = 0;
+	priority = query.compare(0, 9, "priority=") == 0 && parseNumber(query.substr(9), p) ? static_cast<int>(std::max(-1000000ll, std::min(p, 1000000ll))) : 0;
+	return true;
+}
+
+/*
+* A server coloring tiles with colors, which keeps cache_bytes of iteration values in its tile cache and a quarter as much of images.
+*/
+TileServer::TileServer(ColorGenerator::Generators colors, size_t cache_bytes) : cache(cache_bytes)
+{
+	this->colors = colors;
+	layout = colors == ColorGenerator::Generators::DISTANCE ? TileCache::DISTANCE : colors == ColorGenerator::Generators::SMOOTH ? TileCache::SMOOTH : 0;
+	stopping = false;
+	next_order = 0;
+	image_bytes = 0;
+	max_image_bytes = cache_bytes / 4;
+	started = std::chrono::steady_clock::now();
+	std::fill(served, served + 4, 0);
+	coalesced = 0;
+	failed = 0;
+	batches = 0;
+	bytes_sent = 0;
+	cache_stats = cache.statistics();
+	store_stats = store.statistics();
+}
+
+TileServer::~TileServer()
+{
+	stop();
+}
+
+/*
+* Keep the iteration values of tiles in the tile store at path as well, which is created if there is none. Only one process may write to
+* a store at a time, so if another one does (such as a window which is open), its tiles are only read.
+*/
+bool TileServer::openStore(const std::string& path)
+{
+	if (!store.open(path, true))
+		return false;
+	if (!store.isWritable())
+		std::cerr << "Tile store " << path << " is written by another process, the tiles served are not kept" << std::endl;
+	return true;
+}
+
+/*
+* Listen for requests on address (see StreamSocket) and serve them until stop.
+*/
+bool TileServer::start(const std::string& address)
+{
+	if (accept_thread.joinable() || !listener.listen(address))
+		return false;
+	stopping = false;
+	started = std::chrono::steady_clock::now();
+	dispatch_thread = std::thread(&TileServer::dispatch, this);
+	accept_thread = std::thread(&TileServer::acceptConnections, this);
+	return true;
+}
+
+/*
+* Stop accepting connections, fail the tiles which were not rendered yet, and close every connection once its current response is sent.
+*/
+void TileServer::stop()
+{
+	if (!accept_thread.joinable())
+		return;
+
+	stopping = true;
+	accept_thread.join();
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		for (StreamSocket* socket : connections)
+			socket->shutdown();
+		work_condition.notify_all();
+	}
+	dispatch_thread.join();
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		closed_condition.wait(lock, [this] {return connections.empty(); });
+	}
+	listener.close();
+	store.flush();
+}
+
+////////////////////////////////////////////////////////////
+/// Connections
+////////////////////////////////////////////////////////////
+
+void TileServer::acceptConnections()
+{
+	while (!stopping)
+	{
+		// Polls, so that stop is noticed
+		StreamSocket client;
+		if (!listener.accept(client, 100))
+			continue;
+
+		std::unique_ptr<StreamSocket> socket(new StreamSocket(std::move(client)));
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			connections.insert(socket.get());
+		}
+		std::thread(&TileServer::serveConnection, this, std::move(socket)).detach();
+	}
+}
+
+/*
+* Answer the requests of a connection one after another until the client closes it, or asks for it to be closed.
+*/
+void TileServer::serveConnection(std::unique_ptr<StreamSocket> socket)
+{
+	std::string buffer, head;
+	while (!stopping && receiveHead(*socket, buffer, head))
+	{
+		auto request_start = std::chrono::steady_clock::now();
+		std::string method, target, version;
+		std::istringstream(head.substr(0, head.find("\r\n"))) >> method >> target >> version;
+		std::string connection = headerValue(head, "connection");
+		bool keep_alive = version == "HTTP/1.1" ? connection != "close" : connection == "keep-alive";
+
+		int status = 200;
+		const char* content_type = "image/png";
+		std::shared_ptr<const std::string> body;
+		bool tile_request = false;
+		bool shared = false;
+		Source source = Source::COMPUTED;
+
+		TileId id;
+		int priority;
+		if (method != "GET")
+		{
+			// A body would have to be skipped
+			status = 405;
+			keep_alive = false;
+		}
+		else if (target == "/stats")
+		{
+			content_type = "text/plain";
+			body = std::make_shared<const std::string>(statistics());
+		}
+		else if (!parseTileTarget(target, id.mode, id.z, id.x, id.y, priority))
+			status = 404;
+		else
+		{
+			tile_request = true;
+			std::shared_ptr<Pending> pending = request(id, priority, shared);
+			std::unique_lock<std::mutex> lock(mutex);
+			done_condition.wait(lock, [&] {return pending->done; });
+			body = pending->png;
+			source = pending->source;
+			if (!body)
+				status = 503;
+		}
+
+		const char* reason = status == 200 ? "OK" : status == 404 ? "Not Found" : status == 405 ? "Method Not Allowed" : "Service Unavailable";
+		if (status != 200)
+		{
+			content_type = "text/plain";
+			body = std::make_shared<const std::string>(std::string(reason) + "\n");
+		}
+
+		// Tiles never change, so clients and proxies may keep them
+		std::ostringstream response;
+		response << "HTTP/1.1 " << status << " " << reason << "\r\nContent-Type: " << content_type << "\r\nContent-Length: " << body->size() <<
+			"\r\nAccess-Control-Allow-Origin: *\r\n" << (status == 200 && tile_request ? "Cache-Control: public, max-age=31536000, immutable\r\n" : "") <<
+			"Connection: " << (keep_alive ? "keep-alive" : "close") << "\r\n\r\n";
+		std::string response_head = response.str();
+		bool sent = socket->sendAll(response_head.data(), response_head.size()) && socket->sendAll(body->data(), body->size());
+
+		if (tile_request)
+		{
+			float ms = static_cast<float>(millisecondsSince(request_start));
+			std::lock_guard<std::mutex> lock(mutex);
+			if (status != 200)
+				failed += 1;
+			else
+			{
+				served[static_cast<int>(source)] += 1;
+				coalesced += shared;
+				(shared || source == Source::COMPUTED ? computed_latencies : cached_latencies).add(ms);
+				bytes_sent += static_cast<long long>(body->size());
+			}
+		}
+		if (!sent || !keep_alive)
+			break;
+	}
+
+	socket->close();
+	std::lock_guard<std::mutex> lock(mutex);
+	connections.erase(socket.get());
+	closed_condition.notify_all();
+}
+
+/*
+* The pending render of a tile, which is queued unless the tile is being rendered already. Then shared is set, and the render is moved up
+* to priority if it is still queued with a lower one. A tile whose image is kept is done at once.
+*/
+std::shared_ptr<TileServer::Pending> TileServer::request(const TileId& id, int priority, bool& shared)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	auto image = image_index.find(id);
+	if (image != image_index.end())
+	{
+		shared = false;
+		images.splice(images.begin(), images, image->second);
+		std::shared_ptr<Pending> kept = std::make_shared<Pending>();
+		kept->id = id;
+		kept->done = true;
+		kept->source = Source::IMAGE;
+		kept->png = image->second->second;
+		return kept;
+	}
+
+	auto found = in_flight.find(id);
+	shared = found != in_flight.end();
+	if (shared)
+	{
+		found->second->priority = std::max(found->second->priority, priority);
+		return found->second;
+	}
+
+	// Once the dispatcher is stopping nothing is rendered any more, and the tile fails at once
+	std::shared_ptr<Pending> pending = std::make_shared<Pending>();
+	pending->id = id;
+	pending->priority = priority;
+	pending->order = next_order++;
+	pending->done = stopping;
+	pending->source = Source::COMPUTED;
+	if (stopping)
+		return pending;
+	in_flight[id] = pending;
+	queue.push_back(pending);
+	work_condition.notify_one();
+	return pending;
+}
+
+////////////////////////////////////////////////////////////
+/// Rendering
+////////////////////////////////////////////////////////////
+
+/*
+* Keep the image of a tile which was just rendered, in place of those of the tiles served longest ago. Called under mutex.
+*/
+void TileServer::keepImage(const TileId& id, const std::shared_ptr<const std::string>& png)
+{
+	if (!png || png->size() > max_image_bytes || image_index.count(id) != 0)
+		return;
+	while (image_bytes + png->size() > max_image_bytes)
+	{
+		image_bytes -= images.back().second->size();
+		image_index.erase(images.back().first);
+		images.pop_back();
+	}
+	images.emplace_front(id, png);
+	image_index[id] = images.begin();
+	image_bytes += png->size();
+}
+
+/*
+* Render the queued tiles in batches, highest priority (and then oldest) first, until the server stops. The thread pool only takes one
+* batch of jobs at a time, so this is the only thread which uses it.
+*/
+void TileServer::dispatch()
+{
+	// Enough tiles to keep every thread busy, few enough that a tile of higher priority does not wait long
+	size_t batch_limit = static_cast<size_t>(std::max(2, ThreadPool::getInstance().size));
+
+	std::unique_lock<std::mutex> lock(mutex);
+	while (true)
+	{
+		work_condition.wait(lock, [this] {return stopping || !queue.empty(); });
+		if (stopping)
+			break;
+
+		std::sort(queue.begin(), queue.end(), [](const std::shared_ptr<Pending>& a, const std::shared_ptr<Pending>& b) {
+			return a->priority != b->priority ? a->priority > b->priority : a->order < b->order;
+		});
+		size_t count = std::min(batch_limit, queue.size());
+		std::vector<std::shared_ptr<Pending>> batch(queue.begin(), queue.begin() + count);
+		queue.erase(queue.begin(), queue.begin() + count);
+
+		lock.unlock();
+		renderBatch(batch);
+		lock.lock();
+
+		for (const std::shared_ptr<Pending>& pending : batch)
+		{
+			pending->done = true;
+			in_flight.erase(pending->id);
+			keepImage(pending->id, pending->png);
+		}
+		batches += 1;
+		cache_stats = cache.statistics();
+		store_stats = store.statistics();
+		done_condition.notify_all();
+	}
+
+	// Requests still waiting get an error
+	for (const std::shared_ptr<Pending>& pending : queue)
+	{
+		pending->done = true;
+		in_flight.erase(pending->id);
+	}
+	queue.clear();
+	done_condition.notify_all();
+}
+
+/*
+* Zoom level z of the pyramid of a fractal, see pyramidBase. The iteration limit rises by half every 3 zoom levels, like pressing = every
+* time the view gets 8 times smaller.
+*/
+TileServer::Level& TileServer::level(int mode, int z)
+{
+	auto found = levels.find(std::make_pair(mode, z));
+	if (found != levels.end())
+		return found->second;
+
+	Level& l = levels[std::make_pair(mode, z)];
+	Fractal::Viewport base = pyramidBase(mode);
+	l.fractal.selectFractal(mode);
+	l.x_origin = base.x_origin;
+	l.y_origin = base.y_origin;
+	l.x_step = std::ldexp(base.x_step, -z);
+	l.y_step = std::ldexp(base.y_step, -z);
+
+	unsigned int max_iter = l.fractal.maxIterations();
+	for (int i = 0; i < z / 3; ++i)
+		max_iter += max_iter / 2;
+	l.fractal.setMaxIterations(max_iter);
+	l.params = l.fractal.getFormulaParams();
+	return l;
+}
+
+/*
+* Render a batch of tiles into PNG images. Each tile is split into cache tiles, which are copied from the tile cache or store where they are
+* and computed where not, and colored, all as jobs of a single run of the thread pool. Computed cache tiles then go into the cache and
+* store, and the tiles are encoded as a second run.
+*/
+void TileServer::renderBatch(const std::vector<std::shared_ptr<Pending>>& batch)
+{
+	// A cache tile of a tile, and where its iteration values come from
+	struct Piece {
+		int tile;
+		int x, y;						// Within the tile
+		bool cacheable;					// It lies on the cache lattice, so key is valid
+		TileCache::Key key;
+		TileCache::Tile found;
+		Source source;
+	};
+
+	constexpr int size = TileCache::tile_size;
+	constexpr int pieces_per_side = tile_pixels / size;
+	constexpr size_t pixels = static_cast<size_t>(tile_pixels) * tile_pixels;
+	bool want_distance = layout == TileCache::DISTANCE;
+	bool want_smooth = layout == TileCache::SMOOTH;
+	iterations.resize(batch.size() * pixels);
+	extra.resize(layout ? batch.size() * pixels : 0);
+	tile_colors.resize(batch.size() * pixels);
+
+	std::vector<Level*> tile_levels(batch.size());
+	std::vector<Fractal::Viewport> tile_viewports(batch.size());
+	std::vector<ColorGenerator*> tile_palettes(batch.size());
+	std::vector<Piece> pieces;
+	pieces.reserve(batch.size() * pieces_per_side * pieces_per_side);
+	for (size_t t = 0; t < batch.size(); ++t)
+	{
+		const TileId& id = batch[t]->id;
+		Level& l = level(id.mode, id.z);
+		tile_levels[t] = &l;
+		Fractal::Viewport vp{ l.x_origin + id.x * tile_pixels * l.x_step, l.y_origin + id.y * tile_pixels * l.y_step, l.x_step, l.y_step };
+		tile_viewports[t] = vp;
+
+		int n = static_cast<int>(l.params.max_iter);
+		auto palette = palettes.find(n);
+		if (palette == palettes.end())
+		{
+			palette = palettes.emplace(std::piecewise_construct, std::forward_as_tuple(n), std::forward_as_tuple()).first;
+			float marker = 0.0f;	// Only tells beginTiles the distance estimates or smooth values are there
+			palette->second.color_mode = colors;
+			palette->second.beginTiles(tile_pixels, tile_pixels, n, want_distance ? &marker : nullptr, want_smooth ? &marker : nullptr);
+		}
+		tile_palettes[t] = &palette->second;
+
+		for (int piece_y = 0; piece_y < tile_pixels; piece_y += size)
+		{
+			for (int piece_x = 0; piece_x < tile_pixels; piece_x += size)
+			{
+				Piece piece{ static_cast<int>(t), piece_x, piece_y, false, TileCache::Key{}, TileCache::Tile{}, Source::COMPUTED };
+				Fractal::Viewport piece_vp{ vp.x_origin + piece_x * vp.x_step, vp.y_origin + piece_y * vp.y_step, vp.x_step, vp.y_step };
+				long long origin_x, origin_y;
+				piece.key = TileCache::latticeKey(piece_vp, l.params, layout, TileCache::DOUBLE, origin_x, origin_y);
+				piece.cacheable = origin_x % size == 0 && origin_y % size == 0;
+				if (piece.cacheable)
+				{
+					piece.key.tile_x = origin_x / size;
+					piece.key.tile_y = origin_y / size;
+					const TileCache::Tile* cached = cache.find(piece.key);
+					if (cached)
+					{
+						piece.found = *cached;
+						piece.source = Source::MEMORY;
+					}
+					else if (store.find(piece.key, piece.found))
+						piece.source = Source::STORE;
+				}
+				pieces.push_back(piece);
+			}
+		}
+	}
+
+	// The cache and store are only read until the run is over, so the tiles found in them stay valid
+	ThreadPool::getInstance().run(static_cast<int>(pieces.size()), [&](int index) {
+		Piece& piece = pieces[index];
+		size_t first = piece.tile * pixels;
+		size_t offset = static_cast<size_t>(piece.y) * tile_pixels + piece.x;
+		int* matrix = &iterations[first];
+		float* distance = want_distance ? &extra[first] : nullptr;
+		float* smooth = want_smooth ? &extra[first] : nullptr;
+
+		if (piece.source != Source::COMPUTED)
+		{
+			const float* values = piece.found.distance ? piece.found.distance : piece.found.smooth;
+			bool intact = decodeIterations(piece.found.iterations, piece.found.iterations_bytes, matrix + offset, size, size, tile_pixels) &&
+						  (!layout || values);
+			if (intact && layout)
+			{
+				for (int row = 0; row < size; ++row)
+					std::memcpy(&extra[first + offset + static_cast<size_t>(row) * tile_pixels], values + row * size, size * sizeof(float));
+			}
+			if (!intact)
+				piece.source = Source::COMPUTED;
+		}
+		if (piece.source == Source::COMPUTED)
+		{
+			Fractal::Tile rect{ piece.x, piece.y, size, size };
+			tile_levels[piece.tile]->fractal.computeTile(matrix, distance, tile_pixels, rect, tile_viewports[piece.tile], true, smooth);
+		}
+		tile_palettes[piece.tile]->colorTile(matrix, distance, smooth, &tile_colors[first], tile_pixels, piece.x, piece.y, size, size, true);
+	});
+
+	// Every cache tile which was not in memory goes there, and those which were computed into the store as well
+	std::vector<unsigned char> packed(maxEncodedBytes(size, size));
+	std::vector<Source> tile_sources(batch.size(), Source::MEMORY);
+	for (const Piece& piece : pieces)
+	{
+		Source& tile_source = tile_sources[piece.tile];
+		if (piece.source == Source::COMPUTED || (piece.source == Source::STORE && tile_source == Source::MEMORY))
+			tile_source = piece.source;
+		if (!piece.cacheable || piece.source == Source::MEMORY)
+			continue;
+
+		size_t first = piece.tile * pixels + static_cast<size_t>(piece.y) * tile_pixels + piece.x;
+		size_t bytes = encodeIterations(&iterations[first], size, size, tile_pixels, packed.data());
+		TileCache::Tile* cached = cache.insert(piece.key, bytes);
+		std::memcpy(cached->iterations, packed.data(), bytes);
+		float* values = cached->distance ? cached->distance : cached->smooth;
+		for (int row = 0; values && row < size; ++row)
+			std::memcpy(values + row * size, &extra[first + static_cast<size_t>(row) * tile_pixels], size * sizeof(float));
+		if (piece.source == Source::COMPUTED && store.isWritable())
+			store.insert(piece.key, *cached);
+	}
+
+	ThreadPool::getInstance().run(static_cast<int>(batch.size()), [&](int t) {
+		std::string png;
+		encodePng(&tile_colors[t * pixels], tile_pixels, tile_pixels, tile_pixels, png);
+		batch[t]->png = std::make_shared<const std::string>(std::move(png));
+		batch[t]->source = tile_sources[t];
+	});
+}
+
+////////////////////////////////////////////////////////////
+/// Statistics
+////////////////////////////////////////////////////////////
+
+long long TileServer::requestCount()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return served[0] + served[1] + served[2] + served[3] + failed;
+}
+
+std::string TileServer::statistics()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	double seconds = millisecondsSince(started) / 1000.0;
+	long long total = served[0] + served[1] + served[2] + served[3];
+	std::ostringstream out;
+	out.precision(4);
+	out << "Served " << total << " tiles in " << seconds << " s (" << total / std::max(seconds, 1e-3) << " tiles/s, " << bytes_sent / 1e6 <<
+		" MB): " << served[static_cast<int>(Source::IMAGE)] << " as kept images, " << served[static_cast<int>(Source::MEMORY)] << " from the tile cache, " << served[static_cast<int>(Source::STORE)] << " from the store, " <<
+		served[static_cast<int>(Source::COMPUTED)] << " computed, " << coalesced << " shared a render in progress, " << failed << " failed, in " <<
+		batches << " batches\n";
+	out << "Latency of cached tiles: " << latencySummary(cached_latencies) << "\n";
+	out << "Latency of computed tiles: " << latencySummary(computed_latencies) << "\n";
+	out << "Tile cache: " << cache_stats.hits << " hits, " << cache_stats.misses << " misses, " << cache_stats.evictions << " evictions";
+	if (store.isOpen())
+		out << "; tile store: " << store_stats.hits << " hits, " << store_stats.insertions << " insertions";
+	out << "\n";
+	return out.str();
+}
+
+////////////////////////////////////////////////////////////
+/// Server and load test modes
+////////////////////////////////////////////////////////////
+
+static std::atomic<bool> interrupted(false);
+
+static void interrupt(int)
+{
+	interrupted = true;
+}
+
+/*
+* Serve tiles on address until interrupted (Ctrl+C), keeping their iteration values in a tile cache of cache_bytes, and in the tile store at
+* store_path unless it is empty. Statistics are reported every 10 seconds while requests come in, and at the end.
+* Returns the exit code of the program.
+*/
+int serveTiles(const std::string& address, const std::string& store_path, ColorGenerator::Generators colors, size_t cache_bytes)
+{
+	if (colors == ColorGenerator::Generators::HISTOGRAM)
+	{
+		std::cerr << "The histogram colors depend on the whole view, serve tiles with simple, smooth or distance colors" << std::endl;
+		return 1;
+	}
+
+	TileServer server(colors, cache_bytes);
+	if (!store_path.empty() && !server.openStore(store_path))
+	{
+		std::cerr << "Cannot open tile store " << store_path << std::endl;
+		return 1;
+	}
+	if (!server.start(address))
+	{
+		std::cerr << "Cannot listen on " << address << std::endl;
+		return 1;
+	}
+	std::cout << "Serving tiles on " << address << ", e.g. GET /mandelbrot/0/0/0.png. Ctrl+C stops" << std::endl;
+
+	std::signal(SIGINT, interrupt);
+	std::signal(SIGTERM, interrupt);
+	auto last_report = std::chrono::steady_clock::now();
+	long long reported = 0;
+	while (!interrupted)
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(200));
+		if (std::chrono::steady_clock::now() - last_report < std::chrono::seconds(10))
+			continue;
+		last_report = std::chrono::steady_clock::now();
+		long long requests = server.requestCount();
+		if (requests != reported)
+			std::cout << server.statistics() << std::flush;
+		reported = requests;
+	}
+
+	server.stop();
+	std::cout << server.statistics() << std::flush;
+	return 0;
+}
+
+/*
+* Send a GET request for target and receive the response. Returns false if the connection failed, which closes it.
+*/
+static bool get(StreamSocket& socket, std::string& buffer, const std::string& target, int& status, std::string& body)
+{
+	std::string request = "GET " + target + " HTTP/1.1\r\nHost: localhost\r\n\r\n";
+	std::string head;
+	if (!socket.sendAll(request.data(), request.size()) || !receiveHead(socket, buffer, head))
+	{
+		socket.close();
+		return false;
+	}
+
+	long long length = 0;
+	status = std::atoi(head.c_str() + std::min(head.size(), head.find(' ') + 1));
+	if (!parseNumber(headerValue(head, "content-length"), length) || length < 0)
+	{
+		socket.close();
+		return false;
+	}
+	body.assign(buffer, 0, std::min(buffer.size(), static_cast<size_t>(length)));
+	buffer.erase(0, body.size());
+	size_t have = body.size();
+	body.resize(static_cast<size_t>(length));
+	if (!socket.receiveAll(&body[0] + have, body.size() - have))
+	{
+		socket.close();
+		return false;
+	}
+	if (headerValue(head, "connection") == "close")
+		socket.close();
+	return true;
+}
+
+/*
+* Load the tile server at address the way map viewers zooming into the same spot would: every client requests the 3 x 3 tiles around the
+* spot at zoom levels 0 to levels - 1 in turn, in an order of its own, the centre tile with a higher priority, and does so rounds
+* times. The first round finds the tiles missing, so the clients share their renders; later rounds are served from the tile cache.
+* Reports the latency of each round and the server's own statistics. Returns the exit code of the program.
+*/
+int loadTest(const std::string& address, const std::string& fractal, int clients, int levels, int rounds)
+{
+	int mode;
+	if (!fractalMode(fractal, mode))
+	{
+		std::cerr << "Not a fractal: " << fractal << std::endl;
+		return 1;
+	}
+
+	// The spot is found by zooming into the quarter of each tile with the largest escape count outside the set, which follows the
+	// boundary of the set down to where the tiles are detailed and take long to compute
+	constexpr int samples = 8;
+	Fractal::Viewport base = pyramidBase(mode);
+	Fractal reference;
+	reference.selectFractal(mode);
+	std::vector<double> sample_x(4 * samples * samples), sample_y(sample_x.size());
+	std::vector<int> sample_iterations(sample_x.size());
+	long long x = 0, y = 0;
+
+	std::vector<std::vector<std::string>> targets(levels);
+	for (int z = 0; z < levels; ++z)
+	{
+		if (z > 0)
+		{
+			long double x_step = std::ldexp(base.x_step, -z), y_step = std::ldexp(base.y_step, -z);
+			for (int child = 0; child < 4; ++child)
+			{
+				for (int i = 0; i < samples * samples; ++i)
+				{
+					long double pixel_x = (2 * x + child % 2) * TileServer::tile_pixels + (i % samples + 0.5) * TileServer::tile_pixels / samples;
+					long double pixel_y = (2 * y + child / 2) * TileServer::tile_pixels + (i / samples + 0.5) * TileServer::tile_pixels / samples;
+					sample_x[child * samples * samples + i] = static_cast<double>(base.x_origin + pixel_x * x_step);
+					sample_y[child * samples * samples + i] = static_cast<double>(base.y_origin + pixel_y * y_step);
+				}
+			}
+			reference.queryPoints(sample_x.data(), sample_y.data(), sample_x.size(), sample_iterations.data());
+			int best = 0;
+			for (int child = 0, most = -1; child < 4; ++child)
+			{
+				const int* first = sample_iterations.data() + child * samples * samples;
+				int largest = *std::max_element(first, first + samples * samples);
+				if (largest > most)
+				{
+					most = largest;
+					best = child;
+				}
+			}
+			x = 2 * x + best % 2;
+			y = 2 * y + best / 2;
+		}
+
+		long long count = 1ll << z;
+		for (long long ty = y - 1; ty <= y + 1; ++ty)
+		{
+			for (long long tx = x - 1; tx <= x + 1; ++tx)
+			{
+				if (tx < 0 || ty < 0 || tx >= count || ty >= count)
+					continue;
+				targets[z].push_back("/" + fractal + "/" + std::to_string(z) + "/" + std::to_string(tx) + "/" + std::to_string(ty) + ".png" +
+									 (tx == x && ty == y ? "?priority=1" : ""));
+			}
+		}
+	}
+
+	std::vector<std::vector<float>> latencies(rounds);
+	std::vector<double> round_seconds(rounds, 0.0);
+	std::atomic<long long> errors(0), bytes(0);
+	std::mutex results_mutex;
+	auto start = std::chrono::steady_clock::now();
+
+	std::vector<std::thread> threads;
+	for (int client = 0; client < clients; ++client)
+	{
+		threads.emplace_back([&, client] {
+			std::mt19937 random(static_cast<unsigned int>(client));
+			StreamSocket socket;
+			std::string buffer, body;
+			for (int round = 0; round < rounds; ++round)
+			{
+				auto round_start = std::chrono::steady_clock::now();
+				std::vector<float> round_latencies;
+				for (int z = 0; z < levels; ++z)
+				{
+					std::vector<std::string> order = targets[z];
+					std::shuffle(order.begin(), order.end(), random);
+					for (const std::string& target : order)
+					{
+						auto request_start = std::chrono::steady_clock::now();
+						int status = 0;
+						if (!socket.isOpen())
+						{
+							buffer.clear();
+							if (!socket.connect(address))
+							{
+								errors += 1;
+								continue;
+							}
+						}
+						bool received = get(socket, buffer, target, status, body);
+						if (!received || status != 200 || body.compare(0, 8, "\x89PNG\r\n\x1A\n", 8) != 0)
+						{
+							errors += 1;
+							continue;
+						}
+						round_latencies.push_back(static_cast<float>(millisecondsSince(request_start)));
+						bytes += static_cast<long long>(body.size());
+					}
+				}
+
+				std::lock_guard<std::mutex> lock(results_mutex);
+				latencies[round].insert(latencies[round].end(), round_latencies.begin(), round_latencies.end());
+				round_seconds[round] = std::max(round_seconds[round], millisecondsSince(round_start) / 1000.0);
+			}
+		});
+	}
+	for (std::thread& thread : threads)
+		thread.join();
+	double seconds = millisecondsSince(start) / 1000.0;
+
+	long long requests = 0;
+	for (int round = 0; round < rounds; ++round)
+	{
+		requests += static_cast<long long>(latencies[round].size());
+		std::cout << "Round " << round + 1 << (round == 0 ? " (cold)" : "") << ": " << latencySummary(latencies[round]) << std::endl;
+	}
+	std::cout << clients << " clients: " << requests << " tiles in " << seconds << " s, " << requests / seconds << " tiles/s, " <<
+		bytes / 1e6 << " MB, " << errors << " errors" << std::endl;
+
+	// The server's side of it
+	StreamSocket socket;
+	std::string buffer, body;
+	int status = 0;
+	if (socket.connect(address) && get(socket, buffer, "/stats", status, body) && status == 200)
+		std::cout << "Server: " << body << std::flush;
+	return errors > 0 ? 1 : 0;
+}
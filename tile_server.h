@@ -0,0 +1,150 @@
+/*
+* Declares TileServer, which serves fractal tiles over HTTP to web map views, so the renderer runs as a service rather than a desktop app.
+*
+* Tiles are addressed like slippy map tiles: GET /{fractal}/{z}/{x}/{y}.png is the tile_pixels x tile_pixels PNG image at column x, row y
+* of the 2^z x 2^z tiles which cover the square around the default view of the fractal ("mandelbrot", "julia" or "bship"). The
+* iteration limit rises with the zoom level. An optional ?priority=<n> puts a tile ahead of those with a lower one. GET /stats returns the
+* statistics of the server as text.
+*
+* Every request for a tile which is already being rendered waits for that render rather than starting another one. Requested tiles are
+* rendered in batches, highest priority first, by a single dispatcher thread which runs each batch's cache tiles on the thread pool. The
+* iteration values of cache tiles are kept in a TileCache and, if a store is given, a TileStore, so tiles are only ever computed once, and
+* the images of the tiles served last are kept as well, to be sent right away.
+*/
+
+#pragma once
+
+#include "color.h"
+#include "fractal.h"
+#include "stream_socket.h"
+#include "tile_cache.h"
+#include "tile_store.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+class TileServer
+{
+public:
+	// Width and height of a served tile, and the deepest zoom level, beyond which double precision runs out
+	static constexpr int tile_pixels = 256;
+	static constexpr int max_zoom = 40;
+
+	// Latencies in milliseconds, counted in buckets 5% apart from 1 us up, so they take the same memory however long the server runs
+	struct LatencyHistogram {
+		std::vector<long long> counts;
+		long long total;
+		float max;
+
+		LatencyHistogram();
+		void add(float ms);
+		float percentile(double p) const;
+	};
+
+private:
+	struct TileId {
+		int mode;
+		int z;
+		long long x, y;
+
+		bool operator<(const TileId& other) const;
+	};
+
+	// Where a tile came from: its image, or its iteration values
+	enum class Source { IMAGE, MEMORY, STORE, COMPUTED };
+
+	// A requested tile, shared by every request for it until it is rendered
+	struct Pending {
+		TileId id;
+		int priority;
+		long long order;			// Requests of equal priority are rendered first come, first served
+		bool done;
+		Source source;
+		std::shared_ptr<const std::string> png;	// nullptr if the tile could not be rendered
+	};
+
+	// Everything the tiles of one fractal at one zoom level share
+	struct Level {
+		Fractal fractal;
+		Fractal::FormulaParams params;
+		long double x_origin, y_origin;		// Top left corner of tile (0, 0)
+		long double x_step, y_step;
+	};
+
+	ColorGenerator::Generators colors;
+	int layout;
+	TileCache cache;
+	TileStore store;
+	StreamSocket listener;
+	std::thread accept_thread;
+	std::thread dispatch_thread;
+	std::atomic<bool> stopping;
+
+	std::mutex mutex;
+	std::condition_variable work_condition;		// Signalled when a tile is queued
+	std::condition_variable done_condition;		// Signalled when a batch of tiles is done
+	std::condition_variable closed_condition;	// Signalled when a connection is closed
+	std::map<TileId, std::shared_ptr<Pending>> in_flight;
+	std::vector<std::shared_ptr<Pending>> queue;
+	long long next_order;
+	std::set<StreamSocket*> connections;
+
+	// Images of the tiles served last, most recently served first, up to max_image_bytes
+	typedef std::list<std::pair<TileId, std::shared_ptr<const std::string>>> ImageList;
+	ImageList images;
+	std::map<TileId, ImageList::iterator> image_index;
+	size_t image_bytes;
+	size_t max_image_bytes;
+
+	// Statistics, under mutex. Latencies are in milliseconds, from a request being read until its response is sent
+	std::chrono::steady_clock::time_point started;
+	LatencyHistogram cached_latencies;			// Tiles served from images, the cache or the store
+	LatencyHistogram computed_latencies;		// Tiles which were computed, or waited for a render in progress
+	long long served[4];						// Per Source
+	long long coalesced;
+	long long failed;
+	long long batches;
+	long long bytes_sent;
+	TileCache::Stats cache_stats;				// As of the last batch, as the cache and store are only used by the dispatcher
+	TileStore::Stats store_stats;
+
+	// Used by the dispatcher thread only
+	std::map<std::pair<int, int>, Level> levels;
+	std::map<int, ColorGenerator> palettes;		// Per iteration limit
+	std::vector<int> iterations;
+	std::vector<float> extra;
+	std::vector<int> tile_colors;
+
+	void acceptConnections();
+	void serveConnection(std::unique_ptr<StreamSocket> socket);
+	std::shared_ptr<Pending> request(const TileId& id, int priority, bool& shared);
+	void keepImage(const TileId& id, const std::shared_ptr<const std::string>& png);
+	void dispatch();
+	void renderBatch(const std::vector<std::shared_ptr<Pending>>& batch);
+	Level& level(int mode, int z);
+
+public:
+	TileServer(ColorGenerator::Generators colors, size_t cache_bytes);
+	~TileServer();
+
+	bool openStore(const std::string& path);
+	bool start(const std::string& address);
+	void stop();
+	long long requestCount();
+	std::string statistics();
+
+	TileServer(TileServer const&) = delete;
+	void operator=(TileServer const&) = delete;
+};
+
+int serveTiles(const std::string& address, const std::string& store_path, ColorGenerator::Generators colors, size_t cache_bytes);
+int loadTest(const std::string& address, const std::string& fractal, int clients, int levels, int rounds);
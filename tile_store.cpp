@@ -0,0 +1,415 @@
+#include "tile_store.h"
+
+#include "mapped_file.h"
+#include "tile_cache.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+static const char file_magic[8] = { 'F', 'R', 'A', 'C', 'T', 'I', 'L', 'E' };
+static const char tile_magic[8] = { 'T', 'I', 'L', 'E', 'v', '0', '0', '1' };
+
+// The file grows by at least this much at a time, so that appending tiles rarely has to map it again
+constexpr size_t min_growth = 64 * 1024 * 1024;
+
+// Round bytes up to a multiple of alignment, a power of 2
+static size_t roundUp(size_t bytes, size_t alignment)
+{
+	return (bytes + alignment - 1) & ~(alignment - 1);
+}
+
+TileStore::TileStore()
+{
+	stats = Stats{ 0, 0, 0, 0 };
+	index_offset = 0;
+	index_capacity = 0;
+	end = 0;
+}
+
+TileStore::~TileStore()
+{
+	close();
+}
+
+TileStore::FileHeader* TileStore::header() const
+{
+	return reinterpret_cast<FileHeader*>(file.bytes());
+}
+
+TileStore::IndexEntry* TileStore::index() const
+{
+	return reinterpret_cast<IndexEntry*>(file.bytes() + index_offset);
+}
+
+/*
+* Open the store at path. With write a missing (or empty) file is created with room for initial_capacity tiles in its index, otherwise
+* initial_capacity is ignored. If another process writes to the store, it is opened read only instead, see isWritable. Returns false if
+* the file cannot be opened, or is not a store of this version.
+*/
+bool TileStore::open(const std::string& path, bool write, uint32_t initial_capacity)
+{
+	close();
+	// Writing takes the lock on the file, and a store which another process writes to is only read
+	if (!file.open(path, write, write ? page_size : 0, write) && (!write || !file.open(path, false)))
+		return false;
+	write = file.isWritable();
+
+	if (file.size() < sizeof(FileHeader))
+	{
+		file.close();
+		return false;
+	}
+
+	// A store of another version only holds tiles which would be computed again anyway, so a writable one starts over
+	FileHeader* h = header();
+	bool empty = std::all_of(h->magic, h->magic + sizeof(h->magic), [](char c) {return c == 0; });
+	bool outdated = std::memcmp(h->magic, file_magic, sizeof(file_magic)) == 0 && h->version != version;
+	if ((empty || outdated) && write)
+	{
+		uint32_t capacity = 16;
+		while (capacity < initial_capacity)
+			capacity *= 2;
+		size_t index_bytes = roundUp(static_cast<size_t>(capacity) * sizeof(IndexEntry), page_size);
+		// Shrinking first drops the records of an outdated store
+		if (!file.resize(page_size) || !file.resize(page_size + index_bytes))
+		{
+			file.close();
+			return false;
+		}
+
+		h = header();
+		std::memset(file.bytes(), 0, page_size + index_bytes);
+		std::memcpy(h->magic, file_magic, sizeof(file_magic));
+		h->version = version;
+		h->page_size = static_cast<uint32_t>(page_size);
+		h->tile_size = TileCache::tile_size;
+		h->index_capacity = capacity;
+		h->tile_count = 0;
+		h->index_offset = page_size;
+		h->end = page_size + index_bytes;
+	}
+
+	h = header();
+	bool valid = std::memcmp(h->magic, file_magic, sizeof(file_magic)) == 0 && h->version == version && h->page_size == page_size &&
+				 h->tile_size == TileCache::tile_size && h->index_capacity > 0 && (h->index_capacity & (h->index_capacity - 1)) == 0 &&
+				 h->index_offset + static_cast<uint64_t>(h->index_capacity) * sizeof(IndexEntry) <= file.size() &&
+				 (h->end <= file.size() || !write);
+	if (!valid)
+	{
+		file.close();
+		return false;
+	}
+
+	index_offset = h->index_offset;
+	index_capacity = h->index_capacity;
+	// The file may have grown since it was mapped, if another process writes to it
+	end = std::min(h->end, static_cast<uint64_t>(file.size()));
+	verified.assign(index_capacity, 0);
+	return true;
+}
+
+void TileStore::flush()
+{
+	file.flush();
+}
+
+void TileStore::close()
+{
+	if (file.isOpen())
+	{
+		flush();
+		file.close();
+	}
+	verified.clear();
+	index_offset = 0;
+	index_capacity = 0;
+	end = 0;
+}
+
+////////////////////////////////////////////////////////////
+/// Keys and checksums
+////////////////////////////////////////////////////////////
+
+TileStore::StoredKey TileStore::storedKey(const TileCache::Key& key)
+{
+	auto split = [](long double value, double* parts) {
+		parts[0] = static_cast<double>(value);
+		parts[1] = static_cast<double>(value - parts[0]);
+	};
+
+	// Zeroed first, so keys can be compared and hashed byte by byte
+	StoredKey stored;
+	std::memset(&stored, 0, sizeof(stored));
+	stored.mode = static_cast<uint32_t>(key.params.mode);
+	stored.max_iter = key.params.max_iter;
+	stored.distance_estimation = key.params.distance_estimation;
+	stored.layout = key.layout;
+	stored.precision = key.precision;
+	split(key.params.radius, stored.radius);
+	split(key.params.julia_complex_param.real(), stored.julia_real);
+	split(key.params.julia_complex_param.imag(), stored.julia_imag);
+	stored.step_x = key.step_x;
+	stored.step_y = key.step_y;
+	stored.phase_x = key.phase_x;
+	stored.phase_y = key.phase_y;
+	stored.tile_x = key.tile_x;
+	stored.tile_y = key.tile_y;
+	return stored;
+}
+
+// FNV-1a over the bytes of the key, which is the same in every process
+uint64_t TileStore::hash(const StoredKey& key)
+{
+	const unsigned char* bytes = reinterpret_cast<const unsigned char*>(&key);
+	uint64_t h = 0xCBF29CE484222325ull;
+	for (size_t i = 0; i < sizeof(key); ++i)
+		h = (h ^ bytes[i]) * 0x100000001B3ull;
+	return h;
+}
+
+/*
+* A 64-bit checksum of a payload, hashed as 4 independent streams of 64-bit words so it runs at memory speed, and the bytes after the
+* last 32 as a fifth.
+*/
+uint64_t TileStore::checksum(const void* data, size_t bytes)
+{
+	const unsigned char* p = static_cast<const unsigned char*>(data);
+	uint64_t lanes[4] = { 0x9E3779B97F4A7C15ull, 0xC2B2AE3D27D4EB4Full, 0x165667B19E3779F9ull, 0x27D4EB2F165667C5ull };
+	for (size_t i = 0; i + 32 <= bytes; i += 32)
+	{
+		for (int k = 0; k < 4; ++k)
+		{
+			uint64_t word;
+			std::memcpy(&word, p + i + k * 8, sizeof(word));
+			lanes[k] = (lanes[k] ^ word) * 0x9FB21C651E98DF25ull;
+			lanes[k] ^= lanes[k] >> 29;
+		}
+	}
+
+	uint64_t tail = 0;
+	for (size_t i = bytes / 32 * 32; i < bytes; ++i)
+		tail = (tail ^ p[i]) * 0x100000001B3ull;
+
+	uint64_t h = bytes ^ tail;
+	for (uint64_t lane : lanes)
+	{
+		h = (h ^ lane) * 0x100000001B3ull;
+		h ^= h >> 32;
+	}
+	return h;
+}
+
+// Index entry of the tile with this key, or -1
+long long TileStore::lookup(const StoredKey& key, uint64_t key_hash) const
+{
+	const IndexEntry* entries = index();
+	uint64_t mask = index_capacity - 1;
+	for (uint64_t i = key_hash & mask; entries[i].offset != 0; i = (i + 1) & mask)
+	{
+		if (entries[i].hash != key_hash)
+			continue;
+
+		// Tiles stored by another process after this one opened the store are past the end
+		uint64_t offset = entries[i].offset;
+		if (offset + tile_header_bytes > end)
+			continue;
+		const TileHeader* tile = reinterpret_cast<const TileHeader*>(file.bytes() + offset);
+		if (std::memcmp(&tile->key, &key, sizeof(key)) == 0)
+			return static_cast<long long>(i);
+	}
+	return -1;
+}
+
+////////////////////////////////////////////////////////////
+/// Tiles
+////////////////////////////////////////////////////////////
+
+/*
+* Point tile at the values of the stored tile with this key, right in the mapped file. They stay valid until the next insert.
+* Returns false if there is no such tile, or it is corrupt.
+*/
+bool TileStore::find(const TileCache::Key& key, TileCache::Tile& tile)
+{
+	if (!file.isOpen())
+		return false;
+
+	StoredKey stored = storedKey(key);
+	long long i = lookup(stored, hash(stored));
+	if (i < 0)
+	{
+		stats.misses += 1;
+		return false;
+	}
+
+	char* record = file.bytes() + index()[i].offset;
+	const TileHeader* tile_header = reinterpret_cast<const TileHeader*>(record);
+	size_t bytes = tile_header->payload_bytes;
+	size_t values_bytes = TileCache::tileBytes(key.layout, 0);
+	if (verified[i] == 0)
+	{
+		bool intact = bytes > values_bytes && index()[i].offset + tile_header_bytes + bytes <= end &&
+					  checksum(record + tile_header_bytes, bytes) == tile_header->checksum;
+		verified[i] = intact ? 1 : 2;
+		if (!intact)
+			stats.corrupt += 1;
+	}
+	if (verified[i] != 1)
+	{
+		stats.misses += 1;
+		return false;
+	}
+
+	stats.hits += 1;
+	tile = TileCache::tileAt(record + tile_header_bytes, key.layout, bytes - values_bytes);
+	return true;
+}
+
+bool TileStore::contains(const TileCache::Key& key) const
+{
+	if (!file.isOpen())
+		return false;
+
+	StoredKey stored = storedKey(key);
+	return lookup(stored, hash(stored)) >= 0;
+}
+
+/*
+* Grow the file to at least bytes, by at least min_growth or half its size. Returns false if it cannot grow.
+*/
+bool TileStore::reserve(uint64_t bytes)
+{
+	return bytes <= file.size() || file.resize(std::max(static_cast<size_t>(bytes), file.size() + std::max(min_growth, file.size() / 2)));
+}
+
+/*
+* Append an index of twice the capacity and move the entries there. The header only points at it once it is complete, index_offset
+* first, so a process which is killed meanwhile at worst leaves a store with unreachable records. Returns false if the file cannot grow,
+* or the index has reached its largest capacity.
+*/
+bool TileStore::growIndex()
+{
+	if (index_capacity >= (1u << 31))
+		return false;
+
+	uint32_t capacity = index_capacity * 2;
+	size_t index_bytes = roundUp(static_cast<size_t>(capacity) * sizeof(IndexEntry), page_size);
+	uint64_t offset = roundUp(end, page_size);
+	if (!reserve(offset + index_bytes))
+		return false;
+
+	const IndexEntry* old_entries = index();
+	IndexEntry* entries = reinterpret_cast<IndexEntry*>(file.bytes() + offset);
+	std::memset(entries, 0, index_bytes);
+	std::vector<unsigned char> old_verified;
+	old_verified.swap(verified);
+	verified.assign(capacity, 0);
+	uint64_t mask = capacity - 1;
+	for (uint32_t i = 0; i < index_capacity; ++i)
+	{
+		if (old_entries[i].offset == 0)
+			continue;
+		uint64_t k = old_entries[i].hash & mask;
+		while (entries[k].offset != 0)
+			k = (k + 1) & mask;
+		entries[k] = old_entries[i];
+		verified[k] = old_verified[i];
+	}
+
+	FileHeader* h = header();
+	end = offset + index_bytes;
+	h->end = end;
+	index_offset = offset;
+	h->index_offset = offset;
+	index_capacity = capacity;
+	h->index_capacity = capacity;
+	return true;
+}
+
+/*
+* Append a copy of tile to a writable store. Returns false if the store is read only, already holds the tile, or cannot grow the file.
+* Invalidates the tiles handed out by find, as the file may be mapped again.
+*/
+bool TileStore::insert(const TileCache::Key& key, const TileCache::Tile& tile)
+{
+	if (!file.isOpen() || !file.isWritable())
+		return false;
+
+	StoredKey stored = storedKey(key);
+	uint64_t key_hash = hash(stored);
+	if (lookup(stored, key_hash) >= 0)
+		return false;
+
+	// The index is kept at most 3/4 full, so probe sequences stay short
+	if (header()->tile_count + 1 > index_capacity / 4 * 3 && !growIndex())
+		return false;
+
+	size_t bytes = TileCache::tileBytes(key.layout, tile.iterations_bytes);
+	size_t record_bytes = roundUp(tile_header_bytes + bytes, record_alignment);
+	uint64_t offset = end;
+	if (!reserve(offset + record_bytes))
+		return false;
+
+	// Payload first, then its header, then the index entry which makes it visible
+	char* record = file.bytes() + offset;
+	TileCache::Tile copy = TileCache::tileAt(record + tile_header_bytes, key.layout, tile.iterations_bytes);
+	size_t pixels = static_cast<size_t>(TileCache::tile_size) * TileCache::tile_size;
+	std::memcpy(copy.iterations, tile.iterations, tile.iterations_bytes);
+	if (copy.distance)
+		std::memcpy(copy.distance, tile.distance, pixels * sizeof(float));
+	if (copy.smooth)
+		std::memcpy(copy.smooth, tile.smooth, pixels * sizeof(float));
+	if (copy.zx)
+	{
+		std::memcpy(copy.zx, tile.zx, pixels * sizeof(double));
+		std::memcpy(copy.zy, tile.zy, pixels * sizeof(double));
+		std::memcpy(copy.iter, tile.iter, pixels * sizeof(int));
+		std::memcpy(copy.done, tile.done, pixels * sizeof(unsigned char));
+	}
+
+	TileHeader* tile_header = reinterpret_cast<TileHeader*>(record);
+	std::memset(tile_header, 0, tile_header_bytes);
+	std::memcpy(tile_header->magic, tile_magic, sizeof(tile_magic));
+	tile_header->key = stored;
+	tile_header->payload_bytes = bytes;
+	tile_header->checksum = checksum(record + tile_header_bytes, bytes);
+
+	FileHeader* h = header();
+	end = offset + record_bytes;
+	h->end = end;
+	h->tile_count += 1;
+
+	IndexEntry* entries = index();
+	uint64_t mask = index_capacity - 1;
+	uint64_t i = key_hash & mask;
+	while (entries[i].offset != 0)
+		i = (i + 1) & mask;
+	entries[i].hash = key_hash;
+	entries[i].offset = offset;
+	verified[i] = 1;
+
+	stats.insertions += 1;
+	return true;
+}
+
+bool TileStore::isOpen() const
+{
+	return file.isOpen();
+}
+
+bool TileStore::isWritable() const
+{
+	return file.isOpen() && file.isWritable();
+}
+
+long long TileStore::size() const
+{
+	return file.isOpen() ? static_cast<long long>(header()->tile_count) : 0;
+}
+
+TileStore::Stats TileStore::statistics() const
+{
+	return stats;
+}
@@ -0,0 +1,127 @@
+/*
+* Declares TileStore, a file of computed tiles which outlives the process, so views rendered in an earlier session (or pre-warmed in batch
+* mode, see batch.h) are read straight from the page cache instead of being computed again.
+*
+* The file is mapped into memory as a whole and laid out as follows:
+*	- Page 0 (of page_size bytes): the file header (magic "FRACTILE", format version, page and tile size, index capacity, tile count,
+*	  end of the used bytes).
+*	- The index, starting on a page boundary: a hash table of index_capacity entries with linear probing, each the hash of a tile's key
+*	  and the file offset of its record, 0 for an empty entry.
+*	- Tile records, appended at the end, each starting on a multiple of record_alignment bytes (a cache line, which is all the arrays of
+*	  a tile need), so small packed tiles do not take up a page each: a header with the full key (fractal, formula parameters,
+*	  max_iter, layout, precision tier, lattice position), the payload size and a checksum, followed at tile_header_bytes by the payload
+*	  in the layout of TileCache::tileAt, iteration values packed. A tile is served by pointing into the mapping, without copying it out
+*	  of the page cache.
+*
+* A record is written before its index entry, so a process which is killed while inserting leaves at most an unreachable record. Once the
+* index is 3/4 full, an index of twice the capacity is appended after the records, and the old one is left unused.
+*
+* Checksums are verified the first time a tile is served. Only one process may write to a store at a time, which holds a lock on the file;
+* the others open it read only, and see the tiles which were stored when they opened it.
+*/
+
+#pragma once
+
+#include "mapped_file.h"
+#include "tile_cache.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+class TileStore
+{
+public:
+	static constexpr uint32_t version = 3;
+	static constexpr size_t page_size = 4096;
+	static constexpr size_t record_alignment = 64;
+	static constexpr size_t tile_header_bytes = 256;
+
+	struct Stats {
+		long long hits;
+		long long misses;
+		long long insertions;
+		long long corrupt;			// Tiles whose checksum did not match, which are treated as missing
+	};
+
+private:
+	struct FileHeader {
+		char magic[8];
+		uint32_t version;
+		uint32_t page_size;
+		uint32_t tile_size;
+		uint32_t index_capacity;
+		uint64_t tile_count;
+		uint64_t end;				// Offset of the first byte past the last record
+		uint64_t index_offset;
+	};
+
+	// A TileCache::Key with fixed size fields. Long doubles are split into two doubles (high and low part) so the file does not depend on
+	// the compiler's long double
+	struct StoredKey {
+		uint32_t mode;
+		uint32_t max_iter;
+		uint32_t distance_estimation;
+		int32_t layout;
+		int32_t precision;
+		uint32_t reserved;
+		double radius[2];
+		double julia_real[2];
+		double julia_imag[2];
+		int64_t step_x, step_y;
+		int64_t phase_x, phase_y;
+		int64_t tile_x, tile_y;
+	};
+
+	struct IndexEntry {
+		uint64_t hash;
+		uint64_t offset;
+	};
+
+	struct TileHeader {
+		char magic[8];
+		StoredKey key;
+		uint64_t payload_bytes;
+		uint64_t checksum;
+	};
+
+	MappedFile file;
+	std::vector<unsigned char> verified;	// Per index entry: 0 not checked yet, 1 checksum matches, 2 corrupt
+	Stats stats;
+
+	// The index and the used bytes as the store was opened, kept current while writing. A read only store goes by these rather than the
+	// header, as the process writing the store may append beyond the mapping and move the index meanwhile
+	uint64_t index_offset;
+	uint32_t index_capacity;
+	uint64_t end;
+
+	FileHeader* header() const;
+	IndexEntry* index() const;
+	bool reserve(uint64_t bytes);
+	bool growIndex();
+	static StoredKey storedKey(const TileCache::Key& key);
+	static uint64_t hash(const StoredKey& key);
+	static uint64_t checksum(const void* data, size_t bytes);
+	long long lookup(const StoredKey& key, uint64_t key_hash) const;
+
+public:
+	TileStore();
+	~TileStore();
+
+	bool open(const std::string& path, bool write, uint32_t index_capacity = 1 << 16);
+	void flush();
+	void close();
+
+	bool find(const TileCache::Key& key, TileCache::Tile& tile);
+	bool contains(const TileCache::Key& key) const;
+	bool insert(const TileCache::Key& key, const TileCache::Tile& tile);
+
+	bool isOpen() const;
+	bool isWritable() const;
+	long long size() const;
+	Stats statistics() const;
+
+	TileStore(TileStore const&) = delete;
+	void operator=(TileStore const&) = delete;
+};